@@ -0,0 +1,121 @@
+/*
+ * HttpArena.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "HttpArena.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "HttpArena";
+
+
+/**
+ * @brief Create an arena.
+ * @param [in] blockSize The size of the block from which memory is allocated.
+ */
+HttpArena::HttpArena(size_t blockSize) {
+	m_block        = nullptr;
+	m_blockSize    = blockSize;
+	m_used         = 0;
+	m_overflowUsed = 0;
+	m_highWater    = 0;
+	m_overflows    = 0;
+	m_pOverflow    = nullptr;
+} // HttpArena
+
+
+HttpArena::~HttpArena() {
+	reset();
+	::free(m_block);
+} // ~HttpArena
+
+
+/**
+ * @brief Allocate memory.
+ * The memory stays valid until the next reset().
+ * @param [in] size The amount of memory.
+ * @param [in] alignment The alignment of the memory, a power of two no larger than that of malloc().
+ * @return The memory or nullptr if there is no memory left.
+ */
+void* HttpArena::allocate(size_t size, size_t alignment) {
+	if (m_block == nullptr && m_blockSize > 0) {
+		m_block = (uint8_t*) ::malloc(m_blockSize);
+	}
+	size_t offset = (m_used + alignment - 1) & ~(alignment - 1);
+	if (m_block != nullptr && offset + size <= m_blockSize) {
+		m_used = offset + size;
+		return m_block + offset;
+	}
+
+	// The block is full.  The allocation gets memory of its own, in front of which we keep the link.
+	ESP_LOGD(LOG_TAG, "allocate: %d bytes don't fit in the block", size);
+	size_t header = (sizeof(Overflow) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+	Overflow* pOverflow = (Overflow*) ::malloc(header + size);
+	if (pOverflow == nullptr) {
+		ESP_LOGE(LOG_TAG, "allocate: Out of memory allocating %d bytes", size);
+		return nullptr;
+	}
+	pOverflow->pNext = m_pOverflow;
+	m_pOverflow      = pOverflow;
+	m_overflowUsed  += size;
+	m_overflows++;
+	return (uint8_t*) pOverflow + header;
+} // allocate
+
+
+/**
+ * @brief Copy a string into the arena.
+ * @param [in] value The string to copy.
+ * @return A view of the copy or an empty view if there is no memory left.
+ */
+std::string_view HttpArena::copy(std::string_view value) {
+	char* pData = (char*) allocate(value.length(), 1);
+	if (pData == nullptr) return std::string_view();
+	::memcpy(pData, value.data(), value.length());
+	return std::string_view(pData, value.length());
+} // copy
+
+
+size_t HttpArena::getBlockSize() {
+	return m_blockSize;
+} // getBlockSize
+
+
+/**
+ * @brief Get the most memory used between two resets.
+ * @return The high water mark in bytes, including overflow allocations.
+ */
+size_t HttpArena::getHighWater() {
+	return std::max(m_highWater, getUsed());
+} // getHighWater
+
+
+uint32_t HttpArena::getOverflows() {
+	return m_overflows;
+} // getOverflows
+
+
+size_t HttpArena::getUsed() {
+	return m_used + m_overflowUsed;
+} // getUsed
+
+
+/**
+ * @brief Release all the memory allocated since the last reset.
+ * The block is kept for reuse, overflow allocations are freed.
+ */
+void HttpArena::reset() {
+	m_highWater = getHighWater();
+	while (m_pOverflow != nullptr) {
+		Overflow* pNext = m_pOverflow->pNext;
+		::free(m_pOverflow);
+		m_pOverflow = pNext;
+	}
+	m_used         = 0;
+	m_overflowUsed = 0;
+} // reset
@@ -0,0 +1,50 @@
+/*
+ * HttpArena.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_HTTPARENA_H_
+#define COMPONENTS_CPP_UTILS_HTTPARENA_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+
+/**
+ * @brief A bump allocator for the data of one request.
+ *
+ * Memory is handed out from a block by advancing a pointer and is never freed individually.  All of it
+ * is released at once by reset() when the request has been answered.  The block belongs to the
+ * connection and is reused for each request on it, so serving a request doesn't churn the heap.
+ *
+ * An allocation that doesn't fit in the block is taken from an overflow block of its own which is freed
+ * by reset().  The overflow count tells whether the block size suits the requests being served.
+ */
+class HttpArena {
+public:
+	HttpArena(size_t blockSize = 512);
+	virtual ~HttpArena();
+	void*            allocate(size_t size, size_t alignment = sizeof(void*)); // Allocate memory until the next reset().
+	std::string_view copy(std::string_view value);   // Copy a string into the arena.
+	size_t           getBlockSize();                 // Get the size of the block.
+	size_t           getHighWater();                 // Get the most memory used by a request.
+	uint32_t         getOverflows();                 // Get the number of allocations that didn't fit in the block.
+	size_t           getUsed();                      // Get the memory used since the last reset().
+	void             reset();                        // Release all the memory allocated.
+
+private:
+	// An allocation that didn't fit in the block.
+	struct Overflow {
+		Overflow* pNext;
+	};
+
+	uint8_t*  m_block;        // The block, allocated on first use.
+	size_t    m_blockSize;
+	size_t    m_used;         // The amount of the block in use.
+	size_t    m_overflowUsed; // The amount of memory in overflow allocations.
+	size_t    m_highWater;
+	uint32_t  m_overflows;
+	Overflow* m_pOverflow;    // The overflow allocations, most recent first.
+}; // HttpArena
+
+#endif /* COMPONENTS_CPP_UTILS_HTTPARENA_H_ */
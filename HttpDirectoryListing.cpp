@@ -0,0 +1,410 @@
+/*
+ * HttpDirectoryListing.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "HttpDirectoryListing.h"
+#include "HttpParser.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "HttpDirectoryListing";
+
+
+/**
+ * @brief Escape text to be placed in HTML, including in an attribute.
+ */
+static std::string htmlEscape(const std::string& text) {
+	if (text.find_first_of("&<>'\"") == std::string::npos) return text;
+	std::string escaped;
+	for (auto it = text.begin(); it != text.end(); ++it) {
+		switch (*it) {
+			case '&':  escaped += "&amp;";  break;
+			case '<':  escaped += "&lt;";   break;
+			case '>':  escaped += "&gt;";   break;
+			case '\'': escaped += "&#39;";  break;
+			case '"':  escaped += "&quot;"; break;
+			default:   escaped += *it;      break;
+		}
+	}
+	return escaped;
+} // htmlEscape
+
+
+/**
+ * @brief Escape text to be placed in a JSON string.
+ */
+static std::string jsonEscape(const std::string& text) {
+	std::string escaped;
+	for (auto it = text.begin(); it != text.end(); ++it) {
+		if (*it == '"' || *it == '\\') {
+			escaped += '\\';
+			escaped += *it;
+		} else if ((unsigned char) *it < 0x20) {
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", (unsigned char) *it);
+			escaped += code;
+		} else {
+			escaped += *it;
+		}
+	}
+	return escaped;
+} // jsonEscape
+
+
+/**
+ * @brief Create a directory listing.
+ * @param [in] maxIndexEntries The most entries of a directory that are indexed for a sorted listing.
+ * @param [in] maxIndexes The most directories whose index is cached.
+ * @param [in] maxIndexAge The seconds for which an index is used.
+ */
+HttpDirectoryListing::HttpDirectoryListing(size_t maxIndexEntries, size_t maxIndexes, uint32_t maxIndexAge) {
+	m_maxIndexEntries = maxIndexEntries;
+	m_maxIndexes      = maxIndexes;
+	m_maxIndexAge     = maxIndexAge;
+} // HttpDirectoryListing
+
+
+HttpDirectoryListing::~HttpDirectoryListing() {
+} // ~HttpDirectoryListing
+
+
+/**
+ * @brief Drop the cached indexes.
+ */
+void HttpDirectoryListing::clear() {
+	m_lock.take("clear");
+	m_indexes.clear();
+	m_lock.give();
+} // clear
+
+
+/**
+ * @brief Get the index of a directory, sorted by a key.
+ * A cached index is used if the directory hasn't changed since it was read.  Otherwise the directory
+ * is read again.
+ * @param [in] path The path of the directory in the file system.
+ * @param [in] sort The key the index must be sorted by.
+ * @return The index or nullptr if the directory can't be read or has too many entries.
+ */
+std::shared_ptr<HttpDirectoryListing::Index> HttpDirectoryListing::getIndex(const std::string& path, SortKey sort) {
+	struct stat statBuf;
+	if (::stat(path.c_str(), &statBuf) != 0) {
+		return nullptr;
+	}
+	uint32_t now = FreeRTOS::getTimeSinceStart();
+	m_lock.take("getIndex");
+	for (auto it = m_indexes.begin(); it != m_indexes.end(); ++it) {
+		if ((*it)->path != path) continue;
+		if ((*it)->mtime == statBuf.st_mtime && now - (*it)->created < m_maxIndexAge * 1000) {
+			m_indexes.splice(m_indexes.begin(), m_indexes, it);   // Now the most recently used.
+			std::shared_ptr<Index> pIndex = m_indexes.front();
+			sortIndex(*pIndex, sort);
+			m_lock.give();
+			return pIndex;
+		}
+		ESP_LOGD(LOG_TAG, "Index of %s is out of date", path.c_str());
+		m_indexes.erase(it);
+		break;
+	}
+	m_lock.give();
+
+	// Read the directory without holding the lock so that other tasks can use the cache in the meantime.
+	DIR* pDir = ::opendir(path.c_str());
+	if (pDir == nullptr) {
+		return nullptr;
+	}
+	std::shared_ptr<Index> pIndex = std::make_shared<Index>();
+	pIndex->path    = path;
+	pIndex->mtime   = statBuf.st_mtime;
+	pIndex->created = now;
+	struct dirent* pDirent;
+	while ((pDirent = ::readdir(pDir)) != nullptr) {
+		if (pIndex->entries.size() >= m_maxIndexEntries) {
+			ESP_LOGW(LOG_TAG, "%s has more than %d entries, it won't be sorted", path.c_str(), m_maxIndexEntries);
+			::closedir(pDir);
+			return nullptr;
+		}
+		Entry entry;
+		if (readEntry(path, pDirent->d_name, pDirent->d_type, entry)) {
+			pIndex->entries.push_back(entry);
+		}
+	}
+	::closedir(pDir);
+	sortIndex(*pIndex, sort);
+
+	m_lock.take("getIndex");
+	m_indexes.push_front(pIndex);
+	while (m_indexes.size() > m_maxIndexes) {
+		m_indexes.pop_back();
+	}
+	m_lock.give();
+	return pIndex;
+} // getIndex
+
+
+/**
+ * @brief Get the options chosen by the query of a request.
+ * @param [in] pRequest The request.
+ * @return The options.
+ */
+HttpDirectoryListing::Options HttpDirectoryListing::getOptions(HttpRequest* pRequest) {
+	Options options;
+	std::string_view format = pRequest->getQueryValue("format");
+	if (format.empty()) {
+		std::string_view accept = pRequest->getHeaderView(HttpRequest::HTTP_HEADER_ACCEPT);
+		options.format = (accept.find("application/json") != std::string_view::npos &&
+			accept.find("text/html") == std::string_view::npos) ? FORMAT_JSON : FORMAT_HTML;
+	} else {
+		options.format = HttpParser::equalsIgnoreCase(format, "json") ? FORMAT_JSON : FORMAT_HTML;
+	}
+	std::string_view sort = pRequest->getQueryValue("sort");
+	if (sort == "name") {
+		options.sort = SORT_NAME;
+	} else if (sort == "size") {
+		options.sort = SORT_SIZE;
+	} else if (sort == "mtime") {
+		options.sort = SORT_MTIME;
+	} else {
+		options.sort = SORT_NONE;
+	}
+	options.descending = pRequest->getQueryValue("order") == "desc";
+	options.offset     = strtoul(std::string(pRequest->getQueryValue("offset")).c_str(), nullptr, 10);
+	options.limit      = strtoul(std::string(pRequest->getQueryValue("limit")).c_str(), nullptr, 10);
+	return options;
+} // getOptions
+
+
+/**
+ * @brief Read the status of an entry of a directory.
+ * @param [in] path The path of the directory.
+ * @param [in] name The name of the entry.
+ * @param [in] type The type of the entry reported by readdir().
+ * @param [out] entry Receives the entry.
+ * @return False for the "." and ".." entries, which aren't listed.
+ */
+bool HttpDirectoryListing::readEntry(const std::string& path, const char* name, uint8_t type, Entry& entry) {
+	if (::strcmp(name, ".") == 0 || ::strcmp(name, "..") == 0) {
+		return false;
+	}
+	entry.name = name;
+	struct stat statBuf;
+	if (::stat((path + "/" + entry.name).c_str(), &statBuf) == 0) {
+		entry.isDirectory = S_ISDIR(statBuf.st_mode);
+		entry.size        = statBuf.st_size;
+		entry.mtime       = statBuf.st_mtime;
+	} else {
+		entry.isDirectory = (type == DT_DIR);
+		entry.size        = 0;
+		entry.mtime       = 0;
+	}
+	return true;
+} // readEntry
+
+
+/**
+ * @brief Send the listing of a directory.
+ * The status and content type are set and the entries selected by the options are sent.  If the
+ * directory can't be read, 404 Not Found is sent.
+ * @param [in] path The path of the directory in the file system.
+ * @param [in] urlPath The path of the directory in URLs.
+ * @param [in] options What to list and how.
+ * @param [in] pResponse The response to send the listing with.
+ */
+void HttpDirectoryListing::send(const std::string& path, const std::string& urlPath, const Options& options, HttpResponse* pResponse) {
+	ESP_LOGD(LOG_TAG, ">> send: %s", path.c_str());
+	pResponse->setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
+	pResponse->addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, options.format == FORMAT_JSON ? "application/json" : "text/html");
+	pResponse->addHeader(HttpRequest::HTTP_HEADER_CACHE_CONTROL, "no-cache");
+	if (options.sort != SORT_NONE && sendIndexed(path, urlPath, options, pResponse)) {
+		return;
+	}
+	sendStreamed(path, urlPath, options, pResponse);
+} // send
+
+
+/**
+ * @brief Send a sorted listing from the index of the directory.
+ * @param [in] path The path of the directory in the file system.
+ * @param [in] urlPath The path of the directory in URLs.
+ * @param [in] options What to list and how.
+ * @param [in] pResponse The response to send the listing with.
+ * @return False if there is no index of the directory, in which case nothing has been sent.
+ */
+bool HttpDirectoryListing::sendIndexed(const std::string& path, const std::string& urlPath, const Options& options, HttpResponse* pResponse) {
+	std::shared_ptr<Index> pIndex = getIndex(path, options.sort);
+	if (pIndex == nullptr) {
+		return false;
+	}
+	const std::vector<uint32_t>& order = pIndex->order[options.sort];
+	size_t total = order.size();
+	size_t start = std::min(options.offset, total);
+	size_t end   = (options.limit == 0 || total - start <= options.limit) ? total : start + options.limit;
+	pResponse->beginChunked();
+	writeHeader(pResponse, options, urlPath);
+	for (size_t i = start; i < end; i++) {
+		const Entry& entry = pIndex->entries[order[options.descending ? total - 1 - i : i]];
+		writeEntry(pResponse, options, entry, i == start);
+	}
+	writeFooter(pResponse, options, end < total, total);
+	pResponse->end();
+	return true;
+} // sendIndexed
+
+
+/**
+ * @brief Send a listing in the order of the file system, entry by entry as the directory is read.
+ * @param [in] path The path of the directory in the file system.
+ * @param [in] urlPath The path of the directory in URLs.
+ * @param [in] options What to list and how.
+ * @param [in] pResponse The response to send the listing with.
+ */
+void HttpDirectoryListing::sendStreamed(const std::string& path, const std::string& urlPath, const Options& options, HttpResponse* pResponse) {
+	DIR* pDir = ::opendir(path.c_str());
+	if (pDir == nullptr) {
+		ESP_LOGE(LOG_TAG, "Unable to open directory: %s [errno=%d]", path.c_str(), errno);
+		pResponse->setStatus(HttpResponse::HTTP_STATUS_NOT_FOUND, "Not Found");
+		return;
+	}
+	pResponse->beginChunked();
+	writeHeader(pResponse, options, urlPath);
+	size_t position = 0;
+	size_t sent     = 0;
+	bool   more     = false;
+	struct dirent* pDirent;
+	while ((pDirent = ::readdir(pDir)) != nullptr) {
+		Entry entry;
+		if (!readEntry(path, pDirent->d_name, pDirent->d_type, entry)) continue;
+		if (position++ < options.offset) continue;
+		if (options.limit > 0 && sent == options.limit) {
+			more = true;
+			break;
+		}
+		writeEntry(pResponse, options, entry, sent == 0);
+		sent++;
+		if (pResponse->isClosed()) break;   // The client has gone.
+	}
+	::closedir(pDir);
+	writeFooter(pResponse, options, more, -1);
+	pResponse->end();
+} // sendStreamed
+
+
+/**
+ * @brief Build the order of the entries of an index by a sort key, unless already built.  The lock must
+ * be held if the index is cached.
+ * Entries that are equal by the key are ordered by name.
+ * @param [in] index The index.
+ * @param [in] sort The sort key.
+ */
+void HttpDirectoryListing::sortIndex(Index& index, SortKey sort) {
+	std::vector<uint32_t>& order = index.order[sort];
+	if (order.size() == index.entries.size()) return;
+	order.resize(index.entries.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	const std::vector<Entry>& entries = index.entries;
+	std::sort(order.begin(), order.end(), [&entries, sort](uint32_t a, uint32_t b) {
+		const Entry& entryA = entries[a];
+		const Entry& entryB = entries[b];
+		if (sort == SORT_SIZE && entryA.size != entryB.size) {
+			return entryA.size < entryB.size;
+		}
+		if (sort == SORT_MTIME && entryA.mtime != entryB.mtime) {
+			return entryA.mtime < entryB.mtime;
+		}
+		return entryA.name < entryB.name;
+	});
+} // sortIndex
+
+
+/**
+ * @brief Write an entry of the listing.
+ * @param [in] pResponse The response.
+ * @param [in] options What to list and how.
+ * @param [in] entry The entry.
+ * @param [in] first Is this the first entry written?
+ */
+void HttpDirectoryListing::writeEntry(HttpResponse* pResponse, const Options& options, const Entry& entry, bool first) {
+	char line[64];
+	if (options.format == FORMAT_JSON) {
+		pResponse->write(first ? "{\"name\":\"" : ",{\"name\":\"");
+		pResponse->write(jsonEscape(entry.name));
+		snprintf(line, sizeof(line), "\",\"type\":\"%s\",\"size\":%" PRIu32 ",\"mtime\":%ld}",
+			entry.isDirectory ? "dir" : "file", entry.size, (long) entry.mtime);
+		pResponse->write(line);
+		return;
+	}
+	std::string name = htmlEscape(entry.name);
+	pResponse->write("<tr><td><a href='" + name + (entry.isDirectory ? "/'>" : "'>") + name + "</a></td>");
+	if (entry.isDirectory) {
+		pResponse->write("<td>&lt;dir&gt;</td>");
+	} else {
+		snprintf(line, sizeof(line), "<td>%" PRIu32 "</td>", entry.size);
+		pResponse->write(line);
+	}
+	struct tm tm;
+	gmtime_r(&entry.mtime, &tm);
+	strftime(line, sizeof(line), "<td>%Y-%m-%d %H:%M</td></tr>", &tm);
+	pResponse->write(line);
+} // writeEntry
+
+
+/**
+ * @brief Write the end of the listing.
+ * @param [in] pResponse The response.
+ * @param [in] options What to list and how.
+ * @param [in] more Are there entries after those written?
+ * @param [in] total The number of entries in the directory, or -1 if it isn't known.
+ */
+void HttpDirectoryListing::writeFooter(HttpResponse* pResponse, const Options& options, bool more, int total) {
+	if (options.format == FORMAT_JSON) {
+		pResponse->write(more ? "],\"more\":true" : "],\"more\":false");
+		if (total >= 0) {
+			pResponse->write(",\"total\":" + std::to_string(total));
+		}
+		pResponse->write("}");
+		return;
+	}
+	pResponse->write("</table>");
+	if (more) {
+		static const char* sortNames[] = { "", "name", "size", "mtime" };
+		std::string next = "?offset=" + std::to_string(options.offset + options.limit) + "&amp;limit=" + std::to_string(options.limit);
+		if (options.sort != SORT_NONE) {
+			next += std::string("&amp;sort=") + sortNames[options.sort] + (options.descending ? "&amp;order=desc" : "");
+		}
+		pResponse->write("<p><a href='" + next + "'>[Next]</a></p>");
+	}
+	pResponse->write("<hr/></body></html>");
+} // writeFooter
+
+
+/**
+ * @brief Write the start of the listing.
+ * @param [in] pResponse The response.
+ * @param [in] options What to list and how.
+ * @param [in] urlPath The path of the directory in URLs.
+ */
+void HttpDirectoryListing::writeHeader(HttpResponse* pResponse, const Options& options, const std::string& urlPath) {
+	if (options.format == FORMAT_JSON) {
+		pResponse->write("{\"path\":\"" + jsonEscape(urlPath) + "\",\"entries\":[");
+		return;
+	}
+	std::string path = htmlEscape(urlPath);
+	pResponse->write("<html><head><base href='" + path + "/' /></head><body>");
+	pResponse->write("<h1>" + path + "</h1><hr/>");
+	pResponse->write("<p><a href='..'>[To Parent Directory]</a></p>");
+	pResponse->write("<table style='font-family: monospace;'>");
+	pResponse->write("<tr><th><a href='?sort=name'>Name</a></th><th><a href='?sort=size'>Size</a></th>"
+		"<th><a href='?sort=mtime&amp;order=desc'>Modified</a></th></tr>");
+} // writeHeader
@@ -0,0 +1,103 @@
+/*
+ * HttpDirectoryListing.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_HTTPDIRECTORYLISTING_H_
+#define COMPONENTS_CPP_UTILS_HTTPDIRECTORYLISTING_H_
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <list>
+#include <memory>
+#include <vector>
+#include "FreeRTOS.h"
+
+class HttpRequest;
+class HttpResponse;
+
+/**
+ * @brief Send the content of a directory as HTML or JSON.
+ *
+ * The listing is written entry by entry with chunked transfer encoding as the directory is read, so
+ * the size of a directory doesn't matter to the heap.  The query of the request selects:
+ *
+ * * `format=json` - A JSON document rather than an HTML page.  Also chosen by an Accept header that
+ *   asks for application/json.
+ * * `offset=n` and `limit=n` - A page of the entries.
+ * * `sort=name`, `sort=size` or `sort=mtime`, and `order=desc` - The order of the entries.
+ *
+ * Without a sort the entries are sent in the order the file system returns them.  A sorted listing
+ * needs all the entries of the directory, so an index of the directory is built and cached.  The index
+ * is used until the modification time of the directory changes or it reaches the maximum age (some
+ * file systems, FAT among them, don't change the time of a directory when files are added to it).
+ * Directories with more entries than the index may hold are listed unsorted.
+ *
+ * The listing may be used by several tasks at the same time.
+ */
+class HttpDirectoryListing {
+public:
+	enum Format {
+		FORMAT_HTML,
+		FORMAT_JSON
+	};
+
+	enum SortKey {
+		SORT_NONE,    // The order of the file system.
+		SORT_NAME,
+		SORT_SIZE,
+		SORT_MTIME,
+		SORT_COUNT    // The number of sort keys.
+	};
+
+	// What to list and how, taken from a request.
+	struct Options {
+		Format  format;
+		SortKey sort;
+		bool    descending;
+		size_t  offset;       // The entries skipped.
+		size_t  limit;        // The most entries sent.  0 for no limit.
+	};
+
+	HttpDirectoryListing(size_t maxIndexEntries = 1024, size_t maxIndexes = 2, uint32_t maxIndexAge = 10);
+	virtual ~HttpDirectoryListing();
+	static Options getOptions(HttpRequest* pRequest);   // Get the options chosen by the query of a request.
+	void clear();                                         // Drop the cached indexes.
+	void send(const std::string& path, const std::string& urlPath, const Options& options, HttpResponse* pResponse);
+
+private:
+	// An entry of a directory.
+	struct Entry {
+		std::string name;
+		bool        isDirectory;
+		uint32_t    size;
+		time_t      mtime;
+	};
+
+	// All the entries of a directory.
+	struct Index {
+		std::string           path;
+		time_t                mtime;              // The modification time of the directory when it was read.
+		uint32_t              created;            // Time (ms) the directory was read.
+		std::vector<Entry>    entries;            // In the order of the file system.
+		std::vector<uint32_t> order[SORT_COUNT];  // The positions of the entries by each sort key, built when first asked for.
+	};
+
+	size_t                            m_maxIndexEntries;   // The most entries of a directory that are indexed.
+	size_t                            m_maxIndexes;        // The most directories whose index is cached.
+	uint32_t                          m_maxIndexAge;       // Seconds an index is used for.
+	std::list<std::shared_ptr<Index>> m_indexes;           // The cached indexes, most recently used first.
+	FreeRTOS::Semaphore               m_lock = FreeRTOS::Semaphore("HttpDirectoryListing");
+
+	static bool readEntry(const std::string& path, const char* name, uint8_t type, Entry& entry);
+	static void sortIndex(Index& index, SortKey sort);
+	static void writeEntry(HttpResponse* pResponse, const Options& options, const Entry& entry, bool first);
+	static void writeFooter(HttpResponse* pResponse, const Options& options, bool more, int total);
+	static void writeHeader(HttpResponse* pResponse, const Options& options, const std::string& urlPath);
+	std::shared_ptr<Index> getIndex(const std::string& path, SortKey sort);
+	bool sendIndexed(const std::string& path, const std::string& urlPath, const Options& options, HttpResponse* pResponse);
+	void sendStreamed(const std::string& path, const std::string& urlPath, const Options& options, HttpResponse* pResponse);
+}; // HttpDirectoryListing
+
+#endif /* COMPONENTS_CPP_UTILS_HTTPDIRECTORYLISTING_H_ */
@@ -0,0 +1,367 @@
+/*
+ * HttpEventStream.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <stdlib.h>
+#include <algorithm>
+#include "HttpEventStream.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "HttpEventStream";
+
+
+/**
+ * @brief Format an event for the stream.
+ * A data line is written for each line of the data.
+ * @param [in] id The id of the event.
+ * @param [in] event The name of the event.  Empty for an unnamed event.
+ * @param [in] data The data of the event.
+ * @return The formatted event.
+ */
+static std::string formatEvent(uint32_t id, const std::string& event, const std::string& data) {
+	std::string text;
+	text.reserve(data.length() + event.length() + 32);
+	text += "id: ";
+	text += std::to_string(id);
+	text += '\n';
+	if (!event.empty()) {
+		text += "event: ";
+		text += event;
+		text += '\n';
+	}
+	size_t start = 0;
+	while (true) {
+		size_t end = data.find('\n', start);
+		size_t length = (end == std::string::npos ? data.length() : end) - start;
+		if (length > 0 && data[start + length - 1] == '\r') {
+			length--;
+		}
+		text += "data: ";
+		text.append(data, start, length);
+		text += '\n';
+		if (end == std::string::npos) break;
+		start = end + 1;
+	}
+	text += '\n';   // A blank line ends the event.
+	return text;
+} // formatEvent
+
+
+/**
+ * @brief Create an event stream.
+ * @param [in] queueSize The most events held for a subscriber that isn't keeping up.
+ * @param [in] historySize The number of recent events sent again to clients that reconnect.
+ * @param [in] keepAlive The seconds after which an idle subscriber is sent a comment.
+ */
+HttpEventStream::HttpEventStream(size_t queueSize, size_t historySize, uint32_t keepAlive) {
+	m_queueSize   = queueSize > 0 ? queueSize : 1;
+	m_historySize = historySize;
+	m_keepAlive   = keepAlive;
+	m_retry       = 3000;   // Clients reconnect after 3 seconds.
+	m_lastId      = 0;
+	m_stats       = Stats();
+	m_running     = false;
+	m_taskHandle  = nullptr;
+} // HttpEventStream
+
+
+HttpEventStream::~HttpEventStream() {
+	m_lock.take("~HttpEventStream");
+	bool started = m_taskHandle != nullptr;
+	m_running = false;
+	if (started) {
+		wake();
+	}
+	m_lock.give();
+	if (started) {
+		m_stopped.wait("~HttpEventStream");   // The task closes the connections of the subscribers.
+	}
+} // ~HttpEventStream
+
+
+/**
+ * @brief Disconnect all the subscribers.
+ * Clients will reconnect after the retry time unless they are told otherwise.
+ */
+void HttpEventStream::close() {
+	m_lock.take("close");
+	for (auto it = m_subscribers.begin(); it != m_subscribers.end(); ++it) {
+		(*it)->closed = true;
+	}
+	wake();
+	m_lock.give();
+} // close
+
+
+/**
+ * @brief Queue an event for a subscriber.  The lock must be held.
+ * If the queue is full, the oldest event that hasn't started to be sent is dropped.
+ * @param [in] pSubscriber The subscriber.
+ * @param [in] text The formatted event.
+ */
+void HttpEventStream::enqueue(Subscriber* pSubscriber, std::shared_ptr<const std::string> text) {
+	if (pSubscriber->queue.size() >= m_queueSize) {
+		size_t oldest = (pSubscriber->offset > 0 || pSubscriber->sending) ? 1 : 0;   // Part of the first may have been sent.
+		if (oldest < pSubscriber->queue.size()) {
+			pSubscriber->queue.erase(pSubscriber->queue.begin() + oldest);
+			m_stats.dropped++;
+		}
+	}
+	pSubscriber->queue.push_back(text);
+} // enqueue
+
+
+/**
+ * @brief Write what we can of the queues to the subscribers.
+ * No more than the first event in the queue of each subscriber is written at a time, so one subscriber
+ * doesn't get ahead of the others.  The connections of the subscribers that have gone are closed.
+ * @param [out] pBlocked Receives the sockets of the subscribers that can't take any more data.
+ * @param [out] pMaxFd Receives the highest socket in pBlocked.
+ * @return True if a subscriber that is keeping up has more to send.
+ */
+bool HttpEventStream::flush(fd_set* pBlocked, int* pMaxFd) {
+	static const std::shared_ptr<const std::string> keepAlive = std::make_shared<const std::string>(":\n\n");
+	bool more = false;
+	uint32_t now = FreeRTOS::getTimeSinceStart();
+	m_lock.take("flush");
+	std::vector<std::shared_ptr<Subscriber>> subscribers = m_subscribers;
+	m_lock.give();
+
+	for (auto it = subscribers.begin(); it != subscribers.end(); ++it) {
+		Subscriber* pSubscriber = it->get();
+		m_lock.take("flush");
+		if (pSubscriber->queue.empty() && now - pSubscriber->lastSend >= m_keepAlive * 1000) {
+			pSubscriber->queue.push_back(keepAlive);
+		}
+		if (pSubscriber->queue.empty() || pSubscriber->closed) {
+			m_lock.give();
+			continue;
+		}
+		std::shared_ptr<const std::string> text = pSubscriber->queue.front();
+		size_t offset = pSubscriber->offset;
+		pSubscriber->sending = true;
+		m_lock.give();
+
+		// Write without the lock so that events can be published in the meantime.
+		int rc = pSubscriber->socket.trySend((const uint8_t*) text->data() + offset, text->length() - offset);
+
+		m_lock.take("flush");
+		pSubscriber->sending = false;
+		if (rc < 0) {
+			pSubscriber->closed = true;
+		} else {
+			pSubscriber->offset += rc;
+			if (pSubscriber->offset == text->length()) {
+				pSubscriber->queue.pop_front();
+				pSubscriber->offset   = 0;
+				pSubscriber->lastSend = now;
+			}
+			if (rc == 0) {
+				FD_SET(pSubscriber->socket.getFD(), pBlocked);
+				*pMaxFd = std::max(*pMaxFd, pSubscriber->socket.getFD());
+			} else if (!pSubscriber->queue.empty()) {
+				more = true;
+			}
+		}
+		m_lock.give();
+	}
+
+	m_lock.take("flush");
+	for (size_t i = m_subscribers.size(); i-- > 0;) {
+		if (m_subscribers[i]->closed) {
+			ESP_LOGD(LOG_TAG, "Subscriber gone; sockFd=%d", m_subscribers[i]->socket.getFD());
+			m_subscribers[i]->socket.close();
+			m_subscribers.erase(m_subscribers.begin() + i);
+			m_stats.disconnected++;
+		}
+	}
+	m_stats.subscribers = m_subscribers.size();
+	m_lock.give();
+	return more;
+} // flush
+
+
+/**
+ * @brief Get the number of subscribers currently connected.
+ */
+size_t HttpEventStream::getSubscriberCount() {
+	m_lock.take("getSubscriberCount");
+	size_t count = m_subscribers.size();
+	m_lock.give();
+	return count;
+} // getSubscriberCount
+
+
+/**
+ * @brief Get the counters of the use of the stream.
+ * @return A copy of the counters.
+ */
+HttpEventStream::Stats HttpEventStream::getStats() {
+	m_lock.take("getStats");
+	Stats stats = m_stats;
+	m_lock.give();
+	return stats;
+} // getStats
+
+
+/**
+ * @brief Send an unnamed ("message") event to all the subscribers.
+ * @param [in] data The data of the event.  It may contain several lines.
+ * @return The id of the event.
+ */
+uint32_t HttpEventStream::publish(const std::string& data) {
+	return publish("", data);
+} // publish
+
+
+/**
+ * @brief Send a named event to all the subscribers.
+ * The event is formatted once and queued for each subscriber.  We don't wait for it to be sent.
+ * @param [in] event The name of the event.
+ * @param [in] data The data of the event.  It may contain several lines.
+ * @return The id of the event.
+ */
+uint32_t HttpEventStream::publish(const std::string& event, const std::string& data) {
+	m_lock.take("publish");
+	uint32_t id = ++m_lastId;
+	std::shared_ptr<const std::string> text = std::make_shared<const std::string>(formatEvent(id, event, data));
+	if (m_historySize > 0) {
+		if (m_history.size() >= m_historySize) {
+			m_history.pop_front();
+		}
+		Event entry;
+		entry.id   = id;
+		entry.text = text;
+		m_history.push_back(entry);
+	}
+	for (auto it = m_subscribers.begin(); it != m_subscribers.end(); ++it) {
+		enqueue(it->get(), text);
+	}
+	m_stats.published++;
+	wake();
+	m_lock.give();
+	return id;
+} // publish
+
+
+/**
+ * @brief Write the queues to the subscribers until the stream is destroyed.
+ */
+void HttpEventStream::run() {
+	ESP_LOGD(LOG_TAG, ">> run");
+	while (true) {
+		m_lock.take("run");
+		bool running = m_running;
+		m_lock.give();
+		if (!running) break;
+
+		fd_set blocked;
+		FD_ZERO(&blocked);
+		int maxFd = -1;
+		if (flush(&blocked, &maxFd)) continue;   // More to send to subscribers that are keeping up.
+		if (maxFd >= 0) {
+			// Wait for a blocked subscriber to take more data, but not for long as new events
+			// for the others don't wake us up.
+			struct timeval tv;
+			tv.tv_sec  = 0;
+			tv.tv_usec = BLOCKED_WAIT * 1000;
+			::select(maxFd + 1, nullptr, &blocked, nullptr, &tv);
+		} else {
+			::ulTaskNotifyTake(pdTRUE, 1000 / portTICK_PERIOD_MS);   // Wake at least once a second for the keep alives.
+		}
+	}
+
+	m_lock.take("run");
+	for (auto it = m_subscribers.begin(); it != m_subscribers.end(); ++it) {
+		(*it)->socket.close();
+	}
+	m_stats.disconnected += m_subscribers.size();
+	m_subscribers.clear();
+	m_stats.subscribers = 0;
+	m_lock.give();
+	ESP_LOGD(LOG_TAG, "<< run");
+} // run
+
+
+/**
+ * @brief The body of the task writing the queues to the subscribers.
+ * @param [in] pParam The stream.
+ */
+void HttpEventStream::senderTask(void* pParam) {
+	HttpEventStream* pStream = (HttpEventStream*) pParam;
+	pStream->run();
+	pStream->m_stopped.give();   // The stream may be deleted from here on.
+	::vTaskDelete(nullptr);
+} // senderTask
+
+
+/**
+ * @brief Set how long a client waits before reconnecting when its connection is lost.
+ * The time is sent to clients when they subscribe.
+ * @param [in] retry The time in milliseconds.
+ */
+void HttpEventStream::setRetry(uint32_t retry) {
+	m_retry = retry;
+} // setRetry
+
+
+/**
+ * @brief Hold the connection of a request open as a subscriber.
+ * The header of the stream is sent and the connection is handed over from the server to the stream.
+ * A client that sent a Last-Event-ID header is first sent the remembered events it missed.
+ * @param [in] pRequest The request.
+ * @param [in] pResponse The response to the request.
+ */
+void HttpEventStream::subscribe(HttpRequest* pRequest, HttpResponse* pResponse) {
+	pResponse->setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
+	pResponse->addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, "text/event-stream");
+	pResponse->addHeader(HttpRequest::HTTP_HEADER_CACHE_CONTROL, "no-cache");
+	pResponse->sendData("retry: " + std::to_string(m_retry) + "\n\n");
+	pResponse->detach();
+	if (!pRequest->getSocket().isValid()) return;
+
+	std::shared_ptr<Subscriber> pSubscriber = std::make_shared<Subscriber>();
+	pSubscriber->socket   = pRequest->getSocket();
+	pSubscriber->offset   = 0;
+	pSubscriber->sending  = false;
+	pSubscriber->closed   = false;
+	pSubscriber->lastSend = FreeRTOS::getTimeSinceStart();
+	std::string lastEventId(pRequest->getHeaderView(HttpRequest::HTTP_HEADER_LAST_EVENT_ID));
+
+	m_lock.take("subscribe");
+	if (!lastEventId.empty()) {
+		uint32_t lastId = strtoul(lastEventId.c_str(), nullptr, 10);
+		for (auto it = m_history.begin(); it != m_history.end(); ++it) {
+			if (it->id > lastId) {
+				enqueue(pSubscriber.get(), it->text);
+				m_stats.replayed++;
+			}
+		}
+	}
+	m_subscribers.push_back(pSubscriber);
+	m_stats.subscribed++;
+	m_stats.subscribers = m_subscribers.size();
+	ESP_LOGD(LOG_TAG, "New subscriber; sockFd=%d, subscribers: %d", pSubscriber->socket.getFD(), m_subscribers.size());
+	if (m_taskHandle == nullptr) {
+		m_running = true;
+		m_stopped.take("subscribe");
+		::xTaskCreate(senderTask, "HttpEventStream", TASK_STACK_SIZE, this, 5, &m_taskHandle);
+	}
+	wake();
+	m_lock.give();
+} // subscribe
+
+
+/**
+ * @brief Wake the task writing the queues to the subscribers.  The lock must be held.
+ */
+void HttpEventStream::wake() {
+	if (m_taskHandle != nullptr) {
+		::xTaskNotifyGive(m_taskHandle);
+	}
+} // wake
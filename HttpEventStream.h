@@ -0,0 +1,111 @@
+/*
+ * HttpEventStream.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_HTTPEVENTSTREAM_H_
+#define COMPONENTS_CPP_UTILS_HTTPEVENTSTREAM_H_
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "FreeRTOS.h"
+#include "Socket.h"
+
+class HttpRequest;
+class HttpResponse;
+
+/**
+ * @brief Push events to clients with Server-Sent Events (text/event-stream).
+ *
+ * A client subscribes with a GET of the path of the stream (see HttpServer::addEventStream()) and the
+ * connection is then held open.  Each published event is formatted once and the same buffer is queued
+ * for every subscriber.  A task of the stream writes the queues to the subscribers without waiting for
+ * any of them: a subscriber that can't take more data is skipped until its socket is writable again.
+ * When the queue of a slow subscriber is full, its oldest event is dropped.
+ *
+ * Events are numbered.  The most recent events are remembered so that a client that reconnects with
+ * a Last-Event-ID header is sent the events it missed.  A comment is sent to idle subscribers from time
+ * to time so that closed connections are noticed and proxies don't time them out.
+ *
+ * Example:
+ * @code{.cpp}
+ * HttpEventStream* pStream = httpServer->addEventStream("/events");
+ * pStream->publish("temperature", "{\"celsius\":21.5}");
+ * @endcode
+ *
+ * Over SSL a write can't be split, so a slow subscriber may hold up the others for up to the client
+ * timeout of the server.
+ */
+class HttpEventStream {
+public:
+	static const size_t   DEFAULT_QUEUE_SIZE   = 16;   // Events held for a subscriber.
+	static const size_t   DEFAULT_HISTORY_SIZE = 16;   // Events remembered for clients that reconnect.
+	static const uint32_t DEFAULT_KEEP_ALIVE   = 15;   // Seconds after which an idle subscriber is sent a comment.
+
+	// Counters of the use of the stream.
+	struct Stats {
+		uint32_t published;      // Events published.
+		uint32_t dropped;        // Events dropped from the queue of a slow subscriber.
+		uint32_t replayed;       // Events sent again to clients that reconnected.
+		uint32_t subscribed;     // Clients that have subscribed.
+		uint32_t disconnected;   // Subscribers whose connection has been closed.
+		size_t   subscribers;    // Subscribers currently connected.
+	};
+
+	HttpEventStream(size_t queueSize = DEFAULT_QUEUE_SIZE, size_t historySize = DEFAULT_HISTORY_SIZE,
+		uint32_t keepAlive = DEFAULT_KEEP_ALIVE);
+	virtual ~HttpEventStream();
+	void     close();                        // Disconnect all the subscribers.
+	size_t   getSubscriberCount();           // Get the number of subscribers currently connected.
+	Stats    getStats();                     // Get the counters of the use of the stream.
+	uint32_t publish(const std::string& data);                            // Send an unnamed event to all the subscribers.
+	uint32_t publish(const std::string& event, const std::string& data);  // Send a named event to all the subscribers.
+	void     setRetry(uint32_t retry);       // Set the milliseconds a client waits before reconnecting.
+	void     subscribe(HttpRequest* pRequest, HttpResponse* pResponse);   // Hold the connection of a request open as a subscriber.
+
+private:
+	static const uint32_t BLOCKED_WAIT = 10;     // The most milliseconds we wait for a blocked subscriber before looking at the others.
+	static const uint16_t TASK_STACK_SIZE = 4096;
+
+	// A published event.
+	struct Event {
+		uint32_t                           id;
+		std::shared_ptr<const std::string> text;   // The event formatted for the stream.
+	};
+
+	// A client holding a connection open.
+	struct Subscriber {
+		Socket                                         socket;
+		std::deque<std::shared_ptr<const std::string>> queue;      // Events waiting to be sent, oldest first.
+		size_t                                         offset;     // The bytes of the first event in the queue already sent.
+		bool                                           sending;    // Is the first event being written outside the lock?
+		bool                                           closed;     // Should the connection be closed?
+		uint32_t                                       lastSend;   // Time (ms) an event was last sent.
+	};
+
+	size_t                                   m_queueSize;     // Events held for a subscriber.
+	size_t                                   m_historySize;   // Events remembered for clients that reconnect.
+	uint32_t                                 m_keepAlive;     // Seconds after which an idle subscriber is sent a comment.
+	uint32_t                                 m_retry;         // Milliseconds a client waits before reconnecting.
+	uint32_t                                 m_lastId;        // The id of the last published event.
+	std::deque<Event>                        m_history;       // The most recent events, oldest first.
+	std::vector<std::shared_ptr<Subscriber>> m_subscribers;
+	Stats                                    m_stats;
+	bool                                     m_running;       // Should the sender task keep running?
+	TaskHandle_t                             m_taskHandle;    // The task writing the queues to the subscribers, once started.
+	FreeRTOS::Semaphore                      m_lock = FreeRTOS::Semaphore("HttpEventStream");
+	FreeRTOS::Semaphore                      m_stopped = FreeRTOS::Semaphore("HttpEventStreamStopped");   // Given when the sender task ends.
+
+	static void senderTask(void* pParam);
+	void enqueue(Subscriber* pSubscriber, std::shared_ptr<const std::string> text);
+	bool flush(fd_set* pBlocked, int* pMaxFd);
+	void run();
+	void wake();
+}; // HttpEventStream
+
+#endif /* COMPONENTS_CPP_UTILS_HTTPEVENTSTREAM_H_ */
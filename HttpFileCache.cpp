@@ -0,0 +1,179 @@
+/*
+ * HttpFileCache.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <fstream>
+#include "HttpFileCache.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "HttpFileCache";
+
+
+/**
+ * @brief Create a file cache.
+ * @param [in] maxBytes The total size of the files that may be held in the cache.
+ * @param [in] maxFileSize The size of the largest file that is cached.
+ */
+HttpFileCache::HttpFileCache(size_t maxBytes, size_t maxFileSize) {
+	m_maxBytes    = maxBytes;
+	m_maxFileSize = maxFileSize;
+	m_stats       = Stats();
+} // HttpFileCache
+
+
+HttpFileCache::~HttpFileCache() {
+} // ~HttpFileCache
+
+
+/**
+ * @brief Drop all the cached files.
+ * Data that is still being sent stays valid until the sender is done with it.
+ */
+void HttpFileCache::clear() {
+	m_lock.take("clear");
+	m_entries.clear();
+	m_index.clear();
+	m_stats.bytesCached = 0;
+	m_stats.entries     = 0;
+	m_lock.give();
+} // clear
+
+
+/**
+ * @brief Get the content of a file.
+ * If the file is cached and hasn't changed since it was read, the cached content is returned.
+ * Otherwise, if the file is small enough, it is read and added to the cache.
+ * @param [in] fileName The name of the file.
+ * @param [in] statBuf The current status of the file.
+ * @return The content of the file or nullptr if the file isn't cached and can't be cached.  The caller
+ * should then read the file itself.
+ */
+std::shared_ptr<const std::string> HttpFileCache::get(const std::string& fileName, const struct stat& statBuf) {
+	if ((size_t) statBuf.st_size > m_maxFileSize || (size_t) statBuf.st_size > m_maxBytes) {
+		return nullptr;
+	}
+
+	m_lock.take("get");
+	auto it = m_index.find(fileName);
+	if (it != m_index.end()) {
+		if (it->second->size == statBuf.st_size && it->second->mtime == statBuf.st_mtime) {
+			m_entries.splice(m_entries.begin(), m_entries, it->second);   // Now the most recently used.
+			std::shared_ptr<const std::string> data = it->second->data;
+			m_stats.hits++;
+			m_stats.bytesSaved += data->length();
+			m_lock.give();
+			return data;
+		}
+		ESP_LOGD(LOG_TAG, "File %s has changed", fileName.c_str());
+		remove(it->second);
+	}
+	m_stats.misses++;
+	m_lock.give();
+
+	// Read the file without holding the lock so that other tasks can use the cache in the meantime.
+	std::ifstream ifStream(fileName, std::ifstream::in | std::ifstream::binary);
+	if (!ifStream.is_open()) {
+		return nullptr;
+	}
+	std::string* pData = new std::string(statBuf.st_size, '\0');
+	ifStream.read(&(*pData)[0], statBuf.st_size);
+	if ((size_t) ifStream.gcount() != pData->length()) {   // The file changed while we read it.
+		delete pData;
+		return nullptr;
+	}
+	std::shared_ptr<const std::string> data(pData);
+	insert(fileName, statBuf, data);
+	return data;
+} // get
+
+
+/**
+ * @brief Get the fraction of requests for cacheable files that were served from the cache.
+ * @return The hit ratio between 0 and 1.
+ */
+float HttpFileCache::getHitRatio() {
+	Stats stats = getStats();
+	if (stats.hits + stats.misses == 0) {
+		return 0;
+	}
+	return (float) stats.hits / (stats.hits + stats.misses);
+} // getHitRatio
+
+
+size_t HttpFileCache::getMaxBytes() {
+	return m_maxBytes;
+} // getMaxBytes
+
+
+size_t HttpFileCache::getMaxFileSize() {
+	return m_maxFileSize;
+} // getMaxFileSize
+
+
+/**
+ * @brief Get the counters of the use of the cache.
+ * @return A copy of the counters.
+ */
+HttpFileCache::Stats HttpFileCache::getStats() {
+	m_lock.take("getStats");
+	Stats stats = m_stats;
+	m_lock.give();
+	return stats;
+} // getStats
+
+
+/**
+ * @brief Add a file to the cache.
+ * The least recently used files are dropped until the new file fits in the byte budget.
+ * @param [in] fileName The name of the file.
+ * @param [in] statBuf The status of the file when it was read.
+ * @param [in] data The content of the file.
+ */
+void HttpFileCache::insert(const std::string& fileName, const struct stat& statBuf, std::shared_ptr<const std::string> data) {
+	m_lock.take("insert");
+	auto it = m_index.find(fileName);
+	if (it != m_index.end()) {   // Another task read the file at the same time.
+		remove(it->second);
+	}
+	while (!m_entries.empty() && m_stats.bytesCached + data->length() > m_maxBytes) {
+		ESP_LOGD(LOG_TAG, "Evicting %s", m_entries.back().fileName.c_str());
+		remove(std::prev(m_entries.end()));
+	}
+	Entry entry;
+	entry.fileName = fileName;
+	entry.size     = statBuf.st_size;
+	entry.mtime    = statBuf.st_mtime;
+	entry.data     = data;
+	m_entries.push_front(entry);
+	m_index[fileName] = m_entries.begin();
+	m_stats.bytesCached += data->length();
+	m_stats.entries++;
+	m_lock.give();
+} // insert
+
+
+/**
+ * @brief Count a request that was answered with 304 Not Modified.
+ * @param [in] size The size of the file that didn't have to be sent.
+ */
+void HttpFileCache::recordNotModified(size_t size) {
+	m_lock.take("recordNotModified");
+	m_stats.notModified++;
+	m_stats.bytesSaved += size;
+	m_lock.give();
+} // recordNotModified
+
+
+/**
+ * @brief Remove an entry from the cache.  The lock must be held.
+ * @param [in] it The entry.
+ */
+void HttpFileCache::remove(std::list<Entry>::iterator it) {
+	m_stats.bytesCached -= it->data->length();
+	m_stats.entries--;
+	m_index.erase(it->fileName);
+	m_entries.erase(it);
+} // remove
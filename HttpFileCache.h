@@ -0,0 +1,68 @@
+/*
+ * HttpFileCache.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_HTTPFILECACHE_H_
+#define COMPONENTS_CPP_UTILS_HTTPFILECACHE_H_
+#include <stdint.h>
+#include <sys/stat.h>
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "FreeRTOS.h"
+
+/**
+ * @brief Hold the content of small, frequently requested files in RAM.
+ *
+ * Files are cached by name up to a total byte budget.  When the budget is exceeded, the least recently
+ * used files are dropped.  An entry is only used while the size and modification time of the file
+ * are those it was read with.  Files larger than the maximum file size are never cached.
+ *
+ * The cache may be used by several tasks at the same time.
+ */
+class HttpFileCache {
+public:
+	// Counters of the use of the cache.
+	struct Stats {
+		uint32_t hits;          // Requests served from the cache.
+		uint32_t misses;        // Requests for cacheable files that had to be read from the file system.
+		uint32_t notModified;   // Requests answered with 304 Not Modified.
+		uint64_t bytesSaved;    // Bytes not read from the file system (hits) or not sent (304 responses).
+		size_t   bytesCached;   // Bytes currently held in the cache.
+		size_t   entries;       // Files currently held in the cache.
+	};
+
+	HttpFileCache(size_t maxBytes, size_t maxFileSize);
+	virtual ~HttpFileCache();
+	void        clear();                    // Drop all the cached files.
+	std::shared_ptr<const std::string> get(const std::string& fileName, const struct stat& statBuf);   // Get the content of a file.
+	float       getHitRatio();              // Get the fraction of requests served from the cache.
+	size_t      getMaxBytes();              // Get the byte budget of the cache.
+	size_t      getMaxFileSize();           // Get the size of the largest file that is cached.
+	Stats       getStats();                 // Get the counters of the use of the cache.
+	void        recordNotModified(size_t size);   // Count a request answered with 304 Not Modified.
+
+private:
+	// A cached file.
+	struct Entry {
+		std::string                        fileName;
+		off_t                              size;    // The size of the file when it was read.
+		time_t                             mtime;   // The modification time of the file when it was read.
+		std::shared_ptr<const std::string> data;    // The content of the file.
+	};
+
+	size_t                 m_maxBytes;      // The byte budget of the cache.
+	size_t                 m_maxFileSize;   // The size of the largest file that is cached.
+	std::list<Entry>       m_entries;       // The cached files, most recently used first.
+	std::unordered_map<std::string, std::list<Entry>::iterator> m_index;   // The cached files by name.
+	Stats                  m_stats;
+	FreeRTOS::Semaphore    m_lock = FreeRTOS::Semaphore("HttpFileCache");
+
+	void insert(const std::string& fileName, const struct stat& statBuf, std::shared_ptr<const std::string> data);
+	void remove(std::list<Entry>::iterator it);
+}; // HttpFileCache
+
+#endif /* COMPONENTS_CPP_UTILS_HTTPFILECACHE_H_ */
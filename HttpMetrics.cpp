@@ -0,0 +1,262 @@
+/*
+ * HttpMetrics.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "HttpMetrics.h"
+#include "HttpResponse.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "HttpMetrics";
+
+static const int    MIN_OCTAVE = 6;          // The first bucket holds durations up to 2^6 microseconds.
+static const size_t MAX_LABEL_LENGTH = 100;  // Longer route names are cut so that each line fits the line buffer.
+
+static const char* phaseNames[]     = { "parse", "handler", "send" };
+static const char* rejectionNames[] = { "busy", "bad_request", "too_large", "timeout", "head_too_large", "too_many_connections" };
+
+
+HttpMetrics::HttpMetrics() {
+	m_connections          = 0;
+	m_activeConnections    = 0;
+	m_maxActiveConnections = 0;
+	m_activeRequests       = 0;
+	for (size_t i = 0; i < REJECT_COUNT; i++) {
+		m_rejected[i] = 0;
+	}
+} // HttpMetrics
+
+
+HttpMetrics::~HttpMetrics() {
+	for (auto it = m_routes.begin(); it != m_routes.end(); ++it) {
+		delete *it;
+	}
+} // ~HttpMetrics
+
+
+/**
+ * @brief Add a route.
+ * Routes must be added before requests are recorded.
+ * @param [in] name The name of the route, for example "GET /api/leds/:id".
+ * @return The index of the route to pass to recordRequest().
+ */
+size_t HttpMetrics::addRoute(const std::string& name) {
+	Route* pRoute = new Route();   // Value initialized so the counters start at 0.
+	pRoute->name = name;
+	m_routes.push_back(pRoute);
+	return m_routes.size() - 1;
+} // addRoute
+
+
+void HttpMetrics::connectionClosed() {
+	m_activeConnections.fetch_sub(1, std::memory_order_relaxed);
+} // connectionClosed
+
+
+void HttpMetrics::connectionOpened() {
+	m_connections.fetch_add(1, std::memory_order_relaxed);
+	uint32_t active = m_activeConnections.fetch_add(1, std::memory_order_relaxed) + 1;
+	uint32_t max = m_maxActiveConnections.load(std::memory_order_relaxed);
+	while (active > max && !m_maxActiveConnections.compare_exchange_weak(max, active, std::memory_order_relaxed)) {
+	}
+} // connectionOpened
+
+
+/**
+ * @brief Get the histogram bucket of a duration.
+ * @param [in] micros The duration in microseconds.
+ * @return The index of the bucket.
+ */
+size_t HttpMetrics::getBucket(uint32_t micros) {
+	if (micros <= (1u << MIN_OCTAVE)) return 0;
+	uint32_t value = micros - 1;   // So that a duration equal to the limit of a bucket falls in that bucket.
+	int octave = 31 - __builtin_clz(value);
+	size_t bucket = 1 + (octave - MIN_OCTAVE) * 2 + ((value >> (octave - 1)) & 1);
+	return bucket < BUCKET_COUNT ? bucket : BUCKET_COUNT - 1;
+} // getBucket
+
+
+/**
+ * @brief Get the largest duration of a bucket.
+ * @param [in] bucket The index of the bucket.
+ * @return The largest duration in microseconds or UINT32_MAX for the last, unbounded, bucket.
+ */
+uint32_t HttpMetrics::getBucketLimit(size_t bucket) {
+	if (bucket == 0) return 1u << MIN_OCTAVE;
+	if (bucket >= BUCKET_COUNT - 1) return UINT32_MAX;
+	int octave = MIN_OCTAVE + (bucket - 1) / 2;
+	return (1u << octave) + (((bucket - 1) % 2) + 1) * (1u << (octave - 1));
+} // getBucketLimit
+
+
+/**
+ * @brief Get a copy of the metrics.
+ * The counters are read one at a time while requests may be recorded, so they can be slightly out of
+ * step with one another.
+ * @return The metrics.
+ */
+HttpMetrics::Snapshot HttpMetrics::getSnapshot() {
+	Snapshot snapshot;
+	for (auto it = m_routes.begin(); it != m_routes.end(); ++it) {
+		Route* pRoute = *it;
+		RouteSnapshot route;
+		route.name     = pRoute->name;
+		route.requests = pRoute->requests.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < 5; i++) {
+			route.statusClasses[i] = pRoute->statusClasses[i].load(std::memory_order_relaxed);
+		}
+		route.bytesIn  = pRoute->bytesIn.load(std::memory_order_relaxed);
+		route.bytesOut = pRoute->bytesOut.load(std::memory_order_relaxed);
+		for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+			for (size_t i = 0; i < BUCKET_COUNT; i++) {
+				route.latency[phase].buckets[i] = pRoute->latency[phase].buckets[i].load(std::memory_order_relaxed);
+			}
+			route.latency[phase].sum   = pRoute->latency[phase].sum.load(std::memory_order_relaxed);
+			route.latency[phase].count = pRoute->latency[phase].count.load(std::memory_order_relaxed);
+		}
+		snapshot.routes.push_back(route);
+	}
+	snapshot.connections          = m_connections.load(std::memory_order_relaxed);
+	snapshot.activeConnections    = m_activeConnections.load(std::memory_order_relaxed);
+	snapshot.maxActiveConnections = m_maxActiveConnections.load(std::memory_order_relaxed);
+	snapshot.activeRequests       = m_activeRequests.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < REJECT_COUNT; i++) {
+		snapshot.rejected[i] = m_rejected[i].load(std::memory_order_relaxed);
+	}
+	return snapshot;
+} // getSnapshot
+
+
+void HttpMetrics::recordRejection(Rejection reason) {
+	m_rejected[reason].fetch_add(1, std::memory_order_relaxed);
+} // recordRejection
+
+
+/**
+ * @brief Record a request that has been served.
+ * @param [in] route The index of the route that served the request.
+ * @param [in] status The status of the response.
+ * @param [in] bytesIn The bytes of the request received.
+ * @param [in] bytesOut The bytes of the response sent.
+ * @param [in] durations The time taken by each phase in microseconds.
+ */
+void HttpMetrics::recordRequest(size_t route, int status, size_t bytesIn, size_t bytesOut, const uint32_t durations[PHASE_COUNT]) {
+	if (route >= m_routes.size()) return;
+	Route* pRoute = m_routes[route];
+	pRoute->requests.fetch_add(1, std::memory_order_relaxed);
+	if (status >= 100 && status < 600) {
+		pRoute->statusClasses[status / 100 - 1].fetch_add(1, std::memory_order_relaxed);
+	}
+	pRoute->bytesIn.fetch_add(bytesIn, std::memory_order_relaxed);
+	pRoute->bytesOut.fetch_add(bytesOut, std::memory_order_relaxed);
+	for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+		AtomicHistogram& histogram = pRoute->latency[phase];
+		histogram.buckets[getBucket(durations[phase])].fetch_add(1, std::memory_order_relaxed);
+		histogram.sum.fetch_add(durations[phase], std::memory_order_relaxed);
+		histogram.count.fetch_add(1, std::memory_order_relaxed);
+	}
+} // recordRequest
+
+
+void HttpMetrics::requestEnded() {
+	m_activeRequests.fetch_sub(1, std::memory_order_relaxed);
+} // requestEnded
+
+
+void HttpMetrics::requestStarted() {
+	m_activeRequests.fetch_add(1, std::memory_order_relaxed);
+} // requestStarted
+
+
+/**
+ * @brief Send the metrics in the Prometheus text exposition format.
+ * The response is streamed with chunked transfer coding so that it doesn't have to be built in RAM.
+ * The buckets of a histogram above the largest duration recorded are left out.
+ * @param [in] pResponse The response to send the metrics with.
+ */
+void HttpMetrics::writePrometheus(HttpResponse* pResponse) {
+	ESP_LOGD(LOG_TAG, ">> writePrometheus");
+	Snapshot snapshot = getSnapshot();
+	char line[256];
+	auto writeText = [pResponse](const char* text) {
+		pResponse->write((const uint8_t*) text, strlen(text));
+	};
+	auto writeLine = [pResponse, &line](int length) {
+		pResponse->write((const uint8_t*) line, std::min((size_t) length, sizeof(line) - 1));
+	};
+	pResponse->addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+	pResponse->beginChunked();
+
+	writeText("# TYPE http_connections_total counter\n");
+	writeLine(snprintf(line, sizeof(line), "http_connections_total %" PRIu32 "\n", snapshot.connections));
+	writeText("# TYPE http_connections_active gauge\n");
+	writeLine(snprintf(line, sizeof(line), "http_connections_active %" PRIu32 "\n", snapshot.activeConnections));
+	writeText("# TYPE http_connections_max_active gauge\n");
+	writeLine(snprintf(line, sizeof(line), "http_connections_max_active %" PRIu32 "\n", snapshot.maxActiveConnections));
+	writeText("# TYPE http_requests_active gauge\n");
+	writeLine(snprintf(line, sizeof(line), "http_requests_active %" PRIu32 "\n", snapshot.activeRequests));
+	writeText("# TYPE http_rejected_total counter\n");
+	for (size_t i = 0; i < REJECT_COUNT; i++) {
+		writeLine(snprintf(line, sizeof(line), "http_rejected_total{reason=\"%s\"} %" PRIu32 "\n", rejectionNames[i], snapshot.rejected[i]));
+	}
+
+	// The route names become label values in which a quote or backslash must be escaped.
+	std::vector<std::string> labels;
+	for (auto it = snapshot.routes.begin(); it != snapshot.routes.end(); ++it) {
+		std::string label;
+		for (char c : it->name.substr(0, MAX_LABEL_LENGTH)) {
+			if (c == '"' || c == '\\') label += '\\';
+			label += c;
+		}
+		labels.push_back(label);
+	}
+
+	writeText("# TYPE http_requests_total counter\n");
+	for (size_t r = 0; r < snapshot.routes.size(); r++) {
+		for (size_t i = 0; i < 5; i++) {
+			if (snapshot.routes[r].statusClasses[i] == 0) continue;
+			writeLine(snprintf(line, sizeof(line), "http_requests_total{route=\"%s\",status=\"%dxx\"} %" PRIu32 "\n",
+				labels[r].c_str(), (int) (i + 1), snapshot.routes[r].statusClasses[i]));
+		}
+	}
+	writeText("# TYPE http_request_bytes_total counter\n");
+	for (size_t r = 0; r < snapshot.routes.size(); r++) {
+		writeLine(snprintf(line, sizeof(line), "http_request_bytes_total{route=\"%s\"} %llu\n", labels[r].c_str(), (unsigned long long) snapshot.routes[r].bytesIn));
+	}
+	writeText("# TYPE http_response_bytes_total counter\n");
+	for (size_t r = 0; r < snapshot.routes.size(); r++) {
+		writeLine(snprintf(line, sizeof(line), "http_response_bytes_total{route=\"%s\"} %llu\n", labels[r].c_str(), (unsigned long long) snapshot.routes[r].bytesOut));
+	}
+
+	writeText("# TYPE http_request_duration_seconds histogram\n");
+	for (size_t r = 0; r < snapshot.routes.size(); r++) {
+		if (snapshot.routes[r].requests == 0) continue;
+		for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+			const Histogram& histogram = snapshot.routes[r].latency[phase];
+			size_t last = 0;
+			for (size_t i = 0; i < BUCKET_COUNT - 1; i++) {
+				if (histogram.buckets[i] > 0) last = i;
+			}
+			uint32_t cumulative = 0;
+			for (size_t i = 0; i <= last; i++) {
+				cumulative += histogram.buckets[i];
+				writeLine(snprintf(line, sizeof(line), "http_request_duration_seconds_bucket{route=\"%s\",phase=\"%s\",le=\"%.6f\"} %" PRIu32 "\n",
+					labels[r].c_str(), phaseNames[phase], getBucketLimit(i) / 1000000.0, cumulative));
+			}
+			writeLine(snprintf(line, sizeof(line), "http_request_duration_seconds_bucket{route=\"%s\",phase=\"%s\",le=\"+Inf\"} %" PRIu32 "\n",
+				labels[r].c_str(), phaseNames[phase], histogram.count));
+			writeLine(snprintf(line, sizeof(line), "http_request_duration_seconds_sum{route=\"%s\",phase=\"%s\"} %.6f\n",
+				labels[r].c_str(), phaseNames[phase], histogram.sum / 1000000.0));
+			writeLine(snprintf(line, sizeof(line), "http_request_duration_seconds_count{route=\"%s\",phase=\"%s\"} %" PRIu32 "\n",
+				labels[r].c_str(), phaseNames[phase], histogram.count));
+		}
+	}
+	pResponse->end();
+	ESP_LOGD(LOG_TAG, "<< writePrometheus");
+} // writePrometheus
@@ -0,0 +1,119 @@
+/*
+ * HttpMetrics.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_HTTPMETRICS_H_
+#define COMPONENTS_CPP_UTILS_HTTPMETRICS_H_
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+class HttpResponse;
+
+/**
+ * @brief Counters and latency histograms of an HttpServer.
+ *
+ * For each route we count the requests, their status classes (1xx .. 5xx) and the bytes received and
+ * sent.  The time taken by each request is recorded in three latency histograms: receiving and parsing
+ * the head, running the handler and sending the response.  For the server as a whole we count the
+ * connections, the connections and requests in progress and the connections and requests refused.
+ *
+ * Recording only increments atomic counters, so any number of tasks can record at the same time
+ * without taking a lock.  Routes are added when handlers are registered, before the server is started.
+ *
+ * The histograms are log-linear: each power of two from 64us to 16.7s is split into two buckets.
+ *
+ * The metrics can be read with getSnapshot() or sent in the Prometheus text format with writePrometheus().
+ */
+class HttpMetrics {
+public:
+	// The phases of serving a request.
+	enum Phase {
+		PHASE_PARSE,     // Receiving and parsing the head of the request.
+		PHASE_HANDLER,   // Running the handler, less the time it spent sending.
+		PHASE_SEND,      // Sending the response.
+		PHASE_COUNT
+	};
+
+	// The reasons for refusing a connection or request.
+	enum Rejection {
+		REJECT_BUSY,                  // All the workers were busy (503).
+		REJECT_BAD_REQUEST,           // The request couldn't be parsed (400).
+		REJECT_TOO_LARGE,             // The request body was too large (413).
+		REJECT_TIMEOUT,               // The head took too long or the body arrived too slowly (408).
+		REJECT_HEAD_TOO_LARGE,        // The head was too large or had too many headers (431).
+		REJECT_TOO_MANY_CONNECTIONS,  // The client already had as many connections as it may (429).
+		REJECT_COUNT
+	};
+
+	static const size_t BUCKET_COUNT = 38;   // The number of buckets of a latency histogram, the last unbounded.
+
+	// A latency histogram.
+	struct Histogram {
+		uint32_t buckets[BUCKET_COUNT];   // The number of requests by bucket (not cumulative).
+		uint64_t sum;                     // The total time in microseconds.
+		uint32_t count;                   // The number of requests.
+	};
+
+	// The metrics of a route.
+	struct RouteSnapshot {
+		std::string name;
+		uint32_t    requests;
+		uint32_t    statusClasses[5];     // Responses by status class, 1xx first.
+		uint64_t    bytesIn;              // Bytes of requests received, head and body.
+		uint64_t    bytesOut;             // Bytes of responses sent, header and body.
+		Histogram   latency[PHASE_COUNT];
+	};
+
+	// The metrics of the server.
+	struct Snapshot {
+		std::vector<RouteSnapshot> routes;
+		uint32_t connections;             // Connections accepted.
+		uint32_t activeConnections;       // Connections now open.
+		uint32_t maxActiveConnections;    // The most connections that were open at the same time.
+		uint32_t activeRequests;          // Requests now being served.
+		uint32_t rejected[REJECT_COUNT];  // Connections or requests refused by reason.
+	};
+
+	HttpMetrics();
+	virtual ~HttpMetrics();
+	static size_t   getBucket(uint32_t micros);       // Get the histogram bucket of a duration.
+	static uint32_t getBucketLimit(size_t bucket);    // Get the largest duration of a bucket.
+	size_t   addRoute(const std::string& name);       // Add a route and get its index.
+	void     connectionClosed();
+	void     connectionOpened();
+	Snapshot getSnapshot();                           // Get a copy of the metrics.
+	void     recordRejection(Rejection reason);
+	void     recordRequest(size_t route, int status, size_t bytesIn, size_t bytesOut, const uint32_t durations[PHASE_COUNT]);
+	void     requestEnded();
+	void     requestStarted();
+	void     writePrometheus(HttpResponse* pResponse); // Send the metrics in the Prometheus text format.
+
+private:
+	struct AtomicHistogram {
+		std::atomic<uint32_t> buckets[BUCKET_COUNT];
+		std::atomic<uint64_t> sum;
+		std::atomic<uint32_t> count;
+	};
+
+	struct Route {
+		std::string           name;
+		std::atomic<uint32_t> requests;
+		std::atomic<uint32_t> statusClasses[5];
+		std::atomic<uint64_t> bytesIn;
+		std::atomic<uint64_t> bytesOut;
+		AtomicHistogram       latency[PHASE_COUNT];
+	};
+
+	std::vector<Route*>   m_routes;
+	std::atomic<uint32_t> m_connections;
+	std::atomic<uint32_t> m_activeConnections;
+	std::atomic<uint32_t> m_maxActiveConnections;
+	std::atomic<uint32_t> m_activeRequests;
+	std::atomic<uint32_t> m_rejected[REJECT_COUNT];
+}; // HttpMetrics
+
+#endif /* COMPONENTS_CPP_UTILS_HTTPMETRICS_H_ */
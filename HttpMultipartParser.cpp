@@ -0,0 +1,435 @@
+/*
+ * HttpMultipartParser.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+/*
+ * A multipart/form-data body looks like:
+ *
+ * --boundary
+ * Content-Disposition: form-data; name="field"
+ *
+ * value
+ * --boundary
+ * Content-Disposition: form-data; name="upload"; filename="a.txt"
+ * Content-Type: text/plain
+ *
+ * <file content>
+ * --boundary--
+ *
+ * Each line ends with CRLF and the CRLF before a boundary belongs to the boundary, not to the data.
+ * We look for the delimiter CRLF "--" boundary.  So that the first boundary (which has no CRLF in
+ * front of it) is found the same way, the buffer starts with a CRLF.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include "HttpMultipartParser.h"
+#include "HttpRequest.h"
+#include "GeneralUtils.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "HttpMultipartParser";
+
+// The states of the parser.
+static const int STATE_PREAMBLE  = 0;   // Looking for the first boundary.
+static const int STATE_BOUNDARY  = 1;   // A boundary has been found, looking at what follows it.
+static const int STATE_HEADERS   = 2;   // Reading the headers of a part.
+static const int STATE_DATA      = 3;   // Reading the data of a part.
+static const int STATE_EPILOGUE  = 4;   // The closing boundary has been found.
+static const int STATE_ERROR     = 5;   // The body is malformed.
+
+
+void HttpMultipartHandler::begin(const std::string& name, const std::string& fileName, const std::string& contentType) {
+	ESP_LOGD(LOG_TAG, "HttpMultipartHandler::begin(name=\"%s\", fileName=\"%s\")", name.c_str(), fileName.c_str());
+} // begin
+
+
+void HttpMultipartHandler::data(const uint8_t* pData, size_t length) {
+	ESP_LOGD(LOG_TAG, "HttpMultipartHandler::data(), length=%d", length);
+} // data
+
+
+void HttpMultipartHandler::end() {
+	ESP_LOGD(LOG_TAG, "HttpMultipartHandler::end()");
+} // end
+
+
+void HttpMultipartHandler::multipartEnd() {
+	ESP_LOGD(LOG_TAG, "HttpMultipartHandler::multipartEnd()");
+} // multipartEnd
+
+
+void HttpMultipartHandler::multipartStart() {
+	ESP_LOGD(LOG_TAG, "HttpMultipartHandler::multipartStart()");
+} // multipartStart
+
+
+/**
+ * @brief Create a multipart parser.
+ * @param [in] boundary The boundary of the body (see getBoundary()).
+ * @param [in] pHandler The handler of the parts.
+ * @param [in] bufferSize The size of the buffer in which the body is scanned.  The headers of a part
+ * must fit in the buffer.
+ */
+HttpMultipartParser::HttpMultipartParser(const std::string& boundary, HttpMultipartHandler* pHandler, size_t bufferSize) {
+	m_pHandler   = pHandler;
+	m_delimiter  = "\r\n--" + boundary;
+	m_bufferSize = std::max(bufferSize, 2 * m_delimiter.length() + 2);
+	m_buffer     = new char[m_bufferSize];
+	m_buffer[0]  = '\r';
+	m_buffer[1]  = '\n';
+	m_length     = 2;
+	m_state      = boundary.empty() ? STATE_ERROR : STATE_PREAMBLE;
+} // HttpMultipartParser
+
+
+HttpMultipartParser::~HttpMultipartParser() {
+	delete[] m_buffer;
+} // ~HttpMultipartParser
+
+
+/**
+ * @brief Drop data from the front of the buffer.
+ * @param [in] length The amount of data to drop.
+ */
+void HttpMultipartParser::discard(size_t length) {
+	::memmove(m_buffer, m_buffer + length, m_length - length);
+	m_length -= length;
+} // discard
+
+
+/**
+ * @brief Parse some more of the body.
+ * @param [in] pData The data.
+ * @param [in] length The length of the data.
+ * @return False if the body is malformed.
+ */
+bool HttpMultipartParser::feed(const uint8_t* pData, size_t length) {
+	while (length > 0) {
+		size_t size = std::min(length, m_bufferSize - m_length);
+		::memcpy(m_buffer + m_length, pData, size);
+		m_length += size;
+		pData    += size;
+		length   -= size;
+		if (!process()) return false;
+	}
+	return m_state != STATE_ERROR;
+} // feed
+
+
+/**
+ * @brief Get the boundary of a multipart body from its content type.
+ * @param [in] contentType The value of the Content-Type header, for example
+ * `multipart/form-data; boundary=----WebKitFormBoundary7MA4YWxkTrZu0gW`.
+ * @return The boundary or an empty string if the content type isn't multipart.
+ */
+std::string HttpMultipartParser::getBoundary(const std::string& contentType) {
+	std::vector<std::string> parts = GeneralUtils::split(contentType, ';');
+	if (parts.empty()) return "";
+	std::string type = parts[0];
+	GeneralUtils::toLower(type);
+	if (type.compare(0, 10, "multipart/") != 0) return "";
+	for (size_t i = 1; i < parts.size(); i++) {
+		std::string name = parts[i].substr(0, 9);
+		GeneralUtils::toLower(name);
+		if (name == "boundary=") {
+			std::string boundary = parts[i].substr(9);
+			if (boundary.length() >= 2 && boundary.front() == '"' && boundary.back() == '"') {
+				boundary = boundary.substr(1, boundary.length() - 2);
+			}
+			return boundary;
+		}
+	}
+	return "";
+} // getBoundary
+
+
+/**
+ * @brief Determine if the closing boundary has been parsed.
+ * @return True if all the parts have been parsed.
+ */
+bool HttpMultipartParser::isComplete() {
+	return m_state == STATE_EPILOGUE;
+} // isComplete
+
+
+/**
+ * @brief Parse the body of a request.
+ * The body is read straight into the buffer of the parser, a buffer at a time.
+ * @param [in] pRequest The request.
+ * @return True if the body was read and parsed up to and including the closing boundary.
+ */
+bool HttpMultipartParser::parse(HttpRequest* pRequest) {
+	while (m_state != STATE_ERROR) {
+		int rc = pRequest->readBody((uint8_t*) m_buffer + m_length, m_bufferSize - m_length);
+		if (rc <= 0) break;
+		m_length += rc;
+		process();
+	}
+	if (!isComplete()) {
+		ESP_LOGE(LOG_TAG, "parse: Multipart body is incomplete or malformed");
+	}
+	return isComplete();
+} // parse
+
+
+/**
+ * @brief Parse a header of a part.
+ * We are interested in the name and file name of the part, which are parameters of the
+ * Content-Disposition header, and in its Content-Type.
+ * @param [in] line The header line.
+ */
+void HttpMultipartParser::parseHeader(std::string_view line) {
+	size_t colon = line.find(':');
+	if (colon == std::string_view::npos) return;
+	std::string name(line.substr(0, colon));
+	std::string value = GeneralUtils::trim(std::string(line.substr(colon + 1)));
+	GeneralUtils::toLower(name);
+	if (name == "content-type") {
+		m_contentType = value;
+	} else if (name == "content-disposition") {
+		std::vector<std::string> params = GeneralUtils::split(value, ';');
+		for (size_t i = 1; i < params.size(); i++) {
+			size_t equals = params[i].find('=');
+			if (equals == std::string::npos) continue;
+			std::string paramName = GeneralUtils::trim(params[i].substr(0, equals));
+			std::string paramValue = GeneralUtils::trim(params[i].substr(equals + 1));
+			GeneralUtils::toLower(paramName);
+			if (paramValue.length() >= 2 && paramValue.front() == '"' && paramValue.back() == '"') {
+				paramValue = paramValue.substr(1, paramValue.length() - 2);
+			}
+			if (paramName == "name") {
+				m_name = paramValue;
+			} else if (paramName == "filename") {
+				m_fileName = paramValue;
+			}
+		}
+	}
+} // parseHeader
+
+
+/**
+ * @brief Parse as much of the data in the buffer as we can.
+ * Data that might be the start of a delimiter is kept in the buffer until we know.
+ * @return False if the body is malformed.
+ */
+bool HttpMultipartParser::process() {
+	std::string_view line;
+	size_t lineLength;
+	while (true) {
+		std::string_view buffer(m_buffer, m_length);
+		switch (m_state) {
+			case STATE_PREAMBLE:
+			case STATE_DATA: {
+				size_t pos = buffer.find(m_delimiter);
+				if (pos == std::string_view::npos) {
+					// Everything but what may be the start of a delimiter is data (or preamble).
+					size_t keep = std::min(m_length, m_delimiter.length() - 1);
+					if (m_state == STATE_DATA && m_length > keep) {
+						m_pHandler->data((uint8_t*) m_buffer, m_length - keep);
+					}
+					discard(m_length - keep);
+					return true;
+				}
+				if (m_state == STATE_DATA) {
+					if (pos > 0) {
+						m_pHandler->data((uint8_t*) m_buffer, pos);
+					}
+					m_pHandler->end();
+				} else {
+					m_pHandler->multipartStart();
+				}
+				discard(pos + m_delimiter.length());
+				m_state = STATE_BOUNDARY;
+				break;
+			}
+
+			case STATE_BOUNDARY:
+				if (m_length < 2) return true;
+				if (m_buffer[0] == '-' && m_buffer[1] == '-') {   // The closing boundary.
+					m_pHandler->multipartEnd();
+					m_state = STATE_EPILOGUE;
+					break;
+				}
+				lineLength = findLine(line);   // Skip any white space after the boundary.
+				if (lineLength == 0) return m_state != STATE_ERROR;
+				discard(lineLength);
+				m_name.clear();
+				m_fileName.clear();
+				m_contentType.clear();
+				m_state = STATE_HEADERS;
+				break;
+
+			case STATE_HEADERS:
+				lineLength = findLine(line);
+				if (lineLength == 0) return m_state != STATE_ERROR;
+				if (line.empty()) {   // The end of the headers of the part.
+					discard(lineLength);
+					m_pHandler->begin(m_name, m_fileName, m_contentType);
+					m_state = STATE_DATA;
+					break;
+				}
+				parseHeader(line);
+				discard(lineLength);
+				break;
+
+			case STATE_EPILOGUE:   // Anything after the closing boundary is ignored.
+				m_length = 0;
+				return true;
+
+			default:
+				return false;
+		} // switch
+	} // while
+} // process
+
+
+/**
+ * @brief Find the line at the front of the buffer.
+ * @param [out] line The line without its terminator.  It stays valid until the buffer is changed.
+ * @return The length of the line including its terminator, which the caller discards when done with the
+ * line.  Zero if there is no complete line yet.  If there is no room for the rest of the line the
+ * parser goes into error.
+ */
+size_t HttpMultipartParser::findLine(std::string_view& line) {
+	char* pEnd = (char*) ::memchr(m_buffer, '\n', m_length);
+	if (pEnd == nullptr) {
+		if (m_length == m_bufferSize) {
+			ESP_LOGE(LOG_TAG, "A header line of a part is longer than the buffer");
+			m_state = STATE_ERROR;
+		}
+		return 0;
+	}
+	size_t end = pEnd - m_buffer;
+	line = std::string_view(m_buffer, (end > 0 && m_buffer[end - 1] == '\r') ? end - 1 : end);
+	return end + 1;
+} // findLine
+
+
+/**
+ * @brief Create a sink writing uploaded files to a directory.
+ * @param [in] directory The directory in which the files are written.
+ * @param [in] bufferSize The size of the write buffer.  It is rounded up to a whole number of sectors.
+ * @param [in] maxFieldSize The largest value of a plain form field that is kept.
+ */
+HttpMultipartFileSink::HttpMultipartFileSink(const std::string& directory, size_t bufferSize, size_t maxFieldSize) {
+	m_directory    = directory;
+	m_bufferSize   = (bufferSize + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+	if (m_bufferSize == 0) {
+		m_bufferSize = SECTOR_SIZE;
+	}
+	m_buffer       = nullptr;
+	m_length       = 0;
+	m_maxFieldSize = maxFieldSize;
+	m_fd           = -1;
+	m_ok           = true;
+} // HttpMultipartFileSink
+
+
+HttpMultipartFileSink::~HttpMultipartFileSink() {
+	if (m_fd >= 0) {
+		::close(m_fd);
+	}
+	delete[] m_buffer;
+} // ~HttpMultipartFileSink
+
+
+/**
+ * @brief Start a part.
+ * A part with a file name is written to a file in the directory.  Any path in the file name is
+ * ignored.
+ */
+void HttpMultipartFileSink::begin(const std::string& name, const std::string& fileName, const std::string& contentType) {
+	m_name = name;
+	if (fileName.empty()) {         // A plain form field.
+		m_fields[name] = "";
+		return;
+	}
+	std::string baseName = fileName.substr(fileName.find_last_of("/\\") + 1);
+	if (baseName.empty() || baseName == "." || baseName == "..") {
+		ESP_LOGE(LOG_TAG, "Refusing to write file \"%s\"", fileName.c_str());
+		m_ok = false;
+		return;
+	}
+	std::string path = m_directory + "/" + baseName;
+	m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (m_fd < 0) {
+		ESP_LOGE(LOG_TAG, "Unable to open %s for writing", path.c_str());
+		m_ok = false;
+		return;
+	}
+	if (m_buffer == nullptr) {
+		m_buffer = new uint8_t[m_bufferSize];
+	}
+	m_length = 0;
+	m_files.push_back(path);
+} // begin
+
+
+/**
+ * @brief Receive data of a part.
+ * File data is collected in the buffer and written a full buffer at a time.
+ */
+void HttpMultipartFileSink::data(const uint8_t* pData, size_t length) {
+	if (m_fd < 0) {
+		auto it = m_fields.find(m_name);
+		if (it != m_fields.end() && it->second.length() < m_maxFieldSize) {
+			it->second.append((const char*) pData, std::min(length, m_maxFieldSize - it->second.length()));
+		}
+		return;
+	}
+	while (length > 0) {
+		size_t size = std::min(length, m_bufferSize - m_length);
+		::memcpy(m_buffer + m_length, pData, size);
+		m_length += size;
+		pData    += size;
+		length   -= size;
+		if (m_length == m_bufferSize) {
+			flush();
+		}
+	}
+} // data
+
+
+/**
+ * @brief End a part.
+ */
+void HttpMultipartFileSink::end() {
+	if (m_fd < 0) return;
+	flush();
+	::close(m_fd);
+	m_fd = -1;
+} // end
+
+
+/**
+ * @brief Write the buffered data to the file.
+ */
+void HttpMultipartFileSink::flush() {
+	if (m_length == 0) return;
+	if (::write(m_fd, m_buffer, m_length) != (ssize_t) m_length) {
+		ESP_LOGE(LOG_TAG, "Write to %s failed", m_files.back().c_str());
+		m_ok = false;
+	}
+	m_length = 0;
+} // flush
+
+
+std::map<std::string, std::string> HttpMultipartFileSink::getFields() {
+	return m_fields;
+} // getFields
+
+
+std::vector<std::string> HttpMultipartFileSink::getFiles() {
+	return m_files;
+} // getFiles
+
+
+bool HttpMultipartFileSink::isOk() {
+	return m_ok;
+} // isOk
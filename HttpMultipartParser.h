@@ -0,0 +1,121 @@
+/*
+ * HttpMultipartParser.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_HTTPMULTIPARTPARSER_H_
+#define COMPONENTS_CPP_UTILS_HTTPMULTIPARTPARSER_H_
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <map>
+#include <vector>
+
+class HttpRequest;
+
+/**
+ * @brief Handler of the parts of a multipart/form-data body.
+ *
+ * This class is subclassed to receive the parts of the body as they are parsed.  The call sequence is:
+ * ~~~
+ * multipartStart
+ * begin
+ * data*
+ * end
+ * begin
+ * data*
+ * end
+ * ...
+ * multipartEnd
+ * ~~~
+ */
+class HttpMultipartHandler {
+public:
+	virtual ~HttpMultipartHandler() = default;
+	virtual void begin(const std::string& name, const std::string& fileName, const std::string& contentType);
+	virtual void data(const uint8_t* pData, size_t length);
+	virtual void end();
+	virtual void multipartEnd();
+	virtual void multipartStart();
+}; // HttpMultipartHandler
+
+
+/**
+ * @brief Parse a multipart/form-data body (RFC7578) as it arrives.
+ *
+ * The body is scanned for the boundary in a fixed size buffer so a body of any size is parsed in
+ * constant memory.  The data of each part is passed to the handler as it is found.
+ *
+ * @code{.cpp}
+ * HttpMultipartFileSink sink("/spiflash/upload");
+ * HttpMultipartParser parser(HttpMultipartParser::getBoundary(pRequest->getHeader("Content-Type")), &sink);
+ * if (!parser.parse(pRequest)) {
+ *   ...
+ * }
+ * @endcode
+ */
+class HttpMultipartParser {
+public:
+	HttpMultipartParser(const std::string& boundary, HttpMultipartHandler* pHandler, size_t bufferSize = 1024);
+	virtual ~HttpMultipartParser();
+	static std::string getBoundary(const std::string& contentType);
+	bool feed(const uint8_t* pData, size_t length);   // Parse some more of the body.
+	bool isComplete();                               // Has the closing boundary been parsed?
+	bool parse(HttpRequest* pRequest);               // Parse the body of a request.
+
+private:
+	HttpMultipartHandler* m_pHandler;
+	std::string           m_delimiter;     // CRLF "--" boundary.
+	char*                 m_buffer;
+	size_t                m_bufferSize;
+	size_t                m_length;        // The amount of data in the buffer.
+	int                   m_state;
+	std::string           m_name;          // The name of the current part.
+	std::string           m_fileName;      // The file name of the current part.
+	std::string           m_contentType;   // The content type of the current part.
+
+	void   discard(size_t length);
+	size_t findLine(std::string_view& line);
+	void   parseHeader(std::string_view line);
+	bool   process();
+}; // HttpMultipartParser
+
+
+/**
+ * @brief A multipart handler saving uploaded files to a file system.
+ *
+ * Each part that carries a file name is written to a file of that name (without any directory) in a
+ * directory.  Writes are collected in a buffer that is a whole number of sectors so that the FAT file
+ * system writes whole, aligned sectors.  The values of the other parts (plain form fields) are kept,
+ * up to a maximum size, and can be retrieved with getFields().
+ */
+class HttpMultipartFileSink : public HttpMultipartHandler {
+public:
+	HttpMultipartFileSink(const std::string& directory, size_t bufferSize = 4096, size_t maxFieldSize = 512);
+	virtual ~HttpMultipartFileSink();
+	void begin(const std::string& name, const std::string& fileName, const std::string& contentType) override;
+	void data(const uint8_t* pData, size_t length) override;
+	void end() override;
+	std::map<std::string, std::string> getFields();   // Get the values of the plain form fields.
+	std::vector<std::string>           getFiles();    // Get the names of the files written.
+	bool                               isOk();        // Were all the files written?
+
+private:
+	static const size_t SECTOR_SIZE = 512;
+
+	std::string                        m_directory;
+	uint8_t*                           m_buffer;
+	size_t                             m_bufferSize;
+	size_t                             m_length;         // The amount of data in the buffer.
+	size_t                             m_maxFieldSize;
+	int                                m_fd;             // The file being written or -1.
+	std::string                        m_name;           // The name of the current part.
+	std::map<std::string, std::string> m_fields;
+	std::vector<std::string>           m_files;
+	bool                               m_ok;
+
+	void flush();
+}; // HttpMultipartFileSink
+
+#endif /* COMPONENTS_CPP_UTILS_HTTPMULTIPARTPARSER_H_ */
@@ -7,12 +7,17 @@
 
 #include <string>
 #include <iostream>
+#include <cinttypes>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include "HttpParser.h"
 #include "HttpRequest.h"
 #include "GeneralUtils.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/sockets.h>
 
 #undef close
 /**
@@ -29,89 +34,163 @@
  *
  * Example:
  * GET /hello.txt HTTP/1.1
+ *
+ * Design:
+ * The head of the message is received into a fixed size buffer.  We scan the buffer for complete lines
+ * and parse each one as it becomes available, remembering where we got to so that nothing is scanned
+ * twice when further data arrives.  Each item (method, URL, header name, header value ...) is recorded
+ * as an offset/length slice of the buffer.  Header names are converted to lower case in place.
  */
 
 static const char* LOG_TAG = "HttpParser";
 
-static std::string lineTerminator = "\r\n";
+// The states of the parser.
+static const int STATE_START_LINE = 0;   // Waiting for the request/status line.
+static const int STATE_HEADERS    = 1;   // Waiting for header lines.
+static const int STATE_COMPLETE   = 2;   // The head has been parsed.
+static const int STATE_ERROR      = 3;   // The head is in error.
+
+// The states of reading the body.
+static const int BODY_DONE         = 0;   // There is no (more) body.
+static const int BODY_LENGTH       = 1;   // Reading a body of known length.
+static const int BODY_CHUNK_SIZE   = 2;   // Waiting for the size line of a chunk.
+static const int BODY_CHUNK_DATA   = 3;   // Reading the data of a chunk.
+static const int BODY_CHUNK_END    = 4;   // Waiting for the CRLF that ends the data of a chunk.
+static const int BODY_CHUNK_TRAILER = 5;  // Waiting for the trailer lines that follow the last chunk.
+static const int BODY_ERROR        = 6;   // The body is malformed, too large or the connection failed.
 
 
 /**
- * @brief Parse an incoming line of text until we reach a delimiter.
- * @param [in/out] it The current iterator in the text input.
- * @param [in] str The string we are parsing.
- * @param [in] token The token delimiter.
+ * @brief Is the character linear white space?
  */
-static std::string toStringToken(std::string::iterator& it, std::string& str, std::string& token) {
-	std::string ret;
-	std::string part;
-	auto itToken = token.begin();
-	for (; it != str.end(); ++it) {
-		if ((*it) == (*itToken)) {
-			part += (*itToken);
-			++itToken;
-			if (itToken == token.end()) {
-				++it;
-				break;
-			}
-		} else {
-			if (part.empty()) {
-				ret += part;
-				part.clear();
-				itToken = token.begin();
-			}
-			ret += *it;
-		}
-	} // for
-	return ret;
-} // toStringToken
+static inline bool isWhiteSpace(char c) {
+	return c == ' ' || c == '\t';
+} // isWhiteSpace
 
 
 /**
- * @brief Parse a string until the given token is found.
- * @param [in] it The current iterator.
- * @param [in] str The string being parsed.
- * @param [in] token The token terminating the parse.
- * @return The parsed string token.
+ * @brief Parse the value of a Content-Length header.
+ * @param [in] value The value of the header.
+ * @param [out] pLength The length.
+ * @return False if the value isn't a decimal number or is too large for a size_t.
  */
-static std::string toCharToken(std::string::iterator& it, std::string& str, char token) {
-	std::string ret;
-	for(; it != str.end(); ++it) {
-		if ((*it) == token) {
-			++it;
-			break;
-		}
-		ret += *it;
+static bool parseContentLength(std::string_view value, size_t* pLength) {
+	if (value.empty()) return false;
+	size_t length = 0;
+	for (char c : value) {
+		if (c < '0' || c > '9') return false;
+		size_t digit = c - '0';
+		if (length > (SIZE_MAX - digit) / 10) return false;
+		length = length * 10 + digit;
 	}
-	return ret;
-} // toCharToken
+	*pLength = length;
+	return true;
+} // parseContentLength
 
 
 /**
- * @brief Parse a header line.
- * An HTTP Header is of the form:
- *
- * Name":" Value
- *
- * We parse this and return a pair.
- * @param [in] line The line of text to parse.
- * @return A pair of the form name/value.
+ * @brief Parse the size at the start of a chunk size line.
+ * The size may be followed by white space and a chunk extension, which is ignored.
+ * @param [in] line The chunk size line.
+ * @param [out] pSize The size of the chunk.
+ * @return False if the line doesn't start with a hex number, the number is too large for a size_t or
+ * it is followed by anything other than an extension.
  */
-std::pair<std::string, std::string> parseHeader(std::string& line) {
-	auto it = line.begin();
-	std::string name = toCharToken(it, line, ':'); // Parse the line until we find a ':'
-	// We normalize the header name to be lower case.
-	GeneralUtils::toLower(name);
-	auto value = GeneralUtils::trim(toStringToken(it, line, lineTerminator));
-	return std::pair<std::string, std::string>(name, value);
-} // parseHeader
+static bool parseChunkSize(std::string_view line, size_t* pSize) {
+	size_t size = 0;
+	size_t i = 0;
+	for (; i < line.length() && ::isxdigit((unsigned char) line[i]); i++) {
+		if (size > (SIZE_MAX >> 4)) return false;
+		char c = line[i];
+		size = (size << 4) | (size_t) (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+	}
+	if (i == 0) return false;
+	while (i < line.length() && isWhiteSpace(line[i])) i++;
+	if (i < line.length() && line[i] != ';') return false;
+	*pSize = size;
+	return true;
+} // parseChunkSize
+
 
+/**
+ * @brief Create a parser.
+ * @param [in] bufferSize The size of the buffer that holds the message head.  A head that does not fit
+ * is rejected.
+ */
+HttpParser::HttpParser(size_t bufferSize) {
+	m_bufferSize = bufferSize;
+	m_buffer     = new char[bufferSize];
+	m_length     = 0;
+	m_consumed   = 0;
+	m_isResponse = false;
+	m_maxBodySize = 0;
+	m_maxHeaderCount = MAX_HEADERS;
+	m_headerTimeout  = 0;
+	m_minBodyRate    = 0;
+	m_bodyGrace      = 0;
+	reset();
+} // HttpParser
 
-HttpParser::HttpParser() {
-}
 
 HttpParser::~HttpParser() {
-}
+	delete[] m_buffer;
+} // ~HttpParser
+
+
+/**
+ * @brief Compare two strings ignoring case.
+ * @param [in] a A string.
+ * @param [in] b The string to compare against.
+ * @return True if the strings are equal ignoring case.
+ */
+bool HttpParser::equalsIgnoreCase(std::string_view a, std::string_view b) {
+	if (a.length() != b.length()) return false;
+	for (size_t i = 0; i < a.length(); i++) {
+		if (::tolower((unsigned char) a[i]) != ::tolower((unsigned char) b[i])) return false;
+	}
+	return true;
+} // equalsIgnoreCase
+
+
+/**
+ * @brief Determine if a comma separated header value contains a token.
+ * For example, the Connection header "keep-alive, Upgrade" contains the token "upgrade".  Tokens are
+ * compared ignoring case and any parameters (after a ';') are ignored.
+ * @param [in] list The header value.
+ * @param [in] token The token to look for.
+ * @return True if the token is in the list.
+ */
+bool HttpParser::hasToken(std::string_view list, std::string_view token) {
+	while (!list.empty()) {
+		size_t comma = list.find(',');
+		std::string_view item = list.substr(0, comma);
+		list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+		item = item.substr(0, item.find(';'));
+		while (!item.empty() && isWhiteSpace(item.front())) item.remove_prefix(1);
+		while (!item.empty() && isWhiteSpace(item.back())) item.remove_suffix(1);
+		if (equalsIgnoreCase(item, token)) return true;
+	}
+	return false;
+} // hasToken
+
+
+/**
+ * @brief Consume data received beyond the end of the head.
+ * Once the head has been parsed, the buffer may already hold the start of the body.  This function
+ * moves up to length bytes of that data to the caller.
+ * @param [out] data The storage to receive the data.
+ * @param [in] length The maximum amount of data to consume.
+ * @return The amount of data consumed.
+ */
+size_t HttpParser::consume(uint8_t* data, size_t length) {
+	size_t available = getBufferedLength();
+	if (length > available) {
+		length = available;
+	}
+	::memcpy(data, m_buffer + m_consumed, length);
+	m_consumed += length;
+	return length;
+} // consume
 
 
 /**
@@ -119,18 +198,125 @@ HttpParser::~HttpParser() {
  *
  */
 void HttpParser::dump() {
-	ESP_LOGD(LOG_TAG, "Method: %s, URL: \"%s\", Version: %s", m_method.c_str(), m_url.c_str(), m_version.c_str());
-	auto it2 = m_headers.begin();
-	for (; it2 != m_headers.end(); ++it2) {
-		ESP_LOGD(LOG_TAG, "name=\"%s\", value=\"%s\"", it2->first.c_str(), it2->second.c_str());
+	ESP_LOGD(LOG_TAG, "Method: %s, URL: \"%s\", Version: %s", getMethod().c_str(), getURL().c_str(), getVersion().c_str());
+	for (size_t i = 0; i < m_headerCount; i++) {
+		ESP_LOGD(LOG_TAG, "name=\"%.*s\", value=\"%.*s\"",
+			(int) m_headerNames[i].length, m_buffer + m_headerNames[i].offset,
+			(int) m_headerValues[i].length, m_buffer + m_headerValues[i].offset);
 	}
 	ESP_LOGD(LOG_TAG, "Body: \"%s\"", m_body.c_str());
 } // dump
 
 
+/**
+ * @brief Feed data to the parser.
+ * The data is appended to the receive buffer and parsed.  Use this when the data is received by the
+ * caller; use receive() to have the parser read directly from a socket.
+ * @param [in] data The data to parse.
+ * @param [in] length The length of the data.
+ * @return The outcome of the parse.
+ */
+HttpParser::ParseResult HttpParser::feed(const uint8_t* data, size_t length) {
+	if (length > m_bufferSize - m_length) {
+		ESP_LOGE(LOG_TAG, "feed: Message head larger than the buffer (%d bytes)", m_bufferSize);
+		m_state = STATE_ERROR;
+		return PARSE_ERROR;
+	}
+	::memcpy(m_buffer + m_length, data, length);
+	m_length += length;
+	return parseBuffered();
+} // feed
+
+
+/**
+ * @brief Find a header by name.
+ * @param [in] name The name of the header in any case.
+ * @return The index of the header or -1 if not present.
+ */
+int HttpParser::findHeader(std::string_view name) {
+	for (size_t i = 0; i < m_headerCount; i++) {
+		if (equalsIgnoreCase(view(m_headerNames[i]), name)) return i;
+	}
+	return -1;
+} // findHeader
+
+
+/**
+ * @brief Get the body of a message parsed from a string.
+ * The body of a request parsed from a socket is read with readBody().
+ * @return The body.
+ */
 std::string HttpParser::getBody() {
 	return m_body;
-}
+} // getBody
+
+
+/**
+ * @brief Get the amount of body data read so far with readBody().
+ * @return The amount of body data read.
+ */
+size_t HttpParser::getBodyLength() {
+	return m_bodyRead;
+} // getBodyLength
+
+
+/**
+ * @brief Get the amount of data received beyond the end of the head that has not been consumed.
+ * @return The amount of buffered data.
+ */
+size_t HttpParser::getBufferedLength() {
+	if (m_state != STATE_COMPLETE) return 0;
+	return m_length - m_consumed;
+} // getBufferedLength
+
+
+/**
+ * @brief Get the arena from which data of the current message can be allocated.
+ * What is allocated is released by reset().
+ * @return The arena.
+ */
+HttpArena& HttpParser::getArena() {
+	return m_arena;
+} // getArena
+
+
+/**
+ * @brief Get the length of the head of the message.
+ * @return The length of the request/status line and headers, including the empty line that ends them.
+ */
+size_t HttpParser::getHeadLength() {
+	return m_headLength;
+} // getHeadLength
+
+
+/**
+ * @brief Get the time by which the next byte of the body must arrive.
+ * Once the grace period has passed, the body must have arrived at no less than the minimum rate.
+ * @return The deadline (esp_timer_get_time()) or 0 if there is no minimum rate.
+ */
+int64_t HttpParser::getBodyDeadline() {
+	if (m_minBodyRate == 0) return 0;
+	return m_bodyStart + (int64_t) m_bodyGrace * 1000 + (int64_t) (m_bodyRead + 1) * 1000000 / m_minBodyRate;
+} // getBodyDeadline
+
+
+/**
+ * @brief Get why the head or the body of the message failed.
+ * @return The reason or ERROR_NONE if nothing has failed.
+ */
+HttpParser::ParseError HttpParser::getError() {
+	return m_error;
+} // getError
+
+
+/**
+ * @brief Get the time it took to receive and parse the head of the message.
+ * The time runs from when the first data of the head was seen to when the head was complete.
+ * @return The time in microseconds.
+ */
+uint32_t HttpParser::getHeadTime() {
+	return m_headTime;
+} // getHeadTime
 
 
 /**
@@ -139,134 +325,342 @@ std::string HttpParser::getBody() {
  * @return The value of the named header or null if not present.
  */
 std::string HttpParser::getHeader(const std::string& name) {
-	// We normalize the header name to be lower case.
-	std::string localName = name;
-	GeneralUtils::toLower(localName);
-	if (!hasHeader(localName)) return "";
-	return m_headers.at(localName);
+	return std::string(getHeaderView(name));
 } // getHeader
 
 
+size_t HttpParser::getHeaderCount() {
+	return m_headerCount;
+} // getHeaderCount
+
+
+/**
+ * @brief Get the name of a header by its position.
+ * @param [in] index The position of the header, less than getHeaderCount().
+ * @return The name of the header in lower case.
+ */
+std::string_view HttpParser::getHeaderName(size_t index) {
+	if (index >= m_headerCount) return std::string_view();
+	return view(m_headerNames[index]);
+} // getHeaderName
+
+
+/**
+ * @brief Get the value of a header by its position.
+ * @param [in] index The position of the header, less than getHeaderCount().
+ * @return The value of the header.
+ */
+std::string_view HttpParser::getHeaderValue(size_t index) {
+	if (index >= m_headerCount) return std::string_view();
+	return view(m_headerValues[index]);
+} // getHeaderValue
+
+
+/**
+ * @brief Retrieve the value of the named header without copying it.
+ * @param [in] name The name of the header to retrieve.
+ * @return The value of the named header, valid until reset(), or an empty view if not present.
+ */
+std::string_view HttpParser::getHeaderView(std::string_view name) {
+	int index = findHeader(name);
+	if (index < 0) return std::string_view();
+	return view(m_headerValues[index]);
+} // getHeaderView
+
+
+/**
+ * @brief Get all the headers.
+ * The header names are in lower case.  If a header is present more than once, the first value is used.
+ * @return A map of header names to values.
+ */
 std::map<std::string, std::string> HttpParser::getHeaders() {
-	return m_headers;
+	std::map<std::string, std::string> headers;
+	for (size_t i = 0; i < m_headerCount; i++) {
+		headers.insert(std::pair<std::string, std::string>(std::string(view(m_headerNames[i])), std::string(view(m_headerValues[i]))));
+	}
+	return headers;
 } // getHeaders
 
 
 std::string HttpParser::getMethod() {
-	return m_method;
+	return std::string(getMethodView());
 } // getMethod
 
 
+std::string_view HttpParser::getMethodView() {
+	if (m_isResponse) return std::string_view();
+	return view(m_startLine[0]);
+} // getMethodView
+
+
 std::string HttpParser::getURL() {
-	return m_url;
+	return std::string(getURLView());
 } // getURL
 
 
+std::string_view HttpParser::getURLView() {
+	if (m_isResponse) return std::string_view();
+	return view(m_startLine[1]);
+} // getURLView
+
+
 std::string HttpParser::getVersion() {
-	return m_version;
+	return std::string(getVersionView());
 } // getVersion
 
+
+std::string_view HttpParser::getVersionView() {
+	return view(m_startLine[m_isResponse ? 0 : 2]);
+} // getVersionView
+
 std::string HttpParser::getStatus() {
-	return m_status;
+	if (!m_isResponse) return "";
+	return std::string(view(m_startLine[1]));
 } // getStatus
 
 std::string HttpParser::getReason() {
-	return m_reason;
+	if (!m_isResponse) return "";
+	return std::string(view(m_startLine[2]));
 } // getReason
 
+
+/**
+ * @brief Determine if data for a further message is already held in the buffer.
+ * This is the case when a client pipelines requests.
+ * @return True if unconsumed data follows the current message.
+ */
+bool HttpParser::hasBufferedData() {
+	return m_length > m_consumed;
+} // hasBufferedData
+
+
+/**
+ * @brief Get the length of the body announced by the Content-Length header.
+ * The framing of a request is checked when its head is parsed, so a request that gets this far has
+ * a valid Content-Length if it has one at all.
+ * @return The length of the body or 0 if there is no valid Content-Length (or the body is chunked).
+ */
+size_t HttpParser::getContentLength() {
+	if (isBodyChunked()) return 0;
+	size_t length = 0;
+	if (!parseContentLength(getHeaderView(HttpRequest::HTTP_HEADER_CONTENT_LENGTH), &length)) return 0;
+	return length;
+} // getContentLength
+
+
 /**
  * @brief Determine if we have a header of the given name.
  * @param [in] name The name of the header to find.
  * @return True if the header is present and false otherwise.
  */
 bool HttpParser::hasHeader(const std::string& name) {
-	// We normalize the header name to be lower case.
-	std::string localName = name;
-	return m_headers.find(GeneralUtils::toLower(localName)) != m_headers.end();
+	return findHeader(name) >= 0;
 } // hasHeader
 
 
+/**
+ * @brief Determine if the body is sent with chunked transfer coding.
+ * @return True if the last transfer coding of the message is "chunked".
+ */
+bool HttpParser::isBodyChunked() {
+	std::string_view transferEncoding = getHeaderView(HttpRequest::HTTP_HEADER_TRANSFER_ENCODING);
+	std::string_view last = transferEncoding.substr(transferEncoding.rfind(',') + 1);   // The whole value if there is no comma.
+	while (!last.empty() && isWhiteSpace(last.front())) last.remove_prefix(1);
+	while (!last.empty() && isWhiteSpace(last.back())) last.remove_suffix(1);
+	return equalsIgnoreCase(last, "chunked");
+} // isBodyChunked
+
+
+/**
+ * @brief Determine if all of the body has been read.
+ * @return True if the body has been read (or there is none).  False if some of the body is still to
+ * come or reading it failed.
+ */
+bool HttpParser::isBodyComplete() {
+	return m_bodyState == BODY_DONE;
+} // isBodyComplete
+
+
+/**
+ * @brief Determine if the head of the message has been parsed.
+ * @return True if the head is complete.
+ */
+bool HttpParser::isComplete() {
+	return m_state == STATE_COMPLETE;
+} // isComplete
+
+
+/**
+ * @brief Determine if the head of the message is taking too long to arrive.
+ * The head must be complete within the header timeout of its first data arriving, however often
+ * data arrives.  This stops a client from holding a connection by trickling the head.
+ * @return True if the head has been started but not completed in time.
+ */
+bool HttpParser::isHeadOverdue() {
+	if (m_headerTimeout == 0 || m_headStart == 0 || m_state == STATE_COMPLETE) return false;
+	return esp_timer_get_time() > m_headStart + (int64_t) m_headerTimeout * 1000;
+} // isHeadOverdue
+
+
 /**
  * @brief Parse socket data.
+ * We read from the socket until the head of the request has been parsed.  The body is left to be read
+ * with readBody().
+ * If a complete request is already held in the buffer (pipelining), no read is needed for the head.
+ * With a header timeout, the head must be complete within the timeout of the first data arriving (or
+ * of the call if no data has arrived yet).
  * @param [in] s The socket from which to retrieve data.
+ * @return True if a request was parsed, false if the partner closed the connection before sending one,
+ * sent a malformed request or took too long.  getError() tells which.
  */
-void HttpParser::parse(Socket s) {
+bool HttpParser::parse(Socket s) {
 	ESP_LOGD(LOG_TAG, ">> parse: socket: %s", s.toString().c_str());
-	std::string line;
-	line = s.readToDelim(lineTerminator);
-	parseRequestLine(line);
-	line = s.readToDelim(lineTerminator);
-	while (!line.empty()) {
-		m_headers.insert(parseHeader(line));
-		line = s.readToDelim(lineTerminator);
-	}
-	// Only PUT and POST requests have a body
-	if (getMethod() != "POST" && getMethod() != "PUT") {
-		ESP_LOGD(LOG_TAG, "<< parse");
-		return;
-	}
-
-	// We have now parsed up to and including the separator ... we are now at the point where we
-	// want to read the body.  There are two stories here.  The first is that we know the exact length
-	// of the body or we read until we can't read anymore.
-	if (hasHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH)) {
-		std::string val = getHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH);
-		int length = std::atoi(val.c_str());
-		uint8_t data[length];
-		s.receive(data, length, true);
-		m_body = std::string((char*) data, length);
-	} else {
-		uint8_t data[512];
-		int rc = s.receive(data, sizeof(data));
-		if (rc > 0) {
-			m_body = std::string((char*) data, rc);
+	ParseResult result = parseBuffered();
+	int64_t deadline = 0;
+	if (m_headerTimeout > 0) {
+		deadline = (m_headStart != 0 ? m_headStart : esp_timer_get_time()) + (int64_t) m_headerTimeout * 1000;
+	}
+	while (result == PARSE_NEED_MORE) {
+		if (!waitForData(s, deadline)) {
+			ESP_LOGW(LOG_TAG, "parse: Head not received within %" PRIu32 " ms", m_headerTimeout);
+			m_state = STATE_ERROR;
+			m_error = ERROR_TIMEOUT;
+			return false;
 		}
+		result = receive(s);
+	}
+	if (result != PARSE_COMPLETE) {
+		ESP_LOGD(LOG_TAG, "<< parse: No request");
+		return false;
 	}
-	ESP_LOGD(LOG_TAG, "<< parse: Size of body: %d", m_body.length());
+	// The body is not read here.  It is read, as the request handler wants it, with readBody().
+	ESP_LOGD(LOG_TAG, "<< parse: Body length: %d%s", getContentLength(), isBodyChunked() ? " (chunked)" : "");
+	return true;
 } // parse
 
 
 /**
  * @brief Parse a string message.
- * @param [in] message The HTTP message to parse.
+ * @param [in] message The HTTP request to parse.
  */
-/*
 void HttpParser::parse(std::string message) {
-	auto it = message.begin();
-	auto line = toStringToken(it, message, lineTerminator);
-	parseRequestLine(line);
-
-	line = toStringToken(it, message, lineTerminator);
-	while(!line.empty()) {
-		//ESP_LOGD(LOG_TAG, "Header: \"%s\"", line.c_str());
-		m_headers.insert(parseHeader(line));
-		line = toStringToken(it, message, lineTerminator);
+	m_length   = 0;
+	m_consumed = 0;
+	reset();
+	if (message.length() > m_bufferSize) {
+		delete[] m_buffer;
+		m_bufferSize = message.length();
+		m_buffer     = new char[m_bufferSize];
+	}
+	if (feed((uint8_t*) message.data(), message.length()) == PARSE_COMPLETE) {
+		m_body = std::string(m_buffer + m_consumed, m_length - m_consumed);
+		m_consumed  = m_length;
+		m_bodyState = BODY_DONE;
 	}
-
-	m_body = message.substr(std::distance(message.begin(), it));
 } // parse
-*/
+
 
 /**
- * @brief Parse A request line.
- * @param [in] line The request line to parse.
+ * @brief Parse the data held in the buffer.
+ * We look for complete lines that we have not yet parsed and parse them.
+ * @return The outcome of the parse.
  */
-void HttpParser::parseRequestLine(std::string& line) {
-	// A request Line is built from:
-	// <method> <sp> <request-target> <sp> <HTTP-version>
-	ESP_LOGD(LOG_TAG, ">> parseRequestLine: \"%s\" [%d]", line.c_str(), line.length());
-	std::string::iterator it = line.begin();
+HttpParser::ParseResult HttpParser::parseBuffered() {
+	if (m_state == STATE_START_LINE && m_headStart == 0 && m_length > 0) {
+		m_headStart = esp_timer_get_time();   // The first data of the head has arrived.
+	}
+	while (m_state == STATE_START_LINE || m_state == STATE_HEADERS) {
+		char* pEnd = (char*) ::memchr(m_buffer + m_parsed, '\n', m_length - m_parsed);
+		if (pEnd == nullptr) {
+			if (m_length == m_bufferSize) {
+				ESP_LOGE(LOG_TAG, "parse: Message head larger than the buffer (%d bytes)", m_bufferSize);
+				m_state = STATE_ERROR;
+				m_error = ERROR_HEAD_TOO_LARGE;
+				return PARSE_ERROR;
+			}
+			return PARSE_NEED_MORE;
+		}
+		size_t start = m_parsed;
+		size_t next  = pEnd - m_buffer + 1;   // The start of the next line.
+		size_t end   = next - 1;               // The end of this line without the terminator.
+		if (end > start && m_buffer[end - 1] == '\r') {
+			end--;
+		}
+		m_parsed = next;
+
+		if (m_state == STATE_START_LINE) {
+			if (end == start) continue;      // Ignore empty lines before the start line (RFC7230 section 3.5).
+			if (!parseStartLine(start, end)) {
+				m_state = STATE_ERROR;
+				m_error = ERROR_MALFORMED;
+				return PARSE_ERROR;
+			}
+			m_state = STATE_HEADERS;
+		} else if (end == start) {           // The empty line ends the head.
+			m_state      = STATE_COMPLETE;
+			m_consumed   = m_parsed;
+			m_headLength = m_parsed;
+			m_headTime   = esp_timer_get_time() - m_headStart;
+			if (!startBody()) {              // We can't tell where the body ends.
+				m_state = STATE_ERROR;
+				m_error = ERROR_MALFORMED;
+				return PARSE_ERROR;
+			}
+		} else if (!parseHeaderLine(start, end)) {
+			m_state = STATE_ERROR;
+			if (m_error == ERROR_NONE) {
+				m_error = ERROR_MALFORMED;
+			}
+			return PARSE_ERROR;
+		}
+	} // while
+	return m_state == STATE_COMPLETE ? PARSE_COMPLETE : PARSE_ERROR;
+} // parseBuffered
+
 
-	// Get the method
-	m_method = toCharToken(it, line, ' ');
+/**
+ * @brief Parse a header line.
+ * An HTTP Header is of the form:
+ *
+ * Name":" Value
+ *
+ * The name is converted to lower case and white space around the value is removed.
+ * @param [in] start The offset of the line in the buffer.
+ * @param [in] end The offset of the end of the line (excluding the line terminator).
+ * @return True if the header was parsed.
+ */
+bool HttpParser::parseHeaderLine(size_t start, size_t end) {
+	if (isWhiteSpace(m_buffer[start])) {
+		ESP_LOGD(LOG_TAG, "Ignoring folded header line");   // Obsolete line folding (RFC7230 section 3.2.4).
+		return true;
+	}
+	char* pColon = (char*) ::memchr(m_buffer + start, ':', end - start);
+	if (pColon == nullptr) {
+		ESP_LOGE(LOG_TAG, "parse: Malformed header line");
+		return false;
+	}
+	if (m_headerCount == m_maxHeaderCount) {
+		ESP_LOGE(LOG_TAG, "parse: More than %d headers", m_maxHeaderCount);
+		m_error = ERROR_HEAD_TOO_LARGE;
+		return false;
+	}
+	size_t nameEnd = pColon - m_buffer;
+	for (size_t i = start; i < nameEnd; i++) {
+		m_buffer[i] = ::tolower((unsigned char) m_buffer[i]);
+	}
+	size_t valueStart = nameEnd + 1;
+	while (valueStart < end && isWhiteSpace(m_buffer[valueStart])) valueStart++;
+	size_t valueEnd = end;
+	while (valueEnd > valueStart && isWhiteSpace(m_buffer[valueEnd - 1])) valueEnd--;
 
-	// Get the url
-	m_url = toCharToken(it, line, ' ');
+	m_headerNames[m_headerCount].offset  = start;
+	m_headerNames[m_headerCount].length  = nameEnd - start;
+	m_headerValues[m_headerCount].offset = valueStart;
+	m_headerValues[m_headerCount].length = valueEnd - valueStart;
+	m_headerCount++;
+	return true;
+} // parseHeaderLine
 
-	// Get the version
-	m_version = toCharToken(it, line, ' ');
-	ESP_LOGD(LOG_TAG, "<< parseRequestLine: method: %s, url: %s, version: %s", m_method.c_str(), m_url.c_str(), m_version.c_str());
-} // parseRequestLine
 
 /**
  * @brief Parse a response message.
@@ -275,35 +669,363 @@ void HttpParser::parseRequestLine(std::string& line) {
 void HttpParser::parseResponse(std::string message) {
 	// A response is built from:
 	// A status line, any number of header lines, a body
-	auto it = message.begin();
-	auto line = toStringToken(it, message, lineTerminator);
-	parseStatusLine(line);
+	parse(message);
+	m_isResponse = true;
+} // parse
+
 
-	line = toStringToken(it, message, lineTerminator);
-	while (!line.empty()) {
-		ESP_LOGD(LOG_TAG, "Header: \"%s\"", line.c_str());
-		m_headers.insert(parseHeader(line));
-		line = toStringToken(it, message, lineTerminator);
+/**
+ * @brief Parse the start line of the message.
+ * A request line is built from:
+ * <method> <sp> <request-target> <sp> <HTTP-version>
+ *
+ * A status line is built from:
+ * <HTTP-version> <sp> <status> <sp> <reason>
+ *
+ * As the reason may contain spaces, the third item is the remainder of the line.
+ * @param [in] start The offset of the line in the buffer.
+ * @param [in] end The offset of the end of the line (excluding the line terminator).
+ * @return True if the line was parsed.
+ */
+bool HttpParser::parseStartLine(size_t start, size_t end) {
+	size_t pos = start;
+	for (int i = 0; i < 2; i++) {
+		size_t itemStart = pos;
+		while (pos < end && m_buffer[pos] != ' ') pos++;
+		if (pos == end) {
+			ESP_LOGE(LOG_TAG, "parse: Malformed start line");
+			return false;
+		}
+		m_startLine[i].offset = itemStart;
+		m_startLine[i].length = pos - itemStart;
+		pos++;
 	}
+	m_startLine[2].offset = pos;
+	m_startLine[2].length = end - pos;
+	ESP_LOGD(LOG_TAG, "parseStartLine: \"%.*s\"", (int) (end - start), m_buffer + start);
+	return true;
+} // parseStartLine
+
+
+/**
+ * @brief Read some of the body of the request.
+ * Data already received with the head is returned first, then data is read from the socket.  A
+ * chunked body is decoded.  When there is no buffered data, the data is received straight into the
+ * caller's storage.
+ * @param [in] s The socket from which to retrieve data.
+ * @param [out] data The storage to receive the data.
+ * @param [in] length The size of the storage.
+ * @return The amount of data read, 0 at the end of the body or -1 if the body can't be read (malformed,
+ * larger than the maximum body size or the connection failed).
+ */
+int HttpParser::readBody(Socket& s, uint8_t* data, size_t length) {
+	if (length == 0) return 0;
+	if (m_bodyStart == 0) {
+		m_bodyStart = esp_timer_get_time();   // The body rate is measured from the first read.
+	}
+	std::string_view line;
+	while (true) {
+		switch (m_bodyState) {
+			case BODY_DONE:
+				return 0;
+
+			case BODY_LENGTH:
+			case BODY_CHUNK_DATA: {
+				int rc = readBodyData(s, data, length);
+				if (rc > 0 && m_bodyRemaining == 0) {
+					m_bodyState = (m_bodyState == BODY_LENGTH) ? BODY_DONE : BODY_CHUNK_END;
+				}
+				return rc;
+			}
+
+			case BODY_CHUNK_SIZE: {
+				if (!readLine(s, line)) break;
+				if (!parseChunkSize(line, &m_bodyRemaining)) {   // Ignore any chunk extension after the size.
+					ESP_LOGE(LOG_TAG, "readBody: Bad chunk size line");
+					m_bodyState = BODY_ERROR;
+					break;
+				}
+				if (m_maxBodySize > 0 && m_bodyRead + m_bodyRemaining > m_maxBodySize) {
+					ESP_LOGE(LOG_TAG, "readBody: Body larger than %d", m_maxBodySize);
+					m_bodyState = BODY_ERROR;
+					break;
+				}
+				m_bodyState = (m_bodyRemaining == 0) ? BODY_CHUNK_TRAILER : BODY_CHUNK_DATA;
+				break;
+			}
+
+			case BODY_CHUNK_END:
+				if (!readLine(s, line)) break;
+				m_bodyState = line.empty() ? BODY_CHUNK_SIZE : BODY_ERROR;
+				break;
+
+			case BODY_CHUNK_TRAILER:   // Trailer fields are ignored.
+				if (!readLine(s, line)) break;
+				if (line.empty()) {
+					m_bodyState = BODY_DONE;
+				}
+				break;
+
+			default:
+				return -1;
+		} // switch
+	} // while
+} // readBody
+
+
+/**
+ * @brief Read body data of known length (all of a body or of a chunk).
+ * @param [in] s The socket from which to retrieve data.
+ * @param [out] data The storage to receive the data.
+ * @param [in] length The size of the storage.
+ * @return The amount of data read or -1 if the connection failed.
+ */
+int HttpParser::readBodyData(Socket& s, uint8_t* data, size_t length) {
+	if (length > m_bodyRemaining) {
+		length = m_bodyRemaining;
+	}
+	int rc = consume(data, length);
+	if (rc == 0) {
+		if (!waitForData(s, getBodyDeadline())) {
+			ESP_LOGW(LOG_TAG, "readBody: Body arriving slower than %" PRIu32 " bytes/s", m_minBodyRate);
+			m_bodyState = BODY_ERROR;
+			m_error     = ERROR_TIMEOUT;
+			return -1;
+		}
+		rc = s.receive(data, length);
+		if (rc <= 0) {
+			ESP_LOGE(LOG_TAG, "readBody: Connection closed with %d bytes of the body to come", m_bodyRemaining);
+			m_bodyState = BODY_ERROR;
+			return -1;
+		}
+	}
+	m_bodyRemaining -= rc;
+	m_bodyRead      += rc;
+	return rc;
+} // readBodyData
+
+
+/**
+ * @brief Read a line of a chunked body (a chunk size, the end of a chunk or a trailer).
+ * The line is read into the buffer, after the head.
+ * @param [in] s The socket from which to retrieve data.
+ * @param [out] line The line without its terminator.
+ * @return True if a line was read.  False if the line is too long or the connection failed, in which
+ * case the body is in error.
+ */
+bool HttpParser::readLine(Socket& s, std::string_view& line) {
+	while (true) {
+		char* pEnd = (char*) ::memchr(m_buffer + m_consumed, '\n', m_length - m_consumed);
+		if (pEnd != nullptr) {
+			size_t start = m_consumed;
+			size_t end   = pEnd - m_buffer;
+			m_consumed = end + 1;
+			if (end > start && m_buffer[end - 1] == '\r') {
+				end--;
+			}
+			line = std::string_view(m_buffer + start, end - start);
+			return true;
+		}
+		// Make room by moving the unconsumed data to just after the head.
+		::memmove(m_buffer + m_headLength, m_buffer + m_consumed, m_length - m_consumed);
+		m_length  -= m_consumed - m_headLength;
+		m_consumed = m_headLength;
+		if (m_length == m_bufferSize) {
+			ESP_LOGE(LOG_TAG, "readBody: Chunk line too long");
+			m_bodyState = BODY_ERROR;
+			return false;
+		}
+		if (!waitForData(s, getBodyDeadline())) {
+			ESP_LOGW(LOG_TAG, "readBody: Body arriving slower than %" PRIu32 " bytes/s", m_minBodyRate);
+			m_bodyState = BODY_ERROR;
+			m_error     = ERROR_TIMEOUT;
+			return false;
+		}
+		int rc = s.receive((uint8_t*) m_buffer + m_length, m_bufferSize - m_length);
+		if (rc <= 0) {
+			ESP_LOGE(LOG_TAG, "readBody: Connection closed within a chunked body");
+			m_bodyState = BODY_ERROR;
+			return false;
+		}
+		m_length += rc;
+	}
+} // readLine
 
-	m_body = message.substr(std::distance(message.begin(), it));
-} // parse
 
 /**
- * @brief Parse A status line.
- * @param [in] line The status line to parse.
+ * @brief Read the data available on the socket and parse it.
+ * A single receive is performed so this can be used with a socket known to have data to read without
+ * blocking on further data.
+ * @param [in] s The socket from which to retrieve data.
+ * @return The outcome of the parse.
  */
-void HttpParser::parseStatusLine(std::string& line) {
-	// A status Line is built from:
-	// <HTTP-version> <sp> <status> <sp> <reason>
-	ESP_LOGD(LOG_TAG, ">> ParseStatusLine: \"%s\" [%d]", line.c_str(), line.length());
-	std::string::iterator it = line.begin();
-	// Get the version
-	m_version = toCharToken(it, line, ' ');
-	// Get the version
-	m_status = toCharToken(it, line, ' ');
-	// Get the status code
-	m_reason = toStringToken(it, line, lineTerminator);
+HttpParser::ParseResult HttpParser::receive(Socket& s) {
+	if (m_length == m_bufferSize) {
+		return parseBuffered();
+	}
+	int rc = (int) s.receive((uint8_t*) m_buffer + m_length, m_bufferSize - m_length);
+	if (rc <= 0) {
+		ESP_LOGD(LOG_TAG, "receive: Connection closed or in error: %d", rc);
+		m_state = STATE_ERROR;
+		m_error = ERROR_CLOSED;
+		return PARSE_ERROR;
+	}
+	m_length += rc;
+	return parseBuffered();
+} // receive
+
 
-	ESP_LOGD(LOG_TAG, "<< ParseStatusLine: method: %s, version: %s, status: %s", m_method.c_str(), m_version.c_str(), m_status.c_str());
-} // parseRequestLine
+/**
+ * @brief Prepare the parser for the next message.
+ * The data in the buffer that belongs to the current message is discarded.  Any data received beyond
+ * that (for example a pipelined request) is kept and becomes the start of the next message.
+ */
+void HttpParser::reset() {
+	if (m_consumed > 0) {
+		::memmove(m_buffer, m_buffer + m_consumed, m_length - m_consumed);
+		m_length -= m_consumed;
+	}
+	m_consumed    = 0;
+	m_parsed      = 0;
+	m_headLength  = 0;
+	m_headStart   = 0;
+	m_headTime    = 0;
+	m_bodyState   = BODY_DONE;
+	m_bodyRemaining = 0;
+	m_bodyRead    = 0;
+	m_bodyStart   = 0;
+	m_error       = ERROR_NONE;
+	m_state       = STATE_START_LINE;
+	m_headerCount = 0;
+	m_isResponse  = false;
+	for (int i = 0; i < 3; i++) {
+		m_startLine[i].offset = 0;
+		m_startLine[i].length = 0;
+	}
+	m_body.clear();
+	m_arena.reset();
+} // reset
+
+
+/**
+ * @brief Set how long the head of a request may take to arrive.
+ * @param [in] timeout The milliseconds from the first data of the head arriving to the head being
+ * complete, 0 for no limit.
+ */
+void HttpParser::setHeaderTimeout(uint32_t timeout) {
+	m_headerTimeout = timeout;
+} // setHeaderTimeout
+
+
+/**
+ * @brief Set the largest request body we accept.
+ * Reading a body that turns out to be larger fails.
+ * @param [in] maxBodySize The size of the largest body, 0 for no limit.
+ */
+void HttpParser::setMaxBodySize(size_t maxBodySize) {
+	m_maxBodySize = maxBodySize;
+} // setMaxBodySize
+
+
+/**
+ * @brief Set the most headers we accept in a message.
+ * A head with more headers fails with ERROR_HEAD_TOO_LARGE.
+ * @param [in] count The number of headers, no more than MAX_HEADERS.
+ */
+void HttpParser::setMaxHeaderCount(size_t count) {
+	m_maxHeaderCount = (count < MAX_HEADERS) ? count : (size_t) MAX_HEADERS;
+} // setMaxHeaderCount
+
+
+/**
+ * @brief Set the slowest rate at which we accept the body of a request.
+ * Reading a body that arrives more slowly fails with ERROR_TIMEOUT.
+ * @param [in] bytesPerSecond The minimum average rate, 0 for no limit.
+ * @param [in] grace The milliseconds from the first read of the body before the rate is enforced.
+ */
+void HttpParser::setMinBodyRate(uint32_t bytesPerSecond, uint32_t grace) {
+	m_minBodyRate = bytesPerSecond;
+	m_bodyGrace   = grace;
+} // setMinBodyRate
+
+
+/**
+ * @brief Work out how the body of a request that has just been parsed is to be read.
+ * A body is chunked if its last transfer coding is chunked, otherwise its length is given by
+ * Content-Length.  A request with neither has no body (RFC7230 section 3.3.3).
+ *
+ * A request whose body length can't be determined reliably is refused, as a server and a proxy in
+ * front of it could otherwise disagree on where the next request starts.  That is a Transfer-Encoding
+ * whose last coding isn't chunked, more than one Transfer-Encoding header, Transfer-Encoding together
+ * with Content-Length, or a Content-Length that isn't a valid number or disagrees with another one.
+ * @return False if the body length can't be determined.
+ */
+bool HttpParser::startBody() {
+	m_bodyRead = 0;
+	if (m_isResponse) {
+		m_bodyState = BODY_DONE;
+		return true;
+	}
+	size_t transferEncodings = 0;
+	bool   hasLength = false;
+	size_t length    = 0;
+	for (size_t i = 0; i < m_headerCount; i++) {
+		std::string_view name = view(m_headerNames[i]);
+		if (equalsIgnoreCase(name, HttpRequest::HTTP_HEADER_TRANSFER_ENCODING)) {
+			transferEncodings++;
+		} else if (equalsIgnoreCase(name, HttpRequest::HTTP_HEADER_CONTENT_LENGTH)) {
+			size_t value;
+			if (!parseContentLength(view(m_headerValues[i]), &value) || (hasLength && value != length)) {
+				ESP_LOGE(LOG_TAG, "Invalid or conflicting Content-Length");
+				m_bodyState = BODY_ERROR;
+				return false;
+			}
+			hasLength = true;
+			length    = value;
+		}
+	}
+	if (transferEncodings > 0) {
+		if (transferEncodings > 1 || hasLength || !isBodyChunked()) {
+			ESP_LOGE(LOG_TAG, "Transfer-Encoding doesn't end with chunked or is sent with Content-Length");
+			m_bodyState = BODY_ERROR;
+			return false;
+		}
+		m_bodyState = BODY_CHUNK_SIZE;
+		return true;
+	}
+	m_bodyRemaining = length;
+	m_bodyState     = (m_bodyRemaining > 0) ? BODY_LENGTH : BODY_DONE;
+	if (m_maxBodySize > 0 && m_bodyRemaining > m_maxBodySize) {
+		ESP_LOGE(LOG_TAG, "Body of %d bytes is larger than %d", m_bodyRemaining, m_maxBodySize);
+		m_bodyState = BODY_ERROR;
+	}
+	return true;
+} // startBody
+
+
+/**
+ * @brief Get the part of the buffer described by a slice.
+ */
+std::string_view HttpParser::view(const Slice& slice) {
+	return std::string_view(m_buffer + slice.offset, slice.length);
+} // view
+
+
+/**
+ * @brief Wait for data to arrive on the socket, but no later than a deadline.
+ * @param [in] s The socket.
+ * @param [in] deadline The time (esp_timer_get_time()) by which data must arrive, 0 for no deadline.
+ * @return True if data can be read (or reading will report an error), false if the deadline passed.
+ */
+bool HttpParser::waitForData(Socket& s, int64_t deadline) {
+	if (deadline == 0 || s.hasBufferedData()) return true;
+	int64_t remaining = deadline - esp_timer_get_time();
+	if (remaining <= 0) return false;
+	fd_set readSet;
+	FD_ZERO(&readSet);
+	FD_SET(s.getFD(), &readSet);
+	struct timeval tv;
+	tv.tv_sec  = remaining / 1000000;
+	tv.tv_usec = remaining % 1000000;
+	return ::select(s.getFD() + 1, &readSet, nullptr, nullptr, &tv) != 0;
+} // waitForData
@@ -8,38 +8,135 @@
 #ifndef CPP_UTILS_HTTPPARSER_H_
 #define CPP_UTILS_HTTPPARSER_H_
 #include <string>
+#include <string_view>
 #include <map>
 #include "Socket.h"
+#include "HttpArena.h"
 
+/**
+ * @brief Parse an HTTP message.
+ *
+ * The parser owns a fixed size receive buffer into which the message head (request/status line and
+ * headers) is read.  Parsing is incremental: data can be handed to the parser as it arrives, either
+ * from a blocking or a non-blocking socket, and each step reports whether more data is needed, the
+ * head is complete or the head is in error.  The parsed items are kept as slices of the buffer so no
+ * copies or allocations are made while parsing.
+ *
+ * Data received beyond the end of the head (body or pipelined requests) stays in the buffer.  When
+ * reset() is called, any of that data that has not been consumed becomes the start of the next message.
+ *
+ * The getters returning a std::string_view refer to the buffer and are valid until reset().  The parser
+ * also holds an arena from which data derived from the message can be allocated for the same lifetime.
+ */
 class HttpParser {
 public:
-	HttpParser();
+	// The outcome of an incremental parse step.
+	enum ParseResult {
+		PARSE_NEED_MORE, // The head is not yet complete.
+		PARSE_COMPLETE,  // The head has been parsed.
+		PARSE_ERROR      // The head is malformed, too large or the partner closed the connection.
+	};
+
+	// Why parsing the head or reading the body failed.
+	enum ParseError {
+		ERROR_NONE,
+		ERROR_MALFORMED,       // The message isn't valid HTTP.
+		ERROR_HEAD_TOO_LARGE,  // The head is larger than the buffer or has too many headers.
+		ERROR_TIMEOUT,         // The head didn't arrive in time or the body arrived too slowly.
+		ERROR_CLOSED           // The partner closed the connection or the connection failed.
+	};
+	static const size_t MAX_HEADERS = 32;   // The maximum number of headers in a message.
+
+	HttpParser(size_t bufferSize = 2048);
 	virtual ~HttpParser();
+	static bool equalsIgnoreCase(std::string_view a, std::string_view b);
+	static bool hasToken(std::string_view list, std::string_view token);
+	size_t      consume(uint8_t* data, size_t length);
+	ParseResult feed(const uint8_t* data, size_t length);
 	std::string getBody();
+	size_t      getBodyLength();
+	HttpArena&  getArena();
+	size_t      getBufferedLength();
+	size_t      getContentLength();
+	size_t      getHeadLength();
+	uint32_t    getHeadTime();
+	ParseError  getError();
 	std::string getHeader(const std::string& name);
+	size_t      getHeaderCount();
+	std::string_view getHeaderName(size_t index);
 	std::map<std::string, std::string> getHeaders();
+	std::string_view getHeaderValue(size_t index);
+	std::string_view getHeaderView(std::string_view name);
 	std::string getMethod();
+	std::string_view getMethodView();
 	std::string getURL();
+	std::string_view getURLView();
 	std::string getVersion();
+	std::string_view getVersionView();
 	std::string getStatus();
 	std::string getReason();
+	bool hasBufferedData();
 	bool hasHeader(const std::string& name);
+	bool isBodyChunked();
+	bool isBodyComplete();
+	bool isComplete();
+	bool isHeadOverdue();
 	void parse(std::string message);
-	void parse(Socket s);
+	bool parse(Socket s);
+	ParseResult parseBuffered();
 	void parseResponse(std::string message);
+	int  readBody(Socket& s, uint8_t* data, size_t length);
+	ParseResult receive(Socket& s);
+	void reset();
+	void setHeaderTimeout(uint32_t timeout);
+	void setMaxBodySize(size_t maxBodySize);
+	void setMaxHeaderCount(size_t count);
+	void setMinBodyRate(uint32_t bytesPerSecond, uint32_t grace);
 
 private:
-	std::string m_method;
-	std::string m_url;
-	std::string m_version;
+	// A part of the message held in the buffer.
+	struct Slice {
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	char*       m_buffer;       // The receive buffer.
+	size_t      m_bufferSize;   // The size of the receive buffer.
+	size_t      m_length;       // The amount of data in the buffer.
+	size_t      m_parsed;       // The amount of data in the buffer that has been parsed.
+	size_t      m_consumed;     // The amount of data in the buffer that belongs to the current message.
+	int         m_state;        // The state of the parser.
+	bool        m_isResponse;   // Are we parsing a response rather than a request?
+	Slice       m_startLine[3]; // Method, URL, version (request) or version, status, reason (response).
+	Slice       m_headerNames[MAX_HEADERS];
+	Slice       m_headerValues[MAX_HEADERS];
+	size_t      m_headerCount;
 	std::string m_body;
-	std::string m_status;
-	std::string m_reason;
-	std::map<std::string, std::string> m_headers;
-	void dump();
-	void parseRequestLine(std::string& line);
-	void parseStatusLine(std::string& line);
+	size_t      m_headLength;    // The length of the head in the buffer.
+	int64_t     m_headStart;     // When the first data of the head was seen (esp_timer_get_time()), 0 if not yet.
+	uint32_t    m_headTime;      // The microseconds it took to receive and parse the head.
+	int         m_bodyState;     // How far we have got reading the body.
+	size_t      m_bodyRemaining; // What is left of the body (Content-Length) or of the current chunk.
+	size_t      m_bodyRead;      // The amount of body data read so far.
+	size_t      m_maxBodySize;   // The largest body we accept, 0 if there is no limit.
+	size_t      m_maxHeaderCount; // The most headers we accept, no more than MAX_HEADERS.
+	uint32_t    m_headerTimeout; // The milliseconds in which the head must arrive, 0 if there is no limit.
+	uint32_t    m_minBodyRate;   // The slowest the body may arrive in bytes per second, 0 if there is no limit.
+	uint32_t    m_bodyGrace;     // The milliseconds before the body rate is enforced.
+	int64_t     m_bodyStart;     // When reading the body started (esp_timer_get_time()), 0 if not yet.
+	ParseError  m_error;         // Why the head or body failed, if it did.
+	HttpArena   m_arena;         // Memory for the current message, released by reset().
 
+	void             dump();
+	int              findHeader(std::string_view name);
+	int64_t          getBodyDeadline();
+	int              readBodyData(Socket& s, uint8_t* data, size_t length);
+	bool             readLine(Socket& s, std::string_view& line);
+	bool             startBody();
+	bool             parseHeaderLine(size_t start, size_t end);
+	bool             parseStartLine(size_t start, size_t end);
+	std::string_view view(const Slice& slice);
+	bool             waitForData(Socket& s, int64_t deadline);
 };
 
 #endif /* CPP_UTILS_HTTPPARSER_H_ */
@@ -49,20 +49,35 @@ static const char* LOG_TAG="HttpRequest";
 //static std::string lineTerminator = "\r\n";
 
 const char HttpRequest::HTTP_HEADER_ACCEPT[]         = "Accept";
+const char HttpRequest::HTTP_HEADER_ACCEPT_ENCODING[] = "Accept-Encoding";
+const char HttpRequest::HTTP_HEADER_ACCEPT_RANGES[]  = "Accept-Ranges";
 const char HttpRequest::HTTP_HEADER_ALLOW[]          = "Allow";
+const char HttpRequest::HTTP_HEADER_CACHE_CONTROL[]  = "Cache-Control";
 const char HttpRequest::HTTP_HEADER_CONNECTION[]     = "Connection";
+const char HttpRequest::HTTP_HEADER_CONTENT_ENCODING[] = "Content-Encoding";
 const char HttpRequest::HTTP_HEADER_CONTENT_LENGTH[] = "Content-Length";
+const char HttpRequest::HTTP_HEADER_CONTENT_RANGE[]  = "Content-Range";
 const char HttpRequest::HTTP_HEADER_CONTENT_TYPE[]   = "Content-Type";
 const char HttpRequest::HTTP_HEADER_COOKIE[]         = "Cookie";
+const char HttpRequest::HTTP_HEADER_ETAG[]           = "ETag";
+const char HttpRequest::HTTP_HEADER_EXPECT[]         = "Expect";
 const char HttpRequest::HTTP_HEADER_HOST[]           = "Host";
+const char HttpRequest::HTTP_HEADER_IF_MODIFIED_SINCE[] = "If-Modified-Since";
+const char HttpRequest::HTTP_HEADER_IF_NONE_MATCH[]  = "If-None-Match";
+const char HttpRequest::HTTP_HEADER_IF_RANGE[]       = "If-Range";
+const char HttpRequest::HTTP_HEADER_LAST_EVENT_ID[]  = "Last-Event-ID";
 const char HttpRequest::HTTP_HEADER_LAST_MODIFIED[]  = "Last-Modified";
 const char HttpRequest::HTTP_HEADER_ORIGIN[]         = "Origin";
+const char HttpRequest::HTTP_HEADER_RANGE[]          = "Range";
 const char HttpRequest::HTTP_HEADER_SEC_WEBSOCKET_ACCEPT[]   = "Sec-WebSocket-Accept";
+const char HttpRequest::HTTP_HEADER_SEC_WEBSOCKET_EXTENSIONS[] = "Sec-WebSocket-Extensions";
 const char HttpRequest::HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL[] = "Sec-WebSocket-Protocol";
 const char HttpRequest::HTTP_HEADER_SEC_WEBSOCKET_KEY[]      = "Sec-WebSocket-Key";
 const char HttpRequest::HTTP_HEADER_SEC_WEBSOCKET_VERSION[]  = "Sec-WebSocket-Version";
+const char HttpRequest::HTTP_HEADER_TRANSFER_ENCODING[] = "Transfer-Encoding";
 const char HttpRequest::HTTP_HEADER_UPGRADE[]        = "Upgrade";
 const char HttpRequest::HTTP_HEADER_USER_AGENT[]     = "User-Agent";
+const char HttpRequest::HTTP_HEADER_VARY[]           = "Vary";
 
 const char HttpRequest::HTTP_METHOD_CONNECT[] = "CONNECT";
 const char HttpRequest::HTTP_METHOD_DELETE[]  = "DELETE";
@@ -91,33 +106,84 @@ std::string buildWebsocketKeyResponseHash(std::string requestKey) {
 
 /**
  * @brief Create an HTTP Request instance.
+ * The request is read from the socket.
+ * @param [in] clientSocket The socket connected to the client.
  */
 HttpRequest::HttpRequest(Socket clientSocket) {
 	m_clientSocket = clientSocket;
 	m_pWebSocket   = nullptr;
+	m_pDeflateConfig = nullptr;
 	m_isClosed     = false;
+	m_keepAlive    = false;
+	m_pParser      = new HttpParser();
+	m_ownParser    = true;
+	m_bodyLoaded   = false;
+	m_continueSent = false;
+	m_pBodyStreambuf = nullptr;
+
+	if (!m_pParser->parse(clientSocket)) { // Parse the socket stream to build the HTTP data.
+		return;                            // The partner closed the connection or sent nothing we understand.
+	}
+	init();
+} // HttpRequest
 
-	m_parser.parse(clientSocket); // Parse the socket stream to build the HTTP data.
+
+/**
+ * @brief Create an HTTP Request instance from a parser.
+ * The parser belongs to the connection and is reused for each request that arrives on it, which keeps
+ * the data a client pipelined behind this request.
+ * @param [in] clientSocket The socket connected to the client.
+ * @param [in] pParser A parser that has parsed the request from the socket.
+ * @param [in] pDeflateConfig The permessage-deflate extension offered if the request upgrades to a
+ * WebSocket, null for none.
+ */
+HttpRequest::HttpRequest(Socket clientSocket, HttpParser* pParser, const WebSocketDeflate::Config* pDeflateConfig) {
+	m_clientSocket = clientSocket;
+	m_pWebSocket   = nullptr;
+	m_pDeflateConfig = pDeflateConfig;
+	m_isClosed     = false;
+	m_keepAlive    = false;
+	m_pParser      = pParser;
+	m_ownParser    = false;
+	m_bodyLoaded   = false;
+	m_continueSent = false;
+	m_pBodyStreambuf = nullptr;
+	init();
+} // HttpRequest
+
+
+/**
+ * @brief Examine the parsed request.
+ * We determine whether the connection may be kept open and whether the request is asking to become
+ * a WebSocket, in which case we answer the upgrade.
+ */
+void HttpRequest::init() {
 
 	// We have to take some special action on the Connection header.  We want to know if it contains "Upgrade"
 	// however it has come to light that the Connection header can contain multiple parts.  For example, it has
 	// been reported that it can contain "keep-alive,Upgrade".  Because of this we can't simply examine the string
-	// to see if it equals "Upgrade".  Our solution is to get the value of Connection string, split it by "," as
-	// a delimiter and then examine each of the parts to see if any of those are "Upgrade".
-	std::vector<std::string> parts = GeneralUtils::split(getHeader(HTTP_HEADER_CONNECTION), ',');
-	bool upgradeFound = false;
-	if (std::find(parts.begin(), parts.end(), "Upgrade") != parts.end()) {
-		upgradeFound = true;
+	// to see if it equals "Upgrade".  Instead we look for each token in the comma separated list.
+	std::string_view connection = getHeaderView(HTTP_HEADER_CONNECTION);
+	bool upgradeFound   = HttpParser::hasToken(connection, "upgrade");
+	bool closeFound     = HttpParser::hasToken(connection, "close");
+	bool keepAliveFound = HttpParser::hasToken(connection, "keep-alive");
+
+	// HTTP/1.1 connections are persistent unless the client asks otherwise while HTTP/1.0 clients
+	// have to explicitly ask for the connection to be kept open (RFC7230 section 6.3).
+	if (getVersionView() == "HTTP/1.1") {
+		m_keepAlive = !closeFound;
+	} else {
+		m_keepAlive = keepAliveFound && !closeFound;
 	}
 
 	// Is this a Web Socket?
-	if (getMethod() == HTTP_METHOD_GET &&
-			!getHeader(HTTP_HEADER_HOST).empty() &&
-			getHeader(HTTP_HEADER_UPGRADE) == "websocket" &&
+	if (getMethodView() == HTTP_METHOD_GET &&
+			!getHeaderView(HTTP_HEADER_HOST).empty() &&
+			HttpParser::equalsIgnoreCase(getHeaderView(HTTP_HEADER_UPGRADE), "websocket") &&
 			//getHeader(HTTP_HEADER_CONNECTION) == "Upgrade" &&
 			upgradeFound &&
-			!getHeader(HTTP_HEADER_SEC_WEBSOCKET_KEY).empty() &&
-			!getHeader(HTTP_HEADER_SEC_WEBSOCKET_VERSION).empty()) {
+			!getHeaderView(HTTP_HEADER_SEC_WEBSOCKET_KEY).empty() &&
+			!getHeaderView(HTTP_HEADER_SEC_WEBSOCKET_VERSION).empty()) {
 		ESP_LOGD(LOG_TAG, "Websocket detected!");
 		// do something
 		// Process the web socket request
@@ -130,15 +196,56 @@ HttpRequest::HttpRequest(Socket clientSocket) {
 		response.addHeader(HTTP_HEADER_CONNECTION, "Upgrade");
 		response.addHeader(HTTP_HEADER_SEC_WEBSOCKET_ACCEPT,
 			buildWebsocketKeyResponseHash(getHeader(HTTP_HEADER_SEC_WEBSOCKET_KEY)));
+		WebSocketDeflate* pDeflate = nullptr;
+		if (m_pDeflateConfig != nullptr) {   // Accept compression if the client offers it.
+			std::string extensions;
+			pDeflate = WebSocketDeflate::negotiate(getHeaderView(HTTP_HEADER_SEC_WEBSOCKET_EXTENSIONS), *m_pDeflateConfig, extensions);
+			if (pDeflate != nullptr) {
+				response.addHeader(HTTP_HEADER_SEC_WEBSOCKET_EXTENSIONS, extensions);
+			}
+		}
 		response.sendData("");
 
 		// Now that we have converted the request into a WebSocket, create the new WebSocket entry.
-		m_pWebSocket = new WebSocket(clientSocket);
+		m_pWebSocket = new WebSocket(m_clientSocket, pDeflate);
 	} // if this is a web socket ...
-} // HttpRequest
+} // init
+
+
+/**
+ * @brief Create a stream buffer reading the body of a request.
+ * @param [in] pRequest The request.
+ * @param [in] bufferSize The size of the buffer used to read the body.
+ */
+HttpRequestBodyStreambuf::HttpRequestBodyStreambuf(HttpRequest* pRequest, size_t bufferSize) {
+	m_pRequest   = pRequest;
+	m_bufferSize = bufferSize;
+	m_buffer     = new char[bufferSize];
+	setg(m_buffer, m_buffer, m_buffer); // Set the initial get buffer pointers to no data.
+} // HttpRequestBodyStreambuf
+
+
+HttpRequestBodyStreambuf::~HttpRequestBodyStreambuf() {
+	delete[] m_buffer;
+} // ~HttpRequestBodyStreambuf
+
+
+/**
+ * @brief Handle the request to read data from the stream but we need more data from the body.
+ */
+HttpRequestBodyStreambuf::int_type HttpRequestBodyStreambuf::underflow() {
+	int bytesRead = m_pRequest->readBody((uint8_t*) m_buffer, m_bufferSize);
+	if (bytesRead <= 0) return EOF;
+	setg(m_buffer, m_buffer, m_buffer + bytesRead);
+	return traits_type::to_int_type(*gptr());
+} // underflow
 
 
 HttpRequest::~HttpRequest() {
+	delete m_pBodyStreambuf;
+	if (m_ownParser) {
+		delete m_pParser;
+	}
 } // ~HttpRequest
 
 
@@ -159,48 +266,133 @@ void HttpRequest::close() {
  */
 void HttpRequest::dump() {
 	ESP_LOGD(LOG_TAG, "Method: %s, URL: \"%s\", Version: %s", getMethod().c_str(), getPath().c_str(), getVersion().c_str());
-	auto headers = getHeaders();
-	auto it2 = headers.begin();
-	for (; it2 != headers.end(); ++it2) {
-		ESP_LOGD(LOG_TAG, "name=\"%s\", value=\"%s\"", it2->first.c_str(), it2->second.c_str());
+	for (size_t i = 0; i < m_pParser->getHeaderCount(); i++) {
+		std::string_view name  = m_pParser->getHeaderName(i);
+		std::string_view value = m_pParser->getHeaderValue(i);
+		ESP_LOGD(LOG_TAG, "name=\"%.*s\", value=\"%.*s\"", (int) name.length(), name.data(), (int) value.length(), value.data());
 	}
-	ESP_LOGD(LOG_TAG, "Body: \"%s\"", getBody().c_str());
+	ESP_LOGD(LOG_TAG, "Body: %d bytes%s", m_pParser->getContentLength(), m_pParser->isBodyChunked() ? " (chunked)" : "");
 } // dump
 
 
+/**
+ * @brief Get the memory of the request.
+ * What is allocated from the arena stays valid until the response has been sent, after which the
+ * memory is reused for the next request on the connection.
+ * @return The arena.
+ */
+HttpArena& HttpRequest::getArena() {
+	return m_pParser->getArena();
+} // getArena
+
+
 /**
  * @brief Get the body of the HttpRequest.
+ * The whole body is read into RAM.  To handle a large body, read it with getBodyStreambuf() or
+ * readBody() instead.
+ * @return The body of the request.
  */
 std::string HttpRequest::getBody() {
-	return m_parser.getBody();
+	if (!m_bodyLoaded) {
+		m_bodyLoaded = true;
+		m_body.reserve(m_pParser->getContentLength());
+		uint8_t data[256];
+		int rc;
+		while ((rc = readBody(data, sizeof(data))) > 0) {
+			m_body.append((char*) data, rc);
+		}
+	}
+	return m_body;
 } // getBody
 
 
+/**
+ * @brief Get a stream buffer reading the body of the request.
+ *
+ * Example:
+ * @code{.cpp}
+ * std::istream is(pRequest->getBodyStreambuf());
+ * @endcode
+ * @return The stream buffer.  It belongs to the request.
+ */
+HttpRequestBodyStreambuf* HttpRequest::getBodyStreambuf() {
+	if (m_pBodyStreambuf == nullptr) {
+		m_pBodyStreambuf = new HttpRequestBodyStreambuf(this);
+	}
+	return m_pBodyStreambuf;
+} // getBodyStreambuf
+
+
 /**
  * @brief Get the named header.
  * @param [in] name The name of the header field to retrieve.
  * @return The value of the header field.
  */
 std::string HttpRequest::getHeader(std::string name) {
-	return m_parser.getHeader(name);
+	return m_pParser->getHeader(name);
 } // getHeader
 
 
 std::map<std::string, std::string> HttpRequest::getHeaders() {
-	return m_parser.getHeaders();
+	return m_pParser->getHeaders();
 } // getHeaders
 
 
+/**
+ * @brief Get the value of a named header without copying it.
+ * @param [in] name The name of the header, in any case.
+ * @return The value of the header, valid until the response has been sent, or an empty view.
+ */
+std::string_view HttpRequest::getHeaderView(std::string_view name) {
+	return m_pParser->getHeaderView(name);
+} // getHeaderView
+
+
 std::string HttpRequest::getMethod() {
-	return m_parser.getMethod();
+	return m_pParser->getMethod();
 } // getMethod
 
 
+std::string_view HttpRequest::getMethodView() {
+	return m_pParser->getMethodView();
+} // getMethodView
+
+
+/**
+ * @brief Get a parameter taken from the path by the route that matched the request.
+ * For example, a request for "/api/leds/3" matching the route "/api/leds/:id" has the parameter "id"
+ * with the value "3".
+ * @param [in] name The name of the parameter.
+ * @return The value of the parameter or an empty string if there is no such parameter.
+ */
+std::string HttpRequest::getParam(const std::string& name) {
+	auto it = m_params.find(name);
+	if (it == m_params.end()) {
+		return "";
+	}
+	return it->second;
+} // getParam
+
+
+/**
+ * @brief Get all the parameters taken from the path by the route that matched the request.
+ * @return The parameters keyed by name.
+ */
+std::map<std::string, std::string> HttpRequest::getParams() {
+	return m_params;
+} // getParams
+
+
 std::string HttpRequest::getPath() {
-	return m_parser.getURL();
+	return m_pParser->getURL();
 } // getPath
 
 
+std::string_view HttpRequest::getPathView() {
+	return m_pParser->getURLView();
+} // getPathView
+
+
 /**
  * @brief Get the query part of the request.
  * The query is a set of name = value pairs.  The return is a map keyed by the name items.
@@ -259,6 +451,92 @@ std::map<std::string, std::string> HttpRequest::getQuery() {
 } // getQuery
 
 
+/**
+ * @brief Get a value of the query part of the request.
+ * Unlike getQuery(), nothing is copied unless the value has to be decoded, in which case it is decoded
+ * into the arena of the request.
+ * @param [in] name The name of the value.
+ * @return The decoded value, valid until the response has been sent, or an empty view if the query
+ * doesn't have the name.
+ */
+std::string_view HttpRequest::getQueryValue(std::string_view name) {
+	std::string_view path = getPathView();
+	size_t qindex = path.find('?');
+	if (qindex == std::string_view::npos) return std::string_view();
+	std::string_view query = path.substr(qindex + 1);
+	while (!query.empty()) {
+		size_t amp = query.find('&');
+		std::string_view pair = query.substr(0, amp);
+		query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+		size_t equals = pair.find('=');
+		if (pair.substr(0, equals) != name) continue;
+		if (equals == std::string_view::npos) return std::string_view();
+		std::string_view value = pair.substr(equals + 1);
+		if (value.find_first_of("%+") == std::string_view::npos) return value;
+		return urlDecode(value, getArena());
+	}
+	return std::string_view();
+} // getQueryValue
+
+
+/**
+ * @brief Determine if all of the body has been read.
+ * @return True if the body has been read or there is none.
+ */
+bool HttpRequest::isBodyComplete() {
+	return m_pParser->isBodyComplete();
+} // isBodyComplete
+
+
+/**
+ * @brief Determine if the client waits to be told to send the body.
+ * A client sending "Expect: 100-continue" waits for a 100 Continue response before sending the body
+ * so that we can refuse the request without it being sent.
+ * @return True if the client waits for a 100 Continue that we haven't sent yet.
+ */
+bool HttpRequest::isContinueExpected() {
+	if (m_continueSent || m_pParser->isBodyComplete() || getVersionView() != "HTTP/1.1") return false;
+	return HttpParser::equalsIgnoreCase(getHeaderView(HTTP_HEADER_EXPECT), "100-continue");
+} // isContinueExpected
+
+
+/**
+ * @brief Read some of the body of the request.
+ * If the client is waiting to be told to send the body, we tell it to do so first.
+ * @param [out] data The storage to receive the data.
+ * @param [in] length The size of the storage.
+ * @return The amount of data read, 0 at the end of the body or -1 if the body can't be read.
+ */
+int HttpRequest::readBody(uint8_t* data, size_t length) {
+	if (isContinueExpected()) {
+		m_clientSocket.send("HTTP/1.1 100 Continue\r\n\r\n");
+	}
+	m_continueSent = true;
+	return m_pParser->readBody(m_clientSocket, data, length);
+} // readBody
+
+
+/**
+ * @brief Read and discard what is left of the body.
+ * A persistent connection can only carry a further request once the body of this one has been read.
+ * @param [in] maxLength The most data we are prepared to discard.
+ * @return True if the body has been read.  False if it couldn't be read, there was too much left or
+ * the client is still waiting to be told to send it.  The connection can't be reused in that case.
+ */
+bool HttpRequest::skipBody(size_t maxLength) {
+	if (m_pParser->isBodyComplete()) return true;
+	if (isContinueExpected()) return false;   // The client hasn't sent the body and won't unless we ask.
+	uint8_t data[128];
+	size_t skipped = 0;
+	while (skipped <= maxLength) {
+		int rc = readBody(data, sizeof(data));
+		if (rc <= 0) break;
+		skipped += rc;
+	}
+	return m_pParser->isBodyComplete();
+} // skipBody
+
+
 /**
  * @brief Get the underlying socket.
  * @return The underlying socket.
@@ -269,10 +547,15 @@ Socket HttpRequest::getSocket() {
 
 
 std::string HttpRequest::getVersion() {
-	return m_parser.getVersion();
+	return m_pParser->getVersion();
 } // getVersion
 
 
+std::string_view HttpRequest::getVersionView() {
+	return m_pParser->getVersionView();
+} // getVersionView
+
+
 WebSocket* HttpRequest::getWebSocket() {
 	return m_pWebSocket;
 } // getWebSocket
@@ -287,6 +570,17 @@ bool HttpRequest::isClosed() {
 } // isClosed
 
 
+/**
+ * @brief Determine if the connection may be reused for a further request.
+ * This reflects what the client asked for in the Connection header and its HTTP version, as possibly
+ * overridden by the server through setKeepAlive().
+ * @return True if the connection may be kept open once the response has been sent.
+ */
+bool HttpRequest::isKeepAlive() {
+	return m_keepAlive && !m_isClosed;
+} // isKeepAlive
+
+
 /**
  * @brief Determine if this request represents a WebSocket
  * @return True if the request creates a web socket.
@@ -324,6 +618,25 @@ std::map<std::string, std::string> HttpRequest::parseForm() {
 } // parseForm
 
 
+/**
+ * @brief Parse the body as multipart/form-data.
+ * The body is read and handed to the handler a part at a time, so an upload of any size is handled
+ * in the memory of the parse buffer and whatever the handler keeps.
+ * @param [in] pHandler The handler of the parts, for example an HttpMultipartFileSink.
+ * @param [in] bufferSize The size of the parse buffer.  The headers of a part must fit in it.
+ * @return True if the whole body was parsed.  False if the request isn't multipart or the body is malformed.
+ */
+bool HttpRequest::parseMultipart(HttpMultipartHandler* pHandler, size_t bufferSize) {
+	std::string boundary = HttpMultipartParser::getBoundary(getHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE));
+	if (boundary.empty()) {
+		ESP_LOGE(LOG_TAG, "parseMultipart: The request isn't multipart");
+		return false;
+	}
+	HttpMultipartParser parser(boundary, pHandler, bufferSize);
+	return parser.parse(this);
+} // parseMultipart
+
+
 /**
  * @brief Return the constituent parts of the path.
  * If we imagine a path as composed of parts separated by slashes, then this function
@@ -358,6 +671,17 @@ std::vector<std::string> HttpRequest::pathSplit() {
 } // pathSplit
 
 
+/**
+ * @brief Allow or forbid the reuse of the connection after this request.
+ * The server uses this to force a close, for example when the maximum number of requests per
+ * connection has been reached.  Keep alive can only be enabled if the client asked for it.
+ * @param [in] keepAlive False to close the connection once the response has been sent.
+ */
+void HttpRequest::setKeepAlive(bool keepAlive) {
+	m_keepAlive = m_keepAlive && keepAlive;
+} // setKeepAlive
+
+
 /**
  * @brief Decode a URL/form
  * @param [in] str
@@ -385,3 +709,28 @@ std::string HttpRequest::urlDecode(std::string str) {
 	}
 	return ret;
 } // urlDecode
+
+
+/**
+ * @brief Decode a URL/form into an arena.
+ * @param [in] str The encoded string.
+ * @param [in] arena The arena holding the decoded string, usually getArena().
+ * @return The decoded string.
+ */
+std::string_view HttpRequest::urlDecode(std::string_view str, HttpArena& arena) {
+	char* pDecoded = (char*) arena.allocate(str.length(), 1);   // Decoding never makes the string longer.
+	if (pDecoded == nullptr) return std::string_view();
+	size_t length = 0;
+	for (size_t i = 0; i < str.length(); i++) {
+		if (str[i] == '+') {
+			pDecoded[length++] = ' ';
+		} else if (str[i] == '%' && i + 2 < str.length() && isxdigit((unsigned char) str[i + 1]) && isxdigit((unsigned char) str[i + 2])) {
+			char hex[3] = { str[i + 1], str[i + 2], '\0' };
+			pDecoded[length++] = (char) strtol(hex, nullptr, 16);
+			i += 2;
+		} else {
+			pDecoded[length++] = str[i];
+		}
+	}
+	return std::string_view(pDecoded, length);
+} // urlDecode
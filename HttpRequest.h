@@ -8,33 +8,74 @@
 #ifndef COMPONENTS_CPP_UTILS_HTTPREQUEST_H_
 #define COMPONENTS_CPP_UTILS_HTTPREQUEST_H_
 #include <string>
+#include <string_view>
 #include <map>
 #include <vector>
+#include <streambuf>
 #include "Socket.h"
 #include "WebSocket.h"
+#include "WebSocketDeflate.h"
 #include "HttpParser.h"
+#include "HttpMultipartParser.h"
 
 #undef close
 
+class HttpRequest;
+
+/**
+ * @brief A stream buffer reading the body of an HTTP request.
+ *
+ * The body is read from the connection as it is consumed so that a body of any size can be handled
+ * in constant memory.  The stream ends at the end of the body.
+ */
+class HttpRequestBodyStreambuf : public std::streambuf {
+public:
+	HttpRequestBodyStreambuf(HttpRequest* pRequest, size_t bufferSize = 512);
+	~HttpRequestBodyStreambuf();
+	int_type underflow();
+
+private:
+	char*        m_buffer;
+	HttpRequest* m_pRequest;
+	size_t       m_bufferSize;
+};
+
+
 class HttpRequest {
 public:
 	HttpRequest(Socket s);
+	HttpRequest(Socket s, HttpParser* pParser, const WebSocketDeflate::Config* pDeflateConfig = nullptr);
 	virtual ~HttpRequest();
 	static const char HTTP_HEADER_ACCEPT[];
+	static const char HTTP_HEADER_ACCEPT_ENCODING[];
+	static const char HTTP_HEADER_ACCEPT_RANGES[];
 	static const char HTTP_HEADER_ALLOW[];
+	static const char HTTP_HEADER_CACHE_CONTROL[];
 	static const char HTTP_HEADER_CONNECTION[];
+	static const char HTTP_HEADER_CONTENT_ENCODING[];
 	static const char HTTP_HEADER_CONTENT_LENGTH[];
+	static const char HTTP_HEADER_CONTENT_RANGE[];
 	static const char HTTP_HEADER_CONTENT_TYPE[];
 	static const char HTTP_HEADER_COOKIE[];
+	static const char HTTP_HEADER_ETAG[];
+	static const char HTTP_HEADER_EXPECT[];
 	static const char HTTP_HEADER_HOST[];
+	static const char HTTP_HEADER_IF_MODIFIED_SINCE[];
+	static const char HTTP_HEADER_IF_NONE_MATCH[];
+	static const char HTTP_HEADER_IF_RANGE[];
+	static const char HTTP_HEADER_LAST_EVENT_ID[];
 	static const char HTTP_HEADER_LAST_MODIFIED[];
 	static const char HTTP_HEADER_ORIGIN[];
+	static const char HTTP_HEADER_RANGE[];
 	static const char HTTP_HEADER_SEC_WEBSOCKET_ACCEPT[];
+	static const char HTTP_HEADER_SEC_WEBSOCKET_EXTENSIONS[];
 	static const char HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL[];
 	static const char HTTP_HEADER_SEC_WEBSOCKET_KEY[];
 	static const char HTTP_HEADER_SEC_WEBSOCKET_VERSION[];
+	static const char HTTP_HEADER_TRANSFER_ENCODING[];
 	static const char HTTP_HEADER_UPGRADE[];
 	static const char HTTP_HEADER_USER_AGENT[];
+	static const char HTTP_HEADER_VARY[];
 
 	static const char HTTP_METHOD_CONNECT[];
 	static const char HTTP_METHOD_DELETE[];
@@ -47,25 +88,54 @@ public:
 
 	void                               close();                      // Close the connection to the client.
 	void                               dump();                       // Diagnostic dump of the Http request.
+	HttpArena&                         getArena();                   // Get the memory of the request.
 	std::string                        getBody();                    // Get the body of the request.
+	HttpRequestBodyStreambuf*          getBodyStreambuf();           // Get a stream buffer reading the body.
 	std::string                        getHeader(std::string name);  // Get the value of a named header.
 	std::map<std::string, std::string> getHeaders();                 // Get all the headers.
+	std::string_view                   getHeaderView(std::string_view name); // Get the value of a named header without copying it.
 	std::string                        getMethod();                  // Get the request method.
+	std::string_view                   getMethodView();              // Get the request method without copying it.
+	std::string                        getParam(const std::string& name); // Get a parameter taken from the path by the route.
+	std::map<std::string, std::string> getParams();                  // Get all the parameters taken from the path by the route.
 	std::string                        getPath();                    // Get the request path.
+	std::string_view                   getPathView();                // Get the request path without copying it.
 	std::map<std::string, std::string> getQuery();                   // Get the query part of the request.
+	std::string_view                   getQueryValue(std::string_view name); // Get a decoded value of the query.
 	Socket                             getSocket();                  // Get the underlying TCP/IP socket.
 	std::string                        getVersion();                 // Get the HTTP version.
+	std::string_view                   getVersionView();             // Get the HTTP version without copying it.
 	WebSocket*                         getWebSocket();               // Get the WebSocket reference if this is a web socket.
+	bool                               isBodyComplete();             // Has all of the body been read?
 	bool                               isClosed();                   // Has the connection been closed?
+	bool                               isKeepAlive();                // May the connection be reused after the response?
 	bool                               isWebsocket();                // Is this request to create a web socket?
 	std::map<std::string, std::string> parseForm();                  // Parse the body as a form.
+	bool                               parseMultipart(HttpMultipartHandler* pHandler, size_t bufferSize = 1024); // Parse the body as multipart/form-data.
 	std::vector<std::string>           pathSplit();
+	int                                readBody(uint8_t* data, size_t length); // Read some of the body.
+	void                               setKeepAlive(bool keepAlive); // Allow or forbid reuse of the connection.
+	bool                               skipBody(size_t maxLength);   // Read and discard what is left of the body.
 	std::string                        urlDecode(std::string str);   // Decode a URL.
+	std::string_view                   urlDecode(std::string_view str, HttpArena& arena); // Decode a URL into an arena.
 private:
+	friend class HttpServer;
+
 	Socket	  m_clientSocket; // The socket connected to the client.
 	bool		m_isClosed;	 // Is the client connection closed?
-	HttpParser  m_parser;	   // The parse to parse HTTP data.
+	bool		m_keepAlive;	 // Should the connection be kept open after the response?
+	HttpParser* m_pParser;	   // The parser holding the HTTP data.
+	bool		m_ownParser;	 // Was the parser created by this request?
 	WebSocket*  m_pWebSocket;   // A possible reference to a WebSocket object instance.
+	const WebSocketDeflate::Config* m_pDeflateConfig; // The permessage-deflate offered to a WebSocket, null for none.
+	std::map<std::string, std::string> m_params; // Parameters taken from the path by the matching route.
+	bool		m_bodyLoaded;	// Has the body been read into m_body?
+	std::string m_body;		  // The body, once read by getBody().
+	bool		m_continueSent; // Has the client been told to go ahead and send the body?
+	HttpRequestBodyStreambuf* m_pBodyStreambuf; // The stream buffer reading the body, if one was asked for.
+
+	void init();
+	bool isContinueExpected();
 
 };
 
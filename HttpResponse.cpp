@@ -4,36 +4,115 @@
  *  Created on: Sep 2, 2017
  *      Author: kolban
  */
-#include <sstream>
-#include <fstream>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <cstring>
+#include <esp_heap_caps.h>
 #include "HttpRequest.h"
 #include "HttpResponse.h"
+#include "GeneralUtils.h"
 #include <esp_log.h>
+#include <esp_timer.h>
 
 static const char* LOG_TAG = "HttpResponse";
 
 const int HttpResponse::HTTP_STATUS_CONTINUE              = 100;
 const int HttpResponse::HTTP_STATUS_SWITCHING_PROTOCOL    = 101;
 const int HttpResponse::HTTP_STATUS_OK                    = 200;
+const int HttpResponse::HTTP_STATUS_PARTIAL_CONTENT       = 206;
 const int HttpResponse::HTTP_STATUS_MOVED_PERMANENTLY     = 301;
+const int HttpResponse::HTTP_STATUS_NOT_MODIFIED          = 304;
 const int HttpResponse::HTTP_STATUS_BAD_REQUEST           = 400;
 const int HttpResponse::HTTP_STATUS_UNAUTHORIZED          = 401;
 const int HttpResponse::HTTP_STATUS_FORBIDDEN             = 403;
 const int HttpResponse::HTTP_STATUS_NOT_FOUND             = 404;
 const int HttpResponse::HTTP_STATUS_METHOD_NOT_ALLOWED    = 405;
+const int HttpResponse::HTTP_STATUS_REQUEST_TIMEOUT       = 408;
+const int HttpResponse::HTTP_STATUS_PAYLOAD_TOO_LARGE     = 413;
+const int HttpResponse::HTTP_STATUS_RANGE_NOT_SATISFIABLE = 416;
+const int HttpResponse::HTTP_STATUS_TOO_MANY_REQUESTS     = 429;
+const int HttpResponse::HTTP_STATUS_HEADER_FIELDS_TOO_LARGE = 431;
 const int HttpResponse::HTTP_STATUS_INTERNAL_SERVER_ERROR = 500;
 const int HttpResponse::HTTP_STATUS_NOT_IMPLEMENTED       = 501;
 const int HttpResponse::HTTP_STATUS_SERVICE_UNAVAILABLE   = 503;
 
 static std::string lineTerminator = "\r\n";
+
+// The boundary between the parts of a multipart/byteranges body.
+static const char byteRangesBoundary[] = "3d6b6a416f9b5d2a";
+
+// The buffer in which the current task reads files.  See HttpResponse::getFileBuffer().
+static thread_local uint8_t* t_fileBuffer     = nullptr;
+static thread_local size_t   t_fileBufferSize = 0;
+
+// The media types of files by extension.
+static const struct {
+	const char* extension;
+	const char* contentType;
+} contentTypes[] = {
+	{ "html",  "text/html" },
+	{ "htm",   "text/html" },
+	{ "css",   "text/css" },
+	{ "js",    "application/javascript" },
+	{ "mjs",   "application/javascript" },
+	{ "json",  "application/json" },
+	{ "map",   "application/json" },
+	{ "txt",   "text/plain" },
+	{ "csv",   "text/csv" },
+	{ "xml",   "text/xml" },
+	{ "svg",   "image/svg+xml" },
+	{ "png",   "image/png" },
+	{ "jpg",   "image/jpeg" },
+	{ "jpeg",  "image/jpeg" },
+	{ "gif",   "image/gif" },
+	{ "webp",  "image/webp" },
+	{ "ico",   "image/x-icon" },
+	{ "woff",  "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "ttf",   "font/ttf" },
+	{ "wasm",  "application/wasm" },
+	{ "pdf",   "application/pdf" },
+	{ "zip",   "application/zip" },
+	{ "mp3",   "audio/mpeg" },
+	{ "wav",   "audio/wav" },
+	{ "mp4",   "video/mp4" }
+};
+
+// Precompressed versions of a file that may be sent instead of the file, in order of preference.
+static const struct {
+	const char* encoding;    // The content coding.
+	const char* extension;   // Appended to the name of the file to give the name of the precompressed file.
+} sidecars[] = {
+	{ "br",   ".br" },
+	{ "gzip", ".gz" }
+};
+
 HttpResponse::HttpResponse(HttpRequest* request) {
 	m_request = request;
 	m_status  = 200;
 	m_headerCommitted = false; // We have not yet sent a header.
+	m_headerPending   = false;
+	m_headerLength    = 0;
+	m_bytesSent       = 0;
+	m_sendTime        = 0;
+	m_isClosed  = false;
+	m_isDetached = false;
+	m_keepAlive = false;
+	m_chunked   = false;
+	m_pChunkBuffer    = nullptr;
+	m_chunkBufferSize = 0;
+	m_chunkLength     = 0;
+	m_pBodyCapture    = nullptr;
+	m_maxBodyCapture  = 0;
+	m_bodyCaptured    = false;
 }
 
 
 HttpResponse::~HttpResponse() {
+	delete[] m_pChunkBuffer;
 }
 
 
@@ -49,20 +128,197 @@ void HttpResponse::addHeader(const std::string name, const std::string value) {
 } // addHeader
 
 
+/**
+ * @brief Start streaming a body of unknown length.
+ * The header is sent with "Transfer-Encoding: chunked" and what is then passed to write() (or sendData())
+ * is sent as chunks.  Small writes are collected in a buffer so that each chunk is a reasonable size.
+ * The body is completed with end() (or close()).  Because the client can find the end of the body, the
+ * connection can be reused.  An HTTP/1.0 client doesn't understand chunks so for it the body is sent as
+ * is and the connection closed at the end.
+ *
+ * Example:
+ * @code{.cpp}
+ * pResponse->addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, "application/json");
+ * pResponse->beginChunked();
+ * pResponse->write("[");
+ * ... // pResponse->write() each entry.
+ * pResponse->write("]");
+ * pResponse->end();
+ * @endcode
+ * @param [in] bufferSize The size of the buffer collecting small writes.
+ */
+void HttpResponse::beginChunked(size_t bufferSize) {
+	if (m_headerCommitted) {
+		ESP_LOGE(LOG_TAG, "beginChunked: The header has already been sent");
+		return;
+	}
+	m_responseHeaders.erase(HttpRequest::HTTP_HEADER_CONTENT_LENGTH);
+	if (m_request->getVersionView() != "HTTP/1.1") {   // The end of the body is marked by closing the connection.
+		m_responseHeaders.erase(HttpRequest::HTTP_HEADER_CONNECTION);
+		addHeader(HttpRequest::HTTP_HEADER_CONNECTION, "close");
+		sendHeader();
+		return;
+	}
+	addHeader(HttpRequest::HTTP_HEADER_TRANSFER_ENCODING, "chunked");
+	m_chunkBufferSize = std::max(bufferSize, (size_t) 16);
+	m_pChunkBuffer    = new uint8_t[CHUNK_HEADER_SIZE + m_chunkBufferSize + 2];
+	m_chunkLength     = 0;
+	m_chunked         = true;
+	sendHeader();
+} // beginChunked
+
+
+/**
+ * @brief Serialize the status line and headers.
+ * The header is written into the buffer without allocating.  When it doesn't fit, pLength still
+ * receives the length it needs so that the caller can provide a larger buffer.
+ * @param [in] buffer The buffer to write into.
+ * @param [in] size The size of the buffer.
+ * @param [out] pLength The length of the header.
+ * @return True if the header fit in the buffer.
+ */
+bool HttpResponse::buildHeader(char* buffer, size_t size, size_t* pLength) {
+	size_t length = 0;
+	auto append = [&](const char* data, size_t dataLength) {
+		if (length + dataLength <= size) {
+			::memcpy(buffer + length, data, dataLength);
+		}
+		length += dataLength;
+	};
+	std::string_view version = m_request->getVersionView();
+	char status[16];
+	append(version.data(), version.length());
+	append(status, snprintf(status, sizeof(status), " %d ", m_status));
+	append(m_statusMessage.data(), m_statusMessage.length());
+	append("\r\n", 2);
+	for (auto it = m_responseHeaders.begin(); it != m_responseHeaders.end(); ++it) {
+		append(it->first.data(), it->first.length());
+		append(": ", 2);
+		append(it->second.data(), it->second.length());
+		append("\r\n", 2);
+	}
+	append("\r\n", 2);
+	*pLength = length;
+	return length <= size;
+} // buildHeader
+
+
+/**
+ * @brief Copy data of the body for setBodyCapture().
+ * The copy stops, and is incomplete, once the body is larger than the limit.
+ * @param [in] pData The data.
+ * @param [in] size The size of the data.
+ */
+void HttpResponse::captureBody(const uint8_t* pData, size_t size) {
+	if (m_pBodyCapture == nullptr) return;
+	if (m_pBodyCapture->length() + size > m_maxBodyCapture) {
+		m_pBodyCapture->clear();
+		m_pBodyCapture = nullptr;
+		m_bodyCaptured = false;
+		return;
+	}
+	m_pBodyCapture->append((const char*) pData, size);
+} // captureBody
+
+
 /**
  * @brief Close the response.
- * We close the response.  If we haven't yet sent the header, we send that now and then close
- * the socket.
+ * We close the response.  If we haven't yet sent the header, we send that now.  If the connection
+ * can't be reused for a further request (see isKeepAlive()) we then close the socket.  Closing a
+ * response that has already been closed does nothing.
  */
 void HttpResponse::close() {
-	// If we haven't yet sent the header of the data, send that now.
+	if (m_isClosed) return;
+	// If we haven't yet sent the header of the data, send that now.  As no data was sent,
+	// we know that the body is empty.
 	if (!m_headerCommitted) {
+		if (hasBody() && getHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH).empty()) {
+			addHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH, "0");
+		}
 		sendHeader();
 	}
-	m_request->close();
+	if (m_chunked) {   // Send what is left of the body and the last (empty) chunk.
+		flushChunk();
+		if (!m_request->isClosed()) {
+			struct iovec iov[2];
+			iov[1].iov_base = (void*) "0\r\n\r\n";
+			iov[1].iov_len  = 5;
+			sendv(iov, 2);
+		}
+		m_chunked = false;
+	}
+	if (m_headerPending && !m_request->isClosed()) {   // No body was sent.
+		struct iovec iov[1];
+		sendv(iov, 1);
+	}
+	m_isClosed = true;
+	if (!m_keepAlive) {
+		m_request->close();
+	}
 } // close
 
 
+/**
+ * @brief Complete the response but leave the connection open.
+ * The header is sent if it hasn't been.  The server then neither closes the connection nor reads a
+ * further request from it: whoever called detach() owns the connection, for example an HttpEventStream
+ * that holds it open to write events to.
+ */
+void HttpResponse::detach() {
+	if (m_isClosed) return;
+	if (!m_headerCommitted) {
+		sendHeader();
+	}
+	if (m_headerPending && !m_request->isClosed()) {
+		struct iovec iov[1];
+		sendv(iov, 1);
+	}
+	m_isClosed   = true;
+	m_isDetached = true;
+} // detach
+
+
+/**
+ * @brief Complete a body started with beginChunked().
+ * This is the same as close().
+ */
+void HttpResponse::end() {
+	close();
+} // end
+
+
+/**
+ * @brief Send the chunk collected in the buffer.
+ * The size line and the terminating CRLF are written around the data in the buffer so that the
+ * chunk is sent with a single send.
+ */
+void HttpResponse::flushChunk() {
+	if (m_chunkLength == 0 || m_request->isClosed()) {
+		m_chunkLength = 0;
+		return;
+	}
+	char sizeLine[CHUNK_HEADER_SIZE + 1];
+	int length = snprintf(sizeLine, sizeof(sizeLine), "%x\r\n", (unsigned int) m_chunkLength);
+	uint8_t* pStart = m_pChunkBuffer + CHUNK_HEADER_SIZE - length;
+	::memcpy(pStart, sizeLine, length);
+	::memcpy(m_pChunkBuffer + CHUNK_HEADER_SIZE + m_chunkLength, "\r\n", 2);
+	struct iovec iov[2];
+	iov[1].iov_base = pStart;
+	iov[1].iov_len  = length + m_chunkLength + 2;
+	sendv(iov, 2);
+	m_chunkLength = 0;
+} // flushChunk
+
+
+/**
+ * @brief Get the number of bytes of the response sent so far, header included.
+ * @return The number of bytes sent.
+ */
+size_t HttpResponse::getBytesSent() {
+	return m_bytesSent;
+} // getBytesSent
+
+
 /**
  * @brief Get the value of the named header.
  * @param [in] name The name of the header for which the value is to be returned.
@@ -74,11 +330,268 @@ std::string HttpResponse::getHeader(std::string name) {
 } // getHeader
 
 
+/**
+ * @brief Format the Content-Range header of a part of a file.
+ * @param [in] range The part of the file.
+ * @param [in] size The size of the file.
+ * @return The value of the header.
+ */
+std::string HttpResponse::contentRange(const Range& range, size_t size) {
+	return "bytes " + std::to_string(range.offset) + "-" + std::to_string(range.offset + range.length - 1) + "/" + std::to_string(size);
+} // contentRange
+
+
+/**
+ * @brief Get the media type of a file from its extension.
+ * @param [in] fileName The name of the file.
+ * @return The media type.  Files of unknown type are application/octet-stream.
+ */
+std::string HttpResponse::getContentType(const std::string& fileName) {
+	size_t dot = fileName.find_last_of("./");
+	if (dot != std::string::npos && fileName[dot] == '.') {
+		std::string extension = fileName.substr(dot + 1);
+		GeneralUtils::toLower(extension);
+		for (size_t i = 0; i < sizeof(contentTypes) / sizeof(contentTypes[0]); i++) {
+			if (extension == contentTypes[i].extension) {
+				return contentTypes[i].contentType;
+			}
+		}
+	}
+	return "application/octet-stream";
+} // getContentType
+
+
+/**
+ * @brief Get the buffer in which the calling task reads files.
+ * The buffer is allocated the first time a task sends a file and kept so that a server task doesn't
+ * allocate a buffer for each request.  It is DMA capable so that the file system can read whole
+ * sectors straight into it.  If there isn't the memory, the allocation is tried again next time.
+ * @param [in] size The size of the buffer needed.
+ * @return The buffer or nullptr if it couldn't be allocated.
+ */
+uint8_t* HttpResponse::getFileBuffer(size_t size) {
+	if (t_fileBufferSize < size) {
+		releaseFileBuffer();
+		t_fileBuffer = (uint8_t*) ::heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+		if (t_fileBuffer == nullptr) {   // There isn't enough DMA capable memory, any memory will do.
+			t_fileBuffer = (uint8_t*) ::malloc(size);
+		}
+		if (t_fileBuffer == nullptr) {
+			ESP_LOGE(LOG_TAG, "getFileBuffer: Unable to allocate %d bytes", size);
+			return nullptr;
+		}
+		t_fileBufferSize = size;
+	}
+	return t_fileBuffer;
+} // getFileBuffer
+
+
 std::map<std::string, std::string> HttpResponse::getHeaders() {
 	return m_responseHeaders;
 } // getHeaders
 
 
+/**
+ * @brief Get the time spent sending the response so far.
+ * @return The time in microseconds.
+ */
+uint32_t HttpResponse::getSendTime() {
+	return m_sendTime;
+} // getSendTime
+
+
+int HttpResponse::getStatus() {
+	return m_status;
+} // getStatus
+
+
+std::string HttpResponse::getStatusMessage() {
+	return m_statusMessage;
+} // getStatusMessage
+
+
+/**
+ * @brief Determine if the response may have a body.
+ * @return False for a status that never has a body.
+ */
+bool HttpResponse::hasBody() {
+	return m_status != HTTP_STATUS_NOT_MODIFIED;
+} // hasBody
+
+
+/**
+ * @brief Determine if all of the body sent so far has been copied by setBodyCapture().
+ * @return False if no copy was asked for, the body was too large or it was sent from a file.
+ */
+bool HttpResponse::isBodyCaptured() {
+	return m_bodyCaptured;
+} // isBodyCaptured
+
+
+/**
+ * @brief Determine if the connection has been handed over by detach().
+ * @return True if the server should leave the connection alone.
+ */
+bool HttpResponse::isDetached() {
+	return m_isDetached;
+} // isDetached
+
+
+/**
+ * @brief Determine if the response has been completed.
+ * @return True if close() has been called.
+ */
+bool HttpResponse::isClosed() {
+	return m_isClosed;
+} // isClosed
+
+
+/**
+ * @brief Determine if the client accepts a content coding.
+ * A coding is accepted if the Accept-Encoding header of the request lists it (or "*") without a
+ * quality of 0.
+ * @param [in] encoding The content coding, for example "gzip".
+ * @return True if the client accepts the coding.
+ */
+bool HttpResponse::isEncodingAccepted(const std::string& encoding) {
+	std::vector<std::string> codings = GeneralUtils::split(m_request->getHeader(HttpRequest::HTTP_HEADER_ACCEPT_ENCODING), ',');
+	for (auto it = codings.begin(); it != codings.end(); ++it) {
+		std::vector<std::string> parts = GeneralUtils::split(*it, ';');
+		if (parts.empty()) continue;   // An empty element of the list, as in "gzip,,br".
+		std::string name = parts[0];
+		GeneralUtils::toLower(name);
+		if (name != encoding && name != "*") continue;
+		for (size_t i = 1; i < parts.size(); i++) {
+			bool isQuality = parts[i].length() >= 2 && ::tolower((unsigned char) parts[i][0]) == 'q' && parts[i][1] == '=';
+			if (isQuality && std::atof(parts[i].c_str() + 2) == 0) {
+				return false;   // The client explicitly refuses the coding.
+			}
+		}
+		return true;
+	}
+	return false;
+} // isEncodingAccepted
+
+
+/**
+ * @brief Get the parts of a file requested by the Range header.
+ * Only byte ranges are understood.  The Range header is ignored (and the whole file sent) when it is
+ * malformed, asks for too many parts or an If-Range header says the client's copy is out of date.
+ * Parts that overlap or touch are merged.
+ * @param [in] size The size of the file.
+ * @param [in] etag The entity tag of the file.
+ * @param [in] lastModified The modification date of the file as sent in Last-Modified.
+ * @param [out] ranges The parts of the file to send, in order.  Empty if the whole file is to be sent.
+ * @return False if none of the requested parts are within the file.
+ */
+bool HttpResponse::getRanges(size_t size, const std::string& etag, const std::string& lastModified, std::vector<Range>& ranges) {
+	ranges.clear();
+	std::string range = m_request->getHeader(HttpRequest::HTTP_HEADER_RANGE);
+	if (range.compare(0, 6, "bytes=") != 0) {
+		return true;
+	}
+	std::string ifRange = m_request->getHeader(HttpRequest::HTTP_HEADER_IF_RANGE);
+	if (!ifRange.empty() && ifRange != etag && ifRange != lastModified) {
+		return true;
+	}
+
+	std::vector<std::string> specs = GeneralUtils::split(range.substr(6), ',');
+	if (specs.size() > MAX_RANGES) {
+		return true;
+	}
+	for (auto it = specs.begin(); it != specs.end(); ++it) {
+		size_t dash = it->find('-');
+		if (dash == std::string::npos || it->find_first_not_of("0123456789-") != std::string::npos) {
+			ranges.clear();
+			return true;   // Malformed, so we ignore the header.
+		}
+		std::string first = it->substr(0, dash);
+		std::string last  = it->substr(dash + 1);
+		Range part;
+		if (first.empty()) {                 // The last bytes of the file.
+			if (last.empty()) {
+				ranges.clear();
+				return true;
+			}
+			size_t suffix = std::strtoul(last.c_str(), nullptr, 10);
+			if (suffix == 0 || size == 0) continue;
+			part.offset = (suffix < size) ? size - suffix : 0;
+			part.length = size - part.offset;
+		} else {
+			part.offset = std::strtoul(first.c_str(), nullptr, 10);
+			size_t end  = last.empty() ? size - 1 : std::strtoul(last.c_str(), nullptr, 10);
+			if (!last.empty() && end < part.offset) {
+				ranges.clear();
+				return true;
+			}
+			if (part.offset >= size) continue;   // Not satisfiable.
+			part.length = std::min(end, size - 1) - part.offset + 1;
+		}
+		ranges.push_back(part);
+	}
+	if (ranges.empty()) {
+		return false;
+	}
+
+	std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.offset < b.offset; });
+	size_t merged = 0;
+	for (size_t i = 1; i < ranges.size(); i++) {
+		Range& previous = ranges[merged];
+		if (ranges[i].offset <= previous.offset + previous.length) {
+			previous.length = std::max(previous.offset + previous.length, ranges[i].offset + ranges[i].length) - previous.offset;
+		} else {
+			ranges[++merged] = ranges[i];
+		}
+	}
+	ranges.resize(merged + 1);
+	if (ranges.size() == 1 && ranges[0].offset == 0 && ranges[0].length == size) {
+		ranges.clear();   // The whole file.
+	}
+	return true;
+} // getRanges
+
+
+/**
+ * @brief Determine if the client already holds the current version of a file.
+ * The conditional headers of the request are compared with the validators of the file.  As in
+ * RFC7232, If-None-Match takes precedence over If-Modified-Since.  We only honor If-Modified-Since
+ * when it carries exactly the date we sent as Last-Modified, which is what clients do.
+ * @param [in] etag The entity tag of the file.
+ * @param [in] lastModified The modification date of the file as sent in Last-Modified.
+ * @return True if the client's copy is current and a 304 response may be sent.
+ */
+bool HttpResponse::isNotModified(const std::string& etag, const std::string& lastModified) {
+	std::string ifNoneMatch = m_request->getHeader(HttpRequest::HTTP_HEADER_IF_NONE_MATCH);
+	if (!ifNoneMatch.empty()) {
+		std::vector<std::string> tags = GeneralUtils::split(ifNoneMatch, ',');
+		for (auto it = tags.begin(); it != tags.end(); ++it) {
+			std::string tag = *it;
+			if (tag.compare(0, 2, "W/") == 0) {   // If-None-Match uses the weak comparison.
+				tag = tag.substr(2);
+			}
+			if (tag == "*" || tag == etag) {
+				return true;
+			}
+		}
+		return false;
+	}
+	std::string ifModifiedSince = m_request->getHeader(HttpRequest::HTTP_HEADER_IF_MODIFIED_SINCE);
+	return !ifModifiedSince.empty() && ifModifiedSince == lastModified;
+} // isNotModified
+
+
+/**
+ * @brief Determine if the connection will be reused after this response.
+ * A connection can only be kept open if the client asked for it and the end of the response body
+ * can be found by the client without the connection being closed.  This means that the response
+ * must carry a Content-Length header.  The decision is made when the header is sent.
+ * @return True if the connection will be kept open.
+ */
+bool HttpResponse::isKeepAlive() {
+	return m_keepAlive;
+} // isKeepAlive
+
+
 /**
  * @brief Send data to the partner.
  * Send some data to the partner.  If we haven't yet sent the HTTP header then send that now.  We can call this function
@@ -87,8 +600,11 @@ std::map<std::string, std::string> HttpResponse::getHeaders() {
  */
 void HttpResponse::sendData(std::string data) {
 	ESP_LOGD(LOG_TAG, ">> sendData");
+	if (!m_chunked && !m_isClosed) {   // A chunked body is copied by write().
+		captureBody((const uint8_t*) data.data(), data.length());
+	}
 	// If the request is already closed, nothing further to do.
-	if (m_request->isClosed()) {
+	if (m_isClosed || m_request->isClosed()) {
 		ESP_LOGE(LOG_TAG, "<< sendData: Request to send more data but the request/response is already closed");
 		return;
 	}
@@ -99,14 +615,24 @@ void HttpResponse::sendData(std::string data) {
 	}
 
 	// Send the payload data.
-	m_request->getSocket().send(data);
+	if (m_chunked) {
+		write((const uint8_t*) data.data(), data.length());
+		return;
+	}
+	struct iovec iov[2];
+	iov[1].iov_base = (void*) data.data();
+	iov[1].iov_len  = data.length();
+	sendv(iov, 2);
 	ESP_LOGD(LOG_TAG, "<< sendData");
 } // sendData
 
 void HttpResponse::sendData(uint8_t* pData, size_t size) {
 	ESP_LOGD(LOG_TAG, ">> sendData: 0x%x, size: %d", (uint32_t) pData, size);
+	if (!m_chunked && !m_isClosed) {   // A chunked body is copied by write().
+		captureBody(pData, size);
+	}
 	// If the request is already closed, nothing further to do.
-	if (m_request->isClosed()) {
+	if (m_isClosed || m_request->isClosed()) {
 		ESP_LOGE(LOG_TAG, "<< sendData: Request to send more data but the request/response is already closed");
 		return;
 	}
@@ -117,58 +643,350 @@ void HttpResponse::sendData(uint8_t* pData, size_t size) {
 	}
 
 	// Send the payload data.
-	m_request->getSocket().send(pData, size);
+	if (m_chunked) {
+		write(pData, size);
+		return;
+	}
+	struct iovec iov[2];
+	iov[1].iov_base = pData;
+	iov[1].iov_len  = size;
+	sendv(iov, 2);
 	ESP_LOGD(LOG_TAG, "<< sendData");
 } // sendData
 
-void HttpResponse::sendFile(std::string fileName, size_t bufSize) {
-	ESP_LOGI(LOG_TAG, "Opening file: %s", fileName.c_str());
-	std::ifstream ifStream;
-	ifStream.open(fileName, std::ifstream::in | std::ifstream::binary);      // Attempt to open the file for reading.
+/**
+ * @brief Stream data to the client.
+ * After beginChunked(), the data is collected into chunks.  Otherwise this is the same as sendData().
+ * @param [in] data The data to send.
+ */
+void HttpResponse::write(const std::string& data) {
+	write((const uint8_t*) data.data(), data.length());
+} // write
+
+
+/**
+ * @brief Stream data to the client.
+ * After beginChunked(), the data is collected into chunks.  Data that doesn't fit in the buffer is sent
+ * as a chunk of its own.  Otherwise this is the same as sendData().
+ * @param [in] pData The data to send.
+ * @param [in] size The size of the data.
+ */
+void HttpResponse::write(const uint8_t* pData, size_t size) {
+	if (!m_chunked) {
+		sendData((uint8_t*) pData, size);
+		return;
+	}
+	if (!m_isClosed) {
+		captureBody(pData, size);
+	}
+	if (m_isClosed || m_request->isClosed()) {
+		ESP_LOGE(LOG_TAG, "write: Request to send more data but the request/response is already closed");
+		return;
+	}
+	if (size == 0) return;   // An empty chunk would end the body.
+	if (m_chunkLength + size > m_chunkBufferSize) {
+		flushChunk();
+	}
+	if (size < m_chunkBufferSize) {
+		::memcpy(m_pChunkBuffer + CHUNK_HEADER_SIZE + m_chunkLength, pData, size);
+		m_chunkLength += size;
+		return;
+	}
+	char sizeLine[CHUNK_HEADER_SIZE + 1];
+	struct iovec iov[4];
+	iov[1].iov_base = sizeLine;
+	iov[1].iov_len  = snprintf(sizeLine, sizeof(sizeLine), "%x\r\n", (unsigned int) size);
+	iov[2].iov_base = (void*) pData;
+	iov[2].iov_len  = size;
+	iov[3].iov_base = (void*) "\r\n";
+	iov[3].iov_len  = 2;
+	sendv(iov, 4);
+} // write
 
-	// If we failed to open the requested file, then it probably didn't exist so return a not found.
-	if (!ifStream.is_open()) {
+
+/**
+ * @brief Send the content of a file as the response.
+ * The response carries ETag and Last-Modified validators and is answered with 304 Not Modified when
+ * the client's copy is current.  If the client accepts it, a precompressed version of the file
+ * ("file.br" or "file.gz") is sent in place of the file.  Unless already set, the Content-Type is
+ * taken from the extension of the file.
+ * @param [in] fileName The name of the file.
+ * @param [in] bufSize The size of the buffer used to read the file.
+ * @param [in] pCache If not null, a cache from which small files are served.
+ */
+void HttpResponse::sendFile(std::string fileName, size_t bufSize, HttpFileCache* pCache) {
+	ESP_LOGI(LOG_TAG, "Opening file: %s", fileName.c_str());
+	setBodyCapture(nullptr, 0);   // Files are validated and cached by HttpFileCache instead.
+	std::string contentType = getContentType(fileName);
+	std::string encoding;
+	struct stat statBuf;
+	if (!selectFile(fileName, &statBuf, encoding)) {
 		ESP_LOGE(LOG_TAG, "Unable to open file %s for reading", fileName.c_str());
-		setStatus(HttpResponse::HTTP_STATUS_NOT_FOUND, "Not Found");
-		addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, "text/plain");
-		sendData("Not Found");
+		sendNotFound();
+		return; // Since there is no such file, no further work to be done.
+	}
+	if (getHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE).empty()) {
+		addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, contentType);
+	}
+	if (!encoding.empty()) {
+		addHeader(HttpRequest::HTTP_HEADER_CONTENT_ENCODING, encoding);
+	}
+
+	// The validators of the file let the client ask whether its copy is still current.  The entity tag
+	// is made from the size and modification time of the file so it changes whenever the file does.
+	// Each coding of the file is a different representation and so has its own tag.
+	char etag[48];
+	snprintf(etag, sizeof(etag), "\"%lx-%lx%s%s\"", (unsigned long) statBuf.st_size, (unsigned long) statBuf.st_mtime,
+		encoding.empty() ? "" : "-", encoding.c_str());
+	char lastModified[32];
+	struct tm tmBuf;
+	strftime(lastModified, sizeof(lastModified), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&statBuf.st_mtime, &tmBuf));
+	addHeader(HttpRequest::HTTP_HEADER_ETAG, etag);
+	addHeader(HttpRequest::HTTP_HEADER_LAST_MODIFIED, lastModified);
+
+	if (isNotModified(etag, lastModified)) {
+		ESP_LOGD(LOG_TAG, "File %s not modified", fileName.c_str());
+		if (pCache != nullptr) {
+			pCache->recordNotModified(statBuf.st_size);
+		}
+		setStatus(HttpResponse::HTTP_STATUS_NOT_MODIFIED, "Not Modified");
 		close();
-		return; // Since we failed to open the file, no further work to be done.
+		return;
 	}
 
-	// We now have an open file and want to push the content of that file through to the browser.
-	// because of defect #252 we have to do some pretty important re-work here.  Specifically, we can't host the whole file in
-	// RAM at one time.  Instead what we have to do is ensure that we only have enough data in RAM to be sent.
+	addHeader(HttpRequest::HTTP_HEADER_ACCEPT_RANGES, "bytes");
+	std::vector<Range> ranges;
+	if (!getRanges(statBuf.st_size, etag, lastModified, ranges)) {
+		setStatus(HttpResponse::HTTP_STATUS_RANGE_NOT_SATISFIABLE, "Range Not Satisfiable");
+		addHeader(HttpRequest::HTTP_HEADER_CONTENT_RANGE, "bytes */" + std::to_string(statBuf.st_size));
+		close();
+		return;
+	}
 
-	setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
-	uint8_t *pData = new uint8_t[bufSize];
-	while (!ifStream.eof()) {
-		ifStream.read((char*) pData, bufSize);
-		sendData(pData, ifStream.gcount());
+	// Small files may be served from the cache rather than the file system.
+	std::shared_ptr<const std::string> cached = (pCache != nullptr) ? pCache->get(fileName, statBuf) : nullptr;
+	int fd = -1;
+	if (!cached) {
+		fd = ::open(fileName.c_str(), O_RDONLY);   // Attempt to open the file for reading.
+		if (fd < 0) {                              // If we failed to open the requested file, then return a not found.
+			ESP_LOGE(LOG_TAG, "Unable to open file %s for reading", fileName.c_str());
+			m_responseHeaders.clear();
+			sendNotFound();
+			return;   // Since we failed to open the file, no further work to be done.
+		}
+		if (getFileBuffer(bufSize) == nullptr) {   // Fail before anything is sent.
+			::close(fd);
+			m_responseHeaders.clear();
+			setStatus(HttpResponse::HTTP_STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error");
+			addHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH, "0");
+			close();
+			return;
+		}
+	}
+
+	// Telling the client the size of the body lets it find the end of the body without us having to
+	// close the connection which can then be reused for further requests.
+	if (ranges.empty()) {                // The whole file.
+		addHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH, std::to_string(statBuf.st_size));
+		setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
+		sendFileData(fd, cached.get(), 0, statBuf.st_size, bufSize);
+	} else if (ranges.size() == 1) {     // A single part of the file.
+		addHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH, std::to_string(ranges[0].length));
+		addHeader(HttpRequest::HTTP_HEADER_CONTENT_RANGE, contentRange(ranges[0], statBuf.st_size));
+		setStatus(HttpResponse::HTTP_STATUS_PARTIAL_CONTENT, "Partial Content");
+		sendFileData(fd, cached.get(), ranges[0].offset, ranges[0].length, bufSize);
+	} else {                             // Several parts of the file, each sent as a part of a multipart body.
+		std::string contentType = getHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE);
+		std::vector<std::string> partHeaders;
+		size_t contentLength = 0;
+		for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+			partHeaders.push_back(lineTerminator + "--" + byteRangesBoundary + lineTerminator +
+				HttpRequest::HTTP_HEADER_CONTENT_TYPE + ": " + contentType + lineTerminator +
+				HttpRequest::HTTP_HEADER_CONTENT_RANGE + ": " + contentRange(*it, statBuf.st_size) + lineTerminator + lineTerminator);
+			contentLength += partHeaders.back().length() + it->length;
+		}
+		std::string trailer = lineTerminator + "--" + byteRangesBoundary + "--" + lineTerminator;
+		contentLength += trailer.length();
+
+		m_responseHeaders.erase(HttpRequest::HTTP_HEADER_CONTENT_TYPE);
+		addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, std::string("multipart/byteranges; boundary=") + byteRangesBoundary);
+		addHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH, std::to_string(contentLength));
+		setStatus(HttpResponse::HTTP_STATUS_PARTIAL_CONTENT, "Partial Content");
+		for (size_t i = 0; i < ranges.size(); i++) {
+			sendData(partHeaders[i]);
+			sendFileData(fd, cached.get(), ranges[i].offset, ranges[i].length, bufSize);
+		}
+		sendData(trailer);
+	}
+	if (fd >= 0) {
+		::close(fd);
 	}
-	delete[] pData;
-	ifStream.close();
 	close();
 } // sendFile
 
+/**
+ * @brief Choose the representation of a file to send.
+ * If the client accepts it, a precompressed version of the file is preferred to the file itself.  The
+ * plain file doesn't have to exist when a precompressed version does.
+ * @param [in,out] fileName The name of the requested file.  On return, the name of the file to send.
+ * @param [out] pStatBuf The status of the file to send.
+ * @param [out] encoding The content coding of the file to send.  Empty for the plain file.
+ * @return False if there is nothing to send.
+ */
+bool HttpResponse::selectFile(std::string& fileName, struct stat* pStatBuf, std::string& encoding) {
+	encoding = "";
+	if (!m_request->getHeaderView(HttpRequest::HTTP_HEADER_ACCEPT_ENCODING).empty()) {
+		bool hasSidecar = false;
+		for (size_t i = 0; i < sizeof(sidecars) / sizeof(sidecars[0]); i++) {
+			std::string sidecarName = fileName + sidecars[i].extension;
+			if (stat(sidecarName.c_str(), pStatBuf) != 0 || !S_ISREG(pStatBuf->st_mode)) continue;
+			hasSidecar = true;
+			if (isEncodingAccepted(sidecars[i].encoding)) {
+				ESP_LOGD(LOG_TAG, "Sending %s in place of %s", sidecarName.c_str(), fileName.c_str());
+				addHeader(HttpRequest::HTTP_HEADER_VARY, HttpRequest::HTTP_HEADER_ACCEPT_ENCODING);
+				fileName = sidecarName;
+				encoding = sidecars[i].encoding;
+				return true;
+			}
+		}
+		if (hasSidecar) {   // What we send depends on what the client accepts.
+			addHeader(HttpRequest::HTTP_HEADER_VARY, HttpRequest::HTTP_HEADER_ACCEPT_ENCODING);
+		}
+	}
+	return stat(fileName.c_str(), pStatBuf) == 0 && S_ISREG(pStatBuf->st_mode);
+} // selectFile
+
+
+/**
+ * @brief Send part of a file.
+ * We can't afford to hold a large file in RAM (defect #252) so the file is read and sent a buffer at a
+ * time.  The buffer belongs to the calling task and is kept for the next file the task sends.
+ * @param [in] fd The open file.  Not used if the content is cached.
+ * @param [in] pCached The content of the file if it is cached, otherwise nullptr.
+ * @param [in] offset The offset of the first byte to send.
+ * @param [in] length The number of bytes to send.
+ * @param [in] bufSize The size of the buffer used to read the file.
+ */
+void HttpResponse::sendFileData(int fd, const std::string* pCached, size_t offset, size_t length, size_t bufSize) {
+	if (pCached != nullptr) {
+		sendData((uint8_t*) pCached->data() + offset, length);
+		return;
+	}
+	if (::lseek(fd, offset, SEEK_SET) != (off_t) offset) {
+		ESP_LOGE(LOG_TAG, "sendFileData: Unable to seek to %d", offset);
+		m_request->close();   // We can't send what we said we would send.
+		return;
+	}
+	uint8_t* pData = getFileBuffer(bufSize);
+	if (pData == nullptr) {
+		m_request->close();   // We can't send what we said we would send.
+		return;
+	}
+	while (length > 0) {
+		ssize_t rc = ::read(fd, pData, std::min(length, bufSize));
+		if (rc <= 0) {
+			ESP_LOGE(LOG_TAG, "sendFileData: Read failed: %d", rc);
+			m_request->close();   // We can't send what we said we would send.
+			return;
+		}
+		sendData(pData, rc);
+		length -= rc;
+	}
+} // sendFileData
+
+
+/**
+ * @brief Answer that the requested file doesn't exist.
+ */
+void HttpResponse::sendNotFound() {
+	setStatus(HttpResponse::HTTP_STATUS_NOT_FOUND, "Not Found");
+	addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, "text/plain");
+	addHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH, "9");
+	sendData("Not Found");
+	close();
+} // sendNotFound
+
+
+/**
+ * @brief Free the buffer in which the calling task reads files.
+ * Called by a task that sent files before it ends.
+ */
+void HttpResponse::releaseFileBuffer() {
+	::free(t_fileBuffer);
+	t_fileBuffer     = nullptr;
+	t_fileBufferSize = 0;
+} // releaseFileBuffer
+
+
 /**
  * @brief Send the header
  */
 void HttpResponse::sendHeader() {
 	// If we haven't yet sent the header of the data, send that now.
 	if (!m_headerCommitted) {
-		std::ostringstream oss;
-		oss << m_request->getVersion() << " " << m_status << " " << m_statusMessage << lineTerminator;
-		for (auto it = m_responseHeaders.begin(); it != m_responseHeaders.end(); ++it) {
-			oss << it->first.c_str() << ": " << it->second.c_str() << lineTerminator;
+		// Switching protocols (WebSocket upgrade) manages its own Connection header.  Otherwise we keep
+		// the connection open only if the client wants that and the length of the body is known.
+		if (m_status >= 200) {
+			auto connection = m_responseHeaders.find(HttpRequest::HTTP_HEADER_CONNECTION);
+			m_keepAlive = m_request->isKeepAlive() &&
+				(connection == m_responseHeaders.end() || !HttpParser::equalsIgnoreCase(connection->second, "close")) &&
+				(!hasBody() || m_chunked || m_responseHeaders.count(HttpRequest::HTTP_HEADER_CONTENT_LENGTH) > 0);
+			if (connection == m_responseHeaders.end()) {
+				addHeader(HttpRequest::HTTP_HEADER_CONNECTION, m_keepAlive ? "keep-alive" : "close");
+			}
+		}
+		if (!buildHeader(m_header, sizeof(m_header), &m_headerLength)) {   // A large header goes on the heap.
+			size_t length;
+			buildHeader(nullptr, 0, &length);
+			m_headerOverflow.resize(length);
+			buildHeader(&m_headerOverflow[0], length, &m_headerLength);
 		}
-		oss << lineTerminator;
 		m_headerCommitted = true;
-		m_request->getSocket().send(oss.str());
+		m_headerPending   = true;
 	}
 } // sendHeader
 
 
+/**
+ * @brief Send buffers to the client.
+ * If the header is still waiting to be sent, it goes out in front of the buffers with a single send.
+ * @param [in] iov The buffers to send.  The first entry is a free slot that is used for the header.
+ * @param [in] iovcnt The number of entries in iov, including the free slot.
+ */
+void HttpResponse::sendv(struct iovec* iov, int iovcnt) {
+	int64_t start = esp_timer_get_time();
+	int rc = 0;
+	if (m_headerPending) {
+		iov[0].iov_base = m_headerOverflow.empty() ? m_header : &m_headerOverflow[0];
+		iov[0].iov_len  = m_headerLength;
+		m_headerPending = false;
+		rc = m_request->getSocket().sendv(iov, iovcnt);
+		m_headerOverflow.clear();
+		m_headerOverflow.shrink_to_fit();
+	} else if (iovcnt > 1) {
+		rc = m_request->getSocket().sendv(iov + 1, iovcnt - 1);
+	}
+	if (rc > 0) {
+		m_bytesSent += rc;
+	}
+	m_sendTime += esp_timer_get_time() - start;
+} // sendv
+
+
+/**
+ * @brief Keep a copy of the body that is sent.
+ * Used by HttpResponseCache to keep the response of a handler.  Whether the copy is complete can be
+ * checked with isBodyCaptured() once the body has been sent.
+ * @param [in] pBody Receives the copy, or nullptr to stop copying.
+ * @param [in] maxSize The largest body that is copied.
+ */
+void HttpResponse::setBodyCapture(std::string* pBody, size_t maxSize) {
+	m_pBodyCapture   = pBody;
+	m_maxBodyCapture = maxSize;
+	m_bodyCaptured   = pBody != nullptr;
+} // setBodyCapture
+
+
 /**
  * @brief Set the status code that is to be sent back to the client.
  * When a client makes a request, the response contains a status.  This call sets the status that
@@ -11,43 +11,108 @@
 #define COMPONENTS_CPP_UTILS_HTTPRESPONSE_H_
 #include <string>
 #include <map>
+#include <vector>
+#include <lwip/sockets.h>
 #include "HttpRequest.h"
+#include "HttpFileCache.h"
 
 class HttpResponse {
 public:
 	static const int HTTP_STATUS_CONTINUE;
 	static const int HTTP_STATUS_SWITCHING_PROTOCOL;
 	static const int HTTP_STATUS_OK;
+	static const int HTTP_STATUS_PARTIAL_CONTENT;
 	static const int HTTP_STATUS_MOVED_PERMANENTLY;
+	static const int HTTP_STATUS_NOT_MODIFIED;
 	static const int HTTP_STATUS_BAD_REQUEST;
 	static const int HTTP_STATUS_UNAUTHORIZED;
 	static const int HTTP_STATUS_FORBIDDEN;
 	static const int HTTP_STATUS_NOT_FOUND;
 	static const int HTTP_STATUS_METHOD_NOT_ALLOWED;
+	static const int HTTP_STATUS_REQUEST_TIMEOUT;
+	static const int HTTP_STATUS_PAYLOAD_TOO_LARGE;
+	static const int HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+	static const int HTTP_STATUS_TOO_MANY_REQUESTS;
+	static const int HTTP_STATUS_HEADER_FIELDS_TOO_LARGE;
 	static const int HTTP_STATUS_INTERNAL_SERVER_ERROR;
 	static const int HTTP_STATUS_NOT_IMPLEMENTED;
 	static const int HTTP_STATUS_SERVICE_UNAVAILABLE;
 
 	HttpResponse(HttpRequest* httpRequest);
 	virtual ~HttpResponse();
+	static std::string getContentType(const std::string& fileName);   // Get the media type of a file from its extension.
+	static void        releaseFileBuffer();                           // Free the buffer the calling task reads files into.
 
 	void                               addHeader(std::string name, std::string value);  // Add a header to be sent to the client.
+	void                               beginChunked(size_t bufferSize = 1024);          // Start streaming a body of unknown length.
 	void                               close();                                         // Close the request/response.
+	void                               detach();                                        // Complete the response but leave the connection open.
+	void                               end();                                           // Complete a streamed body.
+	size_t                             getBytesSent();                                  // Get the bytes of the response sent so far.
 	std::string                        getHeader(std::string name);                     // Get a named header.
 	std::map<std::string, std::string> getHeaders();                                    // Get all headers.
+	uint32_t                           getSendTime();                                   // Get the microseconds spent sending the response.
+	int                                getStatus();                                     // Get the response status.
+	std::string                        getStatusMessage();                              // Get the response status message.
+	bool                               isBodyCaptured();                                // Has all of the body been kept by setBodyCapture()?
+	bool                               isClosed();                                      // Has the response been completed?
+	bool                               isDetached();                                    // Has the connection been handed over by detach()?
+	bool                               isKeepAlive();                                   // Will the connection be reused?
 	void                               sendData(std::string data);                      // Send data to the client.
 	void                               sendData(uint8_t* pData, size_t size);           // Send data to the client.
+	void                               setBodyCapture(std::string* pBody, size_t maxSize); // Keep a copy of the body that is sent.
 	void                               setStatus(int status, std::string message);      // Set the response status.
-	void 							   sendFile(std::string fileName, size_t bufSize = 4 * 1024);	// Send file contents if exists.
+	void 							   sendFile(std::string fileName, size_t bufSize = 4 * 1024, HttpFileCache* pCache = nullptr);	// Send file contents if exists.
+	void                               write(const std::string& data);                  // Stream data to the client.
+	void                               write(const uint8_t* pData, size_t size);        // Stream data to the client.
 
 private:
+	static const size_t MAX_RANGES = 8;          // The most parts of a file we send for one request.
+	static const size_t CHUNK_HEADER_SIZE = 10;  // Room for the size line of a chunk (8 hex digits and CRLF).
+	static const size_t HEADER_BUFFER_SIZE = 512; // The size of a header that is serialized without allocating.
+
+	// A part of a file.
+	struct Range {
+		size_t offset;
+		size_t length;
+	};
+
 	bool							   m_headerCommitted;  // Has the header been sent?
+	bool							   m_headerPending;	  // Is the serialized header waiting to go out with the first data?
+	char							   m_header[HEADER_BUFFER_SIZE]; // The serialized header.
+	size_t							   m_headerLength;	  // The length of the serialized header in m_header.
+	std::string						m_headerOverflow;   // The serialized header when it doesn't fit in m_header.
+	bool							   m_isClosed;		  // Has the response been completed?
+	bool							   m_isDetached;	  // Has the connection been handed over by detach()?
+	bool							   m_keepAlive;		  // Will the connection be kept open after the response?
+	bool							   m_chunked;		  // Is the body being sent with chunked transfer encoding?
+	uint8_t*						   m_pChunkBuffer;	  // Collects small writes into a chunk, with room for the chunk framing.
+	size_t							   m_chunkBufferSize;  // The most data a buffered chunk holds.
+	size_t							   m_chunkLength;	  // The amount of data in the buffered chunk.
+	size_t							   m_bytesSent;		  // The bytes of the response sent so far.
+	uint32_t						   m_sendTime;		  // The microseconds spent sending the response.
 	HttpRequest*					   m_request;		  // The request associated with this response.
 	std::map<std::string, std::string> m_responseHeaders;  // The headers to be sent with the response.
 	int								m_status;		   // The status to be sent with the response.
 	std::string						m_statusMessage;	// The status message to be sent with the response.
+	std::string*					   m_pBodyCapture;	  // Receives a copy of the body, if not null.
+	size_t							   m_maxBodyCapture;   // The largest body that is copied.
+	bool							   m_bodyCaptured;	  // Has all of the body sent so far been copied?
 
-	void sendHeader();									 // Send the header to the client.
+	static std::string contentRange(const Range& range, size_t size); // Format the Content-Range of a part of a file.
+	static uint8_t*    getFileBuffer(size_t size);                   // Get the buffer the calling task reads files into.
+	bool buildHeader(char* buffer, size_t size, size_t* pLength); // Serialize the status line and headers.
+	void captureBody(const uint8_t* pData, size_t size);	  // Copy data of the body for setBodyCapture().
+	void flushChunk();									   // Send the buffered chunk.
+	bool getRanges(size_t size, const std::string& etag, const std::string& lastModified, std::vector<Range>& ranges); // Get the requested parts of a file.
+	bool hasBody();									    // May the response have a body?
+	bool isEncodingAccepted(const std::string& encoding); // Does the client accept the content coding?
+	bool isNotModified(const std::string& etag, const std::string& lastModified); // Does the client hold the current file?
+	void sendHeader();									 // Serialize the header to be sent with the first data.
+	void sendv(struct iovec* iov, int iovcnt);			 // Send buffers to the client, preceded by the header if it is pending.
+	void sendFileData(int fd, const std::string* pCached, size_t offset, size_t length, size_t bufSize); // Send part of a file.
+	void sendNotFound();								 // Answer that the requested file doesn't exist.
+	bool selectFile(std::string& fileName, struct stat* pStatBuf, std::string& encoding); // Choose the representation of a file to send.
 
 };
 
@@ -0,0 +1,286 @@
+/*
+ * HttpResponseCache.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <esp_timer.h>
+#include "HttpResponseCache.h"
+#include "HttpParser.h"
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "HttpResponseCache";
+
+
+/**
+ * @brief Create a response cache.
+ * @param [in] ttl The seconds for which a response is kept.
+ * @param [in] maxBytes The total size of the responses that may be held in the cache.
+ * @param [in] queryParams The names of the query parameters that select a different resource.
+ */
+HttpResponseCache::HttpResponseCache(uint32_t ttl, size_t maxBytes, const std::vector<std::string>& queryParams) {
+	m_ttl         = ttl;
+	m_maxBytes    = maxBytes;
+	m_queryParams = queryParams;
+	m_stats       = Stats();
+} // HttpResponseCache
+
+
+HttpResponseCache::~HttpResponseCache() {
+} // ~HttpResponseCache
+
+
+/**
+ * @brief Collect the response the handler produced.
+ * @param [in] pResponse The response.
+ * @param [in] body The body of the response.
+ * @return The response or nullptr if it may not be cached.
+ */
+std::shared_ptr<const HttpResponseCache::Response> HttpResponseCache::capture(HttpResponse* pResponse, std::string& body) {
+	int status = pResponse->getStatus();
+	if (status != HttpResponse::HTTP_STATUS_OK && status != 203 && status != HttpResponse::HTTP_STATUS_MOVED_PERMANENTLY &&
+			status != HttpResponse::HTTP_STATUS_NOT_FOUND && status != 410) {
+		return nullptr;
+	}
+	Response* pCached = new Response();
+	pCached->status        = status;
+	pCached->statusMessage = pResponse->getStatusMessage();
+	pCached->size          = body.length() + pCached->statusMessage.length();
+	std::map<std::string, std::string> headers = pResponse->getHeaders();
+	for (auto it = headers.begin(); it != headers.end(); ++it) {
+		if (HttpParser::equalsIgnoreCase(it->first, "Set-Cookie") ||
+				(HttpParser::equalsIgnoreCase(it->first, HttpRequest::HTTP_HEADER_CACHE_CONTROL) &&
+				(it->second.find("no-store") != std::string::npos || it->second.find("private") != std::string::npos))) {
+			delete pCached;
+			return nullptr;
+		}
+		// The framing is decided again when the response is sent.
+		if (HttpParser::equalsIgnoreCase(it->first, HttpRequest::HTTP_HEADER_CONNECTION) ||
+				HttpParser::equalsIgnoreCase(it->first, HttpRequest::HTTP_HEADER_CONTENT_LENGTH) ||
+				HttpParser::equalsIgnoreCase(it->first, HttpRequest::HTTP_HEADER_TRANSFER_ENCODING)) {
+			continue;
+		}
+		pCached->headers.push_back(*it);
+		pCached->size += it->first.length() + it->second.length();
+	}
+	pCached->body.swap(body);
+	pCached->created = esp_timer_get_time();
+	return std::shared_ptr<const Response>(pCached);
+} // capture
+
+
+/**
+ * @brief Drop all the cached responses.
+ * Responses that are still being sent stay valid until the sender is done with them.
+ */
+void HttpResponseCache::clear() {
+	m_lock.take("clear");
+	m_entries.clear();
+	m_index.clear();
+	m_stats.bytesCached = 0;
+	m_stats.entries     = 0;
+	m_lock.give();
+} // clear
+
+
+/**
+ * @brief Find a fresh response.  The lock must be held.
+ * A stale response is dropped.
+ * @param [in] key The key of the resource.
+ * @return The response or nullptr if there is none.
+ */
+std::shared_ptr<const HttpResponseCache::Response> HttpResponseCache::find(const std::string& key) {
+	auto it = m_index.find(key);
+	if (it == m_index.end()) {
+		return nullptr;
+	}
+	if (it->second->expires <= esp_timer_get_time()) {
+		ESP_LOGD(LOG_TAG, "Response to %s is stale", key.c_str());
+		remove(it->second);
+		return nullptr;
+	}
+	m_entries.splice(m_entries.begin(), m_entries, it->second);   // Now the most recently used.
+	return it->second->response;
+} // find
+
+
+/**
+ * @brief Get the fraction of requests answered without calling the handler.
+ * Requests that waited for another request to call the handler count as answered from the cache.
+ * @return The hit ratio between 0 and 1.
+ */
+float HttpResponseCache::getHitRatio() {
+	Stats stats = getStats();
+	if (stats.hits + stats.collapsed + stats.misses == 0) {
+		return 0;
+	}
+	return (float) (stats.hits + stats.collapsed) / (stats.hits + stats.collapsed + stats.misses);
+} // getHitRatio
+
+
+/**
+ * @brief Get the key of the resource requested.
+ * The key is made up of the path and the values of the selected query parameters.
+ * @param [in] pRequest The request.
+ * @return The key.
+ */
+std::string HttpResponseCache::getKey(HttpRequest* pRequest) {
+	std::string_view path = pRequest->getPathView();
+	std::string key(path.substr(0, path.find('?')));
+	for (auto it = m_queryParams.begin(); it != m_queryParams.end(); ++it) {
+		std::string_view value = pRequest->getQueryValue(*it);
+		key += '\n';
+		key += *it;
+		key += '=';
+		key.append(value.data(), value.length());
+	}
+	return key;
+} // getKey
+
+
+size_t HttpResponseCache::getMaxBytes() {
+	return m_maxBytes;
+} // getMaxBytes
+
+
+/**
+ * @brief Get the counters of the use of the cache.
+ * @return A copy of the counters.
+ */
+HttpResponseCache::Stats HttpResponseCache::getStats() {
+	m_lock.take("getStats");
+	Stats stats = m_stats;
+	m_lock.give();
+	return stats;
+} // getStats
+
+
+uint32_t HttpResponseCache::getTTL() {
+	return m_ttl;
+} // getTTL
+
+
+/**
+ * @brief Add a response to the cache.  The lock must be held.
+ * The least recently used responses are dropped until the new response fits in the byte budget.
+ * @param [in] key The key of the resource.
+ * @param [in] response The response.
+ */
+void HttpResponseCache::insert(const std::string& key, std::shared_ptr<const Response> response) {
+	auto it = m_index.find(key);
+	if (it != m_index.end()) {
+		remove(it->second);
+	}
+	while (!m_entries.empty() && m_stats.bytesCached + response->size > m_maxBytes) {
+		ESP_LOGD(LOG_TAG, "Evicting %s", m_entries.back().key.c_str());
+		remove(std::prev(m_entries.end()));
+	}
+	Entry entry;
+	entry.key      = key;
+	entry.expires  = response->created + (int64_t) m_ttl * 1000000;
+	entry.response = response;
+	m_entries.push_front(entry);
+	m_index[key] = m_entries.begin();
+	m_stats.bytesCached += response->size;
+	m_stats.entries++;
+} // insert
+
+
+/**
+ * @brief Remove an entry from the cache.  The lock must be held.
+ * @param [in] it The entry.
+ */
+void HttpResponseCache::remove(std::list<Entry>::iterator it) {
+	m_stats.bytesCached -= it->response->size;
+	m_stats.entries--;
+	m_index.erase(it->key);
+	m_entries.erase(it);
+} // remove
+
+
+/**
+ * @brief Send a cached response.
+ * The body is sent with its length so that the connection may be kept open.
+ * @param [in] response The cached response.
+ * @param [in] pResponse The response to the request.
+ */
+void HttpResponseCache::send(const Response& response, HttpResponse* pResponse) {
+	pResponse->setStatus(response.status, response.statusMessage);
+	for (auto it = response.headers.begin(); it != response.headers.end(); ++it) {
+		pResponse->addHeader(it->first, it->second);
+	}
+	pResponse->addHeader("Age", std::to_string((esp_timer_get_time() - response.created) / 1000000));
+	pResponse->addHeader(HttpRequest::HTTP_HEADER_CONTENT_LENGTH, std::to_string(response.body.length()));
+	if (!response.body.empty()) {
+		pResponse->sendData((uint8_t*) response.body.data(), response.body.length());
+	}
+} // send
+
+
+/**
+ * @brief Answer a request, from the cache if we can.
+ * If the cache holds a fresh response to the resource, it is sent.  If another request is already
+ * calling the handler for the resource, we wait for its response.  Otherwise we call the handler and
+ * keep what it sends.
+ * @param [in] pRequest The request.
+ * @param [in] pResponse The response to the request.
+ * @param [in] handler The handler of the route.
+ */
+void HttpResponseCache::serve(HttpRequest* pRequest, HttpResponse* pResponse, HttpRouter::Handler handler) {
+	std::string key = getKey(pRequest);
+	m_lock.take("serve");
+	std::shared_ptr<const Response> response = find(key);
+	if (response != nullptr) {
+		m_stats.hits++;
+		m_lock.give();
+		send(*response, pResponse);
+		return;
+	}
+
+	auto pending = m_pending.find(key);
+	if (pending != m_pending.end()) {
+		std::shared_ptr<FreeRTOS::Semaphore> pDone = pending->second;
+		m_stats.collapsed++;
+		m_lock.give();
+		if (pDone->take(PENDING_TIMEOUT, "serve")) {
+			pDone->give();   // Let the other waiters through.
+			m_lock.take("serve");
+			response = find(key);
+			m_lock.give();
+		}
+		if (response != nullptr) {
+			send(*response, pResponse);
+		} else {   // The response couldn't be cached or the handler is taking too long.
+			handler(pRequest, pResponse);
+		}
+		return;
+	}
+
+	// We call the handler.  Requests for the same resource that arrive in the meantime wait for us.
+	std::shared_ptr<FreeRTOS::Semaphore> pDone = std::make_shared<FreeRTOS::Semaphore>("HttpResponseCache");
+	pDone->take("serve");
+	m_pending[key] = pDone;
+	m_stats.misses++;
+	m_lock.give();
+
+	std::string body;
+	pResponse->setBodyCapture(&body, m_maxBytes);
+	handler(pRequest, pResponse);
+	if (pResponse->isBodyCaptured()) {
+		response = capture(pResponse, body);
+	}
+	pResponse->setBodyCapture(nullptr, 0);
+
+	m_lock.take("serve");
+	m_pending.erase(key);
+	if (response != nullptr && response->size <= m_maxBytes) {
+		insert(key, response);
+	} else {
+		m_stats.uncacheable++;
+	}
+	m_lock.give();
+	pDone->give();
+} // serve
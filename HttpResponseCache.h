@@ -0,0 +1,97 @@
+/*
+ * HttpResponseCache.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_HTTPRESPONSECACHE_H_
+#define COMPONENTS_CPP_UTILS_HTTPRESPONSECACHE_H_
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "FreeRTOS.h"
+#include "HttpRouter.h"
+
+class HttpRequest;
+class HttpResponse;
+
+/**
+ * @brief Hold the responses of a GET handler in RAM for a while.
+ *
+ * A cache belongs to one route.  The status, headers and body a handler produces are kept for a time
+ * to live and sent to further requests for the same resource without calling the handler.  Requests
+ * are for the same resource when they have the same path and the same values of the selected query
+ * parameters; other query parameters are ignored.
+ *
+ * When several requests miss on the same resource at the same time, only the first calls the handler.
+ * The others wait for it and are answered from the response it produced.
+ *
+ * Only responses with a cacheable status (200, 203, 301, 404, 410) that don't set a cookie and aren't
+ * marked "no-store" or "private" are kept.  When the byte budget is exceeded, the least recently used
+ * responses are dropped.
+ *
+ * The cache may be used by several tasks at the same time.
+ */
+class HttpResponseCache {
+public:
+	// Counters of the use of the cache.
+	struct Stats {
+		uint32_t hits;          // Requests answered from the cache.
+		uint32_t misses;        // Requests that called the handler.
+		uint32_t collapsed;     // Requests that waited for another request to call the handler.
+		uint32_t uncacheable;   // Responses of the handler that couldn't be kept.
+		size_t   bytesCached;   // Bytes currently held in the cache.
+		size_t   entries;       // Responses currently held in the cache.
+	};
+
+	HttpResponseCache(uint32_t ttl, size_t maxBytes, const std::vector<std::string>& queryParams);
+	virtual ~HttpResponseCache();
+	void     clear();                // Drop all the cached responses.
+	float    getHitRatio();          // Get the fraction of requests answered without calling the handler.
+	size_t   getMaxBytes();          // Get the byte budget of the cache.
+	Stats    getStats();             // Get the counters of the use of the cache.
+	uint32_t getTTL();               // Get the seconds for which a response is kept.
+	void     serve(HttpRequest* pRequest, HttpResponse* pResponse, HttpRouter::Handler handler);   // Answer a request.
+
+private:
+	static const uint32_t PENDING_TIMEOUT = 10 * 1000;   // The most milliseconds we wait for another request's handler.
+
+	// A response produced by the handler.
+	struct Response {
+		int         status;
+		std::string statusMessage;
+		std::vector<std::pair<std::string, std::string>> headers;   // Without the framing headers.
+		std::string body;
+		int64_t     created;   // When the handler produced the response (esp_timer_get_time()).
+		size_t      size;      // The bytes of the response counted against the budget.
+	};
+
+	// A cached response.
+	struct Entry {
+		std::string                     key;
+		int64_t                         expires;   // When the response becomes stale (esp_timer_get_time()).
+		std::shared_ptr<const Response> response;
+	};
+
+	uint32_t                 m_ttl;           // Seconds for which a response is kept.
+	size_t                   m_maxBytes;      // The byte budget of the cache.
+	std::vector<std::string> m_queryParams;   // The query parameters that select a different resource.
+	std::list<Entry>         m_entries;       // The cached responses, most recently used first.
+	std::unordered_map<std::string, std::list<Entry>::iterator> m_index;   // The cached responses by key.
+	std::unordered_map<std::string, std::shared_ptr<FreeRTOS::Semaphore>> m_pending;   // Keys whose handler is running, given when it ends.
+	Stats                    m_stats;
+	FreeRTOS::Semaphore      m_lock = FreeRTOS::Semaphore("HttpResponseCache");
+
+	std::shared_ptr<const Response> capture(HttpResponse* pResponse, std::string& body);
+	std::shared_ptr<const Response> find(const std::string& key);
+	std::string getKey(HttpRequest* pRequest);
+	void insert(const std::string& key, std::shared_ptr<const Response> response);
+	void remove(std::list<Entry>::iterator it);
+	static void send(const Response& response, HttpResponse* pResponse);
+}; // HttpResponseCache
+
+#endif /* COMPONENTS_CPP_UTILS_HTTPRESPONSECACHE_H_ */
@@ -0,0 +1,261 @@
+/*
+ * HttpRouter.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <algorithm>
+#include "HttpRouter.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "HttpRouter";
+
+
+HttpRouter::Node::Node(NodeKind kind, std::string_view segment) {
+	this->kind      = kind;
+	this->segment   = std::string(segment);
+	this->pParam    = nullptr;
+	this->pWildcard = nullptr;
+} // Node
+
+
+HttpRouter::Node::~Node() {
+	for (auto it = children.begin(); it != children.end(); ++it) {
+		delete *it;
+	}
+	delete pParam;
+	delete pWildcard;
+} // ~Node
+
+
+HttpRouter::HttpRouter() : m_root(NODE_LITERAL, "") {
+	m_routeCount = 0;
+} // HttpRouter
+
+
+HttpRouter::~HttpRouter() {
+} // ~HttpRouter
+
+
+/**
+ * @brief Get the child of a node for a segment of a pattern, creating it if needed.
+ * @param [in] pNode The parent node.
+ * @param [in] kind How the child is reached.
+ * @param [in] segment The literal segment or the parameter name.
+ * @return The child node.
+ */
+HttpRouter::Node* HttpRouter::addChild(Node* pNode, NodeKind kind, std::string_view segment) {
+	if (kind == NODE_PARAM || kind == NODE_WILDCARD) {
+		Node*& pChild = (kind == NODE_PARAM) ? pNode->pParam : pNode->pWildcard;
+		if (pChild == nullptr) {
+			pChild = new Node(kind, segment);
+		} else if (pChild->segment != segment) {
+			ESP_LOGW(LOG_TAG, "Parameter \"%.*s\" will be known as \"%s\" registered by an earlier route",
+				(int) segment.length(), segment.data(), pChild->segment.c_str());
+		}
+		return pChild;
+	}
+	auto it = std::lower_bound(pNode->children.begin(), pNode->children.end(), segment,
+		[](Node* pChild, std::string_view segment) { return std::string_view(pChild->segment) < segment; });
+	if (it != pNode->children.end() && (*it)->segment == segment) {
+		return *it;
+	}
+	return *pNode->children.insert(it, new Node(kind, segment));
+} // addChild
+
+
+/**
+ * @brief Register a handler for a route.
+ * Registering a second handler for the same method and pattern replaces the first.
+ * @param [in] method The method of the route ("GET", "POST" etc).
+ * @param [in] pattern The path pattern of the route.
+ * @param [in] handler The callback function to be invoked for a matching request.
+ * @return The id of the route, numbered from 0 in the order routes are added, or -1 if the pattern is
+ * invalid.  Replacing a handler keeps the id of the route.
+ */
+int HttpRouter::addRoute(const std::string& method, const std::string& pattern, Handler handler) {
+	ESP_LOGD(LOG_TAG, ">> addRoute: %s %s", method.c_str(), pattern.c_str());
+	Node* pNode = &m_root;
+	std::string_view rest = pattern;
+	std::string_view segment;
+	while (nextSegment(rest, segment)) {
+		if (segment[0] == ':') {
+			pNode = addChild(pNode, NODE_PARAM, segment.substr(1));
+		} else if (segment[0] == '*') {
+			pNode = addChild(pNode, NODE_WILDCARD, segment.length() > 1 ? segment.substr(1) : segment);
+			if (nextSegment(rest, segment)) {
+				ESP_LOGE(LOG_TAG, "A wildcard must be the last segment of a route: %s", pattern.c_str());
+				return -1;
+			}
+			break;
+		} else {
+			pNode = addChild(pNode, NODE_LITERAL, segment);
+		}
+	}
+	for (auto it = pNode->handlers.begin(); it != pNode->handlers.end(); ++it) {
+		if (it->method == method) {
+			it->handler = handler;
+			return it->id;
+		}
+	}
+	Route route;
+	route.method  = method;
+	route.handler = handler;
+	route.id      = m_routeCount++;
+	pNode->handlers.push_back(route);
+	return route.id;
+} // addRoute
+
+
+/**
+ * @brief Find the handler of a request.
+ * @param [in] method The method of the request.
+ * @param [in] path The path of the request without any query.
+ * @param [out] pParams If not null, receives the parameters of the matching route.
+ * @param [out] pRouteId If not null, receives the id of the matching route.
+ * @return The handler of the matching route or nullptr if there is none.
+ */
+HttpRouter::Handler HttpRouter::find(std::string_view method, std::string_view path, std::map<std::string, std::string>* pParams, int* pRouteId) {
+	Match result;
+	Node* pNode = match(&m_root, method, path, result, 0);
+	if (pNode == nullptr) {
+		return nullptr;
+	}
+	if (pParams != nullptr) {
+		for (size_t i = 0; i < result.depth; i++) {
+			if (result.nodes[i]->kind != NODE_LITERAL) {
+				(*pParams)[result.nodes[i]->segment] = std::string(result.values[i]);
+			}
+		}
+	}
+	const Route* pRoute = findHandler(pNode, method);
+	if (pRouteId != nullptr) {
+		*pRouteId = pRoute->id;
+	}
+	return pRoute->handler;
+} // find
+
+
+/**
+ * @brief Find the child of a node reached by a literal segment.
+ * @param [in] pNode The parent node.
+ * @param [in] segment The segment of the path.
+ * @return The child or nullptr if there is none.
+ */
+HttpRouter::Node* HttpRouter::findChild(Node* pNode, std::string_view segment) {
+	auto it = std::lower_bound(pNode->children.begin(), pNode->children.end(), segment,
+		[](Node* pChild, std::string_view segment) { return std::string_view(pChild->segment) < segment; });
+	if (it != pNode->children.end() && (*it)->segment == segment) {
+		return *it;
+	}
+	return nullptr;
+} // findChild
+
+
+/**
+ * @brief Find the handler a node has for a method.
+ * @param [in] pNode The node.
+ * @param [in] method The method of the request.
+ * @return The route or nullptr if there is none.
+ */
+const HttpRouter::Route* HttpRouter::findHandler(Node* pNode, std::string_view method) {
+	for (auto it = pNode->handlers.begin(); it != pNode->handlers.end(); ++it) {
+		if (it->method == method) {
+			return &(*it);
+		}
+	}
+	return nullptr;
+} // findHandler
+
+
+/**
+ * @brief Get the id of a registered route.
+ * @param [in] method The method of the route.
+ * @param [in] pattern The path pattern the route was registered with.
+ * @return The id of the route or -1 if there is no such route.
+ */
+int HttpRouter::getRouteId(const std::string& method, const std::string& pattern) {
+	Node* pNode = &m_root;
+	std::string_view rest = pattern;
+	std::string_view segment;
+	while (pNode != nullptr && nextSegment(rest, segment)) {
+		if (segment[0] == ':') {
+			pNode = pNode->pParam;
+		} else if (segment[0] == '*') {
+			pNode = pNode->pWildcard;
+		} else {
+			pNode = findChild(pNode, segment);
+		}
+	}
+	const Route* pRoute = (pNode == nullptr) ? nullptr : findHandler(pNode, method);
+	return (pRoute == nullptr) ? -1 : pRoute->id;
+} // getRouteId
+
+
+/**
+ * @brief Match the rest of a path below a node.
+ * A literal child is tried before a parameter which is tried before a wildcard.  We back track when a
+ * choice doesn't lead to a handler for the method.
+ * @param [in] pNode The node reached so far.
+ * @param [in] method The method of the request.
+ * @param [in] path The rest of the path.
+ * @param [out] match Records the nodes visited and the parts of the path that led to them.
+ * @param [in] depth The number of nodes visited so far.
+ * @return The node holding the handler or nullptr if there is no match.
+ */
+HttpRouter::Node* HttpRouter::match(Node* pNode, std::string_view method, std::string_view path, Match& match, size_t depth) {
+	std::string_view rest = path;
+	std::string_view segment;
+	if (!nextSegment(rest, segment)) {   // We have reached the end of the path.
+		if (findHandler(pNode, method) != nullptr) {
+			match.depth = depth;
+			return pNode;
+		}
+	} else if (depth < MAX_DEPTH) {
+		Node* pChild = findChild(pNode, segment);
+		if (pChild != nullptr) {
+			match.nodes[depth]  = pChild;
+			match.values[depth] = segment;
+			Node* pFound = HttpRouter::match(pChild, method, rest, match, depth + 1);
+			if (pFound != nullptr) return pFound;
+		}
+		if (pNode->pParam != nullptr) {
+			match.nodes[depth]  = pNode->pParam;
+			match.values[depth] = segment;
+			Node* pFound = HttpRouter::match(pNode->pParam, method, rest, match, depth + 1);
+			if (pFound != nullptr) return pFound;
+		}
+	}
+	if (pNode->pWildcard != nullptr && findHandler(pNode->pWildcard, method) != nullptr) {
+		size_t start = path.find_first_not_of('/');
+		match.nodes[depth]  = pNode->pWildcard;
+		match.values[depth] = (start == std::string_view::npos) ? std::string_view() : path.substr(start);
+		match.depth         = depth + 1;
+		return pNode->pWildcard;
+	}
+	return nullptr;
+} // match
+
+
+/**
+ * @brief Take the next segment from a path.
+ * Empty segments are skipped.
+ * @param [in,out] path The path.  On return, the rest of the path after the segment.
+ * @param [out] segment The segment.
+ * @return False if there are no more segments.
+ */
+bool HttpRouter::nextSegment(std::string_view& path, std::string_view& segment) {
+	size_t start = path.find_first_not_of('/');
+	if (start == std::string_view::npos) {
+		path = std::string_view();
+		return false;
+	}
+	size_t end = path.find('/', start);
+	if (end == std::string_view::npos) {
+		end = path.length();
+	}
+	segment = path.substr(start, end - start);
+	path    = path.substr(end);
+	return true;
+} // nextSegment
@@ -0,0 +1,94 @@
+/*
+ * HttpRouter.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_HTTPROUTER_H_
+#define COMPONENTS_CPP_UTILS_HTTPROUTER_H_
+#include <string>
+#include <string_view>
+#include <map>
+#include <vector>
+
+class HttpRequest;
+class HttpResponse;
+
+/**
+ * @brief Map request paths to their handlers.
+ *
+ * The routes are held in a tree with one level per path segment so finding the handler of a path
+ * costs a walk over the segments of the path rather than a match against every registered route.
+ * A route pattern is made up of segments separated by "/".  Each segment is one of:
+ *
+ * * A literal, which has to match the segment of the path exactly.
+ * * `:name`, which matches any single segment.  The segment is made available as the parameter "name".
+ * * `*` or `*name`, which must be last and matches the rest of the path (possibly nothing).  The rest
+ * is made available as the parameter "*" (or "name").
+ *
+ * When several routes match a path, a literal segment is preferred to a parameter which is preferred
+ * to a wildcard.
+ *
+ * Example:
+ * @code{.cpp}
+ * router.addRoute("GET", "/api/leds/:id", handleLed);
+ * router.addRoute("GET", "/files/:volume", handleVolume);
+ * @endcode
+ */
+class HttpRouter {
+public:
+	typedef void (*Handler)(HttpRequest* pHttpRequest, HttpResponse* pHttpResponse);
+
+	HttpRouter();
+	virtual ~HttpRouter();
+	int     addRoute(const std::string& method, const std::string& pattern, Handler handler);
+	Handler find(std::string_view method, std::string_view path, std::map<std::string, std::string>* pParams, int* pRouteId = nullptr);
+	int     getRouteId(const std::string& method, const std::string& pattern);
+
+private:
+	static const size_t MAX_DEPTH = 32;   // The maximum number of segments in a path we will route.
+
+	// How a node of the tree is reached.
+	enum NodeKind {
+		NODE_LITERAL,   // By a segment equal to the node's segment.
+		NODE_PARAM,     // By any segment.
+		NODE_WILDCARD   // By the rest of the path.
+	};
+
+	// A handler of a route.
+	struct Route {
+		std::string method;
+		Handler     handler;
+		int         id;        // The number of the route in the order routes were added.
+	};
+
+	// A node of the tree.  The node is reached by one segment of the path.
+	struct Node {
+		NodeKind           kind;
+		std::string        segment;     // The literal segment or the name of the parameter.
+		std::vector<Node*> children;    // Children reached by a literal segment, sorted by segment.
+		Node*              pParam;      // The child reached by any segment, if any.
+		Node*              pWildcard;   // The child reached by the rest of the path, if any.
+		std::vector<Route> handlers;    // Handlers of the routes ending here, by method.
+		Node(NodeKind kind, std::string_view segment);
+		~Node();
+	};
+
+	// The nodes visited by a successful match and the parts of the path that led to them.
+	struct Match {
+		Node*            nodes[MAX_DEPTH + 1];
+		std::string_view values[MAX_DEPTH + 1];
+		size_t           depth;
+	};
+
+	Node m_root;
+	int  m_routeCount;   // The number of routes added.
+
+	static Node*   addChild(Node* pNode, NodeKind kind, std::string_view segment);
+	static Node*   findChild(Node* pNode, std::string_view segment);
+	static const Route* findHandler(Node* pNode, std::string_view method);
+	static Node*   match(Node* pNode, std::string_view method, std::string_view path, Match& match, size_t depth);
+	static bool    nextSegment(std::string_view& path, std::string_view& segment);
+}; // HttpRouter
+
+#endif /* COMPONENTS_CPP_UTILS_HTTPROUTER_H_ */
@@ -10,11 +10,14 @@
  *      Author: kolban
  */
 
+#include <algorithm>
+#include <cinttypes>
 #include <fstream>
 #include "HttpServer.h"
 #include "SockServ.h"
 #include "Task.h"
 #include <esp_log.h>
+#include <esp_timer.h>
 #include "HttpRequest.h"
 #include "HttpResponse.h"
 #include "FileSystem.h"
@@ -32,18 +35,68 @@ static const char* LOG_TAG = "HttpServer";
 HttpServer::HttpServer() {
 	m_portNumber = 80;            // The default port number.
 	m_clientTimeout = 5;            // The default timeout 5 seconds.
+	m_keepAliveTimeout     = 5;     // Idle persistent connections are closed after 5 seconds.
+	m_maxKeepAliveRequests = 100;   // Close a persistent connection after 100 requests.
+	m_maxBodySize          = 0;     // Accept request bodies of any size.
+	m_headerTimeout        = 10;    // A request head must arrive within 10 seconds.
+	m_maxHeaderSize        = 2048;  // The largest request head accepted.
+	m_maxHeaderCount       = HttpParser::MAX_HEADERS;
+	m_minBodyRate          = 128;   // After 5 seconds a request body must have arrived at 128 bytes/s or more.
+	m_bodyRateGrace        = 5;
+	m_maxConnectionsPerClient = 0;  // A client may have any number of connections.
+	setWebSocketCompression(false); // Default is WebSockets without compression.
 	m_rootPath   = "";            // The default path.
 	m_useSSL     = false;         // Default SSL is no.
+	m_pSSLContext = nullptr;      // Default TLS configuration is SSLServerContext::getDefault().
+	m_eventDriven = false;        // Default is a blocking task per server (or per worker).
 	setDirectoryListing(false);   // Default directory listing is disabled.
 	m_fileBufferSize = 4 * 1024;	// Default size of the file buffer.
+	m_workerCount     = 0;          // Default is to serve requests in the listening task.
+	m_workerQueueSize = 8;          // Default number of connections waiting for a worker.
+	m_workerQueue     = nullptr;
+	m_pFileCache      = nullptr;        // Default is to read files on every request.
+	m_metrics.addRoute("files");        // METRICS_ROUTE_FILES: Requests served from the file system.
+	m_metrics.addRoute("metrics");      // METRICS_ROUTE_METRICS: Requests for the metrics.
 } // HttpServer
 
 
 HttpServer::~HttpServer() {
 	ESP_LOGD(LOG_TAG, "~HttpServer");
+	if (m_workerQueue != nullptr) {
+		::vQueueDelete(m_workerQueue);
+	}
+	delete m_pFileCache;
+	for (auto it = m_eventStreams.begin(); it != m_eventStreams.end(); ++it) {
+		delete it->second.pStream;
+	}
+	for (auto it = m_responseCaches.begin(); it != m_responseCaches.end(); ++it) {
+		delete *it;
+	}
 }
 
 
+/**
+ * @brief Reject a connection.
+ * We send a minimal response with the given status and close the connection without reading (any
+ * more of) the request.  Used when the server is too busy or the request can't be parsed.
+ * @param [in] clientSocket The connection to reject.
+ * @param [in] status The status code of the response.
+ * @param [in] message The status message of the response.
+ */
+static void sendStatusAndClose(Socket& clientSocket, int status, const char* message) {
+	std::ostringstream oss;
+	oss << "HTTP/1.1 " << status << " " << message << "\r\n"
+		<< HttpRequest::HTTP_HEADER_CONNECTION << ": close\r\n"
+		<< HttpRequest::HTTP_HEADER_CONTENT_LENGTH << ": 0\r\n";
+	if (status == HttpResponse::HTTP_STATUS_SERVICE_UNAVAILABLE || status == HttpResponse::HTTP_STATUS_TOO_MANY_REQUESTS) {
+		oss << "Retry-After: 1\r\n";
+	}
+	oss << "\r\n";
+	clientSocket.send(oss.str());
+	clientSocket.close();
+} // sendStatusAndClose
+
+
 /**
  * @brief Be an HTTP server task.
  * Here we define a Task that will be run when the HTTP server starts.  It is this task
@@ -60,106 +113,750 @@ private:
 	HttpServer* m_pHttpServer; // Reference to the HTTP Server
 
 	/**
-	 * @brief Process an incoming HTTP Request
-	 *
-	 * We examine each of the path handlers to see if we have a match for the method/path pair.  If we do,
-	 * we invoke the handler callback passing in both the request and response.
-	 *
-	 * If we didn't find a handler, then we are going to behave as a Web Server and try and serve up the
-	 * content from the file on the "file system".
-	 *
-	 * @param [in] request The HTTP request to process.
+	 * @brief Perform the task handling for server.
+	 * We loop forever waiting for new client connections to arrive.  When they do, we parse the
+	 * content and look for a handler for that content.
+	 * @param [in] data A reference to the HttpServer.
 	 */
-	void processRequest(HttpRequest& request) {
-		ESP_LOGD("HttpServerTask", ">> processRequest: Method: %s, Path: %s",
-			request.getMethod().c_str(), request.getPath().c_str());
-
-		// Loop over all the path handlers we have looking for the first one that matches.  Note that none of them
-		// need to match.  If we find one that does, then invoke the handler and that is the end of processing.
-		for (auto pathHandlerIterartor = m_pHttpServer->m_pathHandlers.begin();
-				pathHandlerIterartor != m_pHttpServer->m_pathHandlers.end();
-				++pathHandlerIterartor) {
-			if (pathHandlerIterartor->match(request.getMethod(), request.getPath())) { // Did we match the handler?
-				ESP_LOGD("HttpServerTask", "Found a path handler match!!");
-				if (request.isWebsocket()) {                                     // Is this handler to be invoked for a web socket?
-					pathHandlerIterartor->invokePathHandler(&request, nullptr);    // Invoke the handler.
-					request.getWebSocket()->startReader();
-				} else {
-					HttpResponse response(&request);
-					pathHandlerIterartor->invokePathHandler(&request, &response); // Invoke the handler.
+	void run(void* data) {
+		m_pHttpServer = (HttpServer*) data;			 // The passed in data is an instance of an HttpServer.
+		m_pHttpServer->m_socket.setSSL(m_pHttpServer->m_useSSL, m_pHttpServer->m_pSSLContext);
+		m_pHttpServer->m_socket.listen(m_pHttpServer->m_portNumber, false /* is datagram */, true /* Allow address reuse */);
+		ESP_LOGD("HttpServerTask", "Listening on port %d", m_pHttpServer->getPort());
+		Socket clientSocket;
+		while (true) {   // Loop forever.
+			ESP_LOGD("HttpServerTask", "Waiting for new peer client");
+
+			try {
+				clientSocket = m_pHttpServer->m_socket.accept(m_pHttpServer->getClientTimeout());   // Block waiting for a new external client connection.
+				if (!clientSocket.isValid()) continue;   // The SSL handshake failed.
+				clientSocket.setNoDelay(true);   // Responses are written whole, don't hold back their last segment.
+			} catch (std::exception& e) {
+				ESP_LOGE("HttpServerTask", "Caught an exception waiting for new client!");
+				// Tell each of the workers to end.  A null connection is the signal to do so.
+				for (uint8_t i = 0; i < m_pHttpServer->m_workerCount; i++) {
+					Socket* pEnd = nullptr;
+					::xQueueSendToBack(m_pHttpServer->m_workerQueue, &pEnd, portMAX_DELAY);
 				}
-				return;                                                         // End of processing the request
-			} // Path handler match
-		} // For each path handler
+				HttpResponse::releaseFileBuffer();
+				m_pHttpServer->m_semaphoreServerStarted.give();  // Release the semaphore .. we are now no longer running.
+				return;
+			}
+
+			ESP_LOGD("HttpServerTask", "HttpServer that was listening on port %d has received a new client connection; sockFd=%d", m_pHttpServer->getPort(), clientSocket.getFD());
+			if (m_pHttpServer->m_workerCount == 0) {
+				m_pHttpServer->handleConnection(clientSocket);
+				continue;
+			}
+
+			// Hand the connection to the next free worker.  If all the workers are busy and the queue of
+			// waiting connections is full, we shed the load rather than letting clients pile up.
+			Socket* pClientSocket = new Socket(clientSocket);
+			if (::xQueueSendToBack(m_pHttpServer->m_workerQueue, &pClientSocket, 0) != pdTRUE) {
+				ESP_LOGW("HttpServerTask", "All workers busy, rejecting connection; sockFd=%d", clientSocket.getFD());
+				delete pClientSocket;
+				m_pHttpServer->m_metrics.recordRejection(HttpMetrics::REJECT_BUSY);
+				sendStatusAndClose(clientSocket, HttpResponse::HTTP_STATUS_SERVICE_UNAVAILABLE, "Service Unavailable");
+			}
+		} // while
+	} // run
+}; // HttpServerTask
+
+
+/**
+ * @brief A task that serves connections accepted by the HttpServerTask.
+ * When the server is started with workers, the listening task only accepts connections and queues
+ * them.  Each worker takes the next connection from the queue and serves all its requests, so a slow
+ * client only holds up its own worker.
+ */
+class HttpServerWorkerTask: public Task {
+public:
+	HttpServerWorkerTask(std::string name, uint16_t stackSize): Task(name, stackSize) {
+	};
+
+private:
+	/**
+	 * @brief Serve queued connections until the server is stopped.
+	 * @param [in] data A reference to the HttpServer.
+	 */
+	void run(void* data) {
+		HttpServer* pHttpServer = (HttpServer*) data;
+		while (true) {
+			Socket* pClientSocket = nullptr;
+			::xQueueReceive(pHttpServer->m_workerQueue, &pClientSocket, portMAX_DELAY);
+			if (pClientSocket == nullptr) break;   // The server is stopping.
+			ESP_LOGD("HttpServerWorkerTask", "Serving connection; sockFd=%d", pClientSocket->getFD());
+			pHttpServer->handleConnection(*pClientSocket);
+			delete pClientSocket;
+		}
+		HttpResponse::releaseFileBuffer();
+		ESP_LOGD("HttpServerWorkerTask", "<< run");
+	} // run
+}; // HttpServerWorkerTask
 
-		ESP_LOGD("HttpServerTask", "No Path handler found");
-		// If we reach here, then we did not find a handler for the request.
 
+/**
+ * @brief Serve all connections from a single task by waiting on their sockets.
+ * In event driven mode a single task watches the listening socket, the persistent HTTP connections
+ * and all the WebSocket connections with select().  Work is only done for a connection when data has
+ * arrived for it: a complete request is then served or the next WebSocket frame is dispatched to its
+ * handler.  As no task (and stack) is needed per WebSocket, many more of them can be kept open.
+ *
+ * Note that once data has arrived, the rest of the request or frame is read with blocking reads
+ * before it is dispatched.  These reads, and the SSL handshake of a new connection, are bounded by
+ * the client timeout: a WebSocket whose frame stops arriving part way is closed.
+ */
+class HttpServerReactorTask: public Task {
+public:
+	HttpServerReactorTask(std::string name): Task(name, 16 * 1024) {
+		m_pHttpServer = nullptr;
+	};
+
+private:
+	// A persistent HTTP connection waiting for its next request.
+	struct HttpConnection {
+		Socket      socket;
+		HttpParser* pParser;       // Parses requests as their data arrives.
+		uint32_t    requestCount;  // Number of requests served on the connection.
+		uint32_t    lastActivity;  // Time (ms) data last arrived on the connection.
+		uint32_t    address;       // The client address counted against the connections per client.
+		bool        handshaking;   // Is the SSL handshake still being made?
+	};
+
+	HttpServer*                 m_pHttpServer;   // Reference to the HTTP Server
+	std::vector<HttpConnection> m_connections;   // Connections that may carry further requests.
+	std::vector<WebSocket*>     m_webSockets;    // Open WebSocket connections.
+	std::vector<WebSocket*>     m_closedWebSockets;   // Closed WebSockets waiting to be deleted.
 
-		if (request.isWebsocket()) { 		       // Check to see if we have an un-handled WebSocket
-			request.getWebSocket()->close();     // If we do, close the socket as there is nothing further to do.
+	/**
+	 * @brief Accept a new client connection.
+	 * The SSL handshake isn't made here but by serveConnection() as the client's data arrives, so a
+	 * slow client doesn't hold up the other connections.
+	 */
+	void acceptConnection() {
+		HttpConnection connection;
+		try {
+			connection.socket = m_pHttpServer->m_socket.accept(m_pHttpServer->getClientTimeout(), false /* handshake */);
+		} catch (std::exception& e) {
+			ESP_LOGE("HttpServerReactorTask", "Caught an exception accepting a new client!");
 			return;
 		}
+		if (!connection.socket.isValid()) return;   // The SSL state couldn't be set up.
+		if (!m_pHttpServer->admitClient(connection.socket, &connection.address)) return;
+		connection.socket.setNoDelay(true);
+		connection.pParser      = new HttpParser(m_pHttpServer->m_maxHeaderSize);
+		m_pHttpServer->configureParser(*connection.pParser);
+		connection.requestCount = 0;
+		connection.lastActivity = FreeRTOS::getTimeSinceStart();
+		connection.handshaking  = connection.socket.getSSL();
+		m_connections.push_back(connection);
+		m_pHttpServer->m_metrics.connectionOpened();
+		ESP_LOGD("HttpServerReactorTask", "New client connection; sockFd=%d, connections: %d", connection.socket.getFD(), m_connections.size());
+	} // acceptConnection
+
+
+	/**
+	 * @brief Read the data that has arrived on a connection and serve the requests it completes.
+	 * Until the SSL handshake is over, the data goes to the handshake.  After that it is handed to
+	 * the connection's parser.  Nothing is done until the head of a request is complete.  Requests
+	 * pipelined behind it are served straight away.
+	 * @param [in] index The index of the connection in m_connections.
+	 */
+	void serveConnection(size_t index) {
+		HttpConnection& connection = m_connections[index];
+		if (connection.handshaking) {   // The handshake has the client timeout from the accept to complete.
+			int rc = connection.socket.tryHandshake();
+			if (rc < 0) {                 // The socket has been closed.
+				removeConnection(index);
+				return;
+			}
+			if (rc == 0) return;
+			connection.handshaking  = false;
+			connection.lastActivity = FreeRTOS::getTimeSinceStart();
+			return;                       // select() reports the request when it arrives.
+		}
+		connection.lastActivity = FreeRTOS::getTimeSinceStart();
+		HttpParser::ParseResult result = connection.pParser->receive(connection.socket);
+		while (result == HttpParser::PARSE_COMPLETE) {
+			WebSocket* pWebSocket = nullptr;
+			connection.requestCount++;
+			HttpServer::ConnectionState state = m_pHttpServer->serveRequest(connection.socket, *connection.pParser, connection.requestCount, &pWebSocket);
+			if (state != HttpServer::CONNECTION_KEEP_ALIVE) {
+				if (state == HttpServer::CONNECTION_WEBSOCKET) {
+					pWebSocket->m_eventDriven    = true;   // Frames are received whole before they are processed.
+					pWebSocket->m_receiveTimeout = m_pHttpServer->getClientTimeout();
+					m_webSockets.push_back(pWebSocket);
+				}
+				removeConnection(index);
+				return;
+			}
+			result = connection.pParser->parseBuffered();
+		}
+		if (result == HttpParser::PARSE_ERROR) {
+			m_pHttpServer->rejectRequest(connection.socket, connection.pParser->getError());
+			removeConnection(index);
+		}
+	} // serveConnection
 
-		// Serve up the content from the file on the file system ... if found ...
 
-		std::string fileName = m_pHttpServer->getRootPath() + request.getPath(); // Build the absolute file name to read.
+	/**
+	 * @brief Forget a connection that has been closed or handed to a WebSocket.
+	 * @param [in] index The index of the connection in m_connections.
+	 */
+	void removeConnection(size_t index) {
+		m_pHttpServer->m_metrics.connectionClosed();
+		m_pHttpServer->releaseClient(m_connections[index].address);
+		delete m_connections[index].pParser;
+		m_connections.erase(m_connections.begin() + index);
+	} // removeConnection
 
-		// If the file name ends with a '/' then remove it ... we are normalizing to NO trailing slashes.
-		if (GeneralUtils::endsWith(fileName, '/')) {
-			fileName = fileName.substr(0, fileName.length() - 1);
+
+	/**
+	 * @brief Close the persistent connections that have been idle for too long.
+	 * A connection whose request head is being trickled is answered with 408 once the header timeout
+	 * has passed, however recently data arrived.
+	 */
+	void expireIdleConnections() {
+		uint32_t now = FreeRTOS::getTimeSinceStart();
+		for (size_t i = m_connections.size(); i-- > 0;) {
+			if (m_connections[i].pParser->isHeadOverdue()) {
+				ESP_LOGW("HttpServerReactorTask", "Request head too slow; sockFd=%d", m_connections[i].socket.getFD());
+				m_pHttpServer->rejectRequest(m_connections[i].socket, HttpParser::ERROR_TIMEOUT);
+				removeConnection(i);
+				continue;
+			}
+			// A connection in the middle of its handshake or of sending a request gets the client timeout, an
+			// idle one the keep alive timeout.
+			uint32_t timeout = (m_connections[i].handshaking || m_connections[i].pParser->hasBufferedData()) ?
+				m_pHttpServer->getClientTimeout() : m_pHttpServer->getKeepAliveTimeout();
+			if (now - m_connections[i].lastActivity > timeout * 1000) {
+				ESP_LOGD("HttpServerReactorTask", "Closing idle connection; sockFd=%d", m_connections[i].socket.getFD());
+				m_connections[i].socket.close();
+				removeConnection(i);
+			}
 		}
+	} // expireIdleConnections
+
+
+	/**
+	 * @brief Stop serving a WebSocket that has closed, here or in another task.
+	 * The WebSocket is deleted once its handler has been told and no hub broadcast is still using it.
+	 * @param [in] index The index of the WebSocket in m_webSockets.
+	 */
+	void retireWebSocket(size_t index) {
+		WebSocket* pWebSocket = m_webSockets[index];
+		pWebSocket->closeSocket();   // Does nothing if it has already been closed.
+		pWebSocket->releaseReadState();
+		m_webSockets.erase(m_webSockets.begin() + index);
+		m_closedWebSockets.push_back(pWebSocket);
+		deleteClosedWebSockets();
+	} // retireWebSocket
 
-		HttpResponse response(&request);
-		// Test if the path is a directory.
-		if (FileSystem::isDirectory(fileName)) {
-			ESP_LOGD(LOG_TAG, "Path %s is a directory", fileName.c_str());
-			m_pHttpServer->listDirectory(fileName, response);   // List the contents of the directory.
-			return;
-		} // Path was a directory.
 
-		response.sendFile(fileName, m_pHttpServer->getFileBufferSize());
-	} // processRequest
+	/**
+	 * @brief Delete the closed WebSockets that nothing is using any more.
+	 * One closed by another task may still be telling its handler, and a hub may be broadcasting to it.
+	 */
+	void deleteClosedWebSockets() {
+		for (size_t i = m_closedWebSockets.size(); i-- > 0;) {
+			WebSocket* pWebSocket = m_closedWebSockets[i];
+			if (!pWebSocket->m_closed || pWebSocket->m_users > 0) continue;
+			delete pWebSocket;
+			m_closedWebSockets.erase(m_closedWebSockets.begin() + i);
+		}
+	} // deleteClosedWebSockets
+
+
+	/**
+	 * @brief Close everything when the server stops.
+	 * We wait for the closed WebSockets to be released so that none is left behind.
+	 */
+	void closeAll() {
+		for (size_t i = m_connections.size(); i-- > 0;) {
+			m_connections[i].socket.close();
+			removeConnection(i);
+		}
+		for (size_t i = m_webSockets.size(); i-- > 0;) {
+			m_webSockets[i]->close(WebSocket::CLOSE_GOING_AWAY);
+			retireWebSocket(i);       // Nobody will be reading the answer.
+		}
+		while (!m_closedWebSockets.empty()) {
+			FreeRTOS::sleep(10);
+			deleteClosedWebSockets();
+		}
+	} // closeAll
 
 
 	/**
 	 * @brief Perform the task handling for server.
-	 * We loop forever waiting for new client connections to arrive.  When they do, we parse the
-	 * content and look for a handler for that content.
+	 * We loop until the server is stopped waiting for any of our sockets to have data to read.
 	 * @param [in] data A reference to the HttpServer.
 	 */
 	void run(void* data) {
 		m_pHttpServer = (HttpServer*) data;			 // The passed in data is an instance of an HttpServer.
-		m_pHttpServer->m_socket.setSSL(m_pHttpServer->m_useSSL);
+		m_pHttpServer->m_socket.setSSL(m_pHttpServer->m_useSSL, m_pHttpServer->m_pSSLContext);
 		m_pHttpServer->m_socket.listen(m_pHttpServer->m_portNumber, false /* is datagram */, true /* Allow address reuse */);
-		ESP_LOGD("HttpServerTask", "Listening on port %d", m_pHttpServer->getPort());
-		Socket clientSocket;
-		while (true) {   // Loop forever.
-			ESP_LOGD("HttpServerTask", "Waiting for new peer client");
-
-			try {
-				clientSocket = m_pHttpServer->m_socket.accept();   // Block waiting for a new external client connection.
-				clientSocket.setTimeout(m_pHttpServer->getClientTimeout());
-			} catch (std::exception& e) {
-				ESP_LOGE("HttpServerTask", "Caught an exception waiting for new client!");
-				m_pHttpServer->m_semaphoreServerStarted.give();  // Release the semaphore .. we are now no longer running.
-				return;
+		ESP_LOGD("HttpServerReactorTask", "Listening on port %d", m_pHttpServer->getPort());
+
+		while (m_pHttpServer->m_socket.isValid()) {   // Loop until the server socket is closed by stop().
+			fd_set readSet;
+			fd_set writeSet;   // The WebSockets with frames waiting for the socket to take more.
+			FD_ZERO(&readSet);
+			FD_ZERO(&writeSet);
+			int listenFd = m_pHttpServer->m_socket.getFD();
+			int maxFd = listenFd;
+			FD_SET(listenFd, &readSet);
+			bool buffered = false;   // Has the SSL layer already read data for one of the sockets?
+			for (auto it = m_connections.begin(); it != m_connections.end(); ++it) {
+				FD_SET(it->socket.getFD(), &readSet);
+				maxFd = std::max(maxFd, it->socket.getFD());
+				buffered = buffered || it->socket.hasBufferedData();
+			}
+			// WebSockets that another task has closed are dropped rather than waited on.
+			std::vector<int> webSocketFds(m_webSockets.size());
+			for (size_t i = m_webSockets.size(); i-- > 0;) {
+				bool pendingSend;   // Are frames waiting for the socket to take more?
+				int fd = m_webSockets[i]->getPollFD(&pendingSend);
+				if (fd < 0) {
+					retireWebSocket(i);
+					webSocketFds.erase(webSocketFds.begin() + i);
+					continue;
+				}
+				webSocketFds[i] = fd;
+				FD_SET(fd, &readSet);
+				if (pendingSend) {
+					FD_SET(fd, &writeSet);
+				}
+				maxFd = std::max(maxFd, fd);
+				buffered = buffered || m_webSockets[i]->hasBufferedData();
+			}
+			deleteClosedWebSockets();
+
+			// Wake up at least once a second to expire idle connections and notice a stop().
+			struct timeval tv;
+			tv.tv_sec  = buffered ? 0 : 1;
+			tv.tv_usec = 0;
+			int rc = ::select(maxFd + 1, &readSet, &writeSet, nullptr, &tv);
+			if (rc < 0) {
+				if (!m_pHttpServer->m_socket.isValid()) break;
+				ESP_LOGE("HttpServerReactorTask", "select: %s", strerror(errno));
+				continue;
 			}
 
-			ESP_LOGD("HttpServerTask", "HttpServer that was listening on port %d has received a new client connection; sockFd=%d", m_pHttpServer->getPort(), clientSocket.getFD());
+			// Write queued WebSocket frames and dispatch arriving ones.  Iterate backwards so that closed
+			// web sockets can be removed.
+			for (size_t i = m_webSockets.size(); i-- > 0;) {
+				WebSocket* pWebSocket = m_webSockets[i];
+				if (FD_ISSET(webSocketFds[i], &writeSet) && !pWebSocket->flush()) {
+					retireWebSocket(i);
+					continue;
+				}
+				bool ready = FD_ISSET(webSocketFds[i], &readSet) || pWebSocket->hasBufferedData();
+				if ((ready && !pWebSocket->processReceived()) || !pWebSocket->checkTimeouts()) {   // Also pings idle peers.
+					retireWebSocket(i);
+				}
+			}
 
-			HttpRequest request(clientSocket);   // Build the HTTP Request from the socket.
-			if (request.isWebsocket()) {        // If this is a WebSocket
-				clientSocket.setTimeout(0);     //   Clear the timeout.
+			// Serve HTTP requests that have arrived.
+			for (size_t i = m_connections.size(); i-- > 0;) {
+				if (!FD_ISSET(m_connections[i].socket.getFD(), &readSet) && !m_connections[i].socket.hasBufferedData()) continue;
+				serveConnection(i);
 			}
-			request.dump();                      // debug.
-			processRequest(request);             // Process the request.
-			if (!request.isWebsocket()) {        // If this is NOT a WebSocket, then close it as the request
-				request.close();                   //   has been completed.
+
+			if (rc > 0 && m_pHttpServer->m_socket.isValid() && FD_ISSET(listenFd, &readSet)) {
+				acceptConnection();
 			}
+			expireIdleConnections();
 		} // while
+
+		ESP_LOGD("HttpServerReactorTask", "Server socket closed, ending");
+		closeAll();
+		HttpResponse::releaseFileBuffer();
+		m_pHttpServer->m_semaphoreServerStarted.give();  // Release the semaphore .. we are now no longer running.
 	} // run
-}; // HttpServerTask
+}; // HttpServerReactorTask
+
+
+/**
+ * @brief Serve the requests arriving on a client connection.
+ * The first request is read from the connection and processed.  If both the client and the response
+ * allow it (HTTP/1.1 keep alive), further requests are then read from the same connection until the
+ * client closes it, it has been idle for longer than the keep alive timeout or the maximum number of
+ * requests per connection has been reached.  Requests that were pipelined by the client are already
+ * waiting on the socket and are served immediately.
+ * @param [in] clientSocket The newly accepted client connection.
+ */
+void HttpServer::handleConnection(Socket clientSocket) {
+	uint32_t address;
+	if (!admitClient(clientSocket, &address)) return;
+	HttpParser parser(m_maxHeaderSize);   // Parses each of the requests on the connection.
+	configureParser(parser);
+	uint32_t requestCount = 0;
+	m_metrics.connectionOpened();
+	while (true) {
+		requestCount++;
+		if (serveRequest(clientSocket, parser, requestCount, nullptr) != CONNECTION_KEEP_ALIVE) {
+			break;
+		}
+		if (!waitForNextRequest(clientSocket, parser)) {
+			ESP_LOGD(LOG_TAG, "Closing idle persistent connection; sockFd=%d, requests: %" PRIu32, clientSocket.getFD(), requestCount);
+			clientSocket.close();
+			break;
+		}
+	} // while
+	m_metrics.connectionClosed();
+	releaseClient(address);
+} // handleConnection
+
+
+/**
+ * @brief Process an incoming HTTP Request
+ *
+ * We examine each of the path handlers to see if we have a match for the method/path pair.  If we do,
+ * we invoke the handler callback passing in both the request and response.
+ *
+ * If we didn't find a handler, then we are going to behave as a Web Server and try and serve up the
+ * content from the file on the "file system".
+ *
+ * @param [in] request The HTTP request to process.
+ * @param [in] response The response to the request.  It isn't used for a WebSocket.
+ * @return The index of the route that served the request in the metrics.
+ */
+size_t HttpServer::processRequest(HttpRequest& request, HttpResponse& response) {
+	ESP_LOGD("HttpServerTask", ">> processRequest: Method: %s, Path: %s",
+		request.getMethod().c_str(), request.getPath().c_str());
+
+	// Look up the handler of the path in the route table.  The handlers registered with a regular expression
+	// are only tried, in the order they were registered, when no route matches.  Note that none of them need
+	// to match.  If we find one that does, then invoke the handler and that is the end of processing.
+	std::string_view path = request.getPathView();
+	if (!m_metricsPath.empty() && path.substr(0, path.find('?')) == m_metricsPath && !request.isWebsocket()) {
+		// The metrics are only read: a HEAD is answered with the header alone and any other method is refused.
+		if (request.getMethodView() == HttpRequest::HTTP_METHOD_GET) {
+			m_metrics.writePrometheus(&response);
+		} else if (request.getMethodView() == HttpRequest::HTTP_METHOD_HEAD) {
+			response.addHeader(HttpRequest::HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+			response.setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
+			response.close();
+		} else {
+			response.addHeader(HttpRequest::HTTP_HEADER_ALLOW, "GET, HEAD");
+			response.setStatus(HttpResponse::HTTP_STATUS_METHOD_NOT_ALLOWED, "Method Not Allowed");
+			response.close();
+		}
+		return METRICS_ROUTE_METRICS;
+	}
+	if (!m_eventStreams.empty() && !request.isWebsocket() && request.getMethodView() == "GET") {
+		auto eventStream = m_eventStreams.find(std::string(path.substr(0, path.find('?'))));
+		if (eventStream != m_eventStreams.end()) {
+			eventStream->second.pStream->subscribe(&request, &response);   // The stream now holds the connection.
+			return eventStream->second.metricsRoute;
+		}
+	}
+	int routeId = -1;
+	size_t route = METRICS_ROUTE_FILES;
+	HttpRouter::Handler handler = m_router.find(request.getMethodView(), path.substr(0, path.find('?')), &request.m_params, &routeId);
+	if (handler != nullptr) {
+		route = m_routeMetrics[routeId];
+	}
+	for (size_t i = 0; handler == nullptr && i < m_pathHandlers.size(); i++) {
+		if (m_pathHandlers[i].match(request.getMethod(), request.getPath())) {
+			handler = m_pathHandlers[i].getHandler();
+			route   = m_pathHandlerMetrics[i];
+		}
+	}
+	if (handler != nullptr) {                                           // Did we match a handler?
+		ESP_LOGD("HttpServerTask", "Found a path handler match!!");
+		if (request.isWebsocket()) {                                      // Is this handler to be invoked for a web socket?
+			handler(&request, nullptr);                                     // Invoke the handler.
+			if (!m_eventDriven) {                                           // In event driven mode the server task reads the web socket.
+				request.getWebSocket()->startReader();
+			}
+		} else if (routeId >= 0 && (size_t) routeId < m_responseCaches.size() && m_responseCaches[routeId] != nullptr) {
+			m_responseCaches[routeId]->serve(&request, &response, handler); // Answer from the cache or invoke the handler.
+			response.close();
+		} else {
+			handler(&request, &response);                                   // Invoke the handler.
+			response.close();                                               // Complete the response if the handler didn't.
+		}
+		return route;                                                     // End of processing the request
+	} // Path handler match
+
+	ESP_LOGD("HttpServerTask", "No Path handler found");
+	// If we reach here, then we did not find a handler for the request.
+
+
+	if (request.isWebsocket()) { 		       // Check to see if we have an un-handled WebSocket
+		request.getWebSocket()->close();     // If we do, close the socket as there is nothing further to do.
+		return route;
+	}
+
+	// Serve up the content from the file on the file system ... if found ...
+
+	std::string fileName = getRootPath() + std::string(path.substr(0, path.find('?'))); // Build the absolute file name to read.
+
+	// If the file name ends with a '/' then remove it ... we are normalizing to NO trailing slashes.
+	if (GeneralUtils::endsWith(fileName, '/')) {
+		fileName = fileName.substr(0, fileName.length() - 1);
+	}
+
+	// Test if the path is a directory.
+	if (m_directoryListing && FileSystem::isDirectory(fileName)) {
+		ESP_LOGD(LOG_TAG, "Path %s is a directory", fileName.c_str());
+		listDirectory(fileName, request, response);   // List the contents of the directory.
+		return route;
+	} // Path was a directory.
+
+	// The longest matching path prefix decides how long the client may cache the file.
+	auto cacheControl = m_cacheControl.end();
+	for (auto it = m_cacheControl.begin(); it != m_cacheControl.end(); ++it) {
+		if (path.compare(0, it->first.length(), it->first) == 0 &&
+				(cacheControl == m_cacheControl.end() || it->first.length() > cacheControl->first.length())) {
+			cacheControl = it;
+		}
+	}
+	if (cacheControl != m_cacheControl.end()) {
+		response.addHeader(HttpRequest::HTTP_HEADER_CACHE_CONTROL, cacheControl->second);
+	}
+
+	response.sendFile(fileName, getFileBufferSize(), m_pFileCache);
+	return route;
+} // processRequest
+
+
+/**
+ * @brief Read and serve one request from a client connection.
+ * @param [in] clientSocket The client connection.
+ * @param [in] parser The parser of the connection.  The head of the request may already have been parsed.
+ * @param [in] requestCount The number of this request on the connection, starting at 1.
+ * @param [out] ppWebSocket If not null, receives the WebSocket when the request upgraded the connection.
+ * @return What has become of the connection.
+ */
+HttpServer::ConnectionState HttpServer::serveRequest(Socket& clientSocket, HttpParser& parser, uint32_t requestCount, WebSocket** ppWebSocket) {
+	if (!parser.parse(clientSocket)) {
+		rejectRequest(clientSocket, parser.getError());
+		return CONNECTION_CLOSED;
+	}
+	if (m_maxBodySize > 0 && parser.getContentLength() > m_maxBodySize) {
+		ESP_LOGW(LOG_TAG, "Request body of %d bytes is too large; sockFd=%d", parser.getContentLength(), clientSocket.getFD());
+		m_metrics.recordRejection(HttpMetrics::REJECT_TOO_LARGE);
+		sendStatusAndClose(clientSocket, HttpResponse::HTTP_STATUS_PAYLOAD_TOO_LARGE, "Payload Too Large");
+		return CONNECTION_CLOSED;
+	}
+	HttpRequest request(clientSocket, &parser, &m_webSocketDeflate);   // Build the HTTP Request from the parsed data.
+	if (m_keepAliveTimeout == 0 || requestCount >= m_maxKeepAliveRequests) {
+		request.setKeepAlive(false);       // This is the last request we will serve on this connection.
+	}
+	if (request.isWebsocket() && ppWebSocket == nullptr) {   // A WebSocket read by its own task
+		clientSocket.setTimeout(0);      //   Clear the timeout.  The event loop keeps it to bound writes over SSL.
+	}
+	m_metrics.requestStarted();
+	int64_t start = esp_timer_get_time();
+	HttpResponse response(&request);
+	size_t route = processRequest(request, response);   // Process the request.
+	uint32_t durations[HttpMetrics::PHASE_COUNT];
+	durations[HttpMetrics::PHASE_PARSE]   = parser.getHeadTime();
+	durations[HttpMetrics::PHASE_SEND]    = response.getSendTime();
+	durations[HttpMetrics::PHASE_HANDLER] = (uint32_t) (esp_timer_get_time() - start) - durations[HttpMetrics::PHASE_SEND];
+	m_metrics.recordRequest(route,
+		request.isWebsocket() ? HttpResponse::HTTP_STATUS_SWITCHING_PROTOCOL : response.getStatus(),
+		parser.getHeadLength() + parser.getBodyLength(), response.getBytesSent(), durations);
+	m_metrics.requestEnded();
+	if (parser.getError() == HttpParser::ERROR_TIMEOUT) {   // The body arrived too slowly.
+		m_metrics.recordRejection(HttpMetrics::REJECT_TIMEOUT);
+	}
+	if (request.isWebsocket()) {          // A WebSocket now owns the connection.
+		if (ppWebSocket != nullptr) {
+			*ppWebSocket = request.getWebSocket();
+		}
+		return request.getWebSocket()->m_socket.isValid() ? CONNECTION_WEBSOCKET : CONNECTION_CLOSED;
+	}
+	if (response.isDetached()) {          // Someone else now owns the connection.
+		return CONNECTION_DETACHED;
+	}
+	if (request.isClosed()) {             // The response did not allow the connection to be reused.
+		return CONNECTION_CLOSED;
+	}
+	if (!request.skipBody(MAX_BODY_SKIP)) {  // The next request can't be found without reading this body.
+		request.close();
+		return CONNECTION_CLOSED;
+	}
+	parser.reset();                       // Keep any pipelined data for the next request.
+	return CONNECTION_KEEP_ALIVE;
+} // serveRequest
+
+
+/**
+ * @brief Wait for the next request on a persistent connection.
+ * We wait at most the keep alive timeout for the client to send a further request.  An idle persistent
+ * connection stops new clients from being served by the task holding it.  If a new client is waiting
+ * (a connection on the listening socket, or in the worker queue when using workers) we give up on the
+ * idle connection so that the new client can be served.
+ * @param [in] clientSocket The persistent client connection.
+ * @param [in] parser The parser of the connection.
+ * @return True if a request is waiting to be read, false if the connection should be closed.
+ */
+bool HttpServer::waitForNextRequest(Socket& clientSocket, HttpParser& parser) {
+	if (parser.hasBufferedData()) return true;         // Pipelined data already received.
+	if (clientSocket.hasBufferedData()) return true;   // Pipelined data already read by the SSL layer.
+
+	// Workers can't watch the queue with select() so they look at it between short waits.
+	uint32_t sliceMs   = (m_workerCount == 0) ? m_keepAliveTimeout * 1000 : 250;
+	uint32_t waitedMs  = 0;
+	while (waitedMs < m_keepAliveTimeout * 1000) {
+		fd_set readSet;
+		FD_ZERO(&readSet);
+		FD_SET(clientSocket.getFD(), &readSet);
+		int maxFd = clientSocket.getFD();
+		if (m_workerCount == 0) {
+			FD_SET(m_socket.getFD(), &readSet);
+			maxFd = std::max(maxFd, m_socket.getFD());
+		}
+
+		struct timeval tv;
+		tv.tv_sec  = sliceMs / 1000;
+		tv.tv_usec = (sliceMs % 1000) * 1000;
+		int rc = ::select(maxFd + 1, &readSet, nullptr, nullptr, &tv);
+		if (rc < 0) return false;                                        // Error.
+		if (FD_ISSET(clientSocket.getFD(), &readSet)) return true;       // The next request has arrived.
+		if (rc > 0) return false;                                        // A new client is waiting to be accepted.
+		if (m_workerCount > 0 && ::uxQueueMessagesWaiting(m_workerQueue) > 0) return false;
+		waitedMs += sliceMs;
+	}
+	return false;                                                       // Idle timeout.
+} // waitForNextRequest
+
+
+/**
+ * @brief Count a new connection against the limit of connections per client.
+ * A client that already has as many connections as it may is answered with 429 and the connection
+ * is closed.
+ * @param [in] clientSocket The new connection.
+ * @param [out] pAddress The address of the client, to be passed to releaseClient() when the connection ends.
+ * @return True if the connection may be served.
+ */
+bool HttpServer::admitClient(Socket& clientSocket, uint32_t* pAddress) {
+	*pAddress = 0;
+	if (m_maxConnectionsPerClient == 0) return true;
+	struct sockaddr_in addr;
+	clientSocket.getPeer((struct sockaddr*) &addr);
+	*pAddress = addr.sin_addr.s_addr;
+	m_clientLock.take("admitClient");
+	uint16_t& count = m_clientConnections[*pAddress];
+	bool admitted = count < m_maxConnectionsPerClient;
+	if (admitted) {
+		count++;
+	}
+	m_clientLock.give();
+	if (!admitted) {
+		ESP_LOGW(LOG_TAG, "Too many connections from client; sockFd=%d", clientSocket.getFD());
+		m_metrics.recordRejection(HttpMetrics::REJECT_TOO_MANY_CONNECTIONS);
+		sendStatusAndClose(clientSocket, HttpResponse::HTTP_STATUS_TOO_MANY_REQUESTS, "Too Many Requests");
+	}
+	return admitted;
+} // admitClient
+
+
+/**
+ * @brief Apply the limits of the server to the parser of a connection.
+ * @param [in] parser The parser.
+ */
+void HttpServer::configureParser(HttpParser& parser) {
+	parser.setMaxBodySize(m_maxBodySize);
+	parser.setMaxHeaderCount(m_maxHeaderCount);
+	parser.setHeaderTimeout(m_headerTimeout * 1000);
+	parser.setMinBodyRate(m_minBodyRate, m_bodyRateGrace * 1000);
+} // configureParser
+
+
+/**
+ * @brief Answer a request whose head couldn't be read and close the connection.
+ * @param [in] clientSocket The client connection.
+ * @param [in] error Why the head couldn't be read.
+ */
+void HttpServer::rejectRequest(Socket& clientSocket, HttpParser::ParseError error) {
+	switch (error) {
+		case HttpParser::ERROR_MALFORMED:        // We received something that wasn't a request.
+			m_metrics.recordRejection(HttpMetrics::REJECT_BAD_REQUEST);
+			sendStatusAndClose(clientSocket, HttpResponse::HTTP_STATUS_BAD_REQUEST, "Bad Request");
+			break;
+
+		case HttpParser::ERROR_HEAD_TOO_LARGE:
+			m_metrics.recordRejection(HttpMetrics::REJECT_HEAD_TOO_LARGE);
+			sendStatusAndClose(clientSocket, HttpResponse::HTTP_STATUS_HEADER_FIELDS_TOO_LARGE, "Request Header Fields Too Large");
+			break;
+
+		case HttpParser::ERROR_TIMEOUT:
+			m_metrics.recordRejection(HttpMetrics::REJECT_TIMEOUT);
+			sendStatusAndClose(clientSocket, HttpResponse::HTTP_STATUS_REQUEST_TIMEOUT, "Request Timeout");
+			break;
+
+		default:                                 // The client closed the connection or it failed.
+			clientSocket.close();
+			break;
+	}
+} // rejectRequest
+
+
+/**
+ * @brief Forget a connection counted by admitClient().
+ * @param [in] address The address of the client.
+ */
+void HttpServer::releaseClient(uint32_t address) {
+	if (address == 0) return;
+	m_clientLock.take("releaseClient");
+	auto it = m_clientConnections.find(address);
+	if (it != m_clientConnections.end() && --it->second == 0) {
+		m_clientConnections.erase(it);
+	}
+	m_clientLock.give();
+} // releaseClient
+
+
+/**
+ * @brief Set the Cache-Control header sent with the files under a path.
+ *
+ * Example:
+ * @code{.cpp}
+ * webServer.addCacheControl("/", "no-cache");
+ * webServer.addCacheControl("/static/", "public, max-age=86400");
+ * @endcode
+ *
+ * When several prefixes match the path of a file, the longest one is used.
+ * @param [in] pathPrefix The start of the request paths to which the value applies.
+ * @param [in] value The value of the Cache-Control header.
+ */
+void HttpServer::addCacheControl(std::string pathPrefix, std::string value) {
+	m_cacheControl.push_back(std::make_pair(pathPrefix, value));
+} // addCacheControl
+
+
+/**
+ * @brief Serve a stream of Server-Sent Events at a path.
+ * A GET of the path subscribes the client to the stream and the connection is held open by the
+ * stream rather than by a task of the server.  The path takes precedence over the path handlers.
+ *
+ * Example:
+ * @code{.cpp}
+ * HttpEventStream* pTelemetry = webServer.addEventStream("/events");
+ * pTelemetry->publish("temperature", "21.5");
+ * @endcode
+ *
+ * @param [in] path The path of the stream, without a query.
+ * @param [in] queueSize The most events held for a subscriber that isn't keeping up.
+ * @param [in] historySize The number of recent events sent again to clients that reconnect.
+ * @return The stream, owned by the server.  Adding a path twice returns the existing stream.
+ */
+HttpEventStream* HttpServer::addEventStream(const std::string& path, size_t queueSize, size_t historySize) {
+	auto it = m_eventStreams.find(path);
+	if (it != m_eventStreams.end()) {
+		return it->second.pStream;
+	}
+	EventStreamRoute route;
+	route.pStream      = new HttpEventStream(queueSize, historySize);
+	route.metricsRoute = m_metrics.addRoute("GET " + path);
+	m_eventStreams[path] = route;
+	return route.pStream;
+} // addEventStream
 
 
 /**
@@ -188,7 +885,9 @@ void HttpServer::addPathHandler(
 		void (*handler)(HttpRequest* pHttpRequest, HttpResponse* pHttpResponse)) {
 
 	// We are maintaining a C++ vector of PathHandler objects.  We add a new entry into that vector.
+	// A regular expression has no text to name it by in the metrics so it is known by its position.
 	m_pathHandlers.push_back(PathHandler(method, pathExpr, handler));
+	m_pathHandlerMetrics.push_back(m_metrics.addRoute(method + " regex:" + std::to_string(m_pathHandlers.size() - 1)));
 } // addPathHandler
 
 
@@ -206,10 +905,15 @@ void HttpServer::addPathHandler(
  * }
  *
  * webServer.addPathHandler("GET", "/ESP32/WiFi", handle_REST_WiFi);
+ * webServer.addPathHandler("GET", "/ESP32/leds/:id", handle_REST_Led);   // pRequest->getParam("id")
  * @endcode
  *
+ * A path may contain `:name` segments, which match any one segment, and end with a `*` segment, which
+ * matches the rest of the path (available as "*").  The matched parts are available from HttpRequest::getParam().  The
+ * path is matched against the request path without its query.  See HttpRouter.
+ *
  * @param [in] method The method being used for access ("GET", "POST" etc).
- * @param [in] path The plain path being accessed.
+ * @param [in] path The path pattern being accessed.
  * @param [in] handler The callback function to be invoked when a request arrives.
  */
 void HttpServer::addPathHandler(
@@ -217,11 +921,35 @@ void HttpServer::addPathHandler(
 		std::string path,
 		void (*handler)(HttpRequest* pHttpRequest, HttpResponse* pHttpResponse)) {
 
-	// We are maintaining a C++ vector of PathHandler objects.  We add a new entry into that vector.
-	m_pathHandlers.push_back(PathHandler(method, path, handler));
+	// Plain paths are held in the route table.
+	int routeId = m_router.addRoute(method, path, handler);
+	if (routeId >= 0 && (size_t) routeId == m_routeMetrics.size()) {   // A new route rather than a new handler of a route.
+		m_routeMetrics.push_back(m_metrics.addRoute(method + " " + path));
+	}
 } // addPathHandler
 
 
+/**
+ * @brief Get the metrics of the server.
+ * For example, the latency histograms of a route can be read with getMetrics().getSnapshot().
+ * @return The metrics.
+ */
+HttpMetrics& HttpServer::getMetrics() {
+	return m_metrics;
+} // getMetrics
+
+
+/**
+ * @brief Get the event stream served at a path.
+ * @param [in] path The path the stream was added with.
+ * @return The stream or nullptr if there is none.
+ */
+HttpEventStream* HttpServer::getEventStream(const std::string& path) {
+	auto it = m_eventStreams.find(path);
+	return (it == m_eventStreams.end()) ? nullptr : it->second.pStream;
+} // getEventStream
+
+
 /**
  * @brief Get the size of the file buffer.
  * When serving up a file from the file system, we can't afford to read the whole file into RAM before
@@ -234,6 +962,43 @@ size_t HttpServer::getFileBufferSize() {
 } // getFileBufferSize
 
 
+/**
+ * @brief Get the cache of small files.
+ * The cache can be queried for its hit ratio and the bytes it saved.
+ * @return The cache or nullptr if caching is not enabled.
+ */
+HttpFileCache* HttpServer::getFileCache() {
+	return m_pFileCache;
+} // getFileCache
+
+
+/**
+ * @brief Get how long an idle persistent connection is kept open.
+ * @return The keep alive timeout in seconds.
+ */
+uint32_t HttpServer::getKeepAliveTimeout() {
+	return m_keepAliveTimeout;
+} // getKeepAliveTimeout
+
+
+/**
+ * @brief Get the size of the largest request body accepted.
+ * @return The size of the largest body, 0 if there is no limit.
+ */
+size_t HttpServer::getMaxBodySize() {
+	return m_maxBodySize;
+} // getMaxBodySize
+
+
+/**
+ * @brief Get the maximum number of requests served on one persistent connection.
+ * @return The maximum number of requests per connection.
+ */
+uint32_t HttpServer::getMaxKeepAliveRequests() {
+	return m_maxKeepAliveRequests;
+} // getMaxKeepAliveRequests
+
+
 /**
  * @brief Get the port number on which the HTTP Server is listening.
  * @return The port number on which the HTTP server is listening.
@@ -243,6 +1008,21 @@ uint16_t HttpServer::getPort() {
 } // getPort
 
 
+/**
+ * @brief Get the response cache of a GET route.
+ * The cache can be queried for its hit ratio and cleared when the resource changes.
+ * @param [in] path The path pattern the route was registered with.
+ * @return The cache or nullptr if the responses of the route aren't cached.
+ */
+HttpResponseCache* HttpServer::getResponseCache(const std::string& path) {
+	int routeId = m_router.getRouteId("GET", path);
+	if (routeId < 0 || (size_t) routeId >= m_responseCaches.size()) {
+		return nullptr;
+	}
+	return m_responseCaches[routeId];
+} // getResponseCache
+
+
 /**
  * @brief Get the current root path.
  * @return The current root path.
@@ -252,6 +1032,15 @@ std::string HttpServer::getRootPath() {
 } // getRootPath
 
 
+/**
+ * @brief Return whether or not all connections are served from a single event driven task.
+ * @return True if the server is event driven.
+ */
+bool HttpServer::getEventDriven() {
+	return m_eventDriven;
+} // getEventDriven
+
+
 /**
  * @brief Return whether or not we are using SSL.
  * @return True if we are using SSL.
@@ -261,12 +1050,26 @@ bool HttpServer::getSSL() {
 } // getSSL
 
 
+/**
+ * @brief Get the TLS configuration shared by the connections.
+ * It also counts the full, resumed and failed handshakes.
+ * @return The TLS configuration or nullptr if we aren't using SSL.
+ */
+SSLServerContext* HttpServer::getSSLContext() {
+	if (!m_useSSL) return nullptr;
+	return m_pSSLContext != nullptr ? m_pSSLContext : SSLServerContext::getDefault();
+} // getSSLContext
+
+
 /**
  * Send a directory listing back to the browser.
+ * The listing is streamed as the directory is read.  The query of the request may ask for JSON, a page
+ * of the entries and a sort order, see HttpDirectoryListing.
  * @param [in] path The path of the directory to list.
+ * @param [in] request The request for the directory.
  * @param [in] response The response object to use to send data back to the browser.
  */
-void HttpServer::listDirectory(std::string path, HttpResponse& response) {
+void HttpServer::listDirectory(std::string path, HttpRequest& request, HttpResponse& response) {
 	// If path ends with a "/" then remove it.
 	if (GeneralUtils::endsWith(path, '/')) {
 		path = path.substr(0, path.length()-1);
@@ -280,34 +1083,7 @@ void HttpServer::listDirectory(std::string path, HttpResponse& response) {
 		urlPath = urlPath.substr(getRootPath().length());
 	}
 
-	response.addHeader("Content-Type", "text/html");
-	response.setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
-	response.sendData("<html><head>");
-	if (!GeneralUtils::endsWith(path, '/')) {
-		response.sendData("<base href='" + urlPath + "/' />");
-	}
-	response.sendData("</head><body>");
-	response.sendData("<h1>" + path + "</h1>");
-	response.sendData("<hr/>");
-	response.sendData("<p><a href='..'>[To Parent Directory]</a></p>");
-	response.sendData("<table style='font-family: monospace;'>");
-	auto files = FileSystem::getDirectoryContents(path);
-	for (auto it = files.begin(); it != files.end(); ++it) {
-		std::stringstream ss;
-		ss << "<tr><td><a href='" << it->getName() << "'>" << it->getName() << "</a></td>";
-		if (it->isDirectory()) {
-			ss << "<td>&lt;dir&gt;</td>";
-		} else {
-			ss << "<td>" << it->length() << "</td>";
-		}
-
-		ss << "</tr>";
-		response.sendData(ss.str());
-		ESP_LOGD(LOG_TAG, "file: %s", ss.str().c_str());
-	}
-	response.sendData("</table>");
-	response.sendData("<hr/>");
-	response.sendData("</body></html>");
+	m_directoryIndex.send(path, urlPath, HttpDirectoryListing::getOptions(&request), &response);
 	response.close();
 } // listDirectory
 
@@ -339,6 +1115,19 @@ void HttpServer::setDirectoryListing(bool use) {
 } // setDirectoryListening
 
 
+/**
+ * @brief Set whether all connections are served from a single event driven task.
+ * By default the server task (or each worker task) blocks on one connection at a time and each
+ * WebSocket has its own reader task.  In event driven mode a single task waits on all the sockets
+ * at once and serves whichever has data, which scales to many idle connections and WebSockets with
+ * bounded memory.  Workers are not used in this mode.  Must be called before start().
+ * @param [in] use Set to true to use the event driven mode.
+ */
+void HttpServer::setEventDriven(bool use) {
+	m_eventDriven = use;
+} // setEventDriven
+
+
 /**
  * @brief Set the size of the file buffer.
  * When serving up a file from the file system, we can't afford to read the whole file into RAM before
@@ -351,6 +1140,156 @@ void HttpServer::setFileBufferSize(size_t fileBufferSize) {
 } // setFileBufferSize
 
 
+/**
+ * @brief Cache small files in RAM.
+ * Files served from the file system that are no larger than maxFileSize are kept in RAM, up to a
+ * total of maxBytes, so that frequently requested files don't have to be read from flash each time.
+ * Must be called before the server is started.
+ * @param [in] maxBytes The total size of the cached files.  0 disables the cache.
+ * @param [in] maxFileSize The size of the largest file that is cached.
+ */
+void HttpServer::setFileCache(size_t maxBytes, size_t maxFileSize) {
+	delete m_pFileCache;
+	m_pFileCache = (maxBytes > 0) ? new HttpFileCache(maxBytes, maxFileSize) : nullptr;
+} // setFileCache
+
+
+/**
+ * @brief Set how long the head of a request may take to arrive.
+ * The time runs from the first data of the request (or from the connection being accepted) however
+ * often data arrives, unlike the client timeout which only bounds each read.  A request that takes
+ * longer is answered with 408 Request Timeout.
+ * @param [in] timeout The timeout in seconds, 0 for no limit.
+ */
+void HttpServer::setHeaderTimeout(uint32_t timeout) {
+	m_headerTimeout = timeout;
+} // setHeaderTimeout
+
+
+/**
+ * @brief Set how long an idle persistent connection is kept open.
+ * After a response has been sent on a keep alive connection, we wait this long for the client to
+ * send a further request before closing the connection.
+ * @param [in] timeout The keep alive timeout in seconds.  0 disables persistent connections.
+ */
+void HttpServer::setKeepAliveTimeout(uint32_t timeout) {
+	m_keepAliveTimeout = timeout;
+} // setKeepAliveTimeout
+
+
+/**
+ * @brief Set the size of the largest request body accepted.
+ * A request announcing a larger body is answered with 413 Payload Too Large without its body being read.
+ * Reading a chunked body that turns out to be larger fails.  Must be called before the server is started.
+ * @param [in] size The size of the largest body, 0 for no limit.
+ */
+void HttpServer::setMaxBodySize(size_t size) {
+	m_maxBodySize = size;
+} // setMaxBodySize
+
+
+/**
+ * @brief Set the most connections a client (IP address) may have open at the same time.
+ * Further connections are answered with 429 Too Many Requests.  This stops one client from taking all
+ * the workers.  Note that clients behind the same NAT share an address.  Must be called before start().
+ * @param [in] count The number of connections, 0 for no limit.
+ */
+void HttpServer::setMaxConnectionsPerClient(uint16_t count) {
+	m_maxConnectionsPerClient = count;
+} // setMaxConnectionsPerClient
+
+
+/**
+ * @brief Set the most headers accepted in a request.
+ * A request with more is answered with 431 Request Header Fields Too Large.
+ * @param [in] count The number of headers, no more than HttpParser::MAX_HEADERS.
+ */
+void HttpServer::setMaxHeaderCount(size_t count) {
+	m_maxHeaderCount = count;
+} // setMaxHeaderCount
+
+
+/**
+ * @brief Set the size of the largest request head accepted.
+ * The head is the request line and the headers.  A larger head is answered with 431 Request Header
+ * Fields Too Large.  Each connection holds a buffer of this size.
+ * @param [in] size The size in bytes.
+ */
+void HttpServer::setMaxHeaderSize(size_t size) {
+	m_maxHeaderSize = size;
+} // setMaxHeaderSize
+
+
+/**
+ * @brief Set the maximum number of requests served on one persistent connection.
+ * The response to the last permitted request asks the client to close the connection.
+ * @param [in] count The maximum number of requests per connection.
+ */
+void HttpServer::setMaxKeepAliveRequests(uint32_t count) {
+	m_maxKeepAliveRequests = count;
+} // setMaxKeepAliveRequests
+
+
+/**
+ * @brief Set the slowest rate at which a request body is accepted.
+ * A handler reading a body that arrives more slowly gets an error from HttpRequest::readBody() and the
+ * connection is closed.  This stops a client from holding a connection by trickling the body.
+ * @param [in] bytesPerSecond The minimum average rate, 0 for no limit.
+ * @param [in] grace The seconds from the handler starting to read the body before the rate is enforced.
+ */
+void HttpServer::setMinBodyRate(uint32_t bytesPerSecond, uint32_t grace) {
+	m_minBodyRate   = bytesPerSecond;
+	m_bodyRateGrace = grace;
+} // setMinBodyRate
+
+
+/**
+ * @brief Serve the metrics of the server in the Prometheus text format.
+ * A GET of the path returns the metrics and a HEAD only the header.  Other methods are answered with
+ * 405 (Method Not Allowed).  The path takes precedence over the path handlers.
+ * @param [in] path The path of the metrics, for example "/metrics".  An empty path stops serving them.
+ */
+void HttpServer::setMetricsPath(const std::string& path) {
+	m_metricsPath = path;
+} // setMetricsPath
+
+
+/**
+ * @brief Cache the responses of a GET route.
+ * The handler of the route is then only called when the cache doesn't hold a response younger than
+ * the time to live for the path and the selected query parameters.  Only use this for handlers whose
+ * response depends on nothing else: the other query parameters, the headers and any cookies of the
+ * request are ignored.  See HttpResponseCache.
+ *
+ * @code{.cpp}
+ * webServer.addPathHandler("GET", "/api/status", handleStatus);
+ * webServer.setResponseCache("/api/status", 2);
+ * webServer.addPathHandler("GET", "/api/sensors/:id", handleSensor);
+ * webServer.setResponseCache("/api/sensors/:id", 10, 8 * 1024, { "units" });
+ * @endcode
+ *
+ * @param [in] path The path pattern the route was registered with by addPathHandler().
+ * @param [in] ttl The seconds for which a response is kept.  0 stops caching the route.
+ * @param [in] maxBytes The total size of the responses of the route that may be held.
+ * @param [in] queryParams The names of the query parameters that select a different response.
+ * @return The cache or nullptr if it wasn't created.
+ */
+HttpResponseCache* HttpServer::setResponseCache(const std::string& path, uint32_t ttl, size_t maxBytes,
+		const std::vector<std::string>& queryParams) {
+	int routeId = m_router.getRouteId("GET", path);
+	if (routeId < 0) {
+		ESP_LOGE(LOG_TAG, "setResponseCache: No GET handler has been added for %s", path.c_str());
+		return nullptr;
+	}
+	if ((size_t) routeId >= m_responseCaches.size()) {
+		m_responseCaches.resize(routeId + 1, nullptr);
+	}
+	delete m_responseCaches[routeId];
+	m_responseCaches[routeId] = (ttl > 0 && maxBytes > 0) ? new HttpResponseCache(ttl, maxBytes, queryParams) : nullptr;
+	return m_responseCaches[routeId];
+} // setResponseCache
+
+
 /**
  * @brief Set the root path for URL file mapping.
  *
@@ -378,14 +1317,64 @@ void HttpServer::setRootPath(std::string path) {
 } // setRootPath
 
 
+/**
+ * @brief Set the TLS configuration of the server.
+ * By default the certificate and key set with SSLUtils are used.  A context of its own lets a server use
+ * another certificate or size its session cache.  The context must have been loaded and must outlive
+ * the server.  Must be called before start().
+ * @param [in] pContext The TLS configuration.
+ */
+void HttpServer::setSSLContext(SSLServerContext* pContext) {
+	m_pSSLContext = pContext;
+} // setSSLContext
+
+
+/**
+ * @brief Accept the permessage-deflate extension (RFC7692) when a client offers it for a WebSocket.
+ * Messages from the client are decompressed in a window of 2^clientMaxWindowBits bytes per connection,
+ * which is held between messages unless the client is asked not to take the context over.  A client
+ * that can't use a smaller window than 15 bits is served without compression.  We compress each
+ * message we send on its own, with a compressor shared by all the connections.  Changes apply to
+ * WebSockets opened afterwards.
+ * @param [in] use Should compression be accepted?
+ * @param [in] clientMaxWindowBits The window asked of the client, from 8 to 15 bits.
+ * @param [in] clientNoContextTakeover Ask the client to compress each message on its own, so that the
+ * window is released between messages.
+ * @param [in] threshold Messages we send that are shorter than this are not compressed.
+ */
+void HttpServer::setWebSocketCompression(bool use, uint8_t clientMaxWindowBits, bool clientNoContextTakeover, size_t threshold) {
+	m_webSocketDeflate.enabled                 = use;
+	m_webSocketDeflate.clientMaxWindowBits     = clientMaxWindowBits;
+	m_webSocketDeflate.clientNoContextTakeover = clientNoContextTakeover;
+	m_webSocketDeflate.threshold               = threshold;
+} // setWebSocketCompression
+
+
+/**
+ * @brief Set how many accepted connections may wait for a worker.
+ * When all the workers are busy and this many connections are already waiting, new connections are
+ * rejected with a 503 Service Unavailable response.  Only used when the server has workers and must
+ * be called before start().
+ * @param [in] size The number of connections that may wait.
+ */
+void HttpServer::setWorkerQueueSize(size_t size) {
+	m_workerQueueSize = size;
+} // setWorkerQueueSize
+
+
 /**
  * @brief Start the HTTP server listening.
  * We start an instance of the HTTP server listening.  A new task is spawned to perform this work in the
- * back ground.
+ * back ground.  By default that task also serves the requests, one connection at a time.  If workers are
+ * requested, the listening task only accepts connections and hands them to a pool of worker tasks so
+ * that several clients can be served at the same time.
  * @param [in] portNumber The port number on which the HTTP server should listen.
  * @param [in] useSSL Should we use SSL?
+ * @param [in] workerCount The number of worker tasks.  0 serves requests in the listening task.
+ * @param [in] workerStackSize The stack size of each worker task.
+ * @param [in] workerCore The core the worker tasks are pinned to (see Task::setCore).
  */
-void HttpServer::start(uint16_t portNumber, bool useSSL) {
+void HttpServer::start(uint16_t portNumber, bool useSSL, uint8_t workerCount, uint16_t workerStackSize, BaseType_t workerCore) {
 	// Design:
 	// The start of the HTTP server should be as fast as possible.
 	ESP_LOGD(LOG_TAG, ">> start: port: %d, useSSL: %d", portNumber, useSSL);
@@ -397,8 +1386,27 @@ void HttpServer::start(uint16_t portNumber, bool useSSL) {
 		return;
 	}
 
-	m_useSSL     = useSSL;
-	m_portNumber = portNumber;
+	m_useSSL      = useSSL;
+	m_portNumber  = portNumber;
+	m_workerCount = m_eventDriven ? 0 : workerCount;
+
+	if (m_eventDriven) {
+		HttpServerReactorTask* pReactorTask = new HttpServerReactorTask("HttpServerReactorTask");
+		pReactorTask->start(this);
+		ESP_LOGD(LOG_TAG, "<< start: event driven");
+		return;
+	}
+
+	if (m_workerCount > 0) {
+		if (m_workerQueue == nullptr) {
+			m_workerQueue = ::xQueueCreate(m_workerQueueSize, sizeof(Socket*));
+		}
+		for (uint8_t i = 0; i < m_workerCount; i++) {
+			HttpServerWorkerTask* pWorkerTask = new HttpServerWorkerTask("HttpServerWorker" + std::to_string(i), workerStackSize);
+			pWorkerTask->setCore(workerCore);
+			pWorkerTask->start(this);
+		}
+	}
 
 	HttpServerTask* pHttpServerTask = new HttpServerTask("HttpServerTask");
 	pHttpServerTask->start(this);
@@ -415,6 +1423,9 @@ void HttpServer::stop() {
 	// activities.
 	ESP_LOGD(LOG_TAG, ">> stop");
 	m_socket.close();                      // Close the socket that is being used to watch for incoming requests.
+	for (auto it = m_eventStreams.begin(); it != m_eventStreams.end(); ++it) {
+		it->second.pStream->close();       // Disconnect the event stream subscribers.
+	}
 	m_semaphoreServerStarted.wait("stop"); // Wait for the server to stop.
 	ESP_LOGD(LOG_TAG, "<< stop");
 } // stop
@@ -480,6 +1491,15 @@ bool PathHandler::match(std::string method, std::string path) {
 } // match
 
 
+/**
+ * @brief Get the handler function.
+ * @return The handler function.
+ */
+HttpRouter::Handler PathHandler::getHandler() {
+	return m_pRequestHandler;
+} // getHandler
+
+
 /**
  * @brief Invoke the handler.
  * @param [in] request An object representing the request.
@@ -12,14 +12,24 @@
 #define COMPONENTS_CPP_UTILS_HTTPSERVER_H_
 #include <stdint.h>
 
+#include <map>
 #include <vector>
 #include "SockServ.h"
 #include "HttpRequest.h"
 #include "HttpResponse.h"
+#include "HttpRouter.h"
+#include "HttpDirectoryListing.h"
+#include "HttpEventStream.h"
+#include "HttpMetrics.h"
+#include "HttpResponseCache.h"
+#include "SSLServerContext.h"
 #include "FreeRTOS.h"
+#include <freertos/queue.h>
 #include <regex>
 
 class HttpServerTask;
+class HttpServerWorkerTask;
+class HttpServerReactorTask;
 
 /**
  * @brief Handle path matching for an incoming HTTP request.
@@ -42,6 +52,7 @@ class PathHandler {
 				HttpRequest*  pHttpRequest,
 				HttpResponse* pHttpResponse)
 			);
+		HttpRouter::Handler getHandler();                   // Get the handler function.
 		bool match(std::string method, std::string path);   // Does the request method and pattern match?
 		void invokePathHandler(HttpRequest* request, HttpResponse* response);
 	private:
@@ -58,6 +69,10 @@ public:
 	HttpServer();
 	virtual ~HttpServer();
 
+	void        addCacheControl(std::string pathPrefix, std::string value); // Set the Cache-Control header of files under a path.
+	HttpEventStream* addEventStream(const std::string& path,
+		size_t queueSize = HttpEventStream::DEFAULT_QUEUE_SIZE,
+		size_t historySize = HttpEventStream::DEFAULT_HISTORY_SIZE); // Serve Server-Sent Events at a path.
 	void        addPathHandler(
 		std::string method,
 		std::string pathExpr,
@@ -75,29 +90,116 @@ public:
 			HttpResponse* pHttpResponse)
 		);
 	uint32_t    getClientTimeout();							// Get client's socket timeout
+	HttpEventStream* getEventStream(const std::string& path); // Get the event stream served at a path (null if none).
 	size_t      getFileBufferSize();  // Get the current size of the file buffer.
+	HttpFileCache* getFileCache();    // Get the cache of small files (null if not enabled).
+	uint32_t    getKeepAliveTimeout();     // Get how long an idle persistent connection is kept open.
+	uint32_t    getMaxKeepAliveRequests(); // Get the maximum number of requests served on one connection.
+	size_t      getMaxBodySize();     // Get the size of the largest request body accepted.
+	HttpMetrics& getMetrics();        // Get the request counters and latency histograms.
 	uint16_t    getPort();            // Get the port on which the Http server is listening.
+	HttpResponseCache* getResponseCache(const std::string& path); // Get the response cache of a GET route (null if not cached).
+	SSLServerContext* getSSLContext(); // Get the TLS configuration and handshake counters (null without SSL).
 	std::string getRootPath();        // Get the root of the file system path.
+	bool        getEventDriven();     // Are we serving all connections from a single event driven task?
 	bool        getSSL();             // Are we using SSL?
 	void        setClientTimeout(uint32_t timeout);			   // Set client's socket timeout
 	void        setDirectoryListing(bool use);             // Should we list the content of directories?
+	void        setEventDriven(bool use);                  // Serve all connections from a single event driven task.
 	void        setFileBufferSize(size_t fileBufferSize);  // Set the size of the file buffer
+	void        setFileCache(size_t maxBytes, size_t maxFileSize = 8 * 1024); // Cache small files in RAM.  0 bytes disables.
+	void        setHeaderTimeout(uint32_t timeout);        // Set how long the head of a request may take to arrive.
+	void        setKeepAliveTimeout(uint32_t timeout);     // Set how long an idle persistent connection is kept open.
+	void        setMaxBodySize(size_t size);               // Set the size of the largest request body accepted.  0 for no limit.
+	void        setMaxConnectionsPerClient(uint16_t count); // Set the most connections one client address may have open.
+	void        setMaxHeaderCount(size_t count);           // Set the most headers accepted in a request.
+	void        setMaxHeaderSize(size_t size);             // Set the size of the largest request head accepted.
+	void        setMaxKeepAliveRequests(uint32_t count);   // Set the maximum number of requests served on one connection.
+	void        setMetricsPath(const std::string& path);   // Serve the metrics in the Prometheus format at a path.
+	void        setMinBodyRate(uint32_t bytesPerSecond, uint32_t grace = 5); // Set the slowest rate a request body may arrive at.
+	HttpResponseCache* setResponseCache(const std::string& path, uint32_t ttl, size_t maxBytes = 16 * 1024,
+		const std::vector<std::string>& queryParams = {}); // Cache the responses of a GET route for ttl seconds.
 	void        setRootPath(std::string path);             // Set the root of the file system path.
-	void        start(uint16_t portNumber, bool useSSL = false);
+	void        setSSLContext(SSLServerContext* pContext); // Use a TLS configuration other than the default.
+	void        setWebSocketCompression(bool use, uint8_t clientMaxWindowBits = WebSocketDeflate::MAX_WINDOW_BITS,
+		bool clientNoContextTakeover = false, size_t threshold = WebSocketDeflate::DEFAULT_THRESHOLD); // Accept permessage-deflate.
+	void        setWorkerQueueSize(size_t size);           // Set how many accepted connections may wait for a worker.
+	void        start(
+		uint16_t   portNumber,
+		bool       useSSL = false,
+		uint8_t    workerCount = 0,                  // Number of worker tasks.  0 serves requests in the listening task.
+		uint16_t   workerStackSize = 16 * 1024,      // Stack size of each worker task.
+		BaseType_t workerCore = tskNO_AFFINITY);     // Core the worker tasks are pinned to.
 	void        stop();          // Stop a previously started server.
 
 private:
 	friend class HttpServerTask;
+	friend class HttpServerWorkerTask;
+	friend class HttpServerReactorTask;
 	friend class WebSocket;
-	void                     listDirectory(std::string path, HttpResponse& response);
+
+	static const size_t MAX_BODY_SKIP = 4096;   // The most of an unread request body we discard to reuse the connection.
+	static const size_t METRICS_ROUTE_FILES   = 0;  // The metrics route of requests served from the file system.
+	static const size_t METRICS_ROUTE_METRICS = 1;  // The metrics route of requests for the metrics.
+
+	// The state of a client connection after a request has been served.
+	enum ConnectionState {
+		CONNECTION_CLOSED,      // The connection has been closed.
+		CONNECTION_KEEP_ALIVE,  // The connection may carry a further request.
+		CONNECTION_WEBSOCKET,   // The connection now belongs to a WebSocket.
+		CONNECTION_DETACHED     // The connection now belongs to whoever detached the response (an event stream).
+	};
+
+	// An event stream and the metrics route of its subscriptions.
+	struct EventStreamRoute {
+		HttpEventStream* pStream;
+		size_t           metricsRoute;
+	};
+
+	bool                     admitClient(Socket& clientSocket, uint32_t* pAddress);
+	void                     configureParser(HttpParser& parser);
+	void                     handleConnection(Socket clientSocket);
+	void                     listDirectory(std::string path, HttpRequest& request, HttpResponse& response);
+	size_t                   processRequest(HttpRequest& request, HttpResponse& response);
+	void                     rejectRequest(Socket& clientSocket, HttpParser::ParseError error);
+	void                     releaseClient(uint32_t address);
+	ConnectionState          serveRequest(Socket& clientSocket, HttpParser& parser, uint32_t requestCount, WebSocket** ppWebSocket);
+	bool                     waitForNextRequest(Socket& clientSocket, HttpParser& parser);
 	size_t                   m_fileBufferSize;     // Size of the file buffer.
+	HttpFileCache*           m_pFileCache;         // Cache of small files, if enabled.
+	std::vector<std::pair<std::string, std::string>> m_cacheControl; // Cache-Control values by path prefix.
 	bool                     m_directoryListing;   // Should we list directory content?
-	std::vector<PathHandler> m_pathHandlers;       // Vector of path handlers.
+	HttpDirectoryListing     m_directoryIndex;     // Sends directory listings, caching the indexes of sorted ones.
+	std::vector<PathHandler> m_pathHandlers;       // Path handlers matched by regular expression, tried in order.
+	HttpRouter               m_router;             // Path handlers matched by path pattern.
+	HttpMetrics              m_metrics;            // Request counters and latency histograms.
+	std::vector<size_t>      m_routeMetrics;       // The metrics route of each route of m_router, by route id.
+	std::vector<size_t>      m_pathHandlerMetrics; // The metrics route of each of m_pathHandlers.
+	std::vector<HttpResponseCache*> m_responseCaches; // The response cache of each route of m_router, by route id, if any.
+	std::string              m_metricsPath;        // The path at which the metrics are served, empty if they aren't.
+	std::map<std::string, EventStreamRoute> m_eventStreams; // The Server-Sent Event streams by path.
 	uint16_t                 m_portNumber;         // Port number on which server is listening.
 	std::string              m_rootPath;           // Root path into the file system.
 	Socket                   m_socket;
 	bool                     m_useSSL;             // Is this server listening on an HTTPS port?
+	SSLServerContext*        m_pSSLContext;        // The TLS configuration, null for the default.
+	bool                     m_eventDriven;        // Are all connections served from a single event driven task?
 	uint32_t                 m_clientTimeout;      // Default Timeout
+	uint32_t                 m_keepAliveTimeout;   // Seconds an idle persistent connection is kept open.
+	uint32_t                 m_maxKeepAliveRequests; // Maximum number of requests on one connection.
+	size_t                   m_maxBodySize;        // Largest request body accepted, 0 for no limit.
+	uint32_t                 m_headerTimeout;      // Seconds in which a request head must arrive, 0 for no limit.
+	size_t                   m_maxHeaderSize;      // Largest request head accepted.
+	size_t                   m_maxHeaderCount;     // Most headers accepted in a request.
+	uint32_t                 m_minBodyRate;        // Slowest a request body may arrive in bytes per second, 0 for no limit.
+	uint32_t                 m_bodyRateGrace;      // Seconds before the body rate is enforced.
+	uint16_t                 m_maxConnectionsPerClient; // Most connections one client address may have open, 0 for no limit.
+	WebSocketDeflate::Config m_webSocketDeflate;  // The permessage-deflate extension offered to WebSockets.
+	std::map<uint32_t, uint16_t> m_clientConnections;   // Open connections by client address.
+	FreeRTOS::Semaphore      m_clientLock = FreeRTOS::Semaphore("HttpServerClients");
+	uint8_t                  m_workerCount;        // Number of worker tasks serving connections.
+	size_t                   m_workerQueueSize;    // Number of accepted connections that may wait for a worker.
+	QueueHandle_t            m_workerQueue;        // Accepted connections (Socket*) waiting for a worker.
 	FreeRTOS::Semaphore      m_semaphoreServerStarted = FreeRTOS::Semaphore("ServerStarted");
 }; // HttpServer
 
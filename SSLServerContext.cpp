@@ -0,0 +1,300 @@
+/*
+ * SSLServerContext.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <string.h>
+#include <esp_log.h>
+#include "SSLServerContext.h"
+#include "SSLUtils.h"
+
+static const char* LOG_TAG = "SSLServerContext";
+
+// Set when a step of a handshake running on this task found its session in the cache or a ticket.
+// The socket making the handshake takes it with takeSessionFound() after each step, as the steps
+// of several handshakes may be interleaved on one task.
+static thread_local bool s_sessionFound = false;
+
+static void my_debug(
+	void* ctx,
+	int level,
+	const char* file,
+	int line,
+	const char* str) {
+
+	((void) level);
+	((void) ctx);
+	printf("%s:%04d: %s", file, line, str);
+}
+
+
+/**
+ * @brief Create an empty context.
+ * load() must be called before the context is used.
+ * @param [in] cacheEntries The number of sessions held for clients that resume by session id.
+ * @param [in] sessionLifetime The seconds for which a session may be resumed.
+ */
+SSLServerContext::SSLServerContext(size_t cacheEntries, uint32_t sessionLifetime) {
+	m_cacheEntries      = cacheEntries;
+	m_sessionLifetime   = sessionLifetime;
+	m_valid             = false;
+	m_handshakes        = 0;
+	m_failedHandshakes  = 0;
+	m_resumedHandshakes = 0;
+	mbedtls_entropy_init(&m_entropy);
+	mbedtls_ctr_drbg_init(&m_ctr_drbg);
+	mbedtls_ssl_config_init(&m_conf);
+	mbedtls_x509_crt_init(&m_srvcert);
+	mbedtls_pk_init(&m_pkey);
+#if defined(MBEDTLS_SSL_CACHE_C)
+	mbedtls_ssl_cache_init(&m_cache);
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_init(&m_ticket);
+#endif
+} // SSLServerContext
+
+
+SSLServerContext::~SSLServerContext() {
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_free(&m_ticket);
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+	mbedtls_ssl_cache_free(&m_cache);
+#endif
+	mbedtls_pk_free(&m_pkey);
+	mbedtls_x509_crt_free(&m_srvcert);
+	mbedtls_ssl_config_free(&m_conf);
+	mbedtls_ctr_drbg_free(&m_ctr_drbg);
+	mbedtls_entropy_free(&m_entropy);
+} // ~SSLServerContext
+
+
+/**
+ * @brief Look up a session in the cache by the session id sent by the client.
+ */
+int SSLServerContext::cacheGet(void* pContext, const unsigned char* sessionId, size_t sessionIdLen,
+		mbedtls_ssl_session* pSession) {
+#if defined(MBEDTLS_SSL_CACHE_C)
+	int rc = mbedtls_ssl_cache_get(&((SSLServerContext*) pContext)->m_cache, sessionId, sessionIdLen, pSession);
+	if (rc == 0) {
+		s_sessionFound = true;
+	}
+	return rc;
+#else
+	return 1;
+#endif
+} // cacheGet
+
+
+/**
+ * @brief Save a session in the cache.
+ */
+int SSLServerContext::cacheSet(void* pContext, const unsigned char* sessionId, size_t sessionIdLen,
+		const mbedtls_ssl_session* pSession) {
+#if defined(MBEDTLS_SSL_CACHE_C)
+	return mbedtls_ssl_cache_set(&((SSLServerContext*) pContext)->m_cache, sessionId, sessionIdLen, pSession);
+#else
+	return 1;
+#endif
+} // cacheSet
+
+
+/**
+ * @brief Get the configuration to set up a connection with.
+ * @return The shared configuration.
+ */
+const mbedtls_ssl_config* SSLServerContext::getConfig() const {
+	return &m_conf;
+} // getConfig
+
+
+/**
+ * @brief Get the context holding the certificate and key set with SSLUtils.
+ * The context is created and loaded the first time it is asked for, so the certificate and key must be
+ * set before then.
+ * @return The default context.
+ */
+SSLServerContext* SSLServerContext::getDefault() {
+	static SSLServerContext* pDefault = []() {
+		SSLServerContext* pContext = new SSLServerContext();
+		pContext->load(SSLUtils::getCertificate(), SSLUtils::getKey());
+		return pContext;
+	}();
+	return pDefault;
+} // getDefault
+
+
+/**
+ * @brief Get the number of handshakes that failed.
+ */
+uint32_t SSLServerContext::getFailedHandshakes() {
+	return m_failedHandshakes;
+} // getFailedHandshakes
+
+
+/**
+ * @brief Get the number of completed handshakes that negotiated a new session.
+ * These are the handshakes that paid for the public key operations.
+ */
+uint32_t SSLServerContext::getFullHandshakes() {
+	uint32_t handshakes = m_handshakes;
+	uint32_t resumed    = m_resumedHandshakes;
+	return handshakes > resumed ? handshakes - resumed : 0;
+} // getFullHandshakes
+
+
+/**
+ * @brief Get the number of completed handshakes that resumed a session from the cache or a ticket.
+ */
+uint32_t SSLServerContext::getResumedHandshakes() {
+	return m_resumedHandshakes;
+} // getResumedHandshakes
+
+
+/**
+ * @brief Has a certificate and key been loaded?
+ */
+bool SSLServerContext::isValid() const {
+	return m_valid;
+} // isValid
+
+
+/**
+ * @brief Parse the certificate and key, seed the random number generator and set up the configuration.
+ * @param [in] certificate The server certificate in PEM format.
+ * @param [in] key The private key of the certificate in PEM format.
+ * @return 0 on success or an mbedtls error code.
+ */
+int SSLServerContext::load(const char* certificate, const char* key) {
+	const char* pers = "ssl_server";
+	ESP_LOGD(LOG_TAG, ">> load");
+	if (m_valid) {
+		ESP_LOGE(LOG_TAG, "A certificate has already been loaded");
+		return -1;
+	}
+	if (key == nullptr) {
+		ESP_LOGE(LOG_TAG, "No private key file");
+		return -1;
+	}
+	if (certificate == nullptr) {
+		ESP_LOGE(LOG_TAG, "No certificate file");
+		return -1;
+	}
+
+	int ret = mbedtls_x509_crt_parse(&m_srvcert, (const unsigned char*) certificate, strlen(certificate) + 1);
+	if (ret != 0) {
+		ESP_LOGE(LOG_TAG, "mbedtls_x509_crt_parse returned -0x%x", -ret);
+		return ret;
+	}
+
+	ret = mbedtls_pk_parse_key(&m_pkey, (const unsigned char*) key, strlen(key) + 1, (const unsigned char*) "", 0,
+		nullptr, 0);
+	if (ret != 0) {
+		ESP_LOGE(LOG_TAG, "mbedtls_pk_parse_key returned -0x%x", -ret);
+		return ret;
+	}
+
+	ret = mbedtls_ctr_drbg_seed(&m_ctr_drbg, mbedtls_entropy_func, &m_entropy, (const unsigned char*) pers, strlen(pers));
+	if (ret != 0) {
+		ESP_LOGE(LOG_TAG, "mbedtls_ctr_drbg_seed returned -0x%x", -ret);
+		return ret;
+	}
+
+	ret = mbedtls_ssl_config_defaults(&m_conf,
+		MBEDTLS_SSL_IS_SERVER,
+		MBEDTLS_SSL_TRANSPORT_STREAM,
+		MBEDTLS_SSL_PRESET_DEFAULT);
+	if (ret != 0) {
+		ESP_LOGE(LOG_TAG, "mbedtls_ssl_config_defaults returned -0x%x", -ret);
+		return ret;
+	}
+
+	mbedtls_ssl_conf_authmode(&m_conf, MBEDTLS_SSL_VERIFY_NONE);
+	mbedtls_ssl_conf_rng(&m_conf, mbedtls_ctr_drbg_random, &m_ctr_drbg);
+	ret = mbedtls_ssl_conf_own_cert(&m_conf, &m_srvcert, &m_pkey);
+	if (ret != 0) {
+		ESP_LOGE(LOG_TAG, "mbedtls_ssl_conf_own_cert returned -0x%x", -ret);
+		return ret;
+	}
+	mbedtls_ssl_conf_dbg(&m_conf, my_debug, nullptr);
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+	mbedtls_ssl_cache_set_max_entries(&m_cache, m_cacheEntries);
+	mbedtls_ssl_cache_set_timeout(&m_cache, m_sessionLifetime);
+	mbedtls_ssl_conf_session_cache(&m_conf, this, cacheGet, cacheSet);
+#endif
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	// Without tickets clients can still resume from the cache, so a failure here isn't fatal.
+	ret = mbedtls_ssl_ticket_setup(&m_ticket, mbedtls_ctr_drbg_random, &m_ctr_drbg, MBEDTLS_CIPHER_AES_256_GCM, m_sessionLifetime);
+	if (ret == 0) {
+		mbedtls_ssl_conf_session_tickets_cb(&m_conf, ticketWrite, ticketParse, this);
+	} else {
+		ESP_LOGE(LOG_TAG, "mbedtls_ssl_ticket_setup returned -0x%x, session tickets are disabled", -ret);
+	}
+#endif
+
+	m_valid = true;
+	ESP_LOGD(LOG_TAG, "<< load");
+	return 0;
+} // load
+
+
+/**
+ * @brief Count the end of a handshake.
+ * @param [in] success True if the handshake completed.
+ * @param [in] resumed True if the client resumed a session.  Only counted if the handshake completed.
+ */
+void SSLServerContext::recordHandshake(bool success, bool resumed) {
+	if (success) {
+		m_handshakes++;
+		if (resumed) {
+			m_resumedHandshakes++;
+		}
+	} else {
+		m_failedHandshakes++;
+	}
+} // recordHandshake
+
+
+/**
+ * @brief Find out whether the last step of a handshake on this task resumed a session.
+ * Must be called by the task that ran the step, after each step.
+ * @return True if the session was found in the cache or a ticket.
+ */
+bool SSLServerContext::takeSessionFound() {
+	bool found = s_sessionFound;
+	s_sessionFound = false;
+	return found;
+} // takeSessionFound
+
+
+/**
+ * @brief Recover a session from a ticket presented by the client.
+ */
+int SSLServerContext::ticketParse(void* pContext, mbedtls_ssl_session* pSession, unsigned char* buf, size_t len) {
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	int rc = mbedtls_ssl_ticket_parse(&((SSLServerContext*) pContext)->m_ticket, pSession, buf, len);
+	if (rc == 0) {
+		s_sessionFound = true;
+	}
+	return rc;
+#else
+	return -1;
+#endif
+} // ticketParse
+
+
+/**
+ * @brief Create a ticket holding a session for the client.
+ */
+int SSLServerContext::ticketWrite(void* pContext, const mbedtls_ssl_session* pSession, unsigned char* start,
+		const unsigned char* end, size_t* tlen, uint32_t* lifetime) {
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	return mbedtls_ssl_ticket_write(&((SSLServerContext*) pContext)->m_ticket, pSession, start, end, tlen, lifetime);
+#else
+	return -1;
+#endif
+} // ticketWrite
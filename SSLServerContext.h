@@ -0,0 +1,73 @@
+/*
+ * SSLServerContext.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_SSLSERVERCONTEXT_H_
+#define COMPONENTS_CPP_UTILS_SSLSERVERCONTEXT_H_
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/x509_crt.h>
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * @brief The TLS configuration shared by all the connections accepted by a server socket.
+ *
+ * The certificate and key are parsed and the random number generator is seeded once, rather than for
+ * every connection.  A client that has connected before can resume its session, which skips the public
+ * key operations of a full handshake.  The session is found either from a ticket held by the client
+ * (RFC 5077) or, for clients that don't support tickets, by its session id in a cache held here.
+ *
+ * The context must outlive the sockets that use it.  mbedtls must be built with MBEDTLS_THREADING_C
+ * (the ESP-IDF default) when the connections are handled by more than one task.
+ */
+class SSLServerContext {
+public:
+	static const size_t   DEFAULT_CACHE_ENTRIES    = 8;          // Sessions held for resumption by session id.
+	static const uint32_t DEFAULT_SESSION_LIFETIME = 24 * 3600;  // Seconds a session may be resumed.
+
+	SSLServerContext(size_t cacheEntries = DEFAULT_CACHE_ENTRIES, uint32_t sessionLifetime = DEFAULT_SESSION_LIFETIME);
+	virtual ~SSLServerContext();
+	static SSLServerContext* getDefault();             // Get the context holding the certificate and key of SSLUtils.
+	const mbedtls_ssl_config* getConfig() const;       // Get the configuration to set up a connection with.
+	uint32_t getFailedHandshakes();                    // Get the number of handshakes that failed.
+	uint32_t getFullHandshakes();                      // Get the number of completed handshakes that weren't resumed.
+	uint32_t getResumedHandshakes();                   // Get the number of sessions resumed.
+	bool     isValid() const;                          // Has a certificate and key been loaded?
+	int      load(const char* certificate, const char* key); // Parse the certificate and key in PEM format.
+	void     recordHandshake(bool success, bool resumed); // Count a completed or failed handshake.
+	static bool takeSessionFound();                    // Did the last handshake step on this task resume a session?
+
+private:
+	mbedtls_entropy_context    m_entropy;
+	mbedtls_ctr_drbg_context   m_ctr_drbg;
+	mbedtls_ssl_config         m_conf;
+	mbedtls_x509_crt           m_srvcert;
+	mbedtls_pk_context         m_pkey;
+#if defined(MBEDTLS_SSL_CACHE_C)
+	mbedtls_ssl_cache_context  m_cache;
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_context m_ticket;
+#endif
+	size_t                     m_cacheEntries;
+	uint32_t                   m_sessionLifetime;
+	bool                       m_valid;
+	std::atomic<uint32_t>      m_handshakes;           // Handshakes completed, full or resumed.
+	std::atomic<uint32_t>      m_failedHandshakes;
+	std::atomic<uint32_t>      m_resumedHandshakes;    // Completed handshakes that resumed a session.
+
+	static int cacheGet(void* pContext, const unsigned char* sessionId, size_t sessionIdLen, mbedtls_ssl_session* pSession);
+	static int cacheSet(void* pContext, const unsigned char* sessionId, size_t sessionIdLen, const mbedtls_ssl_session* pSession);
+	static int ticketParse(void* pContext, mbedtls_ssl_session* pSession, unsigned char* buf, size_t len);
+	static int ticketWrite(void* pContext, const mbedtls_ssl_session* pSession, unsigned char* start,
+		const unsigned char* end, size_t* tlen, uint32_t* lifetime);
+}; // SSLServerContext
+
+#endif /* COMPONENTS_CPP_UTILS_SSLSERVERCONTEXT_H_ */
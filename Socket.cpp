@@ -21,7 +21,7 @@
 
 #include <unistd.h>
 #include "GeneralUtils.h"
-#include "SSLUtils.h"
+#include "SSLServerContext.h"
 #include "sdkconfig.h"
 #include "Socket.h"
 
@@ -29,21 +29,11 @@ static const char* LOG_TAG = "Socket";
 
 #undef bind
 
-static void my_debug(
-   void* ctx,
-   int level,
-   const char* file,
-   int line,
-   const char* str) {
-
-   ((void) level);
-   ((void) ctx);
-   printf("%s:%04d: %s", file, line, str);
-}
 
 Socket::Socket() {
-	m_sock   = -1;
-	m_useSSL = false;
+	m_sock        = -1;
+	m_useSSL      = false;
+	m_pSSLContext = nullptr;
 }
 
 Socket::~Socket() {
@@ -51,15 +41,34 @@ Socket::~Socket() {
 }
 
 
+Socket::SSLConnection::SSLConnection() {
+	mbedtls_net_init(&net);
+	mbedtls_ssl_init(&ssl);
+	nonBlocking = false;
+	resumed     = false;
+} // SSLConnection
+
+
+Socket::SSLConnection::~SSLConnection() {
+	mbedtls_ssl_free(&ssl);   // The file descriptor in net is closed by Socket::close().
+} // ~SSLConnection
+
+
 /**
  * @brief Accept a new socket.
+ * If the handshake of an SSL connection fails, the new socket is closed and returned invalid.
+ * @param [in] timeout If not 0, the seconds the new socket waits to receive or send.  It also bounds
+ * the SSL handshake, so that a client that stops in the middle of it can't hold up the caller.
+ * @param [in] handshake If false, the SSL handshake is left to be made with tryHandshake() as the
+ * client's data arrives.
+ * @return The new socket.
  */
-Socket Socket::accept() {
+Socket Socket::accept(uint32_t timeout, bool handshake) {
 	struct sockaddr addr;
 	getBind(&addr);
 	ESP_LOGD(LOG_TAG, ">> accept: Accepting on %s; sockFd: %d, using SSL: %d", addressToString(&addr).c_str(), m_sock, getSSL());
 	struct sockaddr_in client_addr;
-	socklen_t sin_size;
+	socklen_t sin_size = sizeof(client_addr);
 	int clientSockFD = ::lwip_accept(m_sock,  (struct sockaddr*) &client_addr, &sin_size);
 	//printf("------> new connection client %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 	if (clientSockFD == -1) {
@@ -71,13 +80,16 @@ Socket Socket::accept() {
 	ESP_LOGD(LOG_TAG, " - accept: Received new client!: sockFd: %d", clientSockFD);
 	Socket newSocket;
 	newSocket.m_sock = clientSockFD;
+	if (timeout > 0) {
+		newSocket.setTimeout(timeout);
+	}
 	if (getSSL()) {
-		newSocket.setSSL(true);
-		newSocket.m_sslSock.fd = clientSockFD;
-		newSocket.sslHandshake();
-		ESP_LOGD(LOG_TAG, "DEBUG DEBUG ");
-		uint8_t x;   // What is going on here???
-		newSocket.receive(&x, 1, 0); // FIX FIX FIX
+		newSocket.m_useSSL      = true;
+		newSocket.m_pSSLContext = m_pSSLContext;   // Share the configuration of the server.
+		if (!(handshake ? newSocket.sslHandshake() : newSocket.sslSetup())) {
+			newSocket.m_pSSL.reset();                // There is no session to send a close notify on.
+			newSocket.close();
+		}
 	}
 	ESP_LOGD(LOG_TAG, "<< accept: sockFd: %d", clientSockFD);
 	return newSocket;
@@ -135,11 +147,12 @@ int Socket::bind(uint16_t port, uint32_t address) {
 int Socket::close() {
 	ESP_LOGD(LOG_TAG, "close: m_sock=%d, ssl: %d", m_sock, getSSL());
 	int rc;
-	if (getSSL()) {
-		rc = mbedtls_ssl_close_notify(&m_sslContext);
+	if (getSSL() && m_pSSL != nullptr) {
+		rc = mbedtls_ssl_close_notify(&m_pSSL->ssl);
 		if (rc < 0) {
 			ESP_LOGD(LOG_TAG, "mbedtls_ssl_close_notify: %d", rc);
 		}
+		m_pSSL.reset();   // The TLS state is freed when the last copy of the socket lets go of it.
 	}
 	rc = 0;
 	if (m_sock != -1) {
@@ -234,6 +247,20 @@ void Socket::getBind(struct sockaddr* pAddr) {
 } // getBind
 
 
+/**
+ * @brief Get the address of the partner of a connected socket.
+ * @param [out] pAddr The storage to hold the address.
+ * @return N/A.
+ */
+void Socket::getPeer(struct sockaddr* pAddr) {
+	socklen_t nameLen = sizeof(struct sockaddr);
+	int rc = ::getpeername(m_sock, pAddr, &nameLen);
+	if (rc != 0) {
+		ESP_LOGE(LOG_TAG, "Error with getpeername in getPeer: %s", strerror(errno));
+	}
+} // getPeer
+
+
 /**
  * @brief Get the underlying socket file descriptor.
  * @return The underlying socket file descriptor.
@@ -246,6 +273,17 @@ bool Socket::getSSL() const {
 	return m_useSSL;
 }
 
+/**
+ * @brief Determine if received data is held by the socket layer itself.
+ * When using SSL, mbedtls may have already read and decrypted data from the underlying socket.  That
+ * data is not visible to select() on the socket file descriptor.
+ * @return True if data can be received without waiting for the network.
+ */
+bool Socket::hasBufferedData() const {
+	if (!getSSL() || m_pSSL == nullptr) return false;
+	return mbedtls_ssl_get_bytes_avail(&m_pSSL->ssl) > 0;
+} // hasBufferedData
+
 bool Socket::isValid() {
 	return m_sock != -1;
 } // isValid
@@ -296,6 +334,23 @@ int Socket::setSocketOption(int option, void* value, size_t len) {
 } // setSocketOption
 
 
+/**
+ * @brief Enable or disable the Nagle algorithm.
+ * With TCP_NODELAY set, a small segment is sent at once rather than held back until the previous
+ * segment is acknowledged.  This suits request/response traffic where each response is written whole.
+ * @param [in] value True to send small segments at once.
+ * @return The result of setsockopt().
+ */
+int Socket::setNoDelay(bool value) {
+	int flag = value ? 1 : 0;
+	int res = ::setsockopt(m_sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	if (res < 0) {
+		ESP_LOGE(LOG_TAG, "setNoDelay: %d", errno);
+	}
+	return res;
+} // setNoDelay
+
+
 /**
  * @brief Socket timeout.
  * @param [in] seconds to wait.
@@ -352,7 +407,7 @@ size_t Socket::receive(uint8_t* data, size_t length, bool exact) {
 		int rc;
 		if (getSSL()) {
 			do {
-				rc = mbedtls_ssl_read(&m_sslContext, data, length);
+				rc = mbedtls_ssl_read(&m_pSSL->ssl, data, length);
 				ESP_LOGD(LOG_TAG, "rc=%d, MBEDTLS_ERR_SSL_WANT_READ=%d", rc, MBEDTLS_ERR_SSL_WANT_READ);
 			} while (rc == MBEDTLS_ERR_SSL_WANT_WRITE || rc == MBEDTLS_ERR_SSL_WANT_READ);
 		} else {
@@ -371,7 +426,7 @@ size_t Socket::receive(uint8_t* data, size_t length, bool exact) {
 	while (amountToRead > 0) {
 		if (getSSL()) {
 			do {
-				rc = mbedtls_ssl_read(&m_sslContext, data, amountToRead);
+				rc = mbedtls_ssl_read(&m_pSSL->ssl, data, amountToRead);
 			} while (rc == MBEDTLS_ERR_SSL_WANT_WRITE || rc == MBEDTLS_ERR_SSL_WANT_READ);
 		} else {
 			rc = ::lwip_recv(m_sock, data, amountToRead, 0);
@@ -418,7 +473,7 @@ int Socket::send(const uint8_t* data, size_t length) const {
 	int rc = ERR_OK;
 	while (length > 0) {
 		if (getSSL()) {
-			rc = mbedtls_ssl_write((mbedtls_ssl_context*)&m_sslContext, data, length);
+			rc = mbedtls_ssl_write(&m_pSSL->ssl, data, length);
 			// retry with same parameters if MBEDTLS_ERR_SSL_WANT_WRITE or MBEDTLS_ERR_SSL_WANT_READ
 			if ((rc != MBEDTLS_ERR_SSL_WANT_WRITE) && (rc != MBEDTLS_ERR_SSL_WANT_READ)) {
 				if (rc < 0) {
@@ -472,6 +527,73 @@ int  Socket::send(uint32_t value) {
 } // send
 
 
+/**
+ * @brief Send data from several buffers to the partner.
+ *
+ * The buffers are sent as though they were one so that, for example, a header and a body can leave in
+ * a single segment.  Over SSL there is no gather write: buffers that together are no larger than
+ * SENDV_GATHER_SIZE are copied into one record, larger ones are sent in turn.
+ *
+ * @param [in] iov The buffers to send.
+ * @param [in] iovcnt The number of buffers, no more than SENDV_MAX_IOV.
+ * @return The total number of bytes sent or a negative value on error.
+ */
+int Socket::sendv(const struct iovec* iov, int iovcnt) const {
+	if (iovcnt > SENDV_MAX_IOV) {
+		ESP_LOGE(LOG_TAG, "sendv: Too many buffers: %d", iovcnt);
+		return -1;
+	}
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	ESP_LOGD(LOG_TAG, "sendv: %d buffers of total length: %d", iovcnt, total);
+
+	if (getSSL()) {
+		if (total <= SENDV_GATHER_SIZE) {
+			uint8_t buffer[SENDV_GATHER_SIZE];
+			size_t length = 0;
+			for (int i = 0; i < iovcnt; i++) {
+				::memcpy(buffer + length, iov[i].iov_base, iov[i].iov_len);
+				length += iov[i].iov_len;
+			}
+			int rc = send(buffer, length);
+			return rc < 0 ? rc : (int) total;
+		}
+		for (int i = 0; i < iovcnt; i++) {
+			int rc = send((const uint8_t*) iov[i].iov_base, iov[i].iov_len);
+			if (rc < 0) return rc;
+		}
+		return total;
+	}
+
+	// writev() may send only some of the data.  Work on a copy of the buffer list that we can advance.
+	struct iovec vec[SENDV_MAX_IOV];
+	::memcpy(vec, iov, iovcnt * sizeof(struct iovec));
+	struct iovec* pVec = vec;
+	size_t remaining = total;
+	while (remaining > 0) {
+		int rc = ::lwip_writev(m_sock, pVec, iovcnt);
+		if (rc < 0) {
+			if (errno == EAGAIN) continue;
+			ESP_LOGE(LOG_TAG, "sendv: socket=%d, %s", m_sock, strerror(errno));
+			return rc;
+		}
+		remaining -= rc;
+		while (iovcnt > 0 && (size_t) rc >= pVec->iov_len) {   // Skip the buffers that were sent completely.
+			rc -= pVec->iov_len;
+			pVec++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			pVec->iov_base = (uint8_t*) pVec->iov_base + rc;
+			pVec->iov_len -= rc;
+		}
+	}
+	return total;
+} // sendv
+
+
 /**
  * @brief Send data to a specific address.
  * @param [in] data The data to send.
@@ -481,7 +603,7 @@ int  Socket::send(uint32_t value) {
 void Socket::sendTo(const uint8_t* data, size_t length, struct sockaddr* pAddr) {
 	int rc;
 	if (getSSL()) {
-		rc = mbedtls_ssl_write(&m_sslContext, data, length);
+		rc = mbedtls_ssl_write(&m_pSSL->ssl, data, length);
 	} else {
 		rc = ::sendto(m_sock, data, length, 0, pAddr, sizeof(struct sockaddr));
 	}
@@ -504,108 +626,238 @@ void Socket::setReuseAddress(bool value) {
 
 
 /**
- * @brief Flag the socket as using SSL
+ * @brief Flag the socket as using SSL.
+ * The connections accepted by a server socket share the configuration held by the context: the
+ * certificate and key are not parsed again for each of them.
  * @param [in] sslValue True if we wish to use SSL.
+ * @param [in] pContext The TLS configuration of the server.  If null, SSLServerContext::getDefault() is
+ * used, which holds the certificate and key set with SSLUtils.
  */
-void Socket::setSSL(bool sslValue) {
-  const char* pers = "ssl_server";
+void Socket::setSSL(bool sslValue, SSLServerContext* pContext) {
 	ESP_LOGD(LOG_TAG, ">> setSSL: %s", sslValue?"Yes":"No");
-	m_useSSL = sslValue;
-
+	m_useSSL      = sslValue;
+	m_pSSLContext = nullptr;
 	if (sslValue) {
-		char *pvtKey = SSLUtils::getKey();
-		char *certificate = SSLUtils::getCertificate();
-		if (pvtKey == nullptr) {
-			ESP_LOGE(LOG_TAG, "No private key file");
-			return;
-		}
-		if (certificate == nullptr) {
-			ESP_LOGE(LOG_TAG, "No certificate file");
-			return;
+		m_pSSLContext = (pContext != nullptr) ? pContext : SSLServerContext::getDefault();
+		if (!m_pSSLContext->isValid()) {
+			ESP_LOGE(LOG_TAG, "setSSL: No certificate and key have been loaded");
 		}
+	}
+} // setSSL
 
-		mbedtls_net_init(&m_sslSock);
-		mbedtls_ssl_init(&m_sslContext);
-		mbedtls_ssl_config_init(&m_conf);
-		mbedtls_x509_crt_init(&m_srvcert);
-		mbedtls_pk_init(&m_pkey);
-		mbedtls_entropy_init(&m_entropy);
-		mbedtls_ctr_drbg_init(&m_ctr_drbg);
-
-		int ret = mbedtls_x509_crt_parse(&m_srvcert, (unsigned char *) certificate, strlen(certificate) + 1);
-		if (ret != 0) {
-			ESP_LOGD(LOG_TAG, "mbedtls_x509_crt_parse returned 0x%x", -ret);
-			goto exit;
-		}
 
-		ret = mbedtls_pk_parse_key(&m_pkey, (unsigned char *) pvtKey, strlen(pvtKey) + 1, (const unsigned char *) "", 0,
-                                   nullptr, 0);
-		if (ret != 0) {
-			ESP_LOGD(LOG_TAG, "mbedtls_pk_parse_key returned 0x%x", -ret);
-			goto exit;
-		}
+/**
+ * @brief Receive for the TLS layer.
+ * When the connection isn't blocking, a receive that would have to wait asks the TLS layer to
+ * call again once there is data.
+ * @param [in] pContext The TLS state of the connection.
+ * @param [in] data The buffer to receive into.
+ * @param [in] length The size of the buffer.
+ * @return The number of bytes received or an mbedtls error.
+ */
+int Socket::sslReceive(void* pContext, unsigned char* data, size_t length) {
+	SSLConnection* pConnection = (SSLConnection*) pContext;
+	if (!pConnection->nonBlocking) {
+		return mbedtls_net_recv(&pConnection->net, data, length);
+	}
+	int rc = ::lwip_recv(pConnection->net.fd, data, length, MSG_DONTWAIT);
+	if (rc >= 0) return rc;
+	if (errno == EAGAIN || errno == EWOULDBLOCK) return MBEDTLS_ERR_SSL_WANT_READ;
+	return MBEDTLS_ERR_NET_RECV_FAILED;
+} // sslReceive
 
-		ret = mbedtls_ctr_drbg_seed(&m_ctr_drbg, mbedtls_entropy_func, &m_entropy, (const unsigned char*) pers, strlen(pers));
-		if (ret != 0) {
-			ESP_LOGD(LOG_TAG, "! mbedtls_ctr_drbg_seed returned %d\n", ret);
-			goto exit;
-		}
 
-		ret = mbedtls_ssl_config_defaults(&m_conf,
-				MBEDTLS_SSL_IS_SERVER,
-				MBEDTLS_SSL_TRANSPORT_STREAM,
-				MBEDTLS_SSL_PRESET_DEFAULT);
-		if (ret != 0) {
-			ESP_LOGD(LOG_TAG, "mbedtls_ssl_config_defaults returned %d\n\n", ret);
-			goto exit;
-		}
+/**
+ * @brief Send for the TLS layer.
+ * @param [in] pContext The TLS state of the connection.
+ * @param [in] data The data to send.
+ * @param [in] length The length of the data.
+ * @return The number of bytes sent or an mbedtls error.
+ */
+int Socket::sslSend(void* pContext, const unsigned char* data, size_t length) {
+	return mbedtls_net_send(&((SSLConnection*) pContext)->net, data, length);
+} // sslSend
 
-		mbedtls_ssl_conf_authmode(&m_conf, MBEDTLS_SSL_VERIFY_NONE);
-		mbedtls_ssl_conf_rng(&m_conf, mbedtls_ctr_drbg_random, &m_ctr_drbg);
 
-//	mbedtls_ssl_conf_ca_chain( &m_conf, m_srvcert.next, NULL);
-		ret = mbedtls_ssl_conf_own_cert(&m_conf, &m_srvcert, &m_pkey);
-		if (ret != 0) {
-			ESP_LOGD(LOG_TAG, "mbedtls_ssl_conf_own_cert returned %d\n\n", ret);
-			goto exit;
-		}
+/**
+ * @brief perform the SSL handshake
+ * @return True if the handshake completed.
+ */
+bool Socket::sslHandshake() {
+	ESP_LOGD(LOG_TAG, ">> sslHandshake: sock: %d", m_sock);
+	if (!sslSetup()) return false;
+	int rc;
+	while ((rc = sslHandshakeStep()) == 0) {}
+	ESP_LOGD(LOG_TAG, "<< sslHandshake");
+	return rc > 0;
+} // sslHandshake
+
+
+/**
+ * @brief Take the SSL handshake as far as the data received allows.
+ * The handshake is counted by the server context when it completes or fails.  Whether the client
+ * resumed a session is noted as the handshake goes, as other handshakes may run on the same task
+ * in between.
+ * @return 1 if the handshake has completed, 0 if it needs more data from the client or -1 if it failed.
+ */
+int Socket::sslHandshakeStep() {
+	int ret = mbedtls_ssl_handshake(&m_pSSL->ssl);
+	m_pSSL->resumed = SSLServerContext::takeSessionFound() || m_pSSL->resumed;
+	if (ret == 0) {
+		m_pSSLContext->recordHandshake(true, m_pSSL->resumed);
+		return 1;
+	}
+	if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+		return 0;
+	}
+	ESP_LOGD(LOG_TAG, "mbedtls_ssl_handshake returned %d", ret);
+	m_pSSLContext->recordHandshake(false, false);
+	return -1;
+} // sslHandshakeStep
+
+
+/**
+ * @brief Prepare the TLS state of a new connection, ready for the handshake.
+ * @return True if the TLS state was set up.
+ */
+bool Socket::sslSetup() {
+	m_pSSL = std::make_shared<SSLConnection>();
+	m_pSSL->net.fd = m_sock;
+	int ret = mbedtls_ssl_setup(&m_pSSL->ssl, m_pSSLContext->getConfig());
+	if (ret != 0) {
+		ESP_LOGE(LOG_TAG, "mbedtls_ssl_setup returned -0x%x", -ret);
+		m_pSSLContext->recordHandshake(false, false);
+		return false;
+	}
+	mbedtls_ssl_set_bio(&m_pSSL->ssl, m_pSSL.get(), sslSend, sslReceive, NULL);
+	return true;
+} // sslSetup
 
-		mbedtls_ssl_conf_dbg(&m_conf, my_debug, nullptr);
-#ifdef CONFIG_MBEDTLS_DEBUG
-		mbedtls_debug_set_threshold(4);
-#endif
 
-		ret = mbedtls_ssl_setup(&m_sslContext, &m_conf);
-		if (ret != 0) {
-			ESP_LOGD(LOG_TAG, "mbedtls_ssl_setup returned %d\n\n", ret);
-			goto exit;
+/**
+ * @brief Take the SSL handshake of a socket accepted without it as far as it goes without waiting.
+ * This is called each time data arrives from the client until the handshake is over.  If the
+ * handshake fails the socket is closed.
+ * @return 1 if the handshake has completed, 0 if it needs more data from the client or -1 if it failed.
+ */
+int Socket::tryHandshake() {
+	m_pSSL->nonBlocking = true;
+	int rc = sslHandshakeStep();
+	m_pSSL->nonBlocking = false;
+	if (rc < 0) {
+		m_pSSL.reset();   // There is no session to send a close notify on.
+		close();
+	}
+	return rc;
+} // tryHandshake
+
+
+/**
+ * @brief Receive what has arrived without waiting for more.
+ * Over SSL only whole records are returned, so data may have arrived and yet none be returned.
+ * @param [in] data The buffer to receive into.
+ * @param [in] length The size of the buffer.
+ * @return The number of bytes received, 0 if there is nothing to receive yet or -1 if the peer has
+ * closed the connection or it has failed.
+ */
+int Socket::tryReceive(uint8_t* data, size_t length) {
+	int rc;
+	if (getSSL()) {
+		m_pSSL->nonBlocking = true;
+		rc = mbedtls_ssl_read(&m_pSSL->ssl, data, length);
+		m_pSSL->nonBlocking = false;
+		if (rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE) {
+			return 0;
+		}
+		if (rc < 0 && rc != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+			ESP_LOGE(LOG_TAG, "tryReceive: SSL read error %d", rc);
+		}
+	} else {
+		rc = ::lwip_recv(m_sock, data, length, MSG_DONTWAIT);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			ESP_LOGE(LOG_TAG, "tryReceive: socket=%d, %s", m_sock, strerror(errno));
 		}
 	}
-exit:
-	return;
-} // setSSL
+	return rc > 0 ? rc : -1;
+} // tryReceive
 
 
 /**
- * @brief perform the SSL handshake
+ * @brief Send as much of the data as the socket will take without waiting.
+ * Over SSL a record can't be split, so the data is written as usual and may wait for up to the send
+ * timeout of the socket.
+ * @param [in] data The data to send.
+ * @param [in] length The length of the data.
+ * @return The number of bytes sent, 0 if the socket can't take any data now or a negative value on error.
  */
-void Socket::sslHandshake() {
-	ESP_LOGD(LOG_TAG, ">> sslHandshake: sock: %d", m_sslSock.fd);
-	mbedtls_ssl_session_reset(&m_sslContext);
-	ESP_LOGD(LOG_TAG, " - Reset complete");
-	mbedtls_ssl_set_bio(&m_sslContext, &m_sslSock, mbedtls_net_send, mbedtls_net_recv, NULL);
+int Socket::trySend(const uint8_t* data, size_t length) const {
+	if (getSSL()) {
+		int rc = mbedtls_ssl_write(&m_pSSL->ssl, data, length);
+		if (rc == MBEDTLS_ERR_SSL_WANT_WRITE || rc == MBEDTLS_ERR_SSL_WANT_READ) {
+			return 0;   // Must be retried with the same data.
+		}
+		if (rc < 0) {
+			ESP_LOGE(LOG_TAG, "trySend: SSL write error %d", rc);
+		}
+		return rc;
+	}
+	int rc = ::lwip_send(m_sock, data, length, MSG_DONTWAIT);
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		ESP_LOGE(LOG_TAG, "trySend: socket=%d, %s", m_sock, strerror(errno));
+	}
+	return rc;
+} // trySend
 
-	while (true) {
-		int ret = mbedtls_ssl_handshake(&m_sslContext);
-		if (ret == 0) break;
 
-		if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-			ESP_LOGD(LOG_TAG, "mbedtls_ssl_handshake returned %d\n\n", ret);
-			return;
+/**
+ * @brief Send as much of the data from several buffers as the socket will take without waiting.
+ * The buffers are sent as though they were one.  Over SSL, buffers that together are no larger than
+ * SENDV_GATHER_SIZE are copied into one record, otherwise only the first buffer is sent.  A record
+ * can't be split, so it is written as usual and may wait for up to the send timeout of the socket.
+ * @param [in] iov The buffers to send.
+ * @param [in] iovcnt The number of buffers, no more than SENDV_MAX_IOV.
+ * @return The number of bytes sent, 0 if the socket can't take any data now or a negative value on error.
+ */
+int Socket::trySendv(const struct iovec* iov, int iovcnt) const {
+	if (iovcnt > SENDV_MAX_IOV) {
+		ESP_LOGE(LOG_TAG, "trySendv: Too many buffers: %d", iovcnt);
+		return -1;
+	}
+	if (getSSL()) {
+		size_t total = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			total += iov[i].iov_len;
 		}
-	} // End while
-	ESP_LOGD(LOG_TAG, "<< sslHandshake");
-} // sslHandshake
+		if (iovcnt > 1 && total <= SENDV_GATHER_SIZE) {
+			uint8_t buffer[SENDV_GATHER_SIZE];
+			size_t length = 0;
+			for (int i = 0; i < iovcnt; i++) {
+				::memcpy(buffer + length, iov[i].iov_base, iov[i].iov_len);
+				length += iov[i].iov_len;
+			}
+			return trySend(buffer, length);
+		}
+		return trySend((const uint8_t*) iov[0].iov_base, iov[0].iov_len);
+	}
+	struct msghdr msg;
+	::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = (struct iovec*) iov;
+	msg.msg_iovlen = iovcnt;
+	int rc = ::lwip_sendmsg(m_sock, &msg, MSG_DONTWAIT);
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		ESP_LOGE(LOG_TAG, "trySendv: socket=%d, %s", m_sock, strerror(errno));
+	}
+	return rc;
+} // trySendv
 
 
 /**
@@ -36,12 +36,15 @@
 #include <cstdio>
 #include <cstring>
 #include <exception>
+#include <memory>
 
 
 #if CONFIG_CXX_EXCEPTIONS != 1
 #error "C++ exception handling must be enabled within make menuconfig. See Compiler Options > Enable C++ Exceptions."
 #endif
 
+class SSLServerContext;
+
 class SocketException: public std::exception {
 public:
 	SocketException(int myErrno);
@@ -61,10 +64,13 @@ private:
  */
 class Socket {
 public:
+	static const int    SENDV_MAX_IOV = 8;          // The most buffers sendv() takes.
+	static const size_t SENDV_GATHER_SIZE = 512;    // Over SSL, buffers up to this size in total are sent as one record.
+
 	Socket();
 	virtual ~Socket();
 
-	Socket accept();
+	Socket accept(uint32_t timeout = 0, bool handshake = true);
 	static std::string addressToString(struct sockaddr* addr);
 	int  bind(uint16_t port, uint32_t address);
 	int  close();
@@ -76,7 +82,9 @@ public:
 	int  setTimeout(uint32_t seconds);
 	void getBind(struct sockaddr* pAddr);
 	int  getFD() const;
+	void getPeer(struct sockaddr* pAddr);
 	bool getSSL() const;
+	bool hasBufferedData() const;
 	bool isValid();
 	int  listen(uint16_t port, bool isDatagram = false, bool reuseAddress = false);
 	bool operator<(const Socket& other) const;
@@ -88,20 +96,35 @@ public:
 	int  send(uint16_t value);
 	int  send(uint32_t value);
 	void sendTo(const uint8_t* data, size_t length, struct sockaddr* pAddr);
-	void setSSL(bool sslValue = true);
+	int  sendv(const struct iovec* iov, int iovcnt) const;
+	int  setNoDelay(bool value);
+	void setSSL(bool sslValue = true, SSLServerContext* pContext = nullptr);
 	std::string toString();
+	int  tryHandshake();
+	int  tryReceive(uint8_t* data, size_t length);
+	int  trySend(const uint8_t* data, size_t length) const;
+	int  trySendv(const struct iovec* iov, int iovcnt) const;
 
 private:
+	// The TLS state of a connection.  It is shared by the copies of the socket.
+	struct SSLConnection {
+		mbedtls_net_context net;
+		mbedtls_ssl_context ssl;
+		bool                nonBlocking;   // Should a receive that would wait return straight away?
+		bool                resumed;       // Has the client resumed a session in the handshake?
+		SSLConnection();
+		~SSLConnection();
+	};
+
 	int  m_sock;     // The underlying TCP/IP socket
 	bool m_useSSL;   // Should we use SSL
-	mbedtls_net_context      m_sslSock{};
-	mbedtls_entropy_context  m_entropy{};
-	mbedtls_ctr_drbg_context m_ctr_drbg{};
-	mbedtls_ssl_context      m_sslContext{};
-	mbedtls_ssl_config       m_conf{};
-	mbedtls_x509_crt         m_srvcert{};
-	mbedtls_pk_context       m_pkey{};
-	void sslHandshake();
+	SSLServerContext*              m_pSSLContext;   // The shared TLS configuration, if using SSL.
+	std::shared_ptr<SSLConnection> m_pSSL;          // The TLS state once the handshake has been made.
+	bool sslHandshake();
+	int  sslHandshakeStep();
+	bool sslSetup();
+	static int sslReceive(void* pContext, unsigned char* data, size_t length);
+	static int sslSend(void* pContext, const unsigned char* data, size_t length);
 
 };
 
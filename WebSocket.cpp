@@ -5,18 +5,17 @@
  *      Author: kolban
  */
 
-#include <sstream>
+#include <algorithm>
+#include <iterator>
 #include "WebSocket.h"
+#include "WebSocketHub.h"
+#include "WebSocketDeflate.h"
 #include "Task.h"
 #include "GeneralUtils.h"
 #include <esp_log.h>
-
-extern "C" {
-	extern uint16_t lwip_ntohs(uint16_t);
-	extern uint32_t lwip_ntohl(uint32_t);
-	extern uint16_t lwip_htons(uint16_t);
-	extern uint32_t lwip_htonl(uint32_t);
-}
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static const char* LOG_TAG = "WebSocket";
 
@@ -28,62 +27,34 @@ static const uint8_t OPCODE_CLOSE    = 0x08;
 static const uint8_t OPCODE_PING     = 0x09;
 static const uint8_t OPCODE_PONG     = 0x0a;
 
+static const uint8_t OPCODE_CONTROL  = 0x08;   // The bit set in the op codes of control frames.
+static const uint8_t RSV1            = 0x04;   // The reserved bit set on the first frame of a compressed message.
+static const size_t  MAX_CONTROL_PAYLOAD = 125;
 
-// Structure definition for the WebSocket frame.
-struct Frame {
-	// Byte 0
-	uint8_t opCode : 4; // [7:4]
-	uint8_t rsv3   : 1; // [3]
-	uint8_t rsv2   : 1; // [2]
-	uint8_t rsv1   : 1; // [1]
-	uint8_t fin    : 1; // [0]
-
-	// Byte 1
-	uint8_t len    : 7; // [7:1]
-	uint8_t mask   : 1; // [0]
-};
+// The unit in which payload is unmasked: the width of a register.
+#if UINTPTR_MAX > 0xffffffff
+typedef uint64_t MaskWord;
+#else
+typedef uint32_t MaskWord;
+#endif
 
 
 /**
- * @brief Dump the content of the WebSocket frame for debugging.
- * @param [in] frame The frame to dump.
+ * @brief Get the name of a frame op code for debugging.
+ * @param [in] opCode The op code.
+ * @return The name of the op code.
  */
-static void dumpFrame(Frame frame) {
-	std::ostringstream oss;
-	oss << "Fin: " << (int) frame.fin << ", OpCode: " << (int) frame.opCode;
-	switch (frame.opCode) {
-		case OPCODE_BINARY: {
-			oss << " BINARY";
-			break;
-		}
-		case OPCODE_CONTINUE: {
-			oss << " CONTINUE";
-			break;
-		}
-		case OPCODE_CLOSE: {
-			oss << " CLOSE";
-			break;
-		}
-		case OPCODE_PING: {
-			oss << " PING";
-			break;
-		}
-		case OPCODE_PONG: {
-			oss << " PONG";
-			break;
-		}
-		case OPCODE_TEXT: {
-			oss << " TEXT";
-			break;
-		}
-		default: {
-			oss << " Unknown";
-			break;
-		}
+static const char* opCodeToString(uint8_t opCode) {
+	switch (opCode) {
+		case OPCODE_BINARY:   return "BINARY";
+		case OPCODE_CONTINUE: return "CONTINUE";
+		case OPCODE_CLOSE:    return "CLOSE";
+		case OPCODE_PING:     return "PING";
+		case OPCODE_PONG:     return "PONG";
+		case OPCODE_TEXT:     return "TEXT";
+		default:              return "Unknown";
 	}
-	oss << ", Mask: " << (int) frame.mask << ", len: " << (int) frame.len;
-	ESP_LOGD(LOG_TAG, "WebSocket frame: %s", oss.str().c_str());
-} // dumpFrame
+} // opCodeToString
 
 
 /**
@@ -106,92 +77,42 @@ private:
 	bool m_end;
 	/**
 	 * @brief Loop over the web socket waiting for new input.
+	 * We wake up at least once a second to ping an idle peer and to notice timeouts.
 	 * @param [in] data A pointer to an instance of the WebSocket.
 	 */
 	void run(void* data) {
 		WebSocket* pWebSocket = (WebSocket*) data;
 		ESP_LOGD("WebSocketReader", "WebSocketReader Task started, socket: %s", pWebSocket->getSocket().toString().c_str());
 
-		Socket peerSocket = pWebSocket->getSocket();
-
-		Frame frame;
 		while (true) {
 			if (m_end) break;
-			ESP_LOGD("WebSocketReader", "Waiting on socket data for socket %s", peerSocket.toString().c_str());
-			int length = peerSocket.receive((uint8_t*) &frame, sizeof(frame), true); // Read exact
-			if (length != sizeof(frame)) {
-				ESP_LOGD("WebSocketReader", "Socket read error");
-				pWebSocket->close();
-				return;
-			}
-			ESP_LOGD("WebSocketReader", "Received data from web socket.  Length: %d", length);
-			dumpFrame(frame);
-
-			// The following section parses the WebSocket frame.
-			uint32_t payloadLen = 0;
-			uint8_t  mask[4];
-			if (frame.len < 126) {
-				payloadLen = frame.len;
-			} else if (frame.len == 126) {
-				uint16_t tempLen;
-				peerSocket.receive((uint8_t*) &tempLen, sizeof(tempLen), true);
-				payloadLen = ntohs(tempLen);
-			} else if (frame.len == 127) {
-				uint64_t tempLen;
-				peerSocket.receive((uint8_t*) &tempLen, sizeof(tempLen), true);
-				payloadLen = ntohl((uint32_t) tempLen);
-			}
-			if (frame.mask == 1) {
-				peerSocket.receive(mask, sizeof(mask), true);
-			}
-
-			if (payloadLen == 0) {
-				ESP_LOGD("WebSocketReader", "Web socket payload is not present");
-			} else {
-				ESP_LOGD("WebSocketReader", "Web socket payload, length=%d:", payloadLen);
-			}
-
-			WebSocketHandler* pWebSocketHandler = pWebSocket->getHandler();
-			switch (frame.opCode) {
-				case OPCODE_TEXT:
-				case OPCODE_BINARY: {
-					if (pWebSocketHandler != nullptr) {
-						WebSocketInputStreambuf streambuf(pWebSocket->getSocket(), payloadLen, (frame.mask == 1) ? mask : nullptr);
-						pWebSocketHandler->onMessage(&streambuf, pWebSocket);
-						//streambuf.discard();
-					}
-					break;
-				}
-
-				// If the WebSocket operation code is close then we are closing the connection.
-				case OPCODE_CLOSE: {
-					pWebSocket->m_receivedClose = true;
-					if (pWebSocketHandler != nullptr) { // If we have a handler, invoke the onClose method upon it.
-						pWebSocketHandler->onClose();
-					}
-					pWebSocket->close();                // Close the websocket.
-					break;
-				}
-
-				case OPCODE_CONTINUE: {
-					break;
-				}
-
-				case OPCODE_PING: {
-					break;
+			if (!pWebSocket->hasBufferedData()) {
+				bool pendingSend;   // Are frames waiting for the socket to take more?
+				int fd = pWebSocket->getPollFD(&pendingSend);
+				if (fd < 0) break;  // Another task has closed the web socket.
+				fd_set readSet;
+				fd_set writeSet;
+				FD_ZERO(&readSet);
+				FD_ZERO(&writeSet);
+				FD_SET(fd, &readSet);
+				if (pendingSend) {
+					FD_SET(fd, &writeSet);
 				}
-
-				case OPCODE_PONG: {
-					break;
+				struct timeval tv;
+				tv.tv_sec  = 1;
+				tv.tv_usec = 0;
+				int rc = ::select(fd + 1, &readSet, &writeSet, nullptr, &tv);
+				if (rc < 0) break;
+				if (FD_ISSET(fd, &writeSet) && !pWebSocket->flush()) break;
+				if (!FD_ISSET(fd, &readSet)) {
+					if (!pWebSocket->checkTimeouts()) break;
+					continue;
 				}
-
-				default: {
-					ESP_LOGD("WebSocketReader", "Unknown opcode: %d", frame.opCode);
-					break;
-				}
-			} // Switch opCode
-
+			}
+			if (!pWebSocket->processFrame()) break;
+			if (!pWebSocket->checkTimeouts()) break;
 		} // while (true)
+		pWebSocket->releaseReadState();
 		ESP_LOGD("WebSocketReader", "<< run");
 	} // run
 }; // WebSocketReader
@@ -199,7 +120,8 @@ private:
 
 /**
  * @brief The default onClose handler.
- * If no over-riding handler is provided for the "close" event, this method is called.
+ * If no over-riding handler is provided for the "close" event, this method is called.  It is called
+ * once when the connection ends, whether or not the peer asked for it.
  */
 void WebSocketHandler::onClose() {
 	ESP_LOGD("WebSocketHandler", ">> onClose");
@@ -216,13 +138,36 @@ void WebSocketHandler::onClose() {
  * buffer << pWebSocketInputRecordStreambuf;
  * ```
  * This will read the whole message into the string stream.
+ *
+ * The default reads the whole message, up to the maximum message size, and passes it to onWholeMessage().
  */
 void WebSocketHandler::onMessage(WebSocketInputStreambuf* pWebSocketInputStreambuf, WebSocket* pWebSocket) {
 	ESP_LOGD("WebSocketHandler", ">> onMessage");
+	std::string message;
+	if (pWebSocket->getMaxMessageSize() > 0) {   // The size has been checked against the limit.
+		message.reserve(pWebSocketInputStreambuf->getRecordSize());
+	}
+	message.assign(std::istreambuf_iterator<char>(pWebSocketInputStreambuf), std::istreambuf_iterator<char>());
+	if (pWebSocketInputStreambuf->isComplete()) {
+		onWholeMessage(message, pWebSocketInputStreambuf->isText(), pWebSocket);
+	}
 	ESP_LOGD("WebSocketHandler", "<< onMessage");
 } // onData
 
 
+/**
+ * @brief The default onWholeMessage handler.
+ * Override this rather than onMessage() to be given each message in one piece.
+ * @param [in] message The payload of the message.  It may be modified or swapped out.
+ * @param [in] isText True for a text message, false for a binary one.
+ * @param [in] pWebSocket The WebSocket the message arrived on.
+ */
+void WebSocketHandler::onWholeMessage(std::string& message, bool isText, WebSocket* pWebSocket) {
+	ESP_LOGD("WebSocketHandler", ">> onWholeMessage: length: %d", message.length());
+	ESP_LOGD("WebSocketHandler", "<< onWholeMessage");
+} // onWholeMessage
+
+
 /**
  * @brief The default onError handler.
  * If no over-riding handler is provided for the "error" event, this method is called.
@@ -235,13 +180,36 @@ void WebSocketHandler::onError(std::string error) {
 
 /**
  * @brief Construct a WebSocket instance.
+ * @param [in] socket The socket of the connection.
+ * @param [in] pDeflate The permessage-deflate extension negotiated in the upgrade, if any.  The web
+ * socket takes ownership of it.
  */
-WebSocket::WebSocket(Socket socket) {
+WebSocket::WebSocket(Socket socket, WebSocketDeflate* pDeflate) {
 	m_receivedClose     = false;
 	m_sentClose         = false;
+	m_pingSent          = false;
 	m_socket            = socket;
 	m_pWebSockerReader  = new WebSocketReader();
 	m_pWebSocketHandler = nullptr;
+	m_pDeflate          = pDeflate;
+	m_readStart         = 0;
+	m_readEnd           = 0;
+	m_bufferSize        = DEFAULT_BUFFER_SIZE;
+	m_maxMessageSize    = DEFAULT_MAX_MESSAGE_SIZE;
+	m_pingInterval      = DEFAULT_PING_INTERVAL;
+	m_pongTimeout       = DEFAULT_PONG_TIMEOUT;
+	m_closeTimeout      = DEFAULT_CLOSE_TIMEOUT;
+	m_lastReceive       = FreeRTOS::getTimeSinceStart();
+	m_closeSent         = 0;
+	m_sendOffset        = 0;
+	m_sendQueueSize     = DEFAULT_SEND_QUEUE_SIZE;
+	m_sendPolicy        = SEND_BLOCK;
+	m_sendStats         = SendStats();
+	m_closed            = false;
+	m_users             = 0;
+	m_eventDriven       = false;
+	m_pendingStart      = 0;
+	m_receiveTimeout    = 0;
 } // WebSocket
 
 
@@ -249,13 +217,58 @@ WebSocket::WebSocket(Socket socket) {
  * @brief Destructor.
  */
 WebSocket::~WebSocket() {
+	for (auto it = m_hubs.begin(); it != m_hubs.end(); ++it) {
+		(*it)->removeMember(this);
+	}
 	m_pWebSockerReader->stop();
 	delete m_pWebSockerReader;
+	delete m_pDeflate;
 } // ~WebSocket
 
 
+/**
+ * @brief Ping an idle peer and close the connection when a timeout has passed.
+ * This is called at least once a second by whichever task reads the web socket.
+ * @return False if the web socket has been closed.
+ */
+bool WebSocket::checkTimeouts() {
+	if (!m_socket.isValid()) return false;
+	uint32_t now = FreeRTOS::getTimeSinceStart();
+	if (m_eventDriven && m_pendingStart < m_pending.length() && now - m_lastReceive > m_receiveTimeout * 1000) {
+		ESP_LOGW(LOG_TAG, "Frame not completed in time; sockFd=%d", m_socket.getFD());
+		closeSocket();
+		return false;
+	}
+	if (m_sentClose) {
+		if (now - m_closeSent > m_closeTimeout * 1000) {
+			ESP_LOGW(LOG_TAG, "No answer to our close request; sockFd=%d", m_socket.getFD());
+			closeSocket();
+			return false;
+		}
+		return true;
+	}
+	if (m_pingInterval == 0) return true;
+	uint32_t idle = now - m_lastReceive;
+	if (m_pingSent && idle > (m_pingInterval + m_pongTimeout) * 1000) {
+		ESP_LOGW(LOG_TAG, "Peer is not responding; sockFd=%d", m_socket.getFD());
+		if (m_pWebSocketHandler != nullptr) {
+			m_pWebSocketHandler->onError("Peer is not responding");
+		}
+		closeSocket();
+		return false;
+	}
+	if (!m_pingSent && idle > m_pingInterval * 1000) {
+		m_pingSent = true;
+		ping();
+	}
+	return m_socket.isValid();
+} // checkTimeouts
+
+
 /**
  * @brief Close the Web socket
+ * A close request is sent to the peer.  The socket is closed when the peer has answered, or straight
+ * away if the peer asked for the close.
  * @param [in] status The code passed in the close request.
  * @param [in] message A clarification message on the close request.
  */
@@ -264,35 +277,231 @@ void WebSocket::close(uint16_t status, std::string message) {
 
 	if (m_sentClose) {             // If we have previously sent a close request then we can close the underlying socket.
 		ESP_LOGD(LOG_TAG, "Closing the underlying socket");
-		m_socket.close();            // Close the underlying socket.
-		m_pWebSockerReader->end();   // Stop the web socket reader.
+		closeSocket();
 		return;
 	}
 	m_sentClose = true;              // Flag that we have sent a close request.
+	m_closeSent = FreeRTOS::getTimeSinceStart();
+
+	// The payload of a close frame is the status code in network byte order followed by the message.
+	uint8_t payload[MAX_CONTROL_PAYLOAD];
+	size_t length = message.length() < MAX_CONTROL_PAYLOAD - 2 ? message.length() : MAX_CONTROL_PAYLOAD - 2;
+	payload[0] = status >> 8;
+	payload[1] = status & 0xff;
+	::memcpy(payload + 2, message.data(), length);
+	bool sent = sendFrame(OPCODE_CLOSE, payload, length + 2);
+
+	if (m_receivedClose || !sent) {
+		closeSocket();
+	}
+} // close
 
-	Frame frame;                     // Build the web socket frame indicating a close request.
-	frame.fin    = 1;
-	frame.rsv1   = 0;
-	frame.rsv2   = 0;
-	frame.rsv3   = 0;
-	frame.opCode = OPCODE_CLOSE;
-	frame.mask   = 0;
-	frame.len    = message.length() + 2;
-	int rc = m_socket.send((uint8_t*) &frame, sizeof(frame));
 
-	if (rc > 0) {
-		rc = m_socket.send(status);
+/**
+ * @brief Close the underlying socket and stop reading it.
+ * Queued frames that the socket won't take straight away are dropped.  The handler is told that the
+ * web socket has closed.  In event driven mode the server deletes the web socket once this has
+ * returned, so the application mustn't use it after onClose().
+ */
+void WebSocket::closeSocket() {
+	m_sendLock.take("closeSocket");
+	if (!m_socket.isValid()) {
+		m_sendLock.give();
+		return;
+	}
+	flushQueue();                // A last chance for the frames already queued, such as our close request.
+	m_sendQueue.clear();
+	m_sendOffset = 0;
+	m_socket.close();            // Close the underlying socket.
+	std::vector<WebSocketHub*> hubs;
+	hubs.swap(m_hubs);
+	m_sendLock.give();
+	m_pWebSockerReader->end();   // Stop the web socket reader.
+	for (auto it = hubs.begin(); it != hubs.end(); ++it) {
+		(*it)->removeMember(this);
 	}
+	if (m_pWebSocketHandler != nullptr) {
+		m_pWebSocketHandler->onClose();
+	}
+	m_closed = true;
+} // closeSocket
 
-	if (rc > 0) {
-		m_socket.send(message);
+
+/**
+ * @brief Encode an unfragmented message with its payload compressed.
+ * @param [in] data The message.
+ * @param [in] length The length of the message.
+ * @param [in] sendType The type of payload.  Either SEND_TYPE_TEXT or SEND_TYPE_BINARY.
+ * @return The frame, or null if the message should be sent uncompressed.
+ */
+std::shared_ptr<const std::string> WebSocket::encodeCompressedMessage(const uint8_t* data, size_t length, uint8_t sendType) {
+	std::string compressed;
+	if (!WebSocketDeflate::compress(data, length, compressed)) {
+		return nullptr;
 	}
+	return encodeFrame((sendType == SEND_TYPE_TEXT) ? OPCODE_TEXT : OPCODE_BINARY,
+		(const uint8_t*) compressed.data(), compressed.length(), RSV1);
+} // encodeCompressedMessage
 
-	if (m_receivedClose || rc == 0 || rc == -1) {
-		m_socket.close();            // Close the underlying socket.
-		m_pWebSockerReader->end();   // Stop the web socket reader.
+
+/**
+ * @brief Encode a frame.
+ * Frames from a server aren't masked.
+ * @param [in] opCode The op code of the frame.
+ * @param [in] data The payload.
+ * @param [in] length The length of the payload.
+ * @param [in] rsv The reserved bits of the frame.
+ * @return The header of the frame followed by the payload.
+ */
+std::shared_ptr<const std::string> WebSocket::encodeFrame(uint8_t opCode, const uint8_t* data, size_t length, uint8_t rsv) {
+	uint8_t header[10];
+	size_t headerLength;
+	header[0] = 0x80 | (rsv << 4) | opCode;   // FIN
+	if (length < 126) {
+		header[1] = length;
+		headerLength = 2;
+	} else if (length <= 0xffff) {
+		header[1] = 126;
+		header[2] = length >> 8;
+		header[3] = length & 0xff;
+		headerLength = 4;
+	} else {
+		header[1] = 127;
+		for (int i = 0; i < 8; i++) {
+			header[2 + i] = ((uint64_t) length >> (56 - 8 * i)) & 0xff;
+		}
+		headerLength = 10;
 	}
-} // close
+	std::shared_ptr<std::string> frame = std::make_shared<std::string>();
+	frame->reserve(headerLength + length);
+	frame->append((const char*) header, headerLength);
+	frame->append((const char*) data, length);
+	return frame;
+} // encodeFrame
+
+
+/**
+ * @brief Encode an unfragmented message.
+ * @param [in] data The message.
+ * @param [in] length The length of the message.
+ * @param [in] sendType The type of payload.  Either SEND_TYPE_TEXT or SEND_TYPE_BINARY.
+ * @return The frame.
+ */
+std::shared_ptr<const std::string> WebSocket::encodeMessage(const uint8_t* data, size_t length, uint8_t sendType) {
+	return encodeFrame((sendType == SEND_TYPE_TEXT) ? OPCODE_TEXT : OPCODE_BINARY, data, length);
+} // encodeMessage
+
+
+/**
+ * @brief Fail the connection because the peer broke the rules.
+ * The peer is sent a close request and the socket is closed without waiting for an answer, as what
+ * follows on the connection can't be understood.
+ * @param [in] status The code passed in the close request.
+ * @param [in] reason What went wrong.
+ * @return False, the web socket has been closed.
+ */
+bool WebSocket::failConnection(uint16_t status, const char* reason) {
+	ESP_LOGW(LOG_TAG, "Failing web socket: %s; sockFd=%d", reason, m_socket.getFD());
+	if (m_pWebSocketHandler != nullptr) {
+		m_pWebSocketHandler->onError(reason);
+	}
+	close(status, reason);
+	closeSocket();
+	return false;
+} // failConnection
+
+
+/**
+ * @brief Make sure the read buffer holds at least a number of bytes, receiving more if needed.
+ * Whatever is available is received, up to the size of the buffer, so a single receive usually
+ * brings in the header of a frame together with the start of its payload.
+ * @param [in] length The number of bytes needed.  At most READ_BUFFER_SIZE.
+ * @return False if the connection has failed.
+ */
+bool WebSocket::fill(size_t length) {
+	if (m_readEnd - m_readStart >= length) return true;
+	if (m_readStart > 0) {
+		::memmove(m_readBuffer, m_readBuffer + m_readStart, m_readEnd - m_readStart);
+		m_readEnd  -= m_readStart;
+		m_readStart = 0;
+	}
+	while (m_readEnd < length) {
+		int rc = receiveData(m_readBuffer + m_readEnd, READ_BUFFER_SIZE - m_readEnd);
+		if (rc <= 0) return false;
+		m_readEnd += rc;
+	}
+	return true;
+} // fill
+
+
+size_t WebSocket::getBufferSize() {
+	return m_bufferSize;
+} // getBufferSize
+
+
+/**
+ * @brief Was permessage-deflate negotiated for the connection?
+ * @return True if messages may be compressed.
+ */
+bool WebSocket::getCompression() {
+	return m_pDeflate != nullptr;
+} // getCompression
+
+
+/**
+ * @brief Write what the socket will take of the send queue.
+ * This is called by the task reading the web socket when the socket can take more data.
+ * @return False if the web socket has been closed.
+ */
+bool WebSocket::flush() {
+	m_sendLock.take("flush");
+	int rc = flushQueue();
+	m_sendLock.give();
+	if (rc < 0) {
+		closeSocket();
+		return false;
+	}
+	return m_socket.isValid();
+} // flush
+
+
+/**
+ * @brief Write the frames in the send queue without waiting.  The send lock must be held.
+ * As many of the frames as a write takes are written together.  We carry on until the queue is empty
+ * or the socket can't take any more.
+ * @return The number of bytes written or -1 on an error.
+ */
+int WebSocket::flushQueue() {
+	int total = 0;
+	while (!m_sendQueue.empty()) {
+		struct iovec iov[Socket::SENDV_MAX_IOV];
+		int iovcnt = 0;
+		for (auto it = m_sendQueue.begin(); it != m_sendQueue.end() && iovcnt < Socket::SENDV_MAX_IOV; ++it) {
+			size_t offset = (iovcnt == 0) ? m_sendOffset : 0;
+			iov[iovcnt].iov_base = (void*) (it->data->data() + offset);
+			iov[iovcnt].iov_len  = it->data->length() - offset;
+			iovcnt++;
+		}
+		int rc = m_socket.trySendv(iov, iovcnt);
+		if (rc < 0) return -1;
+		if (rc == 0) break;          // The socket is full.
+		m_sendStats.writes++;
+		total += rc;
+		size_t written = rc;
+		while (written > 0) {         // Drop the frames that have been sent completely.
+			size_t remaining = m_sendQueue.front().data->length() - m_sendOffset;
+			if (written < remaining) {
+				m_sendOffset += written;
+				break;
+			}
+			written -= remaining;
+			m_sendQueue.pop_front();
+			m_sendOffset = 0;
+			m_sendStats.sent++;
+		}
+	}
+	return total;
+} // flushQueue
 
 
 /**
@@ -305,6 +514,40 @@ WebSocketHandler* WebSocket::getHandler() {
 } // getHandler
 
 
+size_t WebSocket::getMaxMessageSize() {
+	return m_maxMessageSize;
+} // getMaxMessageSize
+
+
+/**
+ * @brief Get the socket to wait on.
+ * It is read under the send lock, which closeSocket() holds while closing the socket, so a web socket
+ * that another task has closed is seen as closed rather than as a stale file descriptor.
+ * @param [out] pPendingSend Set to true if frames are waiting for the socket to take more data.
+ * @return The file descriptor, or -1 if the web socket has been closed.
+ */
+int WebSocket::getPollFD(bool* pPendingSend) {
+	m_sendLock.take("getPollFD");
+	int fd = m_socket.getFD();
+	*pPendingSend = !m_sendQueue.empty();
+	m_sendLock.give();
+	return fd;
+} // getPollFD
+
+
+/**
+ * @brief Get the counters of the frames sent.
+ * @return A copy of the counters.
+ */
+WebSocket::SendStats WebSocket::getSendStats() {
+	m_sendLock.take("getSendStats");
+	SendStats stats = m_sendStats;
+	stats.depth = m_sendQueue.size();
+	m_sendLock.give();
+	return stats;
+} // getSendStats
+
+
 /**
  * @brief Get the underlying socket for the websocket.
  * @return The socket associated with the Web socket.
@@ -314,62 +557,512 @@ Socket WebSocket::getSocket() {
 } // getSocket
 
 
+/**
+ * @brief Has data already been received that select() won't report?
+ * @return True if there is data to read without waiting on the socket.
+ */
+bool WebSocket::hasBufferedData() {
+	return m_readEnd > m_readStart || m_socket.hasBufferedData();
+} // hasBufferedData
+
+
+/**
+ * @brief Has the next frame arrived whole and, if it starts a message, the rest of the message?
+ * In event driven mode a frame is only processed once this is so.  Control frames arriving between
+ * the frames of the message are part of it and count towards its size.  A message larger than the
+ * largest accepted is processed as soon as that is known, so that it is refused rather than held in
+ * memory.
+ * @return True if the next frame can be processed without waiting for data.
+ */
+bool WebSocket::isFrameReceived() {
+	const uint8_t* data = (const uint8_t*) m_pending.data() + m_pendingStart;
+	size_t   available = m_pending.length() - m_pendingStart;
+	size_t   position  = 0;
+	uint64_t received  = 0;   // The payload of the frames so far.
+	while (available - position >= 2) {
+		const uint8_t* pHeader = data + position;
+		bool    fin    = (pHeader[0] & 0x80) != 0;
+		uint8_t opCode = pHeader[0] & 0x0f;
+		uint8_t len    = pHeader[1] & 0x7f;
+		size_t headerLength = 2 + (len == 126 ? 2 : 0) + (len == 127 ? 8 : 0) + ((pHeader[1] & 0x80) ? 4 : 0);
+		if (available - position < headerLength) return false;
+		uint64_t length = len;
+		if (len == 126) {
+			length = (pHeader[2] << 8) | pHeader[3];
+		} else if (len == 127) {
+			length = 0;
+			for (int i = 0; i < 8; i++) {
+				length = (length << 8) | pHeader[2 + i];
+			}
+		}
+		if (length >> 63 || ((opCode & OPCODE_CONTROL) && length > MAX_CONTROL_PAYLOAD)) return true;   // To be failed.
+		received += length;
+		if (m_maxMessageSize > 0 && received > m_maxMessageSize) return true;                          // To be refused.
+		if (available - position - headerLength < length) return false;
+		bool first = position == 0;
+		position += headerLength + length;
+		if (opCode & OPCODE_CONTROL) {
+			if (first) return true;   // A control frame on its own.
+		} else if (fin) {
+			return true;              // The end of the message.
+		}
+	}
+	return false;
+} // isFrameReceived
+
+
+/**
+ * @brief Remember that we are a member of a hub, so that we can leave it when we close.
+ * @param [in] pHub The hub.
+ * @return False if the web socket has already closed.
+ */
+bool WebSocket::joinHub(WebSocketHub* pHub) {
+	m_sendLock.take("joinHub");
+	bool open = m_socket.isValid();
+	if (open && std::find(m_hubs.begin(), m_hubs.end(), pHub) == m_hubs.end()) {
+		m_hubs.push_back(pHub);
+	}
+	m_sendLock.give();
+	return open;
+} // joinHub
+
+
+/**
+ * @brief Forget a hub that we are no longer a member of.
+ * @param [in] pHub The hub.
+ */
+void WebSocket::leaveHub(WebSocketHub* pHub) {
+	m_sendLock.take("leaveHub");
+	m_hubs.erase(std::remove(m_hubs.begin(), m_hubs.end(), pHub), m_hubs.end());
+	m_sendLock.give();
+} // leaveHub
+
+
+/**
+ * @brief Send a ping to the peer.
+ * @param [in] payload Data the peer sends back in its pong.  At most 125 bytes are sent.
+ */
+void WebSocket::ping(std::string payload) {
+	ESP_LOGD(LOG_TAG, ">> ping; sockFd=%d", m_socket.getFD());
+	sendFrame(OPCODE_PING, (const uint8_t*) payload.data(), payload.length() < MAX_CONTROL_PAYLOAD ? payload.length() : MAX_CONTROL_PAYLOAD);
+} // ping
+
+
+/**
+ * @brief Read the payload of the control frame whose header has been read and act on it.
+ * Pings are answered with a pong carrying the same data.  A close request is answered and the
+ * socket closed.
+ * @return False if the web socket has been closed.
+ */
+bool WebSocket::processControlFrame() {
+	uint8_t payload[MAX_CONTROL_PAYLOAD];
+	size_t length = m_frame.length;
+	size_t received = 0;
+	while (received < length) {
+		int rc = receive(payload + received, length - received);
+		if (rc <= 0) {
+			closeSocket();
+			return false;
+		}
+		received += rc;
+	}
+	if (m_frame.masked) {
+		WebSocketInputStreambuf::unmask(payload, length, m_frame.mask);
+	}
+
+	switch (m_frame.opCode) {
+		case OPCODE_PING: {
+			if (!m_sentClose) {
+				sendFrame(OPCODE_PONG, payload, length);
+			}
+			break;
+		}
+
+		case OPCODE_PONG: {
+			ESP_LOGD(LOG_TAG, "Pong received; sockFd=%d", m_socket.getFD());
+			break;
+		}
+
+		// If the WebSocket operation code is close then we are closing the connection.
+		case OPCODE_CLOSE: {
+			m_receivedClose = true;
+			if (length == 1) {
+				return failConnection(CLOSE_PROTOCOL_ERROR, "Truncated close status");
+			}
+			uint16_t status = length >= 2 ? (payload[0] << 8) | payload[1] : CLOSE_NORMAL_CLOSURE;
+			ESP_LOGD(LOG_TAG, "Close request received: status: %d", status);
+			// Answer with the same status and close the socket.  The codes that only report a close
+			// locally mustn't be sent (RFC6455 section 7.4.1), so those are answered with a normal closure.
+			if (status == CLOSE_NO_STATUS_CODE || status == CLOSE_CLOSED_ABNORMALLY || status == CLOSE_TLS_HANDSHAKE_FAILURE) {
+				status = CLOSE_NORMAL_CLOSURE;
+			}
+			close(status);
+			return false;
+		}
+
+		default: {
+			break;
+		}
+	} // Switch opCode
+	return m_socket.isValid();
+} // processControlFrame
+
+
+/**
+ * @brief Read and process the next frame arriving on the web socket.
+ * We block until a complete frame header has been received and then dispatch the frame.  For data
+ * frames the registered handler consumes the message, including any continuation frames, from the
+ * socket.  This is used by the WebSocketReader task and, in event driven mode, by processReceived()
+ * once the frame has arrived whole, in which case nothing here waits on the socket.
+ * @return False if the web socket has been closed, true if further frames may follow.
+ */
+bool WebSocket::processFrame() {
+	ESP_LOGD("WebSocketReader", "Waiting on socket data for socket %s", m_socket.toString().c_str());
+	if (!readFrame()) {
+		return false;
+	}
+	if (m_frame.opCode & OPCODE_CONTROL) {
+		return processControlFrame();
+	}
+	if (m_frame.opCode == OPCODE_CONTINUE) {
+		return failConnection(CLOSE_PROTOCOL_ERROR, "Continuation frame without a message");
+	}
+	if (m_maxMessageSize > 0 && m_frame.length > m_maxMessageSize) {
+		return failConnection(CLOSE_TOO_BIG, "Message too big");
+	}
+
+	WebSocketInputStreambuf streambuf(this, m_bufferSize);
+	WebSocketHandler* pWebSocketHandler = getHandler();
+	if (pWebSocketHandler != nullptr && !m_sentClose) {   // Messages arriving after our close request are dropped.
+		pWebSocketHandler->onMessage(&streambuf, this);
+	}
+	streambuf.discard();                                  // Skip whatever the handler didn't read.
+	if (streambuf.isCompressed() && m_socket.isValid()) {
+		m_pDeflate->endMessage();
+	}
+	return m_socket.isValid();
+} // processFrame
+
+
+/**
+ * @brief Receive what has arrived on the socket without waiting and process the frames it completes.
+ * This is called by an HttpServer running in event driven mode when the socket has data to read.
+ * Data is kept until a frame, and the message it starts, have arrived whole, so the handler reads the
+ * message from memory and the server never waits on one web socket.
+ * @return False if the web socket has been closed.
+ */
+bool WebSocket::processReceived() {
+	size_t length = m_pending.length();
+	m_pending.resize(length + m_bufferSize);
+	int rc = m_socket.tryReceive((uint8_t*) &m_pending[length], m_bufferSize);
+	m_pending.resize(length + (rc > 0 ? rc : 0));
+	if (rc < 0) {
+		closeSocket();
+		return false;
+	}
+	if (rc > 0) {
+		m_lastReceive = FreeRTOS::getTimeSinceStart();
+		m_pingSent    = false;   // Anything from the peer shows it is alive.
+	}
+	while (m_socket.isValid() && isFrameReceived()) {
+		bool open = processFrame();
+		// What the read buffer took beyond the frame is given back, so that the read buffer is empty
+		// and the pending data starts at the next frame.
+		m_pendingStart -= m_readEnd - m_readStart;
+		m_readStart = 0;
+		m_readEnd   = 0;
+		m_pending.erase(0, m_pendingStart);
+		m_pendingStart = 0;
+		if (!open) return false;
+	}
+	if (m_pending.empty() && m_pending.capacity() > m_bufferSize) {
+		std::string().swap(m_pending);   // Don't keep the memory of a large message.
+	}
+	return m_socket.isValid();
+} // processReceived
+
+
+/**
+ * @brief Read the header of the next frame into m_frame.
+ * The header is checked against the rules for frames from a client.  If it breaks them, the
+ * connection is failed.
+ * @return False if the frame can't be processed.
+ */
+bool WebSocket::readFrame() {
+	if (!fill(2)) {
+		ESP_LOGD("WebSocketReader", "Socket read error");
+		closeSocket();
+		return false;
+	}
+	uint8_t* pHeader = m_readBuffer + m_readStart;
+	m_frame.fin    = (pHeader[0] & 0x80) != 0;
+	m_frame.rsv    = (pHeader[0] >> 4) & 0x07;
+	m_frame.opCode = pHeader[0] & 0x0f;
+	m_frame.masked = (pHeader[1] & 0x80) != 0;
+	uint8_t len    = pHeader[1] & 0x7f;
+	size_t headerLength = 2 + (len == 126 ? 2 : 0) + (len == 127 ? 8 : 0) + (m_frame.masked ? 4 : 0);
+	if (!fill(headerLength)) {
+		ESP_LOGD("WebSocketReader", "Socket read error");
+		closeSocket();
+		return false;
+	}
+	pHeader = m_readBuffer + m_readStart;   // The data may have moved.
+	size_t position = 2;
+	if (len == 126) {
+		m_frame.length = (pHeader[2] << 8) | pHeader[3];
+		position = 4;
+	} else if (len == 127) {
+		m_frame.length = 0;
+		for (int i = 0; i < 8; i++) {
+			m_frame.length = (m_frame.length << 8) | pHeader[2 + i];
+		}
+		position = 10;
+	} else {
+		m_frame.length = len;
+	}
+	if (m_frame.masked) {
+		::memcpy(m_frame.mask, pHeader + position, 4);
+	}
+	m_readStart += headerLength;
+	m_lastReceive = FreeRTOS::getTimeSinceStart();
+	m_pingSent    = false;   // Anything from the peer shows it is alive.
+	ESP_LOGD("WebSocketReader", "WebSocket frame: Fin: %d, OpCode: %d %s, Mask: %d, len: %llu",
+		m_frame.fin, m_frame.opCode, opCodeToString(m_frame.opCode), m_frame.masked, m_frame.length);
+
+	// RSV1 marks a compressed message, on its first frame only, once permessage-deflate is negotiated.
+	bool compressed = m_frame.rsv == RSV1 && m_pDeflate != nullptr &&
+		!(m_frame.opCode & OPCODE_CONTROL) && m_frame.opCode != OPCODE_CONTINUE;
+	if (m_frame.rsv != 0 && !compressed) {
+		failConnection(CLOSE_PROTOCOL_ERROR, "Reserved bits set");
+		return false;
+	}
+	if (!m_frame.masked) {
+		failConnection(CLOSE_PROTOCOL_ERROR, "Frame from client not masked");
+		return false;
+	}
+	if (m_frame.length >> 63) {
+		failConnection(CLOSE_PROTOCOL_ERROR, "Invalid length");
+		return false;
+	}
+	if (m_frame.opCode & OPCODE_CONTROL) {
+		if (m_frame.opCode > OPCODE_PONG) {
+			failConnection(CLOSE_PROTOCOL_ERROR, "Unknown op code");
+			return false;
+		}
+		if (!m_frame.fin || m_frame.length > MAX_CONTROL_PAYLOAD) {
+			failConnection(CLOSE_PROTOCOL_ERROR, "Invalid control frame");
+			return false;
+		}
+	} else if (m_frame.opCode > OPCODE_BINARY) {
+		failConnection(CLOSE_PROTOCOL_ERROR, "Unknown op code");
+		return false;
+	}
+	return true;
+} // readFrame
+
+
+/**
+ * @brief Receive payload data.
+ * Data already in the read buffer is taken first.
+ * @param [in] data The buffer to receive into.
+ * @param [in] length The most bytes to receive.
+ * @return The number of bytes received, 0 if the peer has closed or -1 on an error.
+ */
+int WebSocket::receive(uint8_t* data, size_t length) {
+	size_t available = m_readEnd - m_readStart;
+	if (available > 0) {
+		if (available > length) available = length;
+		::memcpy(data, m_readBuffer + m_readStart, available);
+		m_readStart += available;
+		return available;
+	}
+	return receiveData(data, length);
+} // receive
+
+
+/**
+ * @brief Receive from the socket or, in event driven mode, from the data that has already arrived.
+ * @param [in] data The buffer to receive into.
+ * @param [in] length The most bytes to receive.
+ * @return The number of bytes received, 0 if the peer has closed or -1 on an error.
+ */
+int WebSocket::receiveData(uint8_t* data, size_t length) {
+	if (!m_eventDriven) {
+		return (int) m_socket.receive(data, length);
+	}
+	size_t available = m_pending.length() - m_pendingStart;
+	if (available == 0) return -1;   // A message processed before it had all arrived, to be refused.
+	if (available > length) available = length;
+	::memcpy(data, m_pending.data() + m_pendingStart, available);
+	m_pendingStart += available;
+	return available;
+} // receiveData
+
+
+/**
+ * @brief Free what reading messages holds once we have stopped reading the web socket.
+ * A WebSocket served by its own reader task isn't deleted by the server, so the decompressor and its
+ * window of up to 32KB would otherwise be kept for good.  This must be called by the task that read
+ * the web socket, so that no message is being decompressed.
+ */
+void WebSocket::releaseReadState() {
+	if (m_pDeflate != nullptr) {
+		m_pDeflate->release();
+	}
+} // releaseReadState
+
+
 /**
  * @brief Send data down the web socket
  * See the WebSocket spec (RFC6455) section "6.1 Sending Data".
- * We build a WebSocket frame, send the frame followed by the data.
  * @param [in] data The data to send down the WebSocket.
  * @param [in] sendType The type of payload.  Either SEND_TYPE_TEXT or SEND_TYPE_BINARY.
  */
 void WebSocket::send(std::string data, uint8_t sendType) {
-	ESP_LOGD(LOG_TAG, ">> send: Length: %d", data.length());
-	Frame frame;
-	frame.fin    = 1;
-	frame.rsv1   = 0;
-	frame.rsv2   = 0;
-	frame.rsv3   = 0;
-	frame.opCode = (sendType == SEND_TYPE_TEXT) ? OPCODE_TEXT : OPCODE_BINARY;
-	frame.mask   = 0;
-	if (data.length() < 126) {
-		frame.len = data.length();
-		m_socket.send((uint8_t*) &frame, sizeof(frame));
-	} else {
-		frame.len = 126;
-		m_socket.send((uint8_t*) &frame, sizeof(frame));
-		m_socket.send(htons((uint16_t) data.length()));  // Convert to network byte order from host byte order
-	}
-	m_socket.send((uint8_t*)data.data(), data.length());
-	ESP_LOGD(LOG_TAG, "<< send");
+	send((uint8_t*) data.data(), data.length(), sendType);
 } // send_cpp
 
 
 /**
  * @brief Send data down the web socket
  * See the WebSocket spec (RFC6455) section "6.1 Sending Data".
- * We build a WebSocket frame, send the frame followed by the data.
  * @param [in] data The data to send down the WebSocket.
+ * @param [in] length The length of the data.
  * @param [in] sendType The type of payload.  Either SEND_TYPE_TEXT or SEND_TYPE_BINARY.
  */
-void WebSocket::send(uint8_t* data, uint16_t length, uint8_t sendType) {
+void WebSocket::send(uint8_t* data, size_t length, uint8_t sendType) {
 	ESP_LOGD(LOG_TAG, ">> send: Length: %d", length);
-	Frame frame;
-	frame.fin    = 1;
-	frame.rsv1   = 0;
-	frame.rsv2   = 0;
-	frame.rsv3   = 0;
-	frame.opCode = (sendType==SEND_TYPE_TEXT) ? OPCODE_TEXT : OPCODE_BINARY;
-	frame.mask   = 0;
-	if (length < 126) {
-		frame.len = length;
-		m_socket.send((uint8_t*) &frame, sizeof(frame));
-	} else {
-		frame.len = 126;
-		m_socket.send((uint8_t*) &frame, sizeof(frame));
-		m_socket.send(htons(length));  // Convert to network byte order from host byte order
+	if (m_sentClose) {
+		ESP_LOGW(LOG_TAG, "send: The web socket is closing; sockFd=%d", m_socket.getFD());
+		return;
+	}
+	std::shared_ptr<const std::string> frame;
+	if (m_pDeflate != nullptr && m_pDeflate->shouldCompress(length)) {
+		frame = encodeCompressedMessage(data, length, sendType);
+	}
+	if (!frame) {
+		frame = encodeMessage(data, length, sendType);
 	}
-	m_socket.send(data, length);
+	sendFrame(frame, false);
 	ESP_LOGD(LOG_TAG, "<< send");
-}
+} // send
+
+
+/**
+ * @brief Send a frame.
+ * @param [in] opCode The op code of the frame.
+ * @param [in] data The payload.
+ * @param [in] length The length of the payload.
+ * @return False if the frame was dropped or the connection has failed.
+ */
+bool WebSocket::sendFrame(uint8_t opCode, const uint8_t* data, size_t length) {
+	return sendFrame(encodeFrame(opCode, data, length), (opCode & OPCODE_CONTROL) != 0);
+} // sendFrame
+
+
+/**
+ * @brief Queue an encoded frame and write what the socket will take without waiting.
+ * If the queue is full, the send policy is applied.  Control frames don't count against the size of
+ * the queue.  With SEND_BLOCK we wait for up to the close timeout for room, after which the peer is
+ * taken to have stopped reading and the connection is closed as with SEND_CLOSE.  With
+ * SEND_DROP_OLDEST the connection is closed the same way if every queued frame is a control frame or
+ * partly sent, so that none can be dropped.
+ * @param [in] frame The encoded frame.
+ * @param [in] isControl Is this a control frame?
+ * @return False if the frame was dropped or the connection has failed.
+ */
+bool WebSocket::sendFrame(std::shared_ptr<const std::string> frame, bool isControl) {
+	m_sendLock.take("sendFrame");
+	m_sendStats.queued++;
+	uint32_t waitStart = FreeRTOS::getTimeSinceStart();
+	bool     waited    = false;   // Has the wait for room run out?
+	while (!isControl && m_sendPolicy == SEND_BLOCK && m_socket.isValid() && m_sendQueue.size() >= m_sendQueueSize) {
+		if (flushQueue() < 0) break;
+		if (m_sendQueue.size() < m_sendQueueSize) break;
+		if (FreeRTOS::getTimeSinceStart() - waitStart > m_closeTimeout * 1000) {
+			waited = true;
+			break;
+		}
+		m_sendLock.give();           // Let the reader use the socket while we wait.
+		waitWritable();
+		m_sendLock.take("sendFrame");
+	}
+	if (!m_socket.isValid()) {
+		m_sendStats.dropped++;
+		m_sendLock.give();
+		return false;
+	}
+	if (!isControl && m_sendQueue.size() >= m_sendQueueSize) {
+		bool full = m_sendPolicy == SEND_CLOSE || waited;
+		if (!full) {
+			// Drop the oldest data frame, unless part of it has already been sent.  If there is none,
+			// the queue can't be kept to its size and we close as with SEND_CLOSE.
+			full = true;
+			for (auto it = m_sendQueue.begin(); it != m_sendQueue.end(); ++it) {
+				if (it->isControl || (it == m_sendQueue.begin() && m_sendOffset > 0)) continue;
+				m_sendQueue.erase(it);
+				m_sendStats.dropped++;
+				full = false;
+				break;
+			}
+		}
+		if (full) {
+			m_sendStats.dropped++;
+			m_sendLock.give();
+			ESP_LOGW(LOG_TAG, "Send queue full, closing; sockFd=%d", m_socket.getFD());
+			close(CLOSE_TRY_AGAIN_LATER, "Send queue full");
+			return false;
+		}
+	}
+	OutboundFrame outbound;
+	outbound.data      = frame;
+	outbound.isControl = isControl;
+	m_sendQueue.push_back(outbound);
+	if (m_sendQueue.size() > m_sendStats.maxDepth) {
+		m_sendStats.maxDepth = m_sendQueue.size();
+	}
+	int rc = flushQueue();
+	m_sendLock.give();
+	if (rc < 0) {
+		closeSocket();
+		return false;
+	}
+	return true;
+} // sendFrame
+
+
+/**
+ * @brief Set the size of the buffer through which messages are read.
+ * A larger buffer means fewer reads of the socket for large messages, at the cost of heap while a
+ * message is being read.
+ * @param [in] bufferSize The size in bytes.
+ */
+void WebSocket::setBufferSize(size_t bufferSize) {
+	m_bufferSize = bufferSize;
+} // setBufferSize
+
+
+/**
+ * @brief Set the time the peer has to answer our close request.
+ * @param [in] seconds The close timeout.
+ */
+void WebSocket::setCloseTimeout(uint32_t seconds) {
+	m_closeTimeout = seconds;
+} // setCloseTimeout
+
+
+/**
+ * @brief Set the size of the send queue and what a send does when it is full.
+ * @param [in] maxFrames The most frames that may wait to be sent.
+ * @param [in] policy What a send does when the queue is full.  SEND_BLOCK waits for no longer than
+ * the close timeout before closing the connection.
+ */
+void WebSocket::setSendQueue(size_t maxFrames, SendPolicy policy) {
+	m_sendLock.take("setSendQueue");
+	m_sendQueueSize = maxFrames;
+	m_sendPolicy    = policy;
+	m_sendLock.give();
+} // setSendQueue
 
 
 /**
@@ -384,6 +1077,28 @@ void WebSocket::setHandler(WebSocketHandler* pHandler) {
 } // setHandler
 
 
+/**
+ * @brief Set when an idle peer is pinged and how long it has to answer.
+ * @param [in] pingInterval Seconds of silence from the peer after which it is pinged.  0 for no pings.
+ * @param [in] pongTimeout Seconds after the ping within which something must arrive from the peer.
+ */
+void WebSocket::setKeepAlive(uint32_t pingInterval, uint32_t pongTimeout) {
+	m_pingInterval = pingInterval;
+	m_pongTimeout  = pongTimeout;
+} // setKeepAlive
+
+
+/**
+ * @brief Set the size of the largest message that is accepted.
+ * A larger message fails the connection with CLOSE_TOO_BIG.  In event driven mode a message is held
+ * in memory until it has arrived whole, so this also bounds the memory a message takes.
+ * @param [in] maxMessageSize The size in bytes.  0 for no limit.
+ */
+void WebSocket::setMaxMessageSize(size_t maxMessageSize) {
+	m_maxMessageSize = maxMessageSize;
+} // setMaxMessageSize
+
+
 /**
  * @brief Start the WebSocket reader reading the socket.
  * When we have a new web socket, we want to start watching for new incoming events.  This
@@ -395,23 +1110,44 @@ void WebSocket::startReader() {
 } // startReader
 
 
+/**
+ * @brief Wait, for up to a second, until the socket can take more data.
+ */
+void WebSocket::waitWritable() {
+	int fd = m_socket.getFD();
+	if (fd < 0) return;
+	fd_set writeSet;
+	FD_ZERO(&writeSet);
+	FD_SET(fd, &writeSet);
+	struct timeval tv;
+	tv.tv_sec  = 1;
+	tv.tv_usec = 0;
+	::select(fd + 1, nullptr, &writeSet, nullptr, &tv);
+} // waitWritable
+
+
 /**
  * @brief Create a Web Socket input record streambuf
- * @param [in] socket The socket we will be reading from.
- * @param [in] dataLength The size of a record.
+ * The header of the first frame of the message must have been read by the web socket.
+ * @param [in] pWebSocket The web socket we will be reading from.
  * @param [in] bufferSize The size of the buffer we wish to allocate to hold data.
  */
 WebSocketInputStreambuf::WebSocketInputStreambuf(
-	Socket   socket,
-	size_t   dataLength,
-	uint8_t* pMask,
-	size_t   bufferSize) {
-	m_socket     = socket;    // The socket we will be reading from
-	m_dataLength = dataLength; // The size of the record we wish to read.
-	m_pMask      = pMask;
+	WebSocket* pWebSocket,
+	size_t     bufferSize) {
+	m_pWebSocket = pWebSocket; // The web socket we will be reading from
 	m_bufferSize = bufferSize; // The size of the buffer used to hold data
 	m_sizeRead   = 0;          // The size of data read from the socket
+	m_isText     = pWebSocket->m_frame.opCode == OPCODE_TEXT;
+	m_failed     = false;
+	m_compressed = (pWebSocket->m_frame.rsv & RSV1) != 0;
+	m_inflatedSize = 0;
+	m_pInput       = nullptr;
+	m_inputLength  = 0;
+	m_moreOutput   = false;
+	m_tailAdded    = false;
 	m_buffer = new char[bufferSize]; // Create the buffer used to hold the data read from the socket.
+	startFrame();
 
 	setg(m_buffer, m_buffer, m_buffer); // Set the initial get buffer pointers to no data.
 } // WebSocketInputStreambuf
@@ -421,29 +1157,26 @@ WebSocketInputStreambuf::WebSocketInputStreambuf(
  * @brief Destructor
  */
 WebSocketInputStreambuf::~WebSocketInputStreambuf() {
-	delete[] m_buffer;
 	discard();
+	delete[] m_buffer;
 } // ~WebSocketInputRecordStreambuf
 
 
 /**
- * @brief Discard data for the record that has not yet been read.
+ * @brief Discard data for the message that has not yet been read.
  *
- * We are working on a logical fixed length record in a socket stream.  This means that we know in advance
- * how big the record should be.  If we have read some data from the stream and no longer wish to consume
- * any further, we have to discard the remaining bytes in the stream before we can get to process the
- * next record.  This function discards the remainder of the data.
+ * A message is a run of frames in a socket stream.  If we have read some data from the stream and no
+ * longer wish to consume any further, we have to discard the remaining bytes of the message before we
+ * can get to process the next message.  This function discards the remainder of the data.
  *
- * For example, if our record size is 1000 bytes and we have read 700 bytes and determine that we no
+ * For example, if our message size is 1000 bytes and we have read 700 bytes and determine that we no
  * longer need to continue, we can't just stop.  There are still 300 bytes in the socket stream that
- * need to be consumed/discarded before we can move on to the next record.
+ * need to be consumed/discarded before we can move on to the next message.
  */
 void WebSocketInputStreambuf::discard() {
-	uint8_t byte;
-	ESP_LOGD("WebSocketInputStreambuf", ">> discard: Discarding %d bytes", m_dataLength - m_sizeRead);
-	while(m_sizeRead < m_dataLength) {
-		m_socket.receive(&byte, 1);
-		m_sizeRead++;
+	ESP_LOGD("WebSocketInputStreambuf", ">> discard: Discarding %llu bytes of the frame", m_frameRemaining);
+	while (underflow() != EOF) {      // A compressed message is decompressed to keep the peer's stream in step.
+		setg(eback(), egptr(), egptr());
 	}
 	ESP_LOGD("WebSocketInputStreambuf", "<< discard");
 } // discard
@@ -451,60 +1184,249 @@ void WebSocketInputStreambuf::discard() {
 
 /**
  * @brief Get the size of the expected record.
- * @return The size of the expected record.
+ * @return The size of the message if it arrives in a single frame.  For a fragmented message, the
+ * size of the frames whose header has arrived so far.  For a compressed message, the size of the
+ * compressed payload.
  */
 size_t WebSocketInputStreambuf::getRecordSize() {
-	return m_dataLength;
+	return m_sizeRead + m_frameRemaining;
 } // getRecordSize
 
 
 /**
- * @brief Handle the request to read data from the stream but we need more data from the source.
- *
+ * @brief Has the whole message been read?
+ * @return True once the end of the message has been reached without the connection failing.
  */
-WebSocketInputStreambuf::int_type WebSocketInputStreambuf::underflow() {
-	ESP_LOGD("WebSocketInputStreambuf", ">> underflow");
+bool WebSocketInputStreambuf::isComplete() {
+	if (m_compressed && (!m_tailAdded || m_inputLength > 0 || m_moreOutput)) return false;
+	return !m_failed && m_fin && m_frameRemaining == 0;
+} // isComplete
 
-	// If we have already read as many bytes as our record definition says we should read
-	// then don't attempt to ready any further.
-	if (m_sizeRead >= getRecordSize()) {
-		ESP_LOGD("WebSocketInputStreambuf", "<< underflow: Already read maximum");
-		return EOF;
+
+/**
+ * @brief Was the message compressed by the peer?
+ * @return True if the message is being decompressed as it is read.
+ */
+bool WebSocketInputStreambuf::isCompressed() {
+	return m_compressed;
+} // isCompressed
+
+
+/**
+ * @brief Is the message text rather than binary?
+ * @return True for a text message.
+ */
+bool WebSocketInputStreambuf::isText() {
+	return m_isText;
+} // isText
+
+
+/**
+ * @brief Read the header of the next frame of the message.
+ * Control frames that arrive between the frames of the message are processed on the way.
+ * @return False if there is no further frame to read.
+ */
+bool WebSocketInputStreambuf::nextFrame() {
+	while (true) {
+		if (!m_pWebSocket->readFrame()) break;
+		const WebSocket::Frame& frame = m_pWebSocket->m_frame;
+		if (frame.opCode & OPCODE_CONTROL) {
+			if (!m_pWebSocket->processControlFrame()) break;
+			continue;
+		}
+		if (frame.opCode != OPCODE_CONTINUE) {
+			m_pWebSocket->failConnection(WebSocket::CLOSE_PROTOCOL_ERROR, "Expected a continuation frame");
+			break;
+		}
+		size_t maxMessageSize = m_pWebSocket->m_maxMessageSize;
+		if (maxMessageSize > 0 && m_sizeRead + frame.length > maxMessageSize) {
+			m_pWebSocket->failConnection(WebSocket::CLOSE_TOO_BIG, "Message too big");
+			break;
+		}
+		startFrame();
+		return true;
+	}
+	m_failed = true;
+	return false;
+} // nextFrame
+
+
+/**
+ * @brief Take the frame whose header the web socket has just read as the current frame.
+ */
+void WebSocketInputStreambuf::startFrame() {
+	const WebSocket::Frame& frame = m_pWebSocket->m_frame;
+	m_frameRemaining = frame.length;
+	m_frameOffset    = 0;
+	m_masked         = frame.masked;
+	m_fin            = frame.fin;
+	::memcpy(m_mask, frame.mask, sizeof(m_mask));
+} // startFrame
+
+
+/**
+ * @brief Receive the next part of the payload of the message into the buffer.
+ * When the current frame has been read and the message continues, the next frame is started.
+ * @return The number of bytes received.  0 at the end of the message or if the connection failed.
+ */
+size_t WebSocketInputStreambuf::receivePayload() {
+	// If we have already read the whole message then don't attempt to read any further.
+	while (m_frameRemaining == 0) {
+		if (m_fin || m_failed || !nextFrame()) {
+			ESP_LOGD("WebSocketInputStreambuf", "<< underflow: Already read maximum");
+			return 0;
+		}
 	}
 
 	// We wish to refill the buffer.  We want to read data from the socket.  We want to read either
-	// the size of the buffer to fill it or the maximum number of bytes remaining to be read.
+	// the size of the buffer to fill it or the number of bytes remaining in the frame.
 	// We will choose which ever is smaller as the number of bytes to read into the buffer.
-	size_t remainingBytes = getRecordSize() - m_sizeRead;
-	size_t sizeToRead;
-	if (remainingBytes < m_bufferSize) {
-		sizeToRead = remainingBytes;
-	} else {
-		sizeToRead = m_bufferSize;
-	}
+	size_t sizeToRead = m_frameRemaining < m_bufferSize ? (size_t) m_frameRemaining : m_bufferSize;
 
 	ESP_LOGD("WebSocketInputRecordStreambuf", "- getting next buffer of data; size request: %d", sizeToRead);
-	size_t bytesRead = m_socket.receive((uint8_t*) m_buffer, sizeToRead, true);
-	if (bytesRead == 0) {
+	int bytesRead = m_pWebSocket->receive((uint8_t*) m_buffer, sizeToRead);
+	if (bytesRead <= 0) {
 		ESP_LOGD("WebSocketInputRecordStreambuf", "<< underflow: Read 0 bytes");
-		return EOF;
+		m_failed = true;
+		m_pWebSocket->closeSocket();
+		return 0;
 	}
 
 	// If the WebSocket frame shows that we have a mask bit set then we have to unmask the data.
-	if (m_pMask != nullptr) {
-		for (int i = 0; i < bytesRead; i++) {
-			m_buffer[i] = m_buffer[i] ^ m_pMask[(m_sizeRead + i) % 4];
-		}
+	if (m_masked) {
+		unmask((uint8_t*) m_buffer, bytesRead, m_mask, m_frameOffset);
 	}
 
-	m_sizeRead += bytesRead;  // Increase the count of number of bytes actually read from the source.
+	m_sizeRead       += bytesRead;  // Increase the count of number of bytes actually read from the source.
+	m_frameOffset    += bytesRead;
+	m_frameRemaining -= bytesRead;
+	return bytesRead;
+} // receivePayload
+
+
+/**
+ * @brief Handle the request to read data from the stream but we need more data from the source.
+ * When the current frame has been read and the message continues, the next frame is started.
+ */
+WebSocketInputStreambuf::int_type WebSocketInputStreambuf::underflow() {
+	ESP_LOGD("WebSocketInputStreambuf", ">> underflow");
+	if (m_compressed) {
+		return underflowCompressed();
+	}
 
+	size_t bytesRead = receivePayload();
+	if (bytesRead == 0) {
+		return EOF;
+	}
 	setg(m_buffer, m_buffer, m_buffer + bytesRead); // Changethe buffer pointers to reflect the new data read.
 	ESP_LOGD("WebSocketInputRecordStreambuf", "<< underflow - got %d more bytes", bytesRead);
 	return traits_type::to_int_type(*gptr());
 } // underflow
 
 
+/**
+ * @brief Decompress more of a compressed message.
+ * The payload is received into the buffer and decompressed into the window of the decompressor, which
+ * becomes the get area.  At the end of the payload, the ending of the sync flush that the peer left out
+ * is decompressed too.  The maximum message size applies to the decompressed message.
+ */
+WebSocketInputStreambuf::int_type WebSocketInputStreambuf::underflowCompressed() {
+	static const uint8_t syncFlushTail[] = { 0x00, 0x00, 0xff, 0xff };
+	WebSocketDeflate* pDeflate = m_pWebSocket->m_pDeflate;
+	while (!m_failed) {
+		if (m_inputLength > 0 || m_moreOutput) {
+			size_t   length = m_inputLength;
+			uint8_t* pOut;
+			size_t   outLength;
+			WebSocketDeflate::InflateStatus status = pDeflate->inflate(m_pInput, &length, &pOut, &outLength);
+			if (status == WebSocketDeflate::INFLATE_FAILED) {
+				m_failed = true;
+				m_pWebSocket->failConnection(WebSocket::CLOSE_NOT_CONSISTENT, "Invalid compressed data");
+				break;
+			}
+			if (status == WebSocketDeflate::INFLATE_NO_MEMORY) {
+				m_failed = true;
+				m_pWebSocket->failConnection(WebSocket::CLOSE_UNEXPECTED_CONDITION, "No memory to decompress");
+				break;
+			}
+			m_pInput      += length;
+			m_inputLength -= length;
+			m_moreOutput   = status == WebSocketDeflate::INFLATE_HAS_OUTPUT;
+			if (outLength > 0) {
+				m_inflatedSize += outLength;
+				size_t maxMessageSize = m_pWebSocket->m_maxMessageSize;
+				if (maxMessageSize > 0 && m_inflatedSize > maxMessageSize) {
+					m_failed = true;
+					m_pWebSocket->failConnection(WebSocket::CLOSE_TOO_BIG, "Message too big");
+					break;
+				}
+				setg((char*) pOut, (char*) pOut, (char*) pOut + outLength);
+				return traits_type::to_int_type(*gptr());
+			}
+			continue;
+		}
+		if (m_tailAdded) break;                // The whole message has been decompressed.
+
+		size_t bytesRead = receivePayload();
+		if (bytesRead > 0) {
+			m_pInput      = (const uint8_t*) m_buffer;
+			m_inputLength = bytesRead;
+		} else if (!m_failed) {                // The end of the payload.
+			m_pInput      = syncFlushTail;
+			m_inputLength = sizeof(syncFlushTail);
+			m_tailAdded   = true;
+		}
+	}
+	ESP_LOGD("WebSocketInputStreambuf", "<< underflow: End of compressed message");
+	return EOF;
+} // underflowCompressed
+
+
+/**
+ * @brief Unmask payload data in place.
+ * Each byte of the payload is XORed with the byte of the mask at its position in the frame modulo 4.
+ * Rather than working a byte at a time, the mask is rotated to line up with the first aligned word of
+ * the data and repeated to fill a word, and then whole words are XORed.  Only the bytes before the
+ * first aligned word and after the last one are done one at a time.
+ * @param [in] data The data to unmask.
+ * @param [in] length The length of the data.
+ * @param [in] pMask The 4 byte mask of the frame.
+ * @param [in] offset The position of the data in the payload of the frame.
+ */
+void WebSocketInputStreambuf::unmask(uint8_t* data, size_t length, const uint8_t* pMask, size_t offset) {
+	size_t i = 0;
+	while (i < length && ((uintptr_t) (data + i) & (sizeof(MaskWord) - 1)) != 0) {
+		data[i] ^= pMask[(offset + i) & 3];
+		i++;
+	}
+
+	// The mask lined up with data + i, in memory order, so the XOR is the same whatever the endianness.
+	uint8_t rotated[16];
+	for (size_t j = 0; j < sizeof(rotated); j++) {
+		rotated[j] = pMask[(offset + i + j) & 3];
+	}
+#if defined(__SSE2__)
+	__m128i maskVector = _mm_loadu_si128((const __m128i*) rotated);
+	for (; i + 16 <= length; i += 16) {
+		__m128i* pBlock = (__m128i*) (data + i);
+		_mm_storeu_si128(pBlock, _mm_xor_si128(_mm_loadu_si128(pBlock), maskVector));
+	}
+#endif
+	MaskWord maskWord;
+	::memcpy(&maskWord, rotated, sizeof(maskWord));   // Stays lined up as the words are multiples of 4 bytes.
+	for (; i + sizeof(MaskWord) <= length; i += sizeof(MaskWord)) {
+		MaskWord word;
+		::memcpy(&word, data + i, sizeof(word));          // Compiles to a single aligned load.
+		word ^= maskWord;
+		::memcpy(data + i, &word, sizeof(word));
+	}
+
+	for (; i < length; i++) {
+		data[i] ^= pMask[(offset + i) & 3];
+	}
+} // unmask
+
+
 /**
  * @brief Destructor.
  */
@@ -7,37 +7,68 @@
 
 #ifndef COMPONENTS_WEBSOCKET_H_
 #define COMPONENTS_WEBSOCKET_H_
+#include <atomic>
 #include <string>
+#include <deque>
+#include <memory>
+#include <vector>
+#include "FreeRTOS.h"
 #include "Socket.h"
 
 #undef close
 #undef send
 class WebSocketReader;
 class WebSocket;
+class WebSocketHub;
+class WebSocketDeflate;
 
 // +-------------------------------+
 // | WebSocketInputStreambuf |
 // +-------------------------------+
+/**
+ * @brief Read the payload of a message arriving on a WebSocket.
+ *
+ * The stream covers the whole message.  When a message has been fragmented, the continuation frames
+ * are read as the stream reaches them and control frames arriving between them are answered.  A
+ * compressed message (permessage-deflate) is decompressed as it is read.
+ */
 class WebSocketInputStreambuf : public std::streambuf {
 public:
 	WebSocketInputStreambuf(
-		Socket   socket,
-		size_t   dataLength,
-		uint8_t* pMask = nullptr,
-		size_t   bufferSize = 2048);
+		WebSocket* pWebSocket,
+		size_t     bufferSize = 2048);
 	~WebSocketInputStreambuf();
 	int_type underflow();
-	void discard();
+	void   discard();
 	size_t getRecordSize();
+	bool   isComplete();
+	bool   isCompressed();
+	bool   isText();
+	static void unmask(uint8_t* data, size_t length, const uint8_t* pMask, size_t offset = 0);
 
 private:
-	char*    m_buffer;
-	Socket   m_socket;
-	size_t   m_dataLength;
-	size_t   m_bufferSize;
-	size_t   m_sizeRead;
-	uint8_t* m_pMask;
+	char*      m_buffer;
+	WebSocket* m_pWebSocket;
+	size_t     m_bufferSize;
+	size_t     m_sizeRead;        // Bytes of the payload read so far.
+	uint64_t   m_frameRemaining;  // Bytes of the payload of the current frame not yet read.
+	size_t     m_frameOffset;     // Bytes of the payload of the current frame already read.
+	uint8_t    m_mask[4];
+	bool       m_masked;
+	bool       m_fin;             // Is the current frame the last of the message?
+	bool       m_isText;
+	bool       m_failed;          // Has the connection failed before the end of the message?
+	bool       m_compressed;      // Is the payload compressed?
+	size_t     m_inflatedSize;    // Bytes of a compressed message decompressed so far.
+	const uint8_t* m_pInput;      // Compressed data not yet decompressed.
+	size_t     m_inputLength;
+	bool       m_moreOutput;      // Has the decompressor more output without further input?
+	bool       m_tailAdded;       // Has the end of the sync flush been added after the payload?
 
+	bool     nextFrame();
+	size_t   receivePayload();
+	void     startFrame();
+	int_type underflowCompressed();
 };
 
 
@@ -49,6 +80,7 @@ public:
 	virtual ~WebSocketHandler();
 	virtual void onClose();
 	virtual void onMessage(WebSocketInputStreambuf* pWebSocketInputStreambuf, WebSocket* pWebSocket);
+	virtual void onWholeMessage(std::string& message, bool isText, WebSocket* pWebSocket);
 	virtual void onError(std::string error);
 
 };
@@ -57,6 +89,28 @@ public:
 // +-----------+
 // | WebSocket |
 // +-----------+
+/**
+ * @brief A WebSocket connection (RFC6455).
+ *
+ * Each message is handed to the handler once, however many frames it arrived in.  Pings from the
+ * peer are answered.  When the connection has been idle for the ping interval we ping the peer, and
+ * if nothing arrives within the pong timeout after that the connection is closed.  Once we have sent
+ * a close request, the peer has the close timeout to answer it before the socket is closed.
+ *
+ * Frames are sent through a bounded queue.  A send writes straight to the socket when it can do so
+ * without waiting, and otherwise leaves the frame queued for the task reading the web socket, which
+ * writes it when the socket can take more.  Queued frames are written together in a single write.  When
+ * the queue is full, the send policy decides whether the sender waits, the oldest frame is dropped or
+ * the connection is closed with CLOSE_TRY_AGAIN_LATER.  Over SSL a write can't be split, so a send may
+ * still wait for a slow peer.
+ *
+ * When permessage-deflate (RFC7692) has been negotiated in the upgrade, messages from the peer may
+ * arrive compressed and the messages we send are compressed if they are long enough to gain from it.
+ *
+ * An HttpServer in event driven mode receives each message whole, without waiting on the socket,
+ * before handing it to the handler.  It owns its WebSockets: once the handler's onClose() has been
+ * called, the WebSocket is deleted and must no longer be used.
+ */
 class WebSocket {
 public:
 	static const uint16_t CLOSE_NORMAL_CLOSURE        = 1000;
@@ -77,25 +131,132 @@ public:
 	static const uint8_t SEND_TYPE_BINARY = 0x01;
 	static const uint8_t SEND_TYPE_TEXT   = 0x02;
 
-	WebSocket(Socket socket);
+	static const size_t   DEFAULT_BUFFER_SIZE      = 2048;        // The buffer a message is read through.
+	static const size_t   DEFAULT_MAX_MESSAGE_SIZE = 64 * 1024;   // The largest message received.
+	static const uint32_t DEFAULT_PING_INTERVAL    = 30;          // Seconds of silence after which the peer is pinged.
+	static const uint32_t DEFAULT_PONG_TIMEOUT     = 10;          // Seconds the peer has to answer a ping.
+	static const uint32_t DEFAULT_CLOSE_TIMEOUT    = 5;           // Seconds the peer has to answer a close request.
+	static const size_t   DEFAULT_SEND_QUEUE_SIZE  = 16;          // Frames that may wait to be sent.
+
+	// What a send does when the send queue is full.
+	enum SendPolicy {
+		SEND_BLOCK,         // Wait, for up to the close timeout, until the peer has taken enough to make room.
+		SEND_DROP_OLDEST,   // Drop the oldest data frame that hasn't started to be sent, else close as SEND_CLOSE.
+		SEND_CLOSE          // Close the connection with CLOSE_TRY_AGAIN_LATER.
+	};
+
+	// Counters of the frames sent.
+	struct SendStats {
+		uint32_t queued;     // Frames given to be sent.
+		uint32_t sent;       // Frames written to the socket.
+		uint32_t dropped;    // Frames dropped because the queue was full.
+		uint32_t writes;     // Writes to the socket.  Fewer than the frames sent when frames are written together.
+		size_t   depth;      // Frames waiting to be sent.
+		size_t   maxDepth;   // The most frames that have been waiting.
+	};
+
+	WebSocket(Socket socket, WebSocketDeflate* pDeflate = nullptr);
 	virtual ~WebSocket();
 
 	void              close(uint16_t status = CLOSE_NORMAL_CLOSURE, std::string message = "");
+	size_t            getBufferSize();
+	bool              getCompression();
 	WebSocketHandler* getHandler();
+	size_t            getMaxMessageSize();
+	SendStats         getSendStats();
 	Socket            getSocket();
+	void              ping(std::string payload = "");
 	void              send(std::string data, uint8_t sendType = SEND_TYPE_BINARY);
-	void              send(uint8_t* data, uint16_t length, uint8_t sendType = SEND_TYPE_BINARY);
+	void              send(uint8_t* data, size_t length, uint8_t sendType = SEND_TYPE_BINARY);
+	void              setBufferSize(size_t bufferSize);
+	void              setCloseTimeout(uint32_t seconds);
 	void              setHandler(WebSocketHandler *handler);
+	void              setKeepAlive(uint32_t pingInterval, uint32_t pongTimeout = DEFAULT_PONG_TIMEOUT);
+	void              setMaxMessageSize(size_t maxMessageSize);
+	void              setSendQueue(size_t maxFrames, SendPolicy policy = SEND_BLOCK);
 
 private:
+	friend class WebSocketHub;
+	friend class WebSocketInputStreambuf;
 	friend class WebSocketReader;
+	friend class HttpServer;
+	friend class HttpServerReactorTask;
 	friend class HttpServerTask;
+
+	static const size_t READ_BUFFER_SIZE = 128;   // Holds a frame header and, for small messages, the payload too.
+
+	// The header of a frame.
+	struct Frame {
+		bool     fin;
+		uint8_t  rsv;       // The reserved bits, used by extensions.
+		uint8_t  opCode;
+		bool     masked;
+		uint8_t  mask[4];
+		uint64_t length;    // The length of the payload.
+	};
+
+	// An encoded frame waiting to be sent.
+	struct OutboundFrame {
+		std::shared_ptr<const std::string> data;        // The header and the payload.
+		bool                               isControl;   // Control frames are never dropped.
+	};
+
+	static std::shared_ptr<const std::string> encodeCompressedMessage(const uint8_t* data, size_t length, uint8_t sendType);
+	static std::shared_ptr<const std::string> encodeFrame(uint8_t opCode, const uint8_t* data, size_t length, uint8_t rsv = 0);
+	static std::shared_ptr<const std::string> encodeMessage(const uint8_t* data, size_t length, uint8_t sendType);
+	bool              checkTimeouts();
+	void              closeSocket();
+	bool              failConnection(uint16_t status, const char* reason);
+	bool              fill(size_t length);
+	bool              flush();
+	int               flushQueue();
+	int               getPollFD(bool* pPendingSend);
+	bool              hasBufferedData();
+	bool              isFrameReceived();
+	bool              joinHub(WebSocketHub* pHub);
+	void              leaveHub(WebSocketHub* pHub);
+	bool              processControlFrame();
+	bool              processFrame();
+	bool              processReceived();
+	bool              readFrame();
+	int               receive(uint8_t* data, size_t length);
+	int               receiveData(uint8_t* data, size_t length);
+	void              releaseReadState();
+	bool              sendFrame(uint8_t opCode, const uint8_t* data, size_t length);
+	bool              sendFrame(std::shared_ptr<const std::string> frame, bool isControl);
+	void              waitWritable();
 	void              startReader();
 	bool              m_receivedClose; // True when we have received a close request.
 	bool              m_sentClose;	 // True when we have sent a close request.
+	bool              m_pingSent;      // True when we have pinged the peer and heard nothing since.
 	Socket            m_socket;		// Partner socket.
 	WebSocketHandler* m_pWebSocketHandler;
 	WebSocketReader*  m_pWebSockerReader;
+	WebSocketDeflate* m_pDeflate;      // The permessage-deflate extension, null if it wasn't negotiated.
+	Frame             m_frame;         // The header of the frame being read.
+	uint8_t           m_readBuffer[READ_BUFFER_SIZE];   // Data received but not yet consumed.
+	size_t            m_readStart;     // The first unconsumed byte in m_readBuffer.
+	size_t            m_readEnd;       // The end of the data in m_readBuffer.
+	size_t            m_bufferSize;    // The buffer a message is read through.
+	size_t            m_maxMessageSize;
+	uint32_t          m_pingInterval;  // Seconds.  0 for no keep alive pings.
+	uint32_t          m_pongTimeout;   // Seconds.
+	uint32_t          m_closeTimeout;  // Seconds.
+	uint32_t          m_lastReceive;   // Time (ms) a frame last arrived.
+	uint32_t          m_closeSent;     // Time (ms) we sent a close request.
+	std::deque<OutboundFrame> m_sendQueue;   // Frames waiting to be sent, oldest first.
+	size_t            m_sendOffset;    // The bytes of the first frame in the queue already sent.
+	size_t            m_sendQueueSize; // The most frames that may wait to be sent.
+	SendPolicy        m_sendPolicy;
+	SendStats         m_sendStats;
+	std::vector<WebSocketHub*> m_hubs; // The hubs this is a member of, guarded by the send lock.
+	FreeRTOS::Semaphore m_sendLock = FreeRTOS::Semaphore("WebSocketSend");   // Guards the send queue and keeps frames apart.
+	std::atomic<bool> m_closed;        // Set once closeSocket() has told the handler and left the hubs.
+	std::atomic<int>  m_users;         // Hub broadcasts using the web socket outside the hub's lock.
+	bool              m_eventDriven;   // Read by an event driven HttpServer, which never waits for data.
+	std::string       m_pending;       // In event driven mode, data that has arrived but not been processed.
+	size_t            m_pendingStart;  // The first byte of m_pending not yet consumed.
+	uint32_t          m_receiveTimeout; // Seconds a frame that has started to arrive may wait for more data.
 
 }; // WebSocket
 
@@ -0,0 +1,344 @@
+/*
+ * WebSocketDeflate.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <stdlib.h>
+#include <cstring>
+#include <esp_heap_caps.h>
+#include "WebSocketDeflate.h"
+#include "HttpParser.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "WebSocketDeflate";
+
+// The ending of a sync flush (an empty stored block), which the sender of a message leaves out.
+static const uint8_t SYNC_FLUSH_TAIL[] = { 0x00, 0x00, 0xff, 0xff };
+
+// zlib can't compress with a window of 256 bytes and uses 512 bytes when asked to, so we decompress
+// with a window of at least this many bits whatever the client agreed to.
+static const uint8_t MIN_INFLATE_WINDOW_BITS = 9;
+
+// The hash chains searched for a match.  Fewer than the default of 128 is much faster for little
+// loss on short messages.
+static const int COMPRESS_PROBES = 32;
+
+const char WebSocketDeflate::EXTENSION_NAME[] = "permessage-deflate";
+
+tdefl_compressor*   WebSocketDeflate::m_pCompressor = nullptr;
+bool                WebSocketDeflate::m_compressorFailed = false;
+FreeRTOS::Semaphore WebSocketDeflate::m_compressorLock("WebSocketDeflate");
+
+
+/**
+ * @brief Remove the white space around a value.
+ * @param [in] value The value.
+ * @return The value without leading and trailing spaces and tabs.
+ */
+static std::string_view trim(std::string_view value) {
+	while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+	while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+	return value;
+} // trim
+
+
+/**
+ * @brief Parse the value of a window bits parameter.
+ * @param [in] value The value, which may be quoted.
+ * @return The number of bits or -1 if the value isn't a number from 8 to 15.
+ */
+static int parseWindowBits(std::string_view value) {
+	if (value.length() >= 2 && value.front() == '"' && value.back() == '"') {
+		value = value.substr(1, value.length() - 2);
+	}
+	if (value.empty() || value.length() > 2) return -1;
+	int bits = 0;
+	for (size_t i = 0; i < value.length(); i++) {
+		if (value[i] < '0' || value[i] > '9') return -1;
+		bits = bits * 10 + (value[i] - '0');
+	}
+	if (bits < WebSocketDeflate::MIN_WINDOW_BITS || bits > WebSocketDeflate::MAX_WINDOW_BITS) return -1;
+	return bits;
+} // parseWindowBits
+
+
+/**
+ * @brief Create the extension of a connection.
+ * @param [in] config What the server offered.
+ * @param [in] clientWindowBits The window of the client's compressor.
+ * @param [in] serverWindowBits The window the client can decompress.
+ * @param [in] clientNoContextTakeover Does the client compress each message on its own?
+ */
+WebSocketDeflate::WebSocketDeflate(const Config& config, uint8_t clientWindowBits, uint8_t serverWindowBits, bool clientNoContextTakeover) {
+	m_clientWindowBits        = clientWindowBits;
+	m_serverWindowBits        = serverWindowBits;
+	m_clientNoContextTakeover = clientNoContextTakeover;
+	m_threshold               = config.threshold;
+	m_pInflater               = nullptr;
+	m_window                  = nullptr;
+	m_windowSize              = (size_t) 1 << (clientWindowBits < MIN_INFLATE_WINDOW_BITS ? MIN_INFLATE_WINDOW_BITS : clientWindowBits);
+	m_windowPosition          = 0;
+	m_streamEnded             = false;
+} // WebSocketDeflate
+
+
+WebSocketDeflate::~WebSocketDeflate() {
+	release();
+} // ~WebSocketDeflate
+
+
+/**
+ * @brief Allocate the decompressor and its window.
+ * @return False if there isn't the memory.
+ */
+bool WebSocketDeflate::allocate() {
+	m_pInflater = (tinfl_decompressor*) ::malloc(sizeof(tinfl_decompressor));
+	m_window    = (uint8_t*) ::malloc(m_windowSize);
+	if (m_pInflater == nullptr || m_window == nullptr) {
+		ESP_LOGE(LOG_TAG, "No memory to decompress: %d bytes", sizeof(tinfl_decompressor) + m_windowSize);
+		release();
+		return false;
+	}
+	tinfl_init(m_pInflater);
+	m_windowPosition = 0;
+	m_streamEnded    = false;
+	return true;
+} // allocate
+
+
+/**
+ * @brief Compress the payload of a message.
+ * The message is compressed on its own and the output ends with a sync flush, without its last 4
+ * bytes (RFC7692 section 7.2.1).  The compressor is shared by all the connections and allocated the
+ * first time it is needed, from PSRAM if there is some.  If there isn't the memory for it, it isn't
+ * tried again and every message is sent uncompressed.
+ * @param [in] data The message.
+ * @param [in] length The length of the message.
+ * @param [out] compressed The compressed payload.
+ * @return False if the message should be sent uncompressed: it wouldn't get smaller or there isn't
+ * the memory for the compressor.
+ */
+bool WebSocketDeflate::compress(const uint8_t* data, size_t length, std::string& compressed) {
+	m_compressorLock.take("compress");
+	if (m_compressorFailed) {
+		m_compressorLock.give();
+		return false;
+	}
+	if (m_pCompressor == nullptr) {
+		m_pCompressor = (tdefl_compressor*) ::heap_caps_malloc(sizeof(tdefl_compressor), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+		if (m_pCompressor == nullptr) {
+			m_pCompressor = (tdefl_compressor*) ::malloc(sizeof(tdefl_compressor));
+		}
+		if (m_pCompressor == nullptr) {
+			m_compressorFailed = true;
+			m_compressorLock.give();
+			ESP_LOGW(LOG_TAG, "No memory to compress: %d bytes, messages are sent uncompressed", (int) sizeof(tdefl_compressor));
+			return false;
+		}
+	}
+
+	// The stream starts from an empty dictionary, so stale hash chains from the previous message are
+	// never followed and needn't be cleared.
+	::tdefl_init(m_pCompressor, nullptr, nullptr, COMPRESS_PROBES | TDEFL_NONDETERMINISTIC_PARSING_FLAG);
+	size_t capacity = length + sizeof(SYNC_FLUSH_TAIL);   // Anything longer isn't worth sending.
+	compressed.resize(capacity);
+	size_t inLength  = length;
+	size_t outLength = capacity;
+	tdefl_status status = ::tdefl_compress(m_pCompressor, data, &inLength, &compressed[0], &outLength, TDEFL_SYNC_FLUSH);
+	m_compressorLock.give();
+
+	if (status != TDEFL_STATUS_OKAY || inLength != length || outLength >= capacity ||
+			outLength < sizeof(SYNC_FLUSH_TAIL) ||
+			::memcmp(compressed.data() + outLength - sizeof(SYNC_FLUSH_TAIL), SYNC_FLUSH_TAIL, sizeof(SYNC_FLUSH_TAIL)) != 0) {
+		return false;
+	}
+	compressed.resize(outLength - sizeof(SYNC_FLUSH_TAIL));
+	return true;
+} // compress
+
+
+/**
+ * @brief Note the end of a compressed message from the peer.
+ * If the client compresses each message on its own, the decompressor is released until the next
+ * compressed message arrives.  Otherwise the next message carries on the same stream.
+ */
+void WebSocketDeflate::endMessage() {
+	if (m_clientNoContextTakeover) {
+		release();
+	} else if (m_streamEnded) {   // A new stream follows, which may refer to the data already in the window.
+		tinfl_init(m_pInflater);
+		m_streamEnded = false;
+	}
+} // endMessage
+
+
+/**
+ * @brief Decompress data from the peer.
+ * The output is written to the window, which wraps, and is valid until the next call.
+ * @param [in] data The compressed data.
+ * @param [in,out] pLength The length of the data on entry, the length used on return.
+ * @param [out] ppOut The start of the output.
+ * @param [out] pOutLength The length of the output.
+ * @return The outcome.
+ */
+WebSocketDeflate::InflateStatus WebSocketDeflate::inflate(const uint8_t* data, size_t* pLength, uint8_t** ppOut, size_t* pOutLength) {
+	*ppOut      = nullptr;
+	*pOutLength = 0;
+	if (m_streamEnded) {           // Only the tail we add ourselves may follow a final block.
+		return INFLATE_DONE;
+	}
+	if (m_pInflater == nullptr && !allocate()) {
+		return INFLATE_NO_MEMORY;
+	}
+	size_t outLength = m_windowSize - m_windowPosition;
+	tinfl_status status = ::tinfl_decompress(m_pInflater, data, pLength, m_window, m_window + m_windowPosition,
+		&outLength, TINFL_FLAG_HAS_MORE_INPUT);
+	*ppOut      = m_window + m_windowPosition;
+	*pOutLength = outLength;
+	m_windowPosition = (m_windowPosition + outLength) & (m_windowSize - 1);
+	switch (status) {
+		case TINFL_STATUS_NEEDS_MORE_INPUT: return INFLATE_NEEDS_INPUT;
+		case TINFL_STATUS_HAS_MORE_OUTPUT:  return INFLATE_HAS_OUTPUT;
+		case TINFL_STATUS_DONE: {
+			m_streamEnded = true;
+			return INFLATE_DONE;
+		}
+		default: {
+			ESP_LOGD(LOG_TAG, "Invalid compressed data: status: %d", status);
+			return INFLATE_FAILED;
+		}
+	}
+} // inflate
+
+
+/**
+ * @brief Answer the extensions offered in the upgrade of a connection.
+ * The first permessage-deflate offer we can accept is accepted.  We always compress each message on
+ * its own (server_no_context_takeover).  An offer that doesn't let us ask for the window the server is
+ * configured with is declined.
+ * @param [in] offers The value of the Sec-WebSocket-Extensions header.
+ * @param [in] config What the server offers.
+ * @param [out] response The value of the Sec-WebSocket-Extensions header of the response.
+ * @return The extension of the connection, or null if none of the offers was accepted.
+ */
+WebSocketDeflate* WebSocketDeflate::negotiate(std::string_view offers, const Config& config, std::string& response) {
+	if (!config.enabled) return nullptr;
+	while (!offers.empty()) {
+		size_t comma = offers.find(',');
+		std::string_view offer = offers.substr(0, comma);
+		offers = comma == std::string_view::npos ? std::string_view() : offers.substr(comma + 1);
+
+		uint8_t clientWindowBits;
+		uint8_t serverWindowBits;
+		bool    clientNoContextTakeover;
+		bool    serverWindowBitsOffered;
+		if (!negotiateOffer(offer, config, &clientWindowBits, &serverWindowBits, &clientNoContextTakeover, &serverWindowBitsOffered)) {
+			continue;
+		}
+		response = EXTENSION_NAME;
+		response += "; server_no_context_takeover";
+		if (clientNoContextTakeover) {
+			response += "; client_no_context_takeover";
+		}
+		if (serverWindowBitsOffered) {
+			response += "; server_max_window_bits=" + std::to_string(serverWindowBits);
+		}
+		if (clientWindowBits < MAX_WINDOW_BITS) {
+			response += "; client_max_window_bits=" + std::to_string(clientWindowBits);
+		}
+		ESP_LOGD(LOG_TAG, "Negotiated: %s", response.c_str());
+		return new WebSocketDeflate(config, clientWindowBits, serverWindowBits, clientNoContextTakeover);
+	}
+	return nullptr;
+} // negotiate
+
+
+/**
+ * @brief Decide whether an offer of the extension can be accepted.
+ * @param [in] offer An extension and its parameters.
+ * @param [in] config What the server offers.
+ * @param [out] pClientWindowBits The window of the client's compressor.
+ * @param [out] pServerWindowBits The window the client can decompress.
+ * @param [out] pClientNoContextTakeover Will the client compress each message on its own?
+ * @param [out] pServerWindowBitsOffered Did the client limit the window it can decompress?
+ * @return True if the offer is permessage-deflate with parameters we accept.
+ */
+bool WebSocketDeflate::negotiateOffer(std::string_view offer, const Config& config, uint8_t* pClientWindowBits,
+		uint8_t* pServerWindowBits, bool* pClientNoContextTakeover, bool* pServerWindowBitsOffered) {
+	size_t semicolon = offer.find(';');
+	if (!HttpParser::equalsIgnoreCase(trim(offer.substr(0, semicolon)), EXTENSION_NAME)) return false;
+	offer = semicolon == std::string_view::npos ? std::string_view() : offer.substr(semicolon + 1);
+
+	// Each parameter may be given once (RFC7692 section 7).
+	bool    serverNoContextTakeover = false;
+	bool    clientWindowBitsOffered = false;
+	uint8_t clientWindowBitsLimit   = MAX_WINDOW_BITS;
+	*pServerWindowBits        = MAX_WINDOW_BITS;
+	*pServerWindowBitsOffered = false;
+	*pClientNoContextTakeover = false;
+	while (!offer.empty()) {
+		semicolon = offer.find(';');
+		std::string_view param = offer.substr(0, semicolon);
+		offer = semicolon == std::string_view::npos ? std::string_view() : offer.substr(semicolon + 1);
+		size_t equals = param.find('=');
+		std::string_view name = trim(param.substr(0, equals));
+		bool hasValue = equals != std::string_view::npos;
+		int bits = hasValue ? parseWindowBits(trim(param.substr(equals + 1))) : -1;
+
+		if (name == "server_no_context_takeover" && !hasValue && !serverNoContextTakeover) {
+			serverNoContextTakeover = true;
+		} else if (name == "client_no_context_takeover" && !hasValue && !*pClientNoContextTakeover) {
+			*pClientNoContextTakeover = true;
+		} else if (name == "server_max_window_bits" && bits > 0 && !*pServerWindowBitsOffered) {
+			*pServerWindowBits        = bits;
+			*pServerWindowBitsOffered = true;
+		} else if (name == "client_max_window_bits" && (!hasValue || bits > 0) && !clientWindowBitsOffered) {
+			clientWindowBitsLimit   = hasValue ? bits : MAX_WINDOW_BITS;
+			clientWindowBitsOffered = true;
+		} else {
+			ESP_LOGD(LOG_TAG, "Declining offer with parameter: %.*s", (int) param.length(), param.data());
+			return false;
+		}
+	}
+
+	uint8_t clientWindowBits = config.clientMaxWindowBits;
+	if (clientWindowBits < MIN_WINDOW_BITS) clientWindowBits = MIN_WINDOW_BITS;
+	if (clientWindowBits > MAX_WINDOW_BITS) clientWindowBits = MAX_WINDOW_BITS;
+	if (clientWindowBits < MAX_WINDOW_BITS && !clientWindowBitsOffered) {
+		ESP_LOGD(LOG_TAG, "Declining offer: the client can't limit its window to %d bits", clientWindowBits);
+		return false;
+	}
+	*pClientWindowBits = clientWindowBits < clientWindowBitsLimit ? clientWindowBits : clientWindowBitsLimit;
+	*pClientNoContextTakeover = *pClientNoContextTakeover || config.clientNoContextTakeover;
+	return true;
+} // negotiateOffer
+
+
+/**
+ * @brief Free the decompressor and its window.
+ * They are allocated again if another message is decompressed, which starts a new context.
+ */
+void WebSocketDeflate::release() {
+	::free(m_pInflater);
+	::free(m_window);
+	m_pInflater      = nullptr;
+	m_window         = nullptr;
+	m_windowPosition = 0;
+	m_streamEnded    = false;
+} // release
+
+
+/**
+ * @brief Is a message worth compressing?
+ * Short messages gain too little.  When the client can only decompress with a smaller window than the
+ * compressor uses, a message is only compressed if it fits in that window, as no match can then reach
+ * further back.
+ * @param [in] length The length of the message.
+ * @return True if the message should be compressed.
+ */
+bool WebSocketDeflate::shouldCompress(size_t length) {
+	if (length == 0 || length < m_threshold) return false;
+	return m_serverWindowBits >= MAX_WINDOW_BITS || length <= ((size_t) 1 << m_serverWindowBits);
+} // shouldCompress
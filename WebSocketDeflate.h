@@ -0,0 +1,85 @@
+/*
+ * WebSocketDeflate.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_WEBSOCKETDEFLATE_H_
+#define COMPONENTS_CPP_UTILS_WEBSOCKETDEFLATE_H_
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <rom/miniz.h>
+#include "FreeRTOS.h"
+
+/**
+ * @brief The permessage-deflate extension of a WebSocket (RFC7692).
+ *
+ * The extension is negotiated in the upgrade of the connection and then compresses the payload of
+ * whole messages.  An instance holds what was agreed for one connection and the state in which
+ * the messages from the peer are decompressed.
+ *
+ * The memory an open connection needs is what the peer's messages are decompressed in: a window of
+ * 2^clientMaxWindowBits bytes and the decompressor.  A smaller window is asked of the client for
+ * less memory, and with client_no_context_takeover both are released between messages, so an idle
+ * connection holds nothing.  A client that can't use the smaller window is served without compression.
+ *
+ * Messages we send are each compressed on their own (server_no_context_takeover) by a compressor that
+ * all the connections share, so sending compressed costs no memory per connection.  Messages shorter
+ * than the threshold, and those that don't get smaller, are sent as they are.
+ */
+class WebSocketDeflate {
+public:
+	static const char    EXTENSION_NAME[];             // permessage-deflate
+	static const uint8_t MIN_WINDOW_BITS   = 8;
+	static const uint8_t MAX_WINDOW_BITS   = 15;
+	static const size_t  DEFAULT_THRESHOLD = 64;       // Messages shorter than this aren't compressed.
+
+	// What a server offers.
+	struct Config {
+		bool    enabled;                   // Is the extension accepted at all?
+		uint8_t clientMaxWindowBits;       // The window asked of the client.  Bounds the memory per connection.
+		bool    clientNoContextTakeover;   // Ask the client to compress each message on its own.
+		size_t  threshold;                 // Messages shorter than this are sent uncompressed.
+	};
+
+	// The outcome of decompressing some data.
+	enum InflateStatus {
+		INFLATE_FAILED,        // The data isn't a valid deflate stream.
+		INFLATE_NO_MEMORY,     // There isn't the memory to decompress.
+		INFLATE_NEEDS_INPUT,   // All of the input has been used.
+		INFLATE_HAS_OUTPUT,    // The output was cut short.  Call again, even without input.
+		INFLATE_DONE           // The stream ended with a final block.  What follows is ignored.
+	};
+
+	~WebSocketDeflate();
+	static bool              compress(const uint8_t* data, size_t length, std::string& compressed);
+	static WebSocketDeflate* negotiate(std::string_view offers, const Config& config, std::string& response);
+	void                     endMessage();            // The end of a compressed message from the peer.
+	InflateStatus            inflate(const uint8_t* data, size_t* pLength, uint8_t** ppOut, size_t* pOutLength);
+	void                     release();               // Free the decompressor, for example when the connection closes.
+	bool                     shouldCompress(size_t length);   // Is a message of this length worth compressing?
+
+private:
+	WebSocketDeflate(const Config& config, uint8_t clientWindowBits, uint8_t serverWindowBits, bool clientNoContextTakeover);
+
+	static bool negotiateOffer(std::string_view offer, const Config& config, uint8_t* pClientWindowBits,
+		uint8_t* pServerWindowBits, bool* pClientNoContextTakeover, bool* pServerWindowBitsOffered);
+	bool allocate();
+
+	uint8_t             m_clientWindowBits;         // The window of the client's compressor.
+	uint8_t             m_serverWindowBits;         // The window the client can decompress.
+	bool                m_clientNoContextTakeover;  // Does the client compress each message on its own?
+	size_t              m_threshold;
+	tinfl_decompressor* m_pInflater;                // Decompresses the messages from the client.  Null when released.
+	uint8_t*            m_window;                   // The output of m_pInflater, which is also its dictionary.
+	size_t              m_windowSize;               // A power of 2.
+	size_t              m_windowPosition;           // Where the next output goes in m_window.
+	bool                m_streamEnded;              // Did the client end the deflate stream with a final block?
+
+	static tdefl_compressor*   m_pCompressor;       // Shared by all the connections.
+	static bool                m_compressorFailed;  // There wasn't the memory for the compressor.
+	static FreeRTOS::Semaphore m_compressorLock;
+}; // WebSocketDeflate
+
+#endif /* COMPONENTS_CPP_UTILS_WEBSOCKETDEFLATE_H_ */
@@ -0,0 +1,205 @@
+/*
+ * WebSocketHub.cpp
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#include <algorithm>
+#include "WebSocketHub.h"
+#include "WebSocketDeflate.h"
+
+#include <esp_log.h>
+
+static const char* LOG_TAG = "WebSocketHub";
+
+
+WebSocketHub::WebSocketHub() {
+	m_stats = Stats();
+} // WebSocketHub
+
+
+/**
+ * @brief Destructor.
+ * The members forget the hub.
+ */
+WebSocketHub::~WebSocketHub() {
+	m_lock.take("~WebSocketHub");
+	std::vector<WebSocket*> members;
+	for (auto it = m_channels.begin(); it != m_channels.end(); ++it) {
+		members.insert(members.end(), it->second.begin(), it->second.end());
+	}
+	m_channels.clear();
+	m_lock.give();
+	for (auto it = members.begin(); it != members.end(); ++it) {
+		(*it)->leaveHub(this);
+	}
+} // ~WebSocketHub
+
+
+/**
+ * @brief Add a WebSocket to a channel.
+ * A WebSocket may be a member of several channels.  It is removed from all of them when it closes.
+ * @param [in] pWebSocket The WebSocket.
+ * @param [in] channel The channel.
+ */
+void WebSocketHub::add(WebSocket* pWebSocket, const std::string& channel) {
+	ESP_LOGD(LOG_TAG, ">> add: sockFd=%d, channel: %s", pWebSocket->getSocket().getFD(), channel.c_str());
+	m_lock.take("add");
+	std::vector<WebSocket*>& members = m_channels[channel];
+	if (std::find(members.begin(), members.end(), pWebSocket) == members.end()) {
+		members.push_back(pWebSocket);
+	}
+	m_lock.give();
+	if (!pWebSocket->joinHub(this)) {   // It closed in the meantime.
+		removeMember(pWebSocket);
+	}
+} // add
+
+
+/**
+ * @brief Send a message to all the members of a channel.
+ * The frame is encoded once and the same buffer is queued for each member.  Members that negotiated
+ * permessage-deflate share a compressed frame, which is only made if one of them wants it.
+ * @param [in] data The message.
+ * @param [in] sendType The type of the message.  Either SEND_TYPE_TEXT or SEND_TYPE_BINARY.
+ * @param [in] channel The channel.
+ * @return The number of members the message was queued for.
+ */
+size_t WebSocketHub::broadcast(const std::string& data, uint8_t sendType, const std::string& channel) {
+	std::shared_ptr<const std::string> frame = WebSocket::encodeMessage((const uint8_t*) data.data(), data.length(), sendType);
+	m_lock.take("broadcast");
+	auto it = m_channels.find(channel);
+	if (it == m_channels.end()) {
+		m_stats.broadcasts++;
+		m_lock.give();
+		return 0;
+	}
+	// A member may close while we are sending.  Counting ourselves as a user of each member stops
+	// the server deleting it before we are done with it.
+	std::vector<WebSocket*> members = it->second;
+	for (auto member = members.begin(); member != members.end(); ++member) {
+		(*member)->m_users++;
+	}
+	m_lock.give();
+
+	std::shared_ptr<const std::string> compressedFrame;
+	bool compressed = false;   // Has the compressed frame been made?
+	size_t sent = 0;
+	for (auto member = members.begin(); member != members.end(); ++member) {
+		WebSocketDeflate* pDeflate = (*member)->m_pDeflate;
+		std::shared_ptr<const std::string> memberFrame = frame;
+		if (pDeflate != nullptr && pDeflate->shouldCompress(data.length())) {
+			if (!compressed) {
+				compressedFrame = WebSocket::encodeCompressedMessage((const uint8_t*) data.data(), data.length(), sendType);
+				compressed = true;
+			}
+			if (compressedFrame) {   // Null when compression doesn't pay.
+				memberFrame = compressedFrame;
+			}
+		}
+		if (!(*member)->m_sentClose && (*member)->sendFrame(memberFrame, false)) {
+			sent++;
+		}
+		(*member)->m_users--;
+	}
+
+	m_lock.take("broadcast");
+	m_stats.broadcasts++;
+	m_stats.sent   += sent;
+	m_stats.failed += members.size() - sent;
+	m_lock.give();
+	return sent;
+} // broadcast
+
+
+/**
+ * @brief Get the number of members of a channel.
+ * @param [in] channel The channel.
+ * @return The number of members.
+ */
+size_t WebSocketHub::getCount(const std::string& channel) {
+	m_lock.take("getCount");
+	auto it = m_channels.find(channel);
+	size_t count = (it == m_channels.end()) ? 0 : it->second.size();
+	m_lock.give();
+	return count;
+} // getCount
+
+
+/**
+ * @brief Get the counters of the use of the hub.
+ * @return A copy of the counters.
+ */
+WebSocketHub::Stats WebSocketHub::getStats() {
+	m_lock.take("getStats");
+	Stats stats = m_stats;
+	m_lock.give();
+	return stats;
+} // getStats
+
+
+/**
+ * @brief Is a WebSocket a member of any channel?  The lock must be held.
+ * @param [in] pWebSocket The WebSocket.
+ * @return True if it is a member.
+ */
+bool WebSocketHub::isMember(WebSocket* pWebSocket) {
+	for (auto it = m_channels.begin(); it != m_channels.end(); ++it) {
+		if (std::find(it->second.begin(), it->second.end(), pWebSocket) != it->second.end()) {
+			return true;
+		}
+	}
+	return false;
+} // isMember
+
+
+/**
+ * @brief Remove a WebSocket from all the channels.
+ * @param [in] pWebSocket The WebSocket.
+ */
+void WebSocketHub::remove(WebSocket* pWebSocket) {
+	removeMember(pWebSocket);
+	pWebSocket->leaveHub(this);
+} // remove
+
+
+/**
+ * @brief Remove a WebSocket from a channel.
+ * @param [in] pWebSocket The WebSocket.
+ * @param [in] channel The channel.
+ */
+void WebSocketHub::remove(WebSocket* pWebSocket, const std::string& channel) {
+	m_lock.take("remove");
+	auto it = m_channels.find(channel);
+	if (it != m_channels.end()) {
+		it->second.erase(std::remove(it->second.begin(), it->second.end(), pWebSocket), it->second.end());
+		if (it->second.empty()) {
+			m_channels.erase(it);
+		}
+	}
+	bool member = isMember(pWebSocket);
+	m_lock.give();
+	if (!member) {
+		pWebSocket->leaveHub(this);
+	}
+} // remove
+
+
+/**
+ * @brief Remove a WebSocket from all the channels without telling it.
+ * This is what a closing WebSocket calls.
+ * @param [in] pWebSocket The WebSocket.
+ */
+void WebSocketHub::removeMember(WebSocket* pWebSocket) {
+	ESP_LOGD(LOG_TAG, ">> removeMember: sockFd=%d", pWebSocket->getSocket().getFD());
+	m_lock.take("removeMember");
+	for (auto it = m_channels.begin(); it != m_channels.end();) {
+		it->second.erase(std::remove(it->second.begin(), it->second.end(), pWebSocket), it->second.end());
+		if (it->second.empty()) {
+			it = m_channels.erase(it);
+		} else {
+			++it;
+		}
+	}
+	m_lock.give();
+} // removeMember
@@ -0,0 +1,62 @@
+/*
+ * WebSocketHub.h
+ *
+ *  Created on: Oct 16, 2026
+ */
+
+#ifndef COMPONENTS_CPP_UTILS_WEBSOCKETHUB_H_
+#define COMPONENTS_CPP_UTILS_WEBSOCKETHUB_H_
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include "FreeRTOS.h"
+#include "WebSocket.h"
+
+/**
+ * @brief Send the same message to many WebSockets.
+ *
+ * WebSockets join the hub on one or more channels.  A broadcast on a channel encodes the frame once
+ * and the same buffer is queued for every member, so the cost of a broadcast barely grows with the
+ * number of members.  A WebSocket leaves the hub by itself when it closes.
+ *
+ * Example:
+ * @code{.cpp}
+ * WebSocketHub hub;
+ * hub.add(pRequest->getWebSocket(), "telemetry");              // In the handler of the upgrade.
+ * hub.broadcast("{\"celsius\":21.5}", WebSocket::SEND_TYPE_TEXT, "telemetry");
+ * @endcode
+ *
+ * Whether a broadcast waits for a slow member depends on the send policy of the member's WebSocket.
+ * Use WebSocket::SEND_DROP_OLDEST for members that only need the latest data.
+ */
+class WebSocketHub {
+public:
+	// Counters of the use of the hub.
+	struct Stats {
+		uint32_t broadcasts;   // Messages broadcast.
+		uint32_t sent;         // Frames queued for members.
+		uint32_t failed;       // Frames a member dropped or couldn't send.
+	};
+
+	WebSocketHub();
+	virtual ~WebSocketHub();
+	void   add(WebSocket* pWebSocket, const std::string& channel = "");      // Add a WebSocket to a channel.
+	size_t broadcast(const std::string& data, uint8_t sendType = WebSocket::SEND_TYPE_TEXT, const std::string& channel = "");
+	size_t getCount(const std::string& channel = "");                         // Get the number of members of a channel.
+	Stats  getStats();                                                        // Get the counters of the use of the hub.
+	void   remove(WebSocket* pWebSocket);                                     // Remove a WebSocket from all the channels.
+	void   remove(WebSocket* pWebSocket, const std::string& channel);         // Remove a WebSocket from a channel.
+
+private:
+	friend class WebSocket;
+
+	std::map<std::string, std::vector<WebSocket*>> m_channels;   // The members of each channel.
+	Stats                                          m_stats;
+	FreeRTOS::Semaphore                            m_lock = FreeRTOS::Semaphore("WebSocketHub");
+
+	bool isMember(WebSocket* pWebSocket);
+	void removeMember(WebSocket* pWebSocket);
+}; // WebSocketHub
+
+#endif /* COMPONENTS_CPP_UTILS_WEBSOCKETHUB_H_ */
@@ -0,0 +1,255 @@
+/*
+ * Benchmark target for the HTTP server.
+ *
+ * This application starts an HttpServer with the routes exercised by the host side load generator
+ * tools/http_load.py:
+ *
+ * * GET /bench/json - A small JSON document.
+ * * GET /bench/cached - The same document, answered from a response cache that is refreshed every second.
+ * * GET /bench/heap - The free heap, its low water mark and the largest free block as JSON.  The load
+ *   generator reads it before and after a run to report heap drift.
+ * * /bench/echo     - A WebSocket that sends every message back.
+ * * /bench/hub      - A WebSocket that joins a WebSocketHub and is sent whatever /bench/broadcast sends.
+ * * GET /bench/broadcast?count=n&size=n&mode=hub|send - Sends count messages of size bytes to every
+ *   /bench/hub client, with WebSocketHub::broadcast() or with a WebSocket::send() per client, and
+ *   reports the microseconds taken per message as JSON.
+ * * GET /bench/unmask - Times the unmasking of WebSocket payloads of 1 KB, 64 KB and 1 MB, a byte at
+ *   a time as it used to be done and with WebSocketInputStreambuf::unmask(), and reports MB/s as JSON.
+ * * /metrics        - The server metrics in the Prometheus text format.
+ * * Anything else   - Files under ROOT_PATH (mount a file system there to benchmark static files).
+ *
+ * Set WIFI_SSID and WIFI_PASSWORD, flash and then run from the host, for example:
+ *
+ *   python3 tools/http_load.py --host 192.168.1.99 --scenario json --connections 4 --requests 2000
+ *
+ * Build with logging at INFO or below; debug logging in the request path dominates the timings.
+ */
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <HttpServer.h>
+#include <HttpRequest.h>
+#include <HttpResponse.h>
+#include <WebSocket.h>
+#include <WebSocketHub.h>
+#include <Task.h>
+#include <WiFi.h>
+#include <WiFiEventHandler.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "sdkconfig.h"
+
+static char tag[] = "test_http_bench";
+
+#define WIFI_SSID     "myssid"
+#define WIFI_PASSWORD "mypassword"
+#define ROOT_PATH     "/spiflash"
+#define PORT          80
+#define WORKERS       2
+
+extern "C" {
+	void app_main(void);
+}
+
+
+static WiFi*       wifi;
+static HttpServer* httpServer;
+
+
+/**
+ * @brief Send back every message received on a WebSocket.
+ */
+class EchoHandler: public WebSocketHandler {
+	void onMessage(WebSocketInputStreambuf* pWebSocketInputStreambuf, WebSocket* pWebSocket) {
+		std::stringstream buffer;
+		buffer << pWebSocketInputStreambuf;
+		pWebSocket->send(buffer.str(), WebSocket::SEND_TYPE_TEXT);
+	}
+};
+
+static EchoHandler echoHandler;   // Holds no state so one handler serves every WebSocket.
+
+
+static void handleJson(HttpRequest* pRequest, HttpResponse* pResponse) {
+	pResponse->setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
+	pResponse->addHeader("Content-Type", "application/json");
+	pResponse->sendData("{\"status\":\"ok\",\"value\":42,\"items\":[1,2,3]}");
+}
+
+
+static void handleHeap(HttpRequest* pRequest, HttpResponse* pResponse) {
+	char json[128];
+	snprintf(json, sizeof(json), "{\"free\":%u,\"minimum\":%u,\"largest\":%u}",
+		heap_caps_get_free_size(MALLOC_CAP_8BIT),
+		heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+		heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+	pResponse->setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
+	pResponse->addHeader("Content-Type", "application/json");
+	pResponse->addHeader("Cache-Control", "no-store");
+	pResponse->sendData(json);
+}
+
+
+/**
+ * @brief Unmask a byte at a time, as WebSocketInputStreambuf did before it worked a word at a time.
+ */
+static void unmaskBytes(uint8_t* data, size_t length, const uint8_t* pMask, size_t offset) {
+	for (size_t i = 0; i < length; i++) {
+		data[i] = data[i] ^ pMask[(offset + i) % 4];
+	}
+}
+
+
+/**
+ * @brief Time the unmasking of messages of a size in MB/s.
+ * A message larger than the buffer is unmasked a buffer at a time, as it is read from the socket.
+ */
+static double timeUnmask(void (*unmask)(uint8_t*, size_t, const uint8_t*, size_t), uint8_t* buffer, size_t bufferSize, size_t messageSize) {
+	static const uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+	size_t total = 4 * 1024 * 1024;   // Unmask at least this much for a stable figure.
+	int64_t start = esp_timer_get_time();
+	for (size_t done = 0; done < total; done += messageSize) {
+		for (size_t offset = 0; offset < messageSize; offset += bufferSize) {
+			size_t length = messageSize - offset < bufferSize ? messageSize - offset : bufferSize;
+			unmask(buffer, length, mask, offset);
+		}
+	}
+	int64_t elapsed = esp_timer_get_time() - start;
+	return (double) total / elapsed;   // Bytes per microsecond is MB/s.
+}
+
+
+static void handleUnmask(HttpRequest* pRequest, HttpResponse* pResponse) {
+	static const size_t bufferSize = 16 * 1024;
+	uint8_t* buffer = (uint8_t*) malloc(bufferSize);
+	if (buffer == nullptr) {
+		pResponse->setStatus(HttpResponse::HTTP_STATUS_SERVICE_UNAVAILABLE, "Service Unavailable");
+		return;
+	}
+	memset(buffer, 0x5a, bufferSize);
+	std::string json = "[";
+	size_t sizes[] = { 1024, 64 * 1024, 1024 * 1024 };
+	for (int i = 0; i < 3; i++) {
+		char line[128];
+		snprintf(line, sizeof(line), "%s{\"size\":%u,\"byteMBps\":%.1f,\"wordMBps\":%.1f}", i == 0 ? "" : ",", sizes[i],
+			timeUnmask(unmaskBytes, buffer, bufferSize, sizes[i]),
+			timeUnmask(WebSocketInputStreambuf::unmask, buffer, bufferSize, sizes[i]));
+		json += line;
+	}
+	json += "]";
+	free(buffer);
+	pResponse->setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
+	pResponse->addHeader("Content-Type", "application/json");
+	pResponse->addHeader("Cache-Control", "no-store");
+	pResponse->sendData(json);
+}
+
+
+static WebSocketHub            hub;
+static std::vector<WebSocket*> hubClients;   // The same clients, for sending to one by one.
+static FreeRTOS::Semaphore     hubClientsLock("hubClients");
+
+
+static void handleHub(HttpRequest* pRequest, HttpResponse* pResponse) {
+	if (!pRequest->isWebsocket()) {
+		pResponse->setStatus(400, "Bad Request");
+		pResponse->sendData("WebSocket only");
+		return;
+	}
+	WebSocket* pWebSocket = pRequest->getWebSocket();
+	pWebSocket->setSendQueue(64, WebSocket::SEND_DROP_OLDEST);
+	hub.add(pWebSocket);
+	hubClientsLock.take("handleHub");
+	hubClients.push_back(pWebSocket);
+	hubClientsLock.give();
+}
+
+
+static void handleBroadcast(HttpRequest* pRequest, HttpResponse* pResponse) {
+	int count = atoi(std::string(pRequest->getQueryValue("count")).c_str());
+	int size  = atoi(std::string(pRequest->getQueryValue("size")).c_str());
+	bool useHub = pRequest->getQueryValue("mode") != "send";
+	if (count <= 0) count = 100;
+	if (size <= 0) size = 256;
+	std::string message(size, 'x');
+	hubClientsLock.take("handleBroadcast");
+	std::vector<WebSocket*> clients = hubClients;
+	hubClientsLock.give();
+
+	int64_t start = esp_timer_get_time();
+	for (int i = 0; i < count; i++) {
+		if (useHub) {
+			hub.broadcast(message, WebSocket::SEND_TYPE_TEXT);
+		} else {
+			for (auto it = clients.begin(); it != clients.end(); ++it) {
+				(*it)->send(message, WebSocket::SEND_TYPE_TEXT);
+			}
+		}
+	}
+	int64_t elapsed = esp_timer_get_time() - start;
+
+	char json[128];
+	snprintf(json, sizeof(json), "{\"mode\":\"%s\",\"clients\":%u,\"count\":%d,\"size\":%d,\"usPerMessage\":%.1f}",
+		useHub ? "hub" : "send", hub.getCount(), count, size, (double) elapsed / count);
+	pResponse->setStatus(HttpResponse::HTTP_STATUS_OK, "OK");
+	pResponse->addHeader("Content-Type", "application/json");
+	pResponse->addHeader("Cache-Control", "no-store");
+	pResponse->sendData(json);
+}
+
+
+static void handleEcho(HttpRequest* pRequest, HttpResponse* pResponse) {
+	if (!pRequest->isWebsocket()) {
+		pResponse->setStatus(400, "Bad Request");
+		pResponse->sendData("WebSocket only");
+		return;
+	}
+	pRequest->getWebSocket()->setHandler(&echoHandler);
+}
+
+
+class HttpBenchTask: public Task {
+	void run(void* data) {
+		ESP_LOGI(tag, "Starting the HTTP server on port %d", PORT);
+		httpServer = new HttpServer();
+		httpServer->setRootPath(ROOT_PATH);
+		httpServer->setMetricsPath("/metrics");
+		httpServer->addPathHandler("GET", "/bench/json", handleJson);
+		httpServer->addPathHandler("GET", "/bench/cached", handleJson);
+		httpServer->setResponseCache("/bench/cached", 1);
+		httpServer->addPathHandler("GET", "/bench/heap", handleHeap);
+		httpServer->addPathHandler("GET", "/bench/echo", handleEcho);
+		httpServer->addPathHandler("GET", "/bench/unmask", handleUnmask);
+		httpServer->addPathHandler("GET", "/bench/hub", handleHub);
+		httpServer->addPathHandler("GET", "/bench/broadcast", handleBroadcast);
+		httpServer->start(PORT, false, WORKERS);
+	}
+};
+
+static HttpBenchTask* httpBenchTask;
+
+class MyWiFiEventHandler: public WiFiEventHandler {
+
+	esp_err_t staGotIp(system_event_sta_got_ip_t event_sta_got_ip) {
+		ESP_LOGD(tag, "MyWiFiEventHandler(Class): staGotIp");
+
+		httpBenchTask = new HttpBenchTask();
+		httpBenchTask->setStackSize(8000);
+		httpBenchTask->start();
+
+		return ESP_OK;
+	}
+};
+
+
+void app_main(void) {
+	ESP_LOGD(tag, "app_main: HTTP benchmark starting");
+	MyWiFiEventHandler* eventHandler = new MyWiFiEventHandler();
+
+	wifi = new WiFi();
+	wifi->setWifiEventHandler(eventHandler);
+
+	wifi->connectAP(WIFI_SSID, WIFI_PASSWORD);
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Create the precompressed versions of the files of a web root before it is written to flash.
+#
+# For each compressible file (html, css, js, json, svg, ...) a "file.gz" is written next to it and, if
+# the brotli command is installed, a "file.br".  HttpResponse::sendFile() sends these in place of the
+# file to clients that accept them.  With --remove the original files are deleted to save flash; the
+# files are then only served to clients that accept one of the codings.
+#
+# FAT file systems need long file name support (CONFIG_FATFS_LFN_*) for names such as "app.js.gz".
+#
+# Usage: compress_www.sh [--remove] <www root>
+#
+set -e
+
+REMOVE=0
+if [ "$1" = "--remove" ]; then
+	REMOVE=1
+	shift
+fi
+if [ $# -ne 1 ] || [ ! -d "$1" ]; then
+	echo "Usage: $0 [--remove] <www root>" >&2
+	exit 1
+fi
+
+HAVE_BROTLI=0
+if command -v brotli >/dev/null 2>&1; then
+	HAVE_BROTLI=1
+fi
+
+find "$1" -type f \( -name '*.html' -o -name '*.htm' -o -name '*.css' -o -name '*.js' -o -name '*.mjs' \
+	-o -name '*.json' -o -name '*.map' -o -name '*.svg' -o -name '*.txt' -o -name '*.xml' -o -name '*.csv' \
+	-o -name '*.wasm' -o -name '*.ico' -o -name '*.ttf' \) | while read -r FILE; do
+	gzip -9 -n -c "$FILE" > "$FILE.gz"
+	if [ $HAVE_BROTLI -eq 1 ]; then
+		brotli -q 11 -f -o "$FILE.br" "$FILE"
+	fi
+	# Keep a precompressed file only if it is actually smaller.
+	SIZE=$(wc -c < "$FILE")
+	for SIDECAR in "$FILE.gz" "$FILE.br"; do
+		if [ -f "$SIDECAR" ] && [ "$(wc -c < "$SIDECAR")" -ge "$SIZE" ]; then
+			rm -f "$SIDECAR"
+		fi
+	done
+	if [ $REMOVE -eq 1 ] && [ -f "$FILE.gz" ]; then
+		rm -f "$FILE"
+	fi
+	echo "$FILE"
+done
@@ -0,0 +1,372 @@
+#!/usr/bin/env python3
+#
+# Load generator for the HTTP server, run on a host against a device running tests/test_http_bench.cpp.
+#
+# Each connection is served by its own thread which sends requests one after the other and times them.
+# At the end the throughput, the latency percentiles and the errors are reported.  The free heap of the
+# device is read from /bench/heap before and after the run so that leaks and fragmentation show up as
+# drift, and the server's own latency histograms can be fetched from /metrics with --metrics.
+#
+# Scenarios:
+#   json       GET /bench/json on persistent connections.
+#   close      GET /bench/json with a new connection per request.
+#   cached     GET /bench/cached (the same document from a response cache) on persistent connections.
+#   static     GET --path (a file under the web root) on persistent connections.
+#   ws-echo    Send a message on a WebSocket to /bench/echo and wait for it to come back.
+#   ws-fanout  Hold --connections WebSockets open on /bench/hub and have the device send them --requests
+#              messages of --message-size bytes, first with a send() per client and then with one
+#              WebSocketHub broadcast, and report the device's cost per message for each.
+#
+# With --slow-clients, that many extra connections trickle a request head one byte at a time for the
+# whole run (a "slowloris" attack).  Comparing the throughput with and without them shows how well the
+# server protects its capacity; the status each slow connection was answered with (408, 429) is reported.
+#
+# Only the Python standard library is used.
+#
+# Usage: http_load.py --host <address> [--port 80] [--scenario json] [--connections 4]
+#                     [--requests 1000] [--path /index.html] [--message-size 64] [--metrics]
+#                     [--slow-clients 0] [--slow-interval 2]
+#
+import argparse
+import base64
+import json
+import os
+import socket
+import struct
+import sys
+import threading
+import time
+
+
+class Result:
+	def __init__(self):
+		self.latencies = []   # Seconds taken by each successful request.
+		self.errors    = 0
+		self.bytes     = 0
+
+
+def read_response(sock, buffered):
+	"""Read one HTTP response.  Returns (status, headers, body, rest of the data read)."""
+	data = buffered
+	while b"\r\n\r\n" not in data:
+		chunk = sock.recv(4096)
+		if not chunk:
+			raise ConnectionError("connection closed in the response head")
+		data += chunk
+	head, _, data = data.partition(b"\r\n\r\n")
+	lines = head.decode("latin-1").split("\r\n")
+	status = int(lines[0].split(" ")[1])
+	headers = {}
+	for line in lines[1:]:
+		name, _, value = line.partition(":")
+		headers[name.strip().lower()] = value.strip()
+	if headers.get("transfer-encoding", "").lower() == "chunked":
+		body = b""
+		while True:
+			while b"\r\n" not in data:
+				data += recv_some(sock)
+			size_line, _, data = data.partition(b"\r\n")
+			size = int(size_line.split(b";")[0], 16)
+			while len(data) < size + 2:
+				data += recv_some(sock)
+			body += data[:size]
+			data = data[size + 2:]
+			if size == 0:
+				return status, headers, body, data
+	length = int(headers.get("content-length", "0"))
+	while len(data) < length:
+		data += recv_some(sock)
+	return status, headers, data[:length], data[length:]
+
+
+def recv_some(sock):
+	chunk = sock.recv(65536)
+	if not chunk:
+		raise ConnectionError("connection closed in the response body")
+	return chunk
+
+
+def http_get(args, path):
+	"""Send a single request on a new connection.  Returns (status, body)."""
+	with socket.create_connection((args.host, args.port), timeout=args.timeout) as sock:
+		request = "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n" % (path, args.host)
+		sock.sendall(request.encode())
+		status, _, body, _ = read_response(sock, b"")
+		return status, body
+
+
+def run_http(args, path, keep_alive, count, result):
+	connection = "keep-alive" if keep_alive else "close"
+	request = ("GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n" % (path, args.host, connection)).encode()
+	sock = None
+	buffered = b""
+	for _ in range(count):
+		start = time.perf_counter()
+		try:
+			if sock is None:
+				sock = socket.create_connection((args.host, args.port), timeout=args.timeout)
+				sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+				buffered = b""
+			sock.sendall(request)
+			status, headers, body, buffered = read_response(sock, buffered)
+			if status != 200:
+				result.errors += 1
+			else:
+				result.latencies.append(time.perf_counter() - start)
+				result.bytes += len(body)
+			if not keep_alive or headers.get("connection", "").lower() == "close":
+				sock.close()
+				sock = None
+		except (OSError, ValueError, IndexError):
+			result.errors += 1
+			if sock is not None:
+				sock.close()
+			sock = None
+	if sock is not None:
+		sock.close()
+
+
+def ws_connect(args, path="/bench/echo"):
+	sock = socket.create_connection((args.host, args.port), timeout=args.timeout)
+	sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+	key = base64.b64encode(os.urandom(16)).decode()
+	request = ("GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n" % (path, args.host, key))
+	sock.sendall(request.encode())
+	data = b""
+	while b"\r\n\r\n" not in data:
+		data += recv_some(sock)
+	head, _, data = data.partition(b"\r\n\r\n")
+	if b" 101 " not in head.split(b"\r\n")[0]:
+		raise ConnectionError("WebSocket upgrade refused")
+	return sock, data
+
+
+def ws_send(sock, payload, opcode=0x1):
+	mask = os.urandom(4)
+	length = len(payload)
+	if length < 126:
+		header = struct.pack("!BB", 0x80 | opcode, 0x80 | length)
+	elif length < 65536:
+		header = struct.pack("!BBH", 0x80 | opcode, 0x80 | 126, length)
+	else:
+		header = struct.pack("!BBQ", 0x80 | opcode, 0x80 | 127, length)
+	masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+	sock.sendall(header + mask + masked)
+
+
+def ws_receive(sock, buffered):
+	"""Read one unmasked frame from the server.  Returns (opcode, payload, rest of the data read)."""
+	data = buffered
+	while len(data) < 2:
+		data += recv_some(sock)
+	opcode = data[0] & 0x0f
+	length = data[1] & 0x7f
+	offset = 2
+	if length == 126:
+		while len(data) < 4:
+			data += recv_some(sock)
+		length = struct.unpack("!H", data[2:4])[0]
+		offset = 4
+	elif length == 127:
+		while len(data) < 10:
+			data += recv_some(sock)
+		length = struct.unpack("!Q", data[2:10])[0]
+		offset = 10
+	while len(data) < offset + length:
+		data += recv_some(sock)
+	return opcode, data[offset:offset + length], data[offset + length:]
+
+
+def run_ws_echo(args, count, result):
+	payload = b"x" * args.message_size
+	try:
+		sock, buffered = ws_connect(args)
+	except (OSError, ValueError):
+		result.errors += count
+		return
+	try:
+		for _ in range(count):
+			start = time.perf_counter()
+			ws_send(sock, payload)
+			opcode, echo, buffered = ws_receive(sock, buffered)
+			if opcode != 0x1 or echo != payload:
+				result.errors += 1
+			else:
+				result.latencies.append(time.perf_counter() - start)
+				result.bytes += len(echo)
+		ws_send(sock, struct.pack("!H", 1000), opcode=0x8)
+	except (OSError, ValueError):
+		result.errors += 1
+	finally:
+		sock.close()
+
+
+def run_slow_client(args, stop, outcomes):
+	"""Trickle a request head until the server answers, closes the connection or the run ends."""
+	head = ("GET /bench/json HTTP/1.1\r\nHost: %s\r\n" % args.host).encode() + b"X-Padding: " + b"a" * 4096
+	start = time.perf_counter()
+	try:
+		sock = socket.create_connection((args.host, args.port), timeout=args.timeout)
+	except OSError:
+		outcomes.append(("refused", 0.0))
+		return
+	sock.settimeout(args.slow_interval)
+	outcome = "still open"
+	try:
+		for i in range(len(head)):
+			if stop.is_set():
+				break
+			sock.sendall(head[i:i + 1])
+			try:
+				data = sock.recv(1024)
+			except socket.timeout:
+				continue
+			if data:
+				outcome = data.split(b"\r\n")[0].decode("latin-1")
+			else:
+				outcome = "closed"
+			break
+	except OSError:
+		outcome = "reset"
+	finally:
+		sock.close()
+	outcomes.append((outcome, time.perf_counter() - start))
+
+
+def percentile(values, fraction):
+	if not values:
+		return 0.0
+	index = min(len(values) - 1, int(fraction * len(values)))
+	return values[index]
+
+
+def run_ws_fanout(args, count, result, connected):
+	"""Receive count messages from /bench/hub.  The latency of a message is the time since the previous one."""
+	try:
+		sock, buffered = ws_connect(args, "/bench/hub")
+	except (OSError, ValueError):
+		result.errors += count
+		connected.wait()
+		return
+	connected.wait()
+	try:
+		last = time.perf_counter()
+		for _ in range(count):
+			opcode, message, buffered = ws_receive(sock, buffered)
+			now = time.perf_counter()
+			result.latencies.append(now - last)
+			result.bytes += len(message)
+			last = now
+		ws_send(sock, struct.pack("!H", 1000), opcode=0x8)
+	except (OSError, ValueError):
+		result.errors += 1
+	finally:
+		sock.close()
+
+
+def fanout(args):
+	"""Have the device send to the /bench/hub clients, a send() per client and then by broadcast."""
+	for mode in ("send", "hub"):
+		status, body = http_get(args, "/bench/broadcast?count=%d&size=%d&mode=%s" % (args.requests, args.message_size, mode))
+		if status == 200:
+			report = json.loads(body)
+			print("fanout:       %-4s %d clients, %.1f us per message" % (mode, report["clients"], report["usPerMessage"]))
+		else:
+			print("fanout:       %s failed with status %d" % (mode, status))
+
+
+def read_heap(args):
+	try:
+		status, body = http_get(args, "/bench/heap")
+		if status == 200:
+			return json.loads(body)
+	except (OSError, ValueError):
+		pass
+	return None
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Load test an HttpServer running tests/test_http_bench.cpp.")
+	parser.add_argument("--host", required=True)
+	parser.add_argument("--port", type=int, default=80)
+	parser.add_argument("--scenario", choices=["json", "close", "cached", "static", "ws-echo", "ws-fanout"], default="json")
+	parser.add_argument("--connections", type=int, default=4, help="concurrent connections")
+	parser.add_argument("--requests", type=int, default=1000, help="requests (or messages) in total")
+	parser.add_argument("--path", default="/index.html", help="file requested by the static scenario")
+	parser.add_argument("--message-size", type=int, default=64, help="size of a ws-echo or ws-fanout message")
+	parser.add_argument("--timeout", type=float, default=10.0, help="socket timeout in seconds")
+	parser.add_argument("--metrics", action="store_true", help="print the server metrics after the run")
+	parser.add_argument("--slow-clients", type=int, default=0, help="connections trickling a request head during the run")
+	parser.add_argument("--slow-interval", type=float, default=2.0, help="seconds between the bytes sent by a slow client")
+	args = parser.parse_args()
+
+	heap_before = read_heap(args)
+	stop = threading.Event()
+	slow_outcomes = []
+	slow_threads = [threading.Thread(target=run_slow_client, args=(args, stop, slow_outcomes)) for _ in range(args.slow_clients)]
+	for thread in slow_threads:
+		thread.start()
+	if slow_threads:
+		time.sleep(1.0)   # Let the slow clients take their connections first.
+	results = [Result() for _ in range(args.connections)]
+	threads = []
+	connected = threading.Barrier(args.connections + 1)   # Used by ws-fanout to start once every client is in.
+	for i, result in enumerate(results):
+		count = args.requests // args.connections + (1 if i < args.requests % args.connections else 0)
+		if args.scenario == "ws-fanout":
+			target, targs = run_ws_fanout, (args, 2 * args.requests, result, connected)   # Both modes reach every client.
+		elif args.scenario == "ws-echo":
+			target, targs = run_ws_echo, (args, count, result)
+		else:
+			path = {"static": args.path, "cached": "/bench/cached"}.get(args.scenario, "/bench/json")
+			target, targs = run_http, (args, path, args.scenario != "close", count, result)
+		threads.append(threading.Thread(target=target, args=targs))
+
+	start = time.perf_counter()
+	for thread in threads:
+		thread.start()
+	if args.scenario == "ws-fanout":
+		connected.wait()
+		time.sleep(0.5)   # Let the device finish the upgrades.
+		fanout(args)
+	for thread in threads:
+		thread.join()
+	elapsed = time.perf_counter() - start
+	stop.set()
+	for thread in slow_threads:
+		thread.join()
+	heap_after = read_heap(args)
+
+	latencies = sorted(l for result in results for l in result.latencies)
+	errors = sum(result.errors for result in results)
+	received = sum(result.bytes for result in results)
+	print("scenario:     %s, %d connections" % (args.scenario, args.connections))
+	print("completed:    %d in %.2f s, %d errors" % (len(latencies), elapsed, errors))
+	print("throughput:   %.1f req/s, %.1f KiB/s of body" % (len(latencies) / elapsed, received / 1024.0 / elapsed))
+	print("latency (ms): p50 %.2f  p90 %.2f  p99 %.2f  max %.2f" % (
+		percentile(latencies, 0.50) * 1000, percentile(latencies, 0.90) * 1000,
+		percentile(latencies, 0.99) * 1000, (latencies[-1] if latencies else 0.0) * 1000))
+	if slow_outcomes:
+		counts = {}
+		for outcome, _ in slow_outcomes:
+			counts[outcome] = counts.get(outcome, 0) + 1
+		print("slow clients: %s, longest held %.1f s" % (
+			", ".join("%d %s" % (n, o) for o, n in sorted(counts.items())), max(d for _, d in slow_outcomes)))
+	if heap_before and heap_after:
+		print("heap:         free %d -> %d (%+d), largest block %d -> %d, minimum %d" % (
+			heap_before["free"], heap_after["free"], heap_after["free"] - heap_before["free"],
+			heap_before["largest"], heap_after["largest"], heap_after["minimum"]))
+	else:
+		print("heap:         /bench/heap not available")
+	if args.metrics:
+		try:
+			status, body = http_get(args, "/metrics")
+			print(body.decode("utf-8", "replace"))
+		except OSError as e:
+			print("metrics:      %s" % e)
+	return 1 if errors else 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())